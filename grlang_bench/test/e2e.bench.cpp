@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "grtest.h"
+#include "grlang/parse.h"
+#include "grlang/eval.h"
+#include "grlang/opt.h"
+#include "grlang/codegen.h"
+#include "grlang/image.h"
+
+
+namespace {
+    struct Workload {
+        std::string code;
+        std::int64_t arg;
+        std::int64_t expected;  // NOTE: of test_main(arg), checked before anything is timed
+    };
+
+    Workload read_workload(std::string_view name, std::int64_t arg, std::int64_t expected) {
+        std::ifstream input(std::format("{}/{}.grl", GRLANG_BENCH_WORKLOADS, name));
+        if (!input) {
+            throw std::runtime_error(std::format("no workload {}", name));
+        }
+        std::string code((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+        return {std::move(code), arg, expected};
+    }
+
+    // NOTE: many small functions with loops and branches, each calling one made before it, like a big generated unit
+    Workload generate_workload(std::size_t min_size) {
+        const std::int64_t arg = 20;
+        std::string code = "function_0:= (argument:int)->int {\n    return argument\n}\n\n";
+        std::vector<std::int64_t> results{arg};  // NOTE: of each function called with arg, worked out as it is made
+        for (std::size_t i=1; code.size() < min_size; ++i) {
+            code += std::format(
+                "function_{}:= (argument:int)->int {{\n"
+                "    accumulator:= function_{}(argument)\n"
+                "    counter:= {}\n"
+                "    while counter<argument {{\n"
+                "        if accumulator>=1000 accumulator = accumulator-1000 else accumulator = accumulator+counter*{}\n"
+                "        counter = counter+1\n"
+                "    }}\n"
+                "    return accumulator\n"
+                "}}\n\n", i, i/2, i % 7, i % 13);
+            std::int64_t accumulator = results[i/2];
+            for (std::int64_t counter = i % 7; counter < arg; ++counter) {
+                accumulator = accumulator >= 1000 ? accumulator-1000 : accumulator + counter * std::int64_t(i % 13);
+            }
+            results.push_back(accumulator);
+        }
+        code += std::format("test_main:= (arg:int)->int {{\n    return function_{}(arg)\n}}\n", results.size()-1);
+        return {std::move(code), arg, results.back()};
+    }
+
+    std::unordered_map<std::string_view, grlang::node::Node::Ptr> parse_checked(const Workload& workload) {
+        auto exports = grlang::parse::parse_unit(workload.code, {.threads=1});
+        if (grlang::eval::eval_call(exports.at("test_main"), workload.arg) != workload.expected) {
+            throw std::runtime_error("workload gave the wrong result");
+        }
+        return exports;
+    }
+
+    enum class Stage {
+        PARSE,  // NOTE: on one thread, the others go wide where they can
+        PARSE_THREADS,
+        PARSE_LAZY,
+        OPTIMIZE,  // NOTE: includes parsing, the optimizer changes the unit it is given
+        EVAL,
+        EVAL_PROFILED,
+        EVAL_LIMITED,
+        EVAL_IMAGE,
+        EVAL_OPTIMIZED,
+        CODEGEN,
+    };
+
+    void bench_stage(grtest::Benchmark& benchmark, const Workload& workload, Stage stage) {
+        auto exports = parse_checked(workload);
+        auto entry = exports.at("test_main");
+        const std::int64_t arg = workload.arg;
+        const auto functions = static_cast<std::size_t>(std::ranges::count_if(exports, [](auto& item) { return is_function(*item.second); }));
+        switch (stage) {
+            case Stage::PARSE:
+            case Stage::PARSE_THREADS:
+            case Stage::PARSE_LAZY: {
+                grlang::parse::ParseOptions options{.threads = stage == Stage::PARSE ? 1u : 0u, .lazy = stage == Stage::PARSE_LAZY};
+                benchmark.set_items(functions);
+                benchmark.set_bytes(workload.code.size());
+                benchmark.measure([&]() {
+                    grtest::do_not_optimize(grlang::parse::parse_unit(workload.code, options).size());
+                });
+                break;
+            }
+            case Stage::OPTIMIZE:
+                benchmark.set_items(functions);
+                benchmark.measure([&]() {
+                    auto unit = grlang::parse::parse_unit(workload.code, {.threads=1});
+                    grlang::opt::optimize_unit(unit);
+                    grtest::do_not_optimize(unit.size());
+                });
+                break;
+            case Stage::EVAL:
+                benchmark.measure([&]() {
+                    grtest::do_not_optimize(grlang::eval::eval_call(entry, arg));
+                });
+                break;
+            case Stage::EVAL_PROFILED:
+                benchmark.measure([&]() {
+                    grlang::node::Profile profile;
+                    grtest::do_not_optimize(grlang::eval::eval_call(entry, std::span(&arg, 1), profile));
+                });
+                break;
+            case Stage::EVAL_LIMITED:
+                benchmark.measure([&]() {
+                    grtest::do_not_optimize(grlang::eval::try_eval_call(entry, std::span(&arg, 1), std::size_t(1) << 40));
+                });
+                break;
+            case Stage::EVAL_IMAGE: {
+                std::ostringstream output;
+                grlang::node::write_image(exports, output);
+                std::string bytes = output.str();
+                std::vector<std::uint32_t> storage((bytes.size()+3)/4);  // NOTE: images are read in place, aligned
+                std::memcpy(storage.data(), bytes.data(), bytes.size());
+                grlang::node::ImageView image(std::as_bytes(std::span(storage)).first(bytes.size()));
+                benchmark.measure([&]() {
+                    grtest::do_not_optimize(grlang::eval::eval_call(image, "test_main", arg));
+                });
+                break;
+            }
+            case Stage::EVAL_OPTIMIZED: {
+                grlang::opt::optimize_unit(exports);
+                entry = exports.at("test_main");
+                if (grlang::eval::eval_call(entry, arg) != workload.expected) {
+                    throw std::runtime_error("optimized workload gave the wrong result");
+                }
+                benchmark.measure([&]() {
+                    grtest::do_not_optimize(grlang::eval::eval_call(entry, arg));
+                });
+                break;
+            }
+            case Stage::CODEGEN: {
+                std::ostringstream checked;
+                if (!grlang::codegen::gen_llvm_ir(exports, checked, {.threads=1})) {
+                    throw std::runtime_error("workload failed to lower");
+                }
+                benchmark.set_items(functions);
+                benchmark.set_bytes(workload.code.size());
+                benchmark.measure([&]() {
+                    std::ostringstream output;
+                    grlang::codegen::gen_llvm_ir(exports, output, {.threads=1});
+                    grtest::do_not_optimize(output.tellp());
+                });
+                break;
+            }
+        }
+    }
+}
+
+// NOTE: every stage of one workload, read from workloads/<name>.grl, test_main(arg) has to give expected
+#define WORKLOAD_BENCHMARKS(name, arg, expected) \
+    BENCHMARK_CASE(name##_parse) { bench_stage(benchmark, read_workload(#name, arg, expected), Stage::PARSE); } \
+    BENCHMARK_CASE(name##_optimize) { bench_stage(benchmark, read_workload(#name, arg, expected), Stage::OPTIMIZE); } \
+    BENCHMARK_CASE(name##_eval) { bench_stage(benchmark, read_workload(#name, arg, expected), Stage::EVAL); } \
+    BENCHMARK_CASE(name##_eval_profiled) { bench_stage(benchmark, read_workload(#name, arg, expected), Stage::EVAL_PROFILED); } \
+    BENCHMARK_CASE(name##_eval_limited) { bench_stage(benchmark, read_workload(#name, arg, expected), Stage::EVAL_LIMITED); } \
+    BENCHMARK_CASE(name##_eval_image) { bench_stage(benchmark, read_workload(#name, arg, expected), Stage::EVAL_IMAGE); } \
+    BENCHMARK_CASE(name##_eval_optimized) { bench_stage(benchmark, read_workload(#name, arg, expected), Stage::EVAL_OPTIMIZED); } \
+    BENCHMARK_CASE(name##_codegen) { bench_stage(benchmark, read_workload(#name, arg, expected), Stage::CODEGEN); }
+
+WORKLOAD_BENCHMARKS(recursive, 20, 6813)
+WORKLOAD_BENCHMARKS(loops, 20, 314767)
+WORKLOAD_BENCHMARKS(branchy, 2000, 150155)
+WORKLOAD_BENCHMARKS(calls, 20000, 980001)
+
+namespace {
+    constexpr std::size_t GENERATED_SIZE = 2 << 20;
+}
+
+BENCHMARK_CASE(generated_parse) {
+    bench_stage(benchmark, generate_workload(GENERATED_SIZE), Stage::PARSE);
+}
+
+BENCHMARK_CASE(generated_parse_threads) {
+    bench_stage(benchmark, generate_workload(GENERATED_SIZE), Stage::PARSE_THREADS);
+}
+
+BENCHMARK_CASE(generated_parse_lazy) {
+    bench_stage(benchmark, generate_workload(GENERATED_SIZE), Stage::PARSE_LAZY);
+}
+
+BENCHMARK_CASE(generated_optimize) {
+    bench_stage(benchmark, generate_workload(GENERATED_SIZE), Stage::OPTIMIZE);
+}
+
+BENCHMARK_CASE(generated_eval) {
+    bench_stage(benchmark, generate_workload(GENERATED_SIZE), Stage::EVAL);
+}
+
+BENCHMARK_CASE(generated_codegen) {
+    bench_stage(benchmark, generate_workload(GENERATED_SIZE), Stage::CODEGEN);
+}
@@ -1,11 +1,65 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <unordered_map>
 #include <ostream>
+#include <optional>
+#include <filesystem>
+#include <mutex>
+#include <list>
 
 #include "grlang/node.h"
+#include "grlang/profile.h"
 
 namespace grlang::codegen {
-    bool gen_llvm_ir(const std::unordered_map<std::string_view, node::Node::Ptr>& exports, std::ostream& output);
+    struct CacheStats {
+        std::size_t hits = 0;
+        std::size_t misses = 0;
+        std::size_t stores = 0;
+        std::size_t evictions = 0;
+        std::uintmax_t bytes = 0;
+    };
+
+    // On-disk content-addressed store, one file per key, evicting least recently used entries above max_bytes
+    class Cache {
+    public:
+        Cache(std::filesystem::path directory, std::uintmax_t max_bytes);
+
+        std::optional<std::string> load(std::uint64_t key);
+        void store(std::uint64_t key, std::string_view data);
+        CacheStats stats() const;
+
+    private:
+        struct Entry {
+            std::list<std::uint64_t>::iterator lru_pos;
+            std::uintmax_t size;
+        };
+
+        std::filesystem::path entry_path(std::uint64_t key) const;
+        void evict();
+
+        std::filesystem::path directory;
+        std::uintmax_t max_bytes;
+        std::list<std::uint64_t> lru;  // NOTE: most recently used first
+        std::unordered_map<std::uint64_t, Entry> entries;
+        CacheStats stats_;
+        mutable std::mutex mutex;
+    };
+
+    struct Options {
+        std::size_t threads = 0;  // NOTE: 0 means one per hardware thread
+        Cache* cache = nullptr;  // NOTE: functions whose graph hash is cached skip lowering
+        std::size_t vector_lanes = 8;  // NOTE: a power of two, counted loops run that many iterations at once, 1 keeps them scalar
+        // NOTE: branches get weights from it, hot blocks are laid out along the likely arm and arms never taken go
+        // last. Counts have to be recorded for the graphs being lowered, e.g. by eval or an instrumented build
+        const node::Profile* profile = nullptr;
+        // NOTE: counts the arms each branch takes, the program writes them as a profile to $GRLANG_PROFILE, or to
+        // grlang.profile, when it exits. Loops stay scalar, so every iteration is counted
+        bool instrument = false;
+    };
+
+    // Functions are lowered concurrently and written out sorted by export name, so output is byte-identical across runs
+    bool gen_llvm_ir(const std::unordered_map<std::string_view, node::Node::Ptr>& exports, std::ostream& output, const Options& options = {});
 }
@@ -0,0 +1,100 @@
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <format>
+#include <charconv>
+
+#include "grlang/codegen.h"
+
+
+namespace grlang::codegen {
+    Cache::Cache(std::filesystem::path directory_, std::uintmax_t max_bytes_) : directory(std::move(directory_)), max_bytes(max_bytes_) {
+        std::filesystem::create_directories(directory);
+        std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::directory_entry>> found;
+        for (auto& file: std::filesystem::directory_iterator(directory)) {
+            if (file.is_regular_file() && file.path().extension() == ".grc") {
+                found.emplace_back(file.last_write_time(), file);
+            }
+        }
+        std::ranges::sort(found, std::ranges::greater{}, [](auto& item) { return item.first; });
+        for (auto& [time, file]: found) {
+            std::string stem = file.path().stem().string();
+            std::uint64_t key = 0;
+            auto [end, error] = std::from_chars(stem.data(), stem.data() + stem.size(), key, 16);
+            if (error != std::errc() || end != stem.data() + stem.size() || file.path().filename() != entry_path(key).filename()) {
+                continue;  // NOTE: not ours, or not the one name a key is stored under, so ff.grc and 0ff.grc are not both loaded
+            }
+            lru.push_back(key);
+            entries[key] = {std::prev(lru.end()), file.file_size()};
+            stats_.bytes += file.file_size();
+        }
+        evict();
+    }
+
+    std::optional<std::string> Cache::load(std::uint64_t key) {
+        std::lock_guard lock(mutex);
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            ++stats_.misses;
+            return std::nullopt;
+        }
+        std::ifstream input(entry_path(key), std::ios::binary);
+        if (!input) {
+            stats_.bytes -= it->second.size;
+            lru.erase(it->second.lru_pos);
+            entries.erase(it);
+            ++stats_.misses;
+            return std::nullopt;
+        }
+        std::string data((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+        lru.splice(lru.begin(), lru, it->second.lru_pos);
+        std::error_code ignored;
+        std::filesystem::last_write_time(entry_path(key), std::filesystem::file_time_type::clock::now(), ignored);  // NOTE: keep recency across runs
+        ++stats_.hits;
+        return data;
+    }
+
+    void Cache::store(std::uint64_t key, std::string_view data) {
+        std::lock_guard lock(mutex);
+        auto path = entry_path(key);
+        auto tmp_path = path;
+        tmp_path += ".tmp";
+        {
+            std::ofstream output(tmp_path, std::ios::binary | std::ios::trunc);
+            output.write(data.data(), data.size());
+        }
+        std::filesystem::rename(tmp_path, path);
+        if (auto it = entries.find(key); it != entries.end()) {
+            stats_.bytes -= it->second.size;
+            lru.erase(it->second.lru_pos);
+            entries.erase(it);
+        }
+        lru.push_front(key);
+        entries[key] = {lru.begin(), data.size()};
+        stats_.bytes += data.size();
+        ++stats_.stores;
+        evict();
+    }
+
+    CacheStats Cache::stats() const {
+        std::lock_guard lock(mutex);
+        return stats_;
+    }
+
+    std::filesystem::path Cache::entry_path(std::uint64_t key) const {
+        return directory / std::format("{:016x}.grc", key);
+    }
+
+    void Cache::evict() {
+        while (stats_.bytes > max_bytes && !lru.empty()) {
+            std::uint64_t key = lru.back();
+            std::error_code ignored;
+            std::filesystem::remove(entry_path(key), ignored);
+            stats_.bytes -= entries.at(key).size;
+            entries.erase(key);
+            lru.pop_back();
+            ++stats_.evictions;
+        }
+    }
+}
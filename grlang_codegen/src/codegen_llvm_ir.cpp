@@ -1,172 +1,1047 @@
 #include <cassert>
+#include <string>
+#include <vector>
+#include <type_traits>
+#include <thread>
+#include <atomic>
+#include <sstream>
+#include <algorithm>
+#include <exception>
 #include <set>
-#include <map>
+#include <deque>
+#include <format>
+#include <unordered_map>
 
 #include "grlang/node.h"
+#include "grlang/graph.h"
+#include "grlang/loop.h"
+#include "grlang/stats.h"
 #include "grlang/codegen.h"
 
 
 namespace {
-    const grlang::node::Node::Ptr& find_start(const grlang::node::Node::Ptr& node) {
-        switch (node->type) {
-            case grlang::node::Node::Type::CONTROL_START:
-                return node;
-            case grlang::node::Node::Type::CONTROL_STOP:
-            case grlang::node::Node::Type::CONTROL_RETURN:
-            case grlang::node::Node::Type::CONTROL_IFELSE:
-            case grlang::node::Node::Type::CONTROL_PROJECT:
-                return find_start(node->inputs.at(0));
-            case grlang::node::Node::Type::CONTROL_REGION:
-                return find_start(node->inputs.at(1));
-            default:
-                throw std::runtime_error("unknown node type");
+    // NOTE: immediate dominators of the reachable control nodes, by Cooper, Harvey and Kennedy
+    class Dominators {
+    public:
+        explicit Dominators(const grlang::node::Graph& graph) : order(graph.size(), grlang::node::Graph::NO_NODE), idom(graph.size(), grlang::node::Graph::NO_NODE) {
+            auto rpo = graph.control_rpo();
+            for (std::uint32_t i=0; i<rpo.size(); ++i) {
+                order[rpo[i]] = i;
+            }
+            idom[rpo[0]] = rpo[0];
+            for (bool changed = true; changed;) {
+                changed = false;
+                for (std::uint32_t control: rpo.subspan(1)) {
+                    std::uint32_t dominator = grlang::node::Graph::NO_NODE;
+                    auto inputs = graph.inputs(control);
+                    bool region = graph.node(control).type == grlang::node::Node::Type::CONTROL_REGION;
+                    for (std::uint32_t pred: region ? inputs.subspan(1) : inputs.first(1)) {
+                        if (pred == grlang::node::Graph::NO_NODE || idom[pred] == grlang::node::Graph::NO_NODE) {
+                            continue;  // NOTE: unreachable, or not reached yet along a back edge
+                        }
+                        dominator = dominator == grlang::node::Graph::NO_NODE ? pred : intersect(pred, dominator);
+                    }
+                    if (idom[control] != dominator) {
+                        idom[control] = dominator;
+                        changed = true;
+                    }
+                }
+            }
         }
-    }
 
-    using NodeMap = std::map<const grlang::node::Node*, std::vector<const grlang::node::Node*>>;
+        bool dominates(std::uint32_t a, std::uint32_t b) const {
+            while (order[b] > order[a]) {
+                b = idom[b];
+            }
+            return a == b;
+        }
 
-    void build_node_maps(const grlang::node::Node *node, NodeMap& inv_ctl, NodeMap& reg2phi, std::set<const grlang::node::Node*>& visited) {
-        if (visited.contains(node)) {
-            return;
+    private:
+        std::uint32_t intersect(std::uint32_t a, std::uint32_t b) const {
+            while (a != b) {
+                while (order[a] > order[b]) {
+                    a = idom[a];
+                }
+                while (order[b] > order[a]) {
+                    b = idom[b];
+                }
+            }
+            return a;
         }
-        visited.insert(node);
-        switch (node->type) {
-            case grlang::node::Node::Type::DATA_PHI:
-                reg2phi[node->inputs.at(0).get()].push_back(node);
-                break;
-            case grlang::node::Node::Type::CONTROL_STOP:
-            case grlang::node::Node::Type::CONTROL_RETURN:
-            case grlang::node::Node::Type::CONTROL_IFELSE:
-            case grlang::node::Node::Type::CONTROL_PROJECT:
-                inv_ctl[node->inputs.at(0).get()].push_back(node);
-                break;
-            case grlang::node::Node::Type::CONTROL_REGION:
-                inv_ctl[node->inputs.at(1).get()].push_back(node);
-                inv_ctl[node->inputs.at(2).get()].push_back(node);
-                break;
-            default:
-                break;
+
+        std::vector<std::uint32_t> order;  // NOTE: position in reverse postorder
+        std::vector<std::uint32_t> idom;
+    };
+
+    // NOTE: lowering state of one function, value ids of lowered nodes indexed by graph id
+    struct Cache {
+        static constexpr std::size_t NONE = static_cast<std::size_t>(-1);
+
+        Cache(const grlang::node::Graph& graph, const Dominators& dominators_) : ids(graph.size(), NONE), defined(graph.size()), dominators(dominators_) {}
+
+        std::size_t add(std::uint32_t node) {
+            defined[node] = at;
+            return ids[node] = next++;
         }
-        for (auto &child : node->inputs) {
-            if (child) {
-                build_node_maps(child.get(), inv_ctl, reg2phi, visited);
-            }
+        // NOTE: values are reused where the control node they were lowered at dominates
+        bool available(std::uint32_t node) const { return ids[node] != NONE && dominators.dominates(defined[node], at); }
+
+        std::vector<std::size_t> ids;
+        std::vector<std::uint32_t> defined;
+        std::size_t next = 0;
+        const Dominators& dominators;
+        std::uint32_t at = 0;  // NOTE: control node being lowered
+        std::string block;  // NOTE: label of the block being written, phis name their predecessors by it
+        bool traps = false;
+        std::set<std::string> declarations;
+    };
+
+    // NOTE: exported functions by node, the targets of direct calls
+    using Names = std::unordered_map<const grlang::node::Node*, std::string_view>;
+
+    int type_bits(grlang::node::Value::Type type) {
+        return grlang::node::visit_int_type(type, [](auto tag) { return static_cast<int>(sizeof(tag) * 8); });
+    }
+
+    // NOTE: LLVM integers carry no sign, the operations pick it
+    std::string llvm_type(grlang::node::Value::Type type) {
+        if (grlang::node::is_array_type(type) || grlang::node::is_struct_type(type)) {
+            return "ptr";
         }
+        return "i" + std::to_string(type_bits(type));
+    }
+
+    // NOTE: an array is the i64 length followed by the elements
+    std::string llvm_array_type(grlang::node::Value::Type type) {
+        return "{i64, [0 x " + llvm_type(grlang::node::element_type(type)) + "]}";
+    }
+
+    std::string llvm_vector_type(grlang::node::Value::Type type, std::size_t lanes) {
+        return "<" + std::to_string(lanes) + " x " + llvm_type(type) + ">";
+    }
+
+    // NOTE: the bit pattern of a constant, written as a signed number of its width
+    std::int64_t llvm_literal(grlang::node::Value::Type type, std::int64_t value) {
+        return grlang::node::visit_int_type(type, [&](auto tag) {
+            return static_cast<std::int64_t>(static_cast<std::make_signed_t<decltype(tag)>>(value));
+        });
     }
 
-    using Cache = std::map<const grlang::node::Node*, std::size_t>;
+    // NOTE: the same constant in every lane
+    std::string llvm_vector_literal(grlang::node::Value::Type type, std::size_t lanes, std::int64_t value) {
+        std::string literal = "<";
+        for (std::size_t i=0; i<lanes; ++i) {
+            literal += (i ? ", " : "") + llvm_type(type) + " " + std::to_string(llvm_literal(type, value));
+        }
+        return literal + ">";
+    }
 
-    const char* op_code(grlang::node::Node::Type type) {
+    const char* op_code(grlang::node::Node::Type type, grlang::node::Value::Type width) {
+        bool is_unsigned = grlang::node::is_unsigned_type(width);
         switch (type) {
             case grlang::node::Node::Type::DATA_OP_MUL: return "mul";
-            case grlang::node::Node::Type::DATA_OP_DIV: return "div";
+            case grlang::node::Node::Type::DATA_OP_DIV: return is_unsigned ? "udiv" : "sdiv";
             case grlang::node::Node::Type::DATA_OP_ADD: return "add";
             case grlang::node::Node::Type::DATA_OP_SUB: return "sub";
-            case grlang::node::Node::Type::DATA_OP_GT: return "gt";
-            case grlang::node::Node::Type::DATA_OP_GEQ: return "ge";
-            case grlang::node::Node::Type::DATA_OP_LT: return "lt";
-            case grlang::node::Node::Type::DATA_OP_LEQ: return "le";
-            case grlang::node::Node::Type::DATA_OP_EQ: return "eq";
-            case grlang::node::Node::Type::DATA_OP_NEQ: return "neq";
+            case grlang::node::Node::Type::DATA_OP_GT: return is_unsigned ? "icmp ugt" : "icmp sgt";
+            case grlang::node::Node::Type::DATA_OP_GEQ: return is_unsigned ? "icmp uge" : "icmp sge";
+            case grlang::node::Node::Type::DATA_OP_LT: return is_unsigned ? "icmp ult" : "icmp slt";
+            case grlang::node::Node::Type::DATA_OP_LEQ: return is_unsigned ? "icmp ule" : "icmp sle";
+            case grlang::node::Node::Type::DATA_OP_EQ: return "icmp eq";
+            case grlang::node::Node::Type::DATA_OP_NEQ: return "icmp ne";
+            case grlang::node::Node::Type::DATA_OP_SHL: return "shl";
+            case grlang::node::Node::Type::DATA_OP_SHR: return is_unsigned ? "lshr" : "ashr";
+            case grlang::node::Node::Type::DATA_OP_AND: return "and";
             default: throw std::runtime_error("bad op" + std::to_string((int)type));
         }
     }
 
-    int output_expression(const grlang::node::Node::Ptr& node, Cache& cache, std::ostream& output) {
-        if (cache.contains(node.get())) {
-            return cache.at(node.get());
+    // NOTE: comparisons give an i1, widened to the int the language gives
+    std::size_t output_bool(std::size_t flag, Cache& cache, std::uint32_t id, std::ostream& output) {
+        auto expr_id = cache.add(id);
+        output << "    %v" << expr_id << " = zext i1 %v" << flag << " to i32\n";
+        return expr_id;
+    }
+
+    int output_expression(const grlang::node::Graph& graph, std::uint32_t id, const Names& names, Cache& cache, std::ostream& output);
+
+    // NOTE: callee is the input holding the function, the arguments follow it
+    std::size_t output_call(const grlang::node::Graph& graph, std::uint32_t id, std::size_t callee_input, const Names& names, Cache& cache, std::ostream& output) {
+        auto callee = names.find(&graph.node(graph.inputs(id)[callee_input]));
+        if (callee == names.end()) {
+            throw std::runtime_error("callee has no name");
+        }
+        auto& signature = get_signature(graph.node(graph.inputs(id)[callee_input]));
+        std::vector<std::size_t> args;
+        for (std::size_t i=callee_input+1; i<graph.inputs(id).size(); ++i) {
+            args.push_back(output_expression(graph, graph.inputs(id)[i], names, cache, output));
+        }
+        auto expr_id = cache.add(id);
+        output << "    %v" << expr_id << " = call " << llvm_type(signature.result) << " @" << callee->second << "(";
+        for (std::size_t i=0; i<args.size(); ++i) {
+            output << (i ? ", " : "") << llvm_type(signature.params[i]) << " %v" << args[i];
+        }
+        output << ")\n";
+        return expr_id;
+    }
+
+    int output_expression(const grlang::node::Graph& graph, std::uint32_t id, const Names& names, Cache& cache, std::ostream& output) {
+        if (cache.available(id)) {
+            return cache.ids[id];
         }
-        if (grlang::node::is_const(*node)) {
-            auto expr_id = cache.size();
-            output << "    %v" << expr_id << " = add i32 " << grlang::node::get_value_int(*node) << ", 0\n";
-            cache[node.get()] = expr_id;
+        const grlang::node::Node& node = graph.node(id);
+        if (grlang::node::is_const(node)) {
+            auto type = grlang::node::result_type(node);
+            auto expr_id = cache.add(id);
+            output << "    %v" << expr_id << " = add " << llvm_type(type) << " " << llvm_literal(type, grlang::node::get_value_i64(node)) << ", 0\n";
             return expr_id;
         }
-        if (is_binary_op(*node)) {
-            std::size_t op1 = output_expression(node->inputs.at(0), cache, output);
-            std::size_t op2 = output_expression(node->inputs.at(1), cache, output);
-            auto expr_id = cache.size();
-            output << "    %v" << expr_id << " = " << op_code(node->type) << " i32 %v" << op1 << ", %v" << op2 << "\n";
-            cache[node.get()] = expr_id;
+        if (is_binary_op(node)) {
+            std::size_t op1 = output_expression(graph, graph.inputs(id)[0], names, cache, output);
+            std::size_t op2 = output_expression(graph, graph.inputs(id)[1], names, cache, output);
+            if (grlang::node::is_comparison(node.type)) {
+                auto flag = cache.next++;
+                output << "    %v" << flag << " = " << op_code(node.type, node.value_type) << " " << llvm_type(node.value_type) << " %v" << op1 << ", %v" << op2 << "\n";
+                return output_bool(flag, cache, id, output);
+            }
+            auto expr_id = cache.add(id);
+            output << "    %v" << expr_id << " = " << op_code(node.type, node.value_type) << " " << llvm_type(node.value_type) << " %v" << op1 << ", %v" << op2 << "\n";
             return expr_id;
         }
-        switch (node->type) {
+        switch (node.type) {
             case grlang::node::Node::Type::DATA_TERM:
                 throw std::runtime_error("unknown node value");
             case grlang::node::Node::Type::DATA_PROJECT:
-                assert(node->inputs.at(0)->type == grlang::node::Node::Type::CONTROL_START);
-                assert(node->value == 1);  // TODO: support different arities
-                return node->value-1;
-            // case grlang::node::Node::Type::DATA_OP_NEG:
-            //     return -eval_expression(node->inputs.at(0), cache);
-            // case grlang::node::Node::Type::DATA_OP_NOT:
-            //     return eval_expression(node->inputs.at(0), cache) == 1 ? 0 : 1;
-            // case grlang::node::Node::Type::DATA_CALL:
-            //     assert(node->inputs.size() == 2);
-            //     return grlang::eval::eval_call(node->inputs.at(0), eval_expression(node->inputs.at(1), cache));
+                assert(graph.node(graph.inputs(id)[0]).type == grlang::node::Node::Type::CONTROL_START);
+                return node.value-1;
+            case grlang::node::Node::Type::DATA_OP_NEG: {
+                std::size_t op = output_expression(graph, graph.inputs(id)[0], names, cache, output);
+                auto expr_id = cache.add(id);
+                output << "    %v" << expr_id << " = sub " << llvm_type(node.value_type) << " 0, %v" << op << "\n";
+                return expr_id;
+            }
+            case grlang::node::Node::Type::DATA_OP_NOT: {
+                std::size_t op = output_expression(graph, graph.inputs(id)[0], names, cache, output);
+                auto flag = cache.next++;
+                output << "    %v" << flag << " = icmp eq " << llvm_type(node.value_type) << " %v" << op << ", 0\n";
+                return output_bool(flag, cache, id, output);
+            }
+            case grlang::node::Node::Type::DATA_OP_CONVERT: {
+                auto from = grlang::node::result_type(graph.node(graph.inputs(id)[0]));
+                std::size_t op = output_expression(graph, graph.inputs(id)[0], names, cache, output);
+                if (type_bits(from) == type_bits(node.value_type)) {
+                    cache.defined[id] = cache.at;
+                    return cache.ids[id] = op;  // NOTE: signedness only matters to the operations
+                }
+                const char* op_code = type_bits(from) > type_bits(node.value_type) ? "trunc" : grlang::node::is_unsigned_type(from) ? "zext" : "sext";
+                auto expr_id = cache.add(id);
+                output << "    %v" << expr_id << " = " << op_code << " " << llvm_type(from) << " %v" << op << " to " << llvm_type(node.value_type) << "\n";
+                return expr_id;
+            }
+            case grlang::node::Node::Type::DATA_CALL:
+                assert(node.value == grlang::node::DIRECT_CALL);
+                return output_call(graph, id, 0, names, cache, output);
+            case grlang::node::Node::Type::DATA_LENGTH: {
+                std::size_t array = output_expression(graph, graph.inputs(id)[0], names, cache, output);
+                auto length = cache.next++;
+                output << "    %v" << length << " = load i64, ptr %v" << array << "\n";
+                auto expr_id = cache.add(id);
+                output << "    %v" << expr_id << " = trunc i64 %v" << length << " to i32\n";
+                return expr_id;
+            }
+            case grlang::node::Node::Type::DATA_STRUCT: {
+                // NOTE: only structs that escape are left by now, see replace_aggregates. They get an 8 byte slot per field
+                std::vector<std::size_t> fields;
+                for (std::uint32_t input: graph.inputs(id)) {
+                    fields.push_back(output_expression(graph, input, names, cache, output));
+                }
+                auto expr_id = cache.add(id);  // NOTE: never changed once its fields are stored
+                output << "    %v" << expr_id << " = call ptr @calloc(i64 " << fields.size() << ", i64 8)\n";
+                cache.declarations.insert("declare ptr @calloc(i64, i64)");
+                for (std::size_t i=0; i<fields.size(); ++i) {
+                    auto slot = cache.next++;
+                    output << "    %v" << slot << " = getelementptr inbounds i64, ptr %v" << expr_id << ", i64 " << i << "\n";
+                    output << "    store " << llvm_type(grlang::node::result_type(graph.node(graph.inputs(id)[i]))) << " %v" << fields[i] << ", ptr %v" << slot << "\n";
+                }
+                return expr_id;
+            }
+            case grlang::node::Node::Type::DATA_FIELD: {
+                std::size_t value = output_expression(graph, graph.inputs(id)[0], names, cache, output);
+                auto slot = cache.next++;
+                output << "    %v" << slot << " = getelementptr inbounds i64, ptr %v" << value << ", i64 " << static_cast<int>(node.value) << "\n";
+                auto expr_id = cache.add(id);
+                output << "    %v" << expr_id << " = load " << llvm_type(node.value_type) << ", ptr %v" << slot << "\n";
+                return expr_id;
+            }
+            case grlang::node::Node::Type::DATA_PHI:
+            case grlang::node::Node::Type::MEMORY_NEW:
+            case grlang::node::Node::Type::MEMORY_LOAD:
+            case grlang::node::Node::Type::MEMORY_CALL:
+                throw std::runtime_error("value used where it is not defined");
+            default:
+                throw std::runtime_error("unknown node type " +  std::to_string((int)node.type));
+        }
+    }
+
+    std::uint32_t next_control(const grlang::node::Graph& graph, std::uint32_t ctl) {
+        std::uint32_t next = grlang::node::Graph::NO_NODE;
+        for (std::uint32_t user: graph.outputs(ctl)) {
+            if (grlang::node::is_control(graph.node(user)) && graph.is_control_edge(ctl, user)) {
+                assert(next == grlang::node::Graph::NO_NODE || next == user);
+                next = user;
+            }
+        }
+        return next;
+    }
+
+    // NOTE: pointer to the element, after trapping on an index out of bounds if the node is checked
+    std::size_t output_element(const grlang::node::Graph& graph, std::uint32_t id, const Names& names, Cache& cache, std::ostream& output) {
+        auto array_type = grlang::node::result_type(graph.node(graph.inputs(id)[1]));
+        std::size_t array = output_expression(graph, graph.inputs(id)[1], names, cache, output);
+        auto index_type = grlang::node::result_type(graph.node(graph.inputs(id)[2]));
+        std::size_t index = output_expression(graph, graph.inputs(id)[2], names, cache, output);
+        if (type_bits(index_type) < 64) {
+            auto wide = cache.next++;
+            output << "    %v" << wide << " = " << (grlang::node::is_unsigned_type(index_type) ? "zext " : "sext ") << llvm_type(index_type) << " %v" << index << " to i64\n";
+            index = wide;
+        }
+        if (graph.node(id).value == grlang::node::BOUNDS_CHECK) {
+            auto length = cache.next++;
+            output << "    %v" << length << " = load i64, ptr %v" << array << "\n";
+            auto in_bounds = cache.next++;  // NOTE: unsigned, so a negative index is out of bounds too
+            output << "    %v" << in_bounds << " = icmp ult i64 %v" << index << ", %v" << length << "\n";
+            output << "    br i1 %v" << in_bounds << ", label %in" << in_bounds << ", label %trap\n";
+            cache.block = "in" + std::to_string(in_bounds);
+            output << cache.block << ":\n";
+            cache.traps = true;
+        }
+        auto pointer = cache.next++;
+        output << "    %v" << pointer << " = getelementptr inbounds " << llvm_array_type(array_type) << ", ptr %v" << array << ", i64 0, i32 1, i64 %v" << index << "\n";
+        return pointer;
+    }
+
+    void output_memory(const grlang::node::Graph& graph, std::uint32_t id, const Names& names, Cache& cache, std::ostream& output) {
+        const grlang::node::Node& node = graph.node(id);
+        switch (node.type) {
+            case grlang::node::Node::Type::MEMORY_NEW: {
+                auto length_type = grlang::node::result_type(graph.node(graph.inputs(id)[1]));
+                std::size_t length = output_expression(graph, graph.inputs(id)[1], names, cache, output);
+                auto wide = cache.next++;
+                output << "    %v" << wide << " = sext " << llvm_type(length_type) << " %v" << length << " to i64\n";
+                // NOTE: traps on a negative length and on running out of memory, like a failed bounds check
+                auto valid = cache.next++;
+                output << "    %v" << valid << " = icmp sge i64 %v" << wide << ", 0\n";
+                output << "    br i1 %v" << valid << ", label %new" << valid << ", label %trap\n";
+                cache.block = "new" + std::to_string(valid);
+                output << cache.block << ":\n";
+                cache.traps = true;
+                auto bytes = cache.next++;
+                output << "    %v" << bytes << " = mul i64 %v" << wide << ", " << type_bits(grlang::node::element_type(node.value_type)) / 8 << "\n";
+                auto size = cache.next++;
+                output << "    %v" << size << " = add i64 %v" << bytes << ", 8\n";
+                auto expr_id = cache.add(id);  // NOTE: zeroed, like eval gives new arrays
+                output << "    %v" << expr_id << " = call ptr @calloc(i64 %v" << size << ", i64 1)\n";
+                cache.declarations.insert("declare ptr @calloc(i64, i64)");
+                auto allocated = cache.next++;
+                output << "    %v" << allocated << " = icmp ne ptr %v" << expr_id << ", null\n";
+                output << "    br i1 %v" << allocated << ", label %new" << allocated << ", label %trap\n";
+                cache.block = "new" + std::to_string(allocated);
+                output << cache.block << ":\n";
+                output << "    store i64 %v" << wide << ", ptr %v" << expr_id << "\n";
+                return;
+            }
+            case grlang::node::Node::Type::MEMORY_LOAD: {
+                std::size_t pointer = output_element(graph, id, names, cache, output);
+                auto expr_id = cache.add(id);
+                output << "    %v" << expr_id << " = load " << llvm_type(node.value_type) << ", ptr %v" << pointer << "\n";
+                return;
+            }
+            case grlang::node::Node::Type::MEMORY_STORE: {
+                std::size_t pointer = output_element(graph, id, names, cache, output);
+                std::size_t value = output_expression(graph, graph.inputs(id)[3], names, cache, output);
+                auto element = grlang::node::element_type(grlang::node::result_type(graph.node(graph.inputs(id)[1])));
+                output << "    store " << llvm_type(element) << " %v" << value << ", ptr %v" << pointer << "\n";
+                return;
+            }
+            case grlang::node::Node::Type::MEMORY_CALL:
+                assert(node.value == grlang::node::DIRECT_CALL);
+                output_call(graph, id, 1, names, cache, output);
+                return;
             default:
-                throw std::runtime_error("unknown node type " +  std::to_string((int)node->type));
-        }
-    }
-
-    void output_function(std::string_view name, const grlang::node::Node::Ptr& func, std::ostream& output) {
-        NodeMap inv_ctl;
-        NodeMap reg2phi;
-        std::set<const grlang::node::Node*> visited;
-        build_node_maps(func->inputs.at(0).get(), inv_ctl, reg2phi, visited);
-
-        const grlang::node::Node::Ptr& start = find_start(func->inputs.at(0));
-        
-        const std::size_t n_params = 1;  // TODO: figure out number of parames
-        std::size_t vars = 0;
-        output << "define i32 @" << name << "(";
-        while(vars<n_params) {
-            output << "i32 %v" << vars++;
-            if (vars<n_params) {
-                output << ", ";
-            }
-        }
-        output << ") {\n";
-
-        Cache cache;
-        cache[start.get()] = cache.size();  // TODO: handle function params properly
-
-        const grlang::node::Node *prev = nullptr;
-        const grlang::node::Node *ctl = start.get();
-        while (ctl->type != grlang::node::Node::Type::CONTROL_STOP) {
-            if (ctl->type == grlang::node::Node::Type::CONTROL_RETURN) {
-                std::size_t result = output_expression(ctl->inputs.at(1), cache, output);
-                output << "    ret i32 %v" << result << "\n";
-                break;
-            }
-            if (ctl->type == grlang::node::Node::Type::CONTROL_REGION) {
-            }
-            if (ctl->type == grlang::node::Node::Type::CONTROL_IFELSE) {
-                auto cond = output_expression(ctl->inputs.at(1), cache, output);
-                output << "    br i1 %v" << cond << " label t" << cond << ", label f" << cond << "\n";
-                output << "label t" << cond << ":\n";
-                // output true branch till join
-                output << "label f" << cond << ":\n";
-                // output false branch till join
-                // set ctl to the join point
+                throw std::runtime_error("unknown node type " +  std::to_string((int)node.type));
+        }
+    }
+
+    std::uint64_t cache_key(std::string_view name, const grlang::node::Node::Ptr& func, const Names& names, const grlang::codegen::Options& options) {
+        constexpr std::uint64_t LLVM_IR_CACHE_VERSION = 9;  // NOTE: bump when lowering changes
+        std::vector<const grlang::node::Node*> callees;
+        std::uint64_t key = grlang::node::hash_graph(func, &callees) ^ LLVM_IR_CACHE_VERSION;
+        key = (key ^ options.vector_lanes) * 0x100000001b3ull;
+        key = (key ^ options.instrument) * 0x100000001b3ull;
+        auto add_name = [&](std::string_view name) {
+            for (char c: name) {
+                key = (key ^ static_cast<std::uint8_t>(c)) * 0x100000001b3ull;
+            }
+            key = (key ^ 0xFF) * 0x100000001b3ull;
+        };
+        add_name(name);
+        for (const grlang::node::Node* node: callees) {  // NOTE: the code names the functions it calls
+            auto callee = names.find(node);
+            add_name(callee == names.end() ? std::string_view{} : callee->second);
+        }
+        if (options.profile) {
+            grlang::node::Graph graph(*func);
+            auto counts = grlang::node::branch_counts(*options.profile, *func);
+            for (std::uint32_t id=0; id<graph.size(); ++id) {
+                if (auto it = counts.find(&graph.node(id)); it != counts.end()) {
+                    for (std::uint64_t value: {std::uint64_t(id), it->second.taken[0], it->second.taken[1]}) {
+                        key = (key ^ value) * 0x100000001b3ull;
+                    }
+                }
+            }
+        }
+        return key;
+    }
+
+    // NOTE: phis of a region, in the order of its users
+    std::vector<std::uint32_t> region_phis(const grlang::node::Graph& graph, std::uint32_t region) {
+        std::vector<std::uint32_t> phis;
+        for (std::uint32_t user: graph.outputs(region)) {
+            if (graph.node(user).type == grlang::node::Node::Type::DATA_PHI && graph.inputs(user)[0] == region && std::ranges::find(phis, user) == phis.end()) {
+                phis.push_back(user);
+            }
+        }
+        return phis;
+    }
+
+    struct VectorPlan {
+        grlang::node::CountedLoop loop;
+        grlang::node::VectorLoop vector;
+    };
+
+    // Lowers the body of a counted loop for lanes iterations at once. Values that stay the same go to the block
+    // before the loop, splatted across the lanes
+    struct VectorLowering {
+        const grlang::node::Graph& graph;
+        const Names& names;
+        Cache& cache;
+        const VectorPlan& plan;
+        std::size_t lanes;
+        std::ostream& before;
+        std::ostream& body;
+        std::vector<bool> variant;
+        std::vector<std::size_t> ids;  // NOTE: vector values, for an ifelse the lanes that take its first arm
+        std::size_t counter = 0;  // NOTE: the scalar counter of the first lane
+        std::size_t index = 0;  // NOTE: the same, widened for addressing
+
+        std::size_t splat(std::size_t scalar, grlang::node::Value::Type type, std::ostream& output) {
+            auto one = cache.next++;
+            output << "    %v" << one << " = insertelement " << llvm_vector_type(type, lanes) << " poison, " << llvm_type(type) << " %v" << scalar << ", i64 0\n";
+            auto all = cache.next++;
+            output << "    %v" << all << " = shufflevector " << llvm_vector_type(type, lanes) << " %v" << one << ", " << llvm_vector_type(type, lanes) << " poison, <" << lanes << " x i32> zeroinitializer\n";
+            return all;
+        }
+
+        std::size_t flag(std::size_t value, grlang::node::Value::Type type, std::uint32_t id) {
+            auto widened = cache.next++;
+            body << "    %v" << widened << " = zext <" << lanes << " x i1> %v" << value << " to " << llvm_vector_type(type, lanes) << "\n";
+            return ids[id] = widened;
+        }
+
+        std::size_t value(std::uint32_t id) {
+            if (ids[id] != Cache::NONE) {
+                return ids[id];
+            }
+            const grlang::node::Node& node = graph.node(id);
+            auto type = grlang::node::result_type(node);
+            auto vector = llvm_vector_type(type, lanes);
+            if (!variant[id]) {
+                return ids[id] = splat(output_expression(graph, id, names, cache, before), type, before);
+            }
+            if (id == plan.loop.counter) {
+                auto lanes_of = splat(counter, type, body);
+                auto result = cache.next++;
+                body << "    %v" << result << " = add " << vector << " %v" << lanes_of << ", <";
+                for (std::size_t i=0; i<lanes; ++i) {
+                    body << (i ? ", " : "") << "i32 " << i;
+                }
+                body << ">\n";
+                return ids[id] = result;
+            }
+            auto inputs = graph.inputs(id);
+            if (is_binary_op(node)) {
+                std::size_t op1 = value(inputs[0]);
+                std::size_t op2 = value(inputs[1]);
+                auto result = cache.next++;
+                body << "    %v" << result << " = " << op_code(node.type, node.value_type) << " " << llvm_vector_type(node.value_type, lanes) << " %v" << op1 << ", %v" << op2 << "\n";
+                return grlang::node::is_comparison(node.type) ? flag(result, type, id) : ids[id] = result;
+            }
+            switch (node.type) {
+                case grlang::node::Node::Type::DATA_OP_NEG: {
+                    std::size_t op = value(inputs[0]);
+                    auto result = cache.next++;
+                    body << "    %v" << result << " = sub " << vector << " zeroinitializer, %v" << op << "\n";
+                    return ids[id] = result;
+                }
+                case grlang::node::Node::Type::DATA_OP_NOT: {
+                    std::size_t op = value(inputs[0]);
+                    auto result = cache.next++;
+                    body << "    %v" << result << " = icmp eq " << llvm_vector_type(node.value_type, lanes) << " %v" << op << ", zeroinitializer\n";
+                    return flag(result, type, id);
+                }
+                case grlang::node::Node::Type::DATA_OP_CONVERT: {
+                    auto from = grlang::node::result_type(graph.node(inputs[0]));
+                    std::size_t op = value(inputs[0]);
+                    if (type_bits(from) == type_bits(type)) {
+                        return ids[id] = op;
+                    }
+                    const char* op_code = type_bits(from) > type_bits(type) ? "trunc" : grlang::node::is_unsigned_type(from) ? "zext" : "sext";
+                    auto result = cache.next++;
+                    body << "    %v" << result << " = " << op_code << " " << llvm_vector_type(from, lanes) << " %v" << op << " to " << vector << "\n";
+                    return ids[id] = result;
+                }
+                case grlang::node::Node::Type::DATA_PHI: {
+                    auto select = std::ranges::find(plan.vector.selects, inputs[0], &grlang::node::VectorLoop::Select::merge);
+                    assert(select != plan.vector.selects.end());
+                    std::size_t taken = value(inputs[select->taken]);
+                    std::size_t other = value(inputs[select->taken == 1 ? 2 : 1]);
+                    std::size_t mask = condition(select->ifelse);
+                    auto result = cache.next++;
+                    body << "    %v" << result << " = select <" << lanes << " x i1> %v" << mask << ", " << vector << " %v" << taken << ", " << vector << " %v" << other << "\n";
+                    return ids[id] = result;
+                }
+                default:
+                    throw std::runtime_error("unknown node type " +  std::to_string((int)node.type));
+            }
+        }
+
+        // NOTE: like a scalar ifelse, the first arm is taken when the condition is exactly 1
+        std::size_t condition(std::uint32_t ifelse) {
+            if (ids[ifelse] == Cache::NONE) {
+                std::uint32_t input = graph.inputs(ifelse)[1];
+                auto type = grlang::node::result_type(graph.node(input));
+                std::size_t op = value(input);
+                ids[ifelse] = cache.next++;
+                body << "    %v" << ids[ifelse] << " = icmp eq " << llvm_vector_type(type, lanes) << " %v" << op << ", " << llvm_vector_literal(type, lanes, 1) << "\n";
+            }
+            return ids[ifelse];
+        }
+
+        std::size_t element(std::uint32_t id) {
+            auto array_type = grlang::node::result_type(graph.node(graph.inputs(id)[1]));
+            std::size_t array = output_expression(graph, graph.inputs(id)[1], names, cache, before);
+            auto pointer = cache.next++;
+            body << "    %v" << pointer << " = getelementptr inbounds " << llvm_array_type(array_type) << ", ptr %v" << array << ", i64 0, i32 1, i64 %v" << index << "\n";
+            return pointer;
+        }
+
+        void output_memory(std::uint32_t id) {
+            const grlang::node::Node& node = graph.node(id);
+            if (node.type != grlang::node::Node::Type::MEMORY_LOAD && node.type != grlang::node::Node::Type::MEMORY_STORE) {
+                return;
+            }
+            auto element_type = grlang::node::element_type(grlang::node::result_type(graph.node(graph.inputs(id)[1])));
+            auto align = type_bits(element_type) / 8;
+            if (node.type == grlang::node::Node::Type::MEMORY_LOAD) {
+                std::size_t pointer = element(id);
+                ids[id] = cache.next++;
+                body << "    %v" << ids[id] << " = load " << llvm_vector_type(element_type, lanes) << ", ptr %v" << pointer << ", align " << align << "\n";
+            } else if (node.type == grlang::node::Node::Type::MEMORY_STORE) {
+                std::size_t pointer = element(id);
+                std::size_t stored = value(graph.inputs(id)[3]);
+                body << "    store " << llvm_vector_type(element_type, lanes) << " %v" << stored << ", ptr %v" << pointer << ", align " << align << "\n";
+            }
+        }
+    };
+
+    const char* reduction_name(grlang::node::Reduction reduction, grlang::node::Value::Type type) {
+        bool is_unsigned = grlang::node::is_unsigned_type(type);
+        switch (reduction) {
+            case grlang::node::Reduction::ADD: return "add";
+            case grlang::node::Reduction::MUL: return "mul";
+            case grlang::node::Reduction::AND: return "and";
+            case grlang::node::Reduction::MIN: return is_unsigned ? "umin" : "smin";
+            case grlang::node::Reduction::MAX: return is_unsigned ? "umax" : "smax";
+        }
+        return "";
+    }
+
+    // Branches from the block before a counted loop into a vector loop running lanes iterations at a time, when
+    // there are that many left and every array holds the elements they touch. The loop itself finishes whatever
+    // the vector loop leaves
+    void output_vector_loop(const grlang::node::Graph& graph, const VectorPlan& plan, std::size_t lanes, const Names& names, Cache& cache, std::vector<std::vector<std::string>>& incoming, std::ostream& output) {
+        const auto& loop = plan.loop;
+        std::string label = std::to_string(loop.region);
+        std::string before = cache.block;
+        auto phis = region_phis(graph, loop.region);
+        std::vector<std::size_t> starts;
+        for (std::uint32_t phi: phis) {
+            starts.push_back(output_expression(graph, graph.inputs(phi)[loop.entry], names, cache, output));
+            incoming[phi].push_back("[ %v" + std::to_string(starts.back()) + ", %" + before + " ]");
+        }
+        std::size_t first = starts[std::ranges::find(phis, loop.counter) - phis.begin()];
+        std::size_t limit = output_expression(graph, loop.limit, names, cache, output);
+
+        // NOTE: in i64, so the trip count can't overflow
+        auto first64 = cache.next++;
+        output << "    %v" << first64 << " = sext i32 %v" << first << " to i64\n";
+        auto limit64 = cache.next++;
+        output << "    %v" << limit64 << " = sext i32 %v" << limit << " to i64\n";
+        auto trip = cache.next++;
+        output << "    %v" << trip << " = sub i64 %v" << limit64 << ", %v" << first64 << "\n";
+        auto vector_trip = cache.next++;
+        output << "    %v" << vector_trip << " = and i64 %v" << trip << ", -" << lanes << "\n";
+        auto end64 = cache.next++;
+        output << "    %v" << end64 << " = add i64 %v" << first64 << ", %v" << vector_trip << "\n";
+        auto end = cache.next++;
+        output << "    %v" << end << " = trunc i64 %v" << end64 << " to i32\n";
+        auto enough = cache.next++;
+        output << "    %v" << enough << " = icmp sge i64 %v" << trip << ", " << lanes << "\n";
+        auto valid = cache.next++;
+        output << "    %v" << valid << " = icmp sge i64 %v" << first64 << ", 0\n";
+        auto ok = cache.next++;
+        output << "    %v" << ok << " = and i1 %v" << enough << ", %v" << valid << "\n";
+        for (std::uint32_t array: plan.vector.arrays) {
+            std::size_t pointer = output_expression(graph, array, names, cache, output);
+            auto length = cache.next++;
+            output << "    %v" << length << " = load i64, ptr %v" << pointer << "\n";
+            auto fits = cache.next++;
+            output << "    %v" << fits << " = icmp sle i64 %v" << end64 << ", %v" << length << "\n";
+            auto both = cache.next++;
+            output << "    %v" << both << " = and i1 %v" << ok << ", %v" << fits << "\n";
+            ok = both;
+        }
+
+        std::ostringstream body;
+        VectorLowering lowering{graph, names, cache, plan, lanes, output, body, grlang::node::loop_variant(graph, loop), std::vector<std::size_t>(graph.size(), Cache::NONE)};
+        lowering.counter = cache.next++;
+        lowering.index = cache.next++;
+        body << "    %v" << lowering.index << " = sext i32 %v" << lowering.counter << " to i64\n";
+        std::vector<std::size_t> accumulators;
+        for (auto [phi, reduction]: plan.vector.reductions) {
+            auto type = graph.node(phi).value_type;
+            std::size_t start = starts[std::ranges::find(phis, phi) - phis.begin()];
+            std::size_t init;
+            if (reduction == grlang::node::Reduction::MIN || reduction == grlang::node::Reduction::MAX) {
+                init = lowering.splat(start, type, output);
             } else {
-                assert(inv_ctl.at(ctl).size() == 1);
-                prev = ctl;
-                ctl = inv_ctl.at(prev).front();
+                // NOTE: the other lanes start from the identity of the operation
+                std::int64_t identity = reduction == grlang::node::Reduction::ADD ? 0 : reduction == grlang::node::Reduction::MUL ? 1 : -1;
+                init = cache.next++;
+                output << "    %v" << init << " = insertelement " << llvm_vector_type(type, lanes) << " " << llvm_vector_literal(type, lanes, identity) << ", " << llvm_type(type) << " %v" << start << ", i64 0\n";
+            }
+            accumulators.push_back(init);
+            lowering.ids[phi] = cache.next++;
+        }
+        for (std::uint32_t control: loop.nodes) {
+            lowering.output_memory(control);
+        }
+        std::vector<std::size_t> results;
+        for (auto [phi, reduction]: plan.vector.reductions) {
+            results.push_back(lowering.value(graph.inputs(phi)[loop.back]));
+        }
+        auto next = cache.next++;
+        body << "    %v" << next << " = add i32 %v" << lowering.counter << ", " << lanes << "\n";
+        auto more = cache.next++;
+        body << "    %v" << more << " = icmp slt i32 %v" << next << ", %v" << end << "\n";
+        body << "    br i1 %v" << more << ", label %vl" << label << ", label %vx" << label << "\n";
+
+        output << "    br i1 %v" << ok << ", label %vl" << label << ", label %b" << label << "\n";
+        output << "vl" << label << ":\n";
+        output << "    %v" << lowering.counter << " = phi i32 [ %v" << first << ", %" << before << " ], [ %v" << next << ", %vl" << label << " ]\n";
+        for (std::size_t i=0; i<plan.vector.reductions.size(); ++i) {
+            auto [phi, reduction] = plan.vector.reductions[i];
+            output << "    %v" << lowering.ids[phi] << " = phi " << llvm_vector_type(graph.node(phi).value_type, lanes) << " [ %v" << accumulators[i] << ", %" << before << " ], [ %v" << results[i] << ", %vl" << label << " ]\n";
+        }
+        output << body.str();
+
+        output << "vx" << label << ":\n";
+        incoming[loop.counter].push_back("[ %v" + std::to_string(end) + ", %vx" + label + " ]");
+        for (std::size_t i=0; i<plan.vector.reductions.size(); ++i) {
+            auto [phi, reduction] = plan.vector.reductions[i];
+            auto type = graph.node(phi).value_type;
+            std::string intrinsic = std::string("@llvm.vector.reduce.") + reduction_name(reduction, type) + ".v" + std::to_string(lanes) + llvm_type(type);
+            cache.declarations.insert("declare " + llvm_type(type) + " " + intrinsic + "(" + llvm_vector_type(type, lanes) + ")");
+            auto reduced = cache.next++;
+            output << "    %v" << reduced << " = call " << llvm_type(type) << " " << intrinsic << "(" << llvm_vector_type(type, lanes) << " %v" << results[i] << ")\n";
+            incoming[phi].push_back("[ %v" + std::to_string(reduced) + ", %vx" + label + " ]");
+        }
+        output << "    br label %b" << label << "\n";
+    }
+
+    // NOTE: ends the block at from with a branch to a region, its phis get their values for this predecessor
+    void output_branch(const grlang::node::Graph& graph, std::uint32_t from, std::uint32_t region, const Names& names, Cache& cache, std::vector<std::vector<std::string>>& incoming, std::ostream& output) {
+        auto inputs = graph.inputs(region);
+        std::size_t input = std::ranges::find(inputs, from) - inputs.begin();
+        for (std::uint32_t phi: region_phis(graph, region)) {
+            std::size_t value = output_expression(graph, graph.inputs(phi)[input], names, cache, output);
+            incoming[phi].push_back("[ %v" + std::to_string(value) + ", %" + cache.block + " ]");
+        }
+        output << "    br label %b" << region << "\n";
+    }
+
+    // NOTE: branches an instrumented function counts, in graph order, each arm has a counter of its own
+    std::vector<std::uint32_t> counted_branches(const grlang::node::Graph& graph) {
+        std::vector<std::uint32_t> branches;
+        for (std::uint32_t id=0; id<graph.size(); ++id) {
+            if (graph.node(id).type == grlang::node::Node::Type::CONTROL_IFELSE) {
+                branches.push_back(id);
+            }
+        }
+        return branches;
+    }
+
+    std::string counters_name(std::string_view name) {
+        return "@grlang.counts." + std::string(name);
+    }
+
+    // NOTE: LLVM takes 32-bit weights, only their ratio matters
+    std::string branch_weights(const grlang::node::Profile::Branch& branch) {
+        std::uint64_t taken[2] = {branch.taken[0], branch.taken[1]};
+        while (std::max(taken[0], taken[1]) > 0xFFFFFFFFull) {
+            taken[0] >>= 1;
+            taken[1] >>= 1;
+        }
+        return ", !prof !{!\"branch_weights\", i32 " + std::to_string(taken[0]) + ", i32 " + std::to_string(taken[1]) + "}";
+    }
+
+    // NOTE: order to write blocks in, by index. Without counts that's the order they were made in, reverse postorder.
+    // Otherwise each block is followed by its likeliest successor not placed yet, and blocks that are only reached
+    // through an arm that was never taken go last, out of the way of the hot code
+    std::vector<std::size_t> layout_blocks(const grlang::node::Graph& graph, const Dominators& dominators, const grlang::node::BranchCounts& counts, const std::vector<std::uint32_t>& heads, const std::vector<std::vector<std::uint32_t>>& successors) {
+        std::vector<std::size_t> order;
+        if (counts.empty()) {
+            for (std::size_t i=0; i<heads.size(); ++i) {
+                order.push_back(i);
+            }
+            return order;
+        }
+        std::vector<std::uint32_t> cold_arms;
+        for (std::uint32_t head: heads) {
+            if (graph.node(head).type != grlang::node::Node::Type::CONTROL_PROJECT) {
+                continue;
+            }
+            auto it = counts.find(&graph.node(graph.inputs(head)[0]));
+            std::uint8_t arm = graph.node(head).value;
+            if (it != counts.end() && it->second.taken[arm] == 0 && it->second.taken[1-arm] != 0) {
+                cold_arms.push_back(head);
+            }
+        }
+        std::unordered_map<std::uint32_t, std::size_t> index;  // NOTE: by head
+        std::vector<bool> cold(heads.size());
+        for (std::size_t i=0; i<heads.size(); ++i) {
+            index[heads[i]] = i;
+            cold[i] = std::ranges::any_of(cold_arms, [&](std::uint32_t arm) { return dominators.dominates(arm, heads[i]); });
+        }
+        std::vector<bool> placed(heads.size());
+        for (std::size_t first=0; first<heads.size(); ++first) {
+            for (std::size_t i = first; i < heads.size() && !placed[i] && !cold[i];) {
+                placed[i] = true;
+                order.push_back(i);
+                auto next = std::ranges::find_if(successors[i], [&](std::uint32_t head) { return !placed[index.at(head)] && !cold[index.at(head)]; });
+                i = next == successors[i].end() ? heads.size() : index.at(*next);
+            }
+        }
+        for (std::size_t i=0; i<heads.size(); ++i) {
+            if (!placed[i]) {
+                order.push_back(i);
+            }
+        }
+        return order;
+    }
+
+    // NOTE: a destructor that writes the counters of every instrumented function in the format of node::Profile
+    void output_profile_writer(const std::vector<std::pair<std::string_view, const grlang::node::Node::Ptr*>>& functions, std::ostream& output) {
+        output << "@grlang.profile.env = private constant [15 x i8] c\"GRLANG_PROFILE\\00\"\n";
+        output << "@grlang.profile.path = private constant [15 x i8] c\"grlang.profile\\00\"\n";
+        output << "@grlang.profile.mode = private constant [2 x i8] c\"w\\00\"\n";
+        output << "@grlang.profile.header = private constant [18 x i8] c\"grlang-profile " << grlang::node::Profile::VERSION << "\\0A\\00\"\n";
+        output << "@grlang.profile.line = private constant [22 x i8] c\"%016llx %u %llu %llu\\0A\\00\"\n";
+        output << "define internal void @grlang.profile.write() {\n";
+        output << "    %env = call ptr @getenv(ptr @grlang.profile.env)\n";
+        output << "    %unset = icmp eq ptr %env, null\n";
+        output << "    %path = select i1 %unset, ptr @grlang.profile.path, ptr %env\n";
+        output << "    %file = call ptr @fopen(ptr %path, ptr @grlang.profile.mode)\n";
+        output << "    %failed = icmp eq ptr %file, null\n";
+        output << "    br i1 %failed, label %done, label %write\n";
+        output << "write:\n";
+        output << "    call i32 (ptr, ptr, ...) @fprintf(ptr %file, ptr @grlang.profile.header)\n";
+        std::size_t next = 0;
+        for (auto& [name, func]: functions) {
+            grlang::node::Graph graph(**func);
+            auto branches = counted_branches(graph);
+            std::uint64_t hash = grlang::node::hash_graph(**func);
+            std::string array = "[" + std::to_string(2*branches.size()) + " x i64]";
+            for (std::size_t i=0; i<branches.size(); ++i) {
+                std::size_t taken = next;
+                for (std::size_t arm: {0, 1}) {
+                    output << "    %c" << next << "p = getelementptr inbounds " << array << ", ptr " << counters_name(name) << ", i64 0, i64 " << 2*i+arm << "\n";
+                    output << "    %c" << next << " = load i64, ptr %c" << next << "p\n";
+                    ++next;
+                }
+                output << "    call i32 (ptr, ptr, ...) @fprintf(ptr %file, ptr @grlang.profile.line, i64 " << static_cast<std::int64_t>(hash) << ", i32 " << branches[i] << ", i64 %c" << taken << ", i64 %c" << taken+1 << ")\n";
+            }
+        }
+        output << "    call i32 @fclose(ptr %file)\n";
+        output << "    br label %done\n";
+        output << "done:\n";
+        output << "    ret void\n";
+        output << "}\n";
+        output << "@llvm.global_dtors = appending global [1 x { i32, ptr, ptr }] [{ i32, ptr, ptr } { i32 65535, ptr @grlang.profile.write, ptr null }]\n";
+    }
+
+    void output_function(std::string_view name, const grlang::node::Node::Ptr& func, bool exported, const Names& names, const grlang::codegen::Options& options, std::ostream& output) {
+        grlang::node::ensure_built(*func);
+        grlang::node::PhaseTimer lower(grlang::node::Phase::LOWER);
+        grlang::node::PhaseTimer schedule(grlang::node::Phase::SCHEDULE);
+        grlang::node::Graph graph(*func);
+        Dominators dominators(graph);
+        schedule.stop();
+
+        auto& signature = get_signature(*func);
+        const std::size_t n_params = signature.params.size();
+        std::ostringstream header;
+        header << (exported ? "define " : "define internal ") << llvm_type(signature.result) << " @" << name << "(";
+        for (std::size_t i=0; i<n_params; ++i) {
+            header << (i ? ", " : "") << llvm_type(signature.params[i]) << " %v" << i;
+        }
+        header << ") {\n";
+
+        Cache cache(graph, dominators);
+        cache.at = graph.start();
+        cache.add(graph.start());  // TODO: handle function params properly
+        cache.next = std::max<std::size_t>(n_params, 1);  // NOTE: parameters are %v0 and up
+
+        grlang::node::BranchCounts counts;
+        if (options.profile) {
+            counts = grlang::node::branch_counts(*options.profile, *func);
+        }
+        std::vector<std::uint32_t> counted;
+        if (options.instrument) {
+            counted = counted_branches(graph);
+        }
+
+        std::unordered_map<std::uint32_t, VectorPlan> plans;  // NOTE: by loop region
+        if (options.vector_lanes > 1 && !options.instrument) {
+            for (auto& loop: grlang::node::find_counted_loops(graph)) {
+                if (auto vector = grlang::node::match_vector_loop(graph, loop)) {
+                    plans.emplace(loop.region, VectorPlan{std::move(loop), std::move(*vector)});
+                }
+            }
+        }
+
+        // NOTE: a block starts at the start, a region or an ifelse project and follows control from there
+        std::vector<std::pair<std::uint32_t, std::string>> blocks;
+        std::vector<std::vector<std::uint32_t>> successors;  // NOTE: heads of the blocks each block goes to, likeliest first
+        std::vector<std::vector<std::string>> incoming(graph.size());  // NOTE: by phi
+        for (std::uint32_t head: graph.control_rpo()) {
+            auto type = graph.node(head).type;
+            if (type != grlang::node::Node::Type::CONTROL_START && type != grlang::node::Node::Type::CONTROL_REGION && type != grlang::node::Node::Type::CONTROL_PROJECT) {
+                continue;
+            }
+            std::ostringstream code;
+            successors.emplace_back();
+            cache.at = head;
+            cache.block = "b" + std::to_string(head);
+            if (type == grlang::node::Node::Type::CONTROL_REGION) {
+                for (std::uint32_t phi: region_phis(graph, head)) {
+                    cache.add(phi);
+                }
+            }
+            if (type == grlang::node::Node::Type::CONTROL_PROJECT && options.instrument) {
+                std::size_t counter = 2*(std::ranges::find(counted, graph.inputs(head)[0]) - counted.begin()) + graph.node(head).value;
+                std::string array = "[" + std::to_string(2*counted.size()) + " x i64]";
+                std::size_t ptr = cache.next++;
+                std::size_t count = cache.next++;
+                code << "    %v" << ptr << " = getelementptr inbounds " << array << ", ptr " << counters_name(name) << ", i64 0, i64 " << counter << "\n";
+                code << "    %v" << count << " = load i64, ptr %v" << ptr << "\n";
+                code << "    %v" << cache.next << " = add i64 %v" << count << ", 1\n";
+                code << "    store i64 %v" << cache.next++ << ", ptr %v" << ptr << "\n";
+            }
+            for (std::uint32_t ctl = head;;) {
+                cache.at = ctl;
+                const grlang::node::Node& node = graph.node(ctl);
+                if (grlang::node::is_memory(node)) {
+                    output_memory(graph, ctl, names, cache, code);
+                }
+                if (node.type == grlang::node::Node::Type::CONTROL_RETURN) {
+                    std::size_t result = output_expression(graph, graph.inputs(ctl)[1], names, cache, code);
+                    code << "    ret " << llvm_type(signature.result) << " %v" << result << "\n";
+                    break;
+                }
+                if (node.type == grlang::node::Node::Type::CONTROL_IFELSE) {
+                    auto value = output_expression(graph, graph.inputs(ctl)[1], names, cache, code);
+                    auto cond = cache.next++;  // NOTE: the first arm is taken when the condition is exactly 1
+                    code << "    %v" << cond << " = icmp eq " << llvm_type(grlang::node::result_type(graph.node(graph.inputs(ctl)[1]))) << " %v" << value << ", 1\n";
+                    code << "    br i1 %v" << cond;
+                    for (std::uint8_t arm: {0, 1}) {
+                        for (std::uint32_t user: graph.outputs(ctl)) {
+                            if (graph.node(user).type == grlang::node::Node::Type::CONTROL_PROJECT && graph.node(user).value == arm) {
+                                code << ", label %b" << user;
+                                successors.back().push_back(user);
+                            }
+                        }
+                    }
+                    if (auto it = counts.find(&node); it != counts.end()) {
+                        code << branch_weights(it->second);
+                        if (it->second.taken[1] > it->second.taken[0]) {
+                            std::ranges::reverse(successors.back());
+                        }
+                    }
+                    code << "\n";
+                    break;
+                }
+                std::uint32_t next = next_control(graph, ctl);
+                if (next == grlang::node::Graph::NO_NODE) {
+                    code << "    unreachable\n";
+                    break;
+                }
+                if (graph.node(next).type == grlang::node::Node::Type::CONTROL_REGION) {
+                    successors.back().push_back(next);
+                    auto plan = plans.find(next);
+                    if (plan != plans.end() && graph.inputs(next)[plan->second.loop.entry] == ctl) {
+                        output_vector_loop(graph, plan->second, options.vector_lanes, names, cache, incoming, code);
+                    } else {
+                        output_branch(graph, ctl, next, names, cache, incoming, code);
+                    }
+                    break;
+                }
+                ctl = next;
+            }
+            blocks.emplace_back(head, std::move(code).str());
+        }
+
+        if (cache.traps) {
+            cache.declarations.insert("declare void @llvm.trap()");
+        }
+        for (auto& declaration: cache.declarations) {
+            output << declaration << "\n";
+        }
+        if (options.instrument) {
+            output << counters_name(name) << " = internal global [" << 2*counted.size() << " x i64] zeroinitializer\n";
+        }
+        output << header.str();
+        std::vector<std::uint32_t> heads;
+        for (auto& block: blocks) {
+            heads.push_back(block.first);
+        }
+        for (std::size_t index: layout_blocks(graph, dominators, counts, heads, successors)) {
+            auto& [head, code] = blocks[index];
+            output << "b" << head << ":\n";
+            if (graph.node(head).type == grlang::node::Node::Type::CONTROL_REGION) {
+                for (std::uint32_t phi: region_phis(graph, head)) {
+                    output << "    %v" << cache.ids[phi] << " = phi " << llvm_type(grlang::node::result_type(graph.node(phi))) << " ";
+                    for (std::size_t i=0; i<incoming[phi].size(); ++i) {
+                        output << (i ? ", " : "") << incoming[phi][i];
+                    }
+                    output << "\n";
+                }
             }
+            output << code;
+        }
+        if (cache.traps) {
+            output << "trap:\n";
+            output << "    call void @llvm.trap()\n";
+            output << "    unreachable\n";
         }
         output << "}\n";
     }
 }
 
 namespace grlang::codegen {
-    bool gen_llvm_ir(const std::unordered_map<std::string_view, node::Node::Ptr>& exports, std::ostream& output) {
+    bool gen_llvm_ir(const std::unordered_map<std::string_view, node::Node::Ptr>& exports, std::ostream& output, const Options& options) {
+        std::vector<std::pair<std::string_view, const node::Node::Ptr*>> functions;
+        Names names;
         for (auto& [name, node]: exports) {
             assert(node->type == node::Node::Type::DATA_TERM);
-            if (get_value_int(*node) == 0x0FEFEFE0) {  // TODO function ptr type
-                output_function(name, node, output);
+            if (is_function(*node)) {
+                functions.emplace_back(name, &node);
+                names.emplace(node.get(), name);
+            }
+        }
+        std::ranges::sort(functions, {}, [](auto& func) { return func.first; });  // NOTE: stable output regardless of hash map order
+        const std::size_t n_exported = functions.size();
+
+        // NOTE: functions called but not exported, local function literals and the copies opt::optimize_unit makes, are
+        // defined internal, named after the first function found calling them and a number
+        std::deque<node::Node::Ptr> locals;
+        std::deque<std::string> local_names;
+        for (std::size_t i = 0; i < functions.size(); ++i) {
+            auto [caller, func] = functions.at(i);
+            node::ensure_built(**func);
+            node::Graph graph(**func);
+            std::size_t n_locals = 0;
+            for (std::uint32_t id=0; id<graph.size(); ++id) {
+                for (const node::Node::Ptr& input: graph.node(id).inputs) {
+                    if (input && is_function(*input) && !names.contains(input.get())) {
+                        auto& name = local_names.emplace_back(std::format("{}.{}", caller, ++n_locals));
+                        names.emplace(input.get(), name);
+                        functions.emplace_back(name, &locals.emplace_back(input));
+                    }
+                }
+            }
+        }
+
+        std::vector<std::string> buffers(functions.size());
+        std::vector<std::exception_ptr> errors(functions.size());
+        std::atomic<std::size_t> next_function = 0;
+        auto worker = [&]() {
+            for (std::size_t i = next_function++; i < functions.size(); i = next_function++) {
+                try {
+                    auto& [name, func] = functions.at(i);
+                    std::uint64_t key = options.cache ? cache_key(name, *func, names, options) : 0;
+                    if (options.cache) {
+                        if (auto cached = options.cache->load(key)) {
+                            buffers.at(i) = std::move(*cached);
+                            continue;
+                        }
+                    }
+                    std::ostringstream buffer;
+                    output_function(name, *func, i < n_exported, names, options, buffer);
+                    buffers.at(i) = std::move(buffer).str();
+                    if (options.cache) {
+                        options.cache->store(key, buffers.at(i));
+                    }
+                } catch (...) {
+                    errors.at(i) = std::current_exception();
+                }
+            }
+        };
+
+        std::size_t n_threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+        n_threads = std::min(n_threads, functions.size());
+        {
+            std::vector<std::jthread> pool;
+            for (std::size_t i = 1; i < n_threads; ++i) {
+                pool.emplace_back(worker);
+            }
+            worker();
+        }
+
+        for (std::size_t i = 0; i < functions.size(); ++i) {
+            if (errors.at(i)) {
+                std::rethrow_exception(errors.at(i));
             }
         }
+        // NOTE: each function starts with what it calls, the module declares each of those once
+        std::set<std::string_view> declarations;
+        for (std::string_view buffer: buffers) {
+            while (buffer.starts_with("declare ")) {
+                auto line = buffer.substr(0, buffer.find('\n') + 1);
+                declarations.insert(line);
+                buffer.remove_prefix(line.size());
+            }
+            output << buffer;
+        }
+        if (options.instrument) {
+            output_profile_writer(functions, output);
+            for (std::string_view declaration: {"declare ptr @getenv(ptr)\n", "declare ptr @fopen(ptr, ptr)\n", "declare i32 @fprintf(ptr, ptr, ...)\n", "declare i32 @fclose(ptr)\n"}) {
+                declarations.insert(declaration);
+            }
+        }
+        for (std::string_view declaration: declarations) {
+            output << declaration;
+        }
         output.flush();
         return true;
     }
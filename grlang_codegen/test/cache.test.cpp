@@ -0,0 +1,77 @@
+#include <sstream>
+#include <fstream>
+
+#include "grtest.h"
+#include "grlang/parse.h"
+#include "grlang/codegen.h"
+
+
+namespace {
+    std::filesystem::path fresh_directory(std::string_view name) {
+        auto path = std::filesystem::temp_directory_path() / name;
+        std::filesystem::remove_all(path);
+        return path;
+    }
+}
+
+TEST_CASE(test_cache_lru) {
+    grlang::codegen::Cache cache(fresh_directory("grlang_cache_lru"), 8);
+    assert(!cache.load(1));
+    cache.store(1, "1234");
+    cache.store(2, "5678");
+    assert(cache.load(1) == "1234");
+    cache.store(3, "9abc");
+    assert(!cache.load(2));
+    assert(cache.load(1) == "1234");
+    assert(cache.load(3) == "9abc");
+
+    auto stats = cache.stats();
+    assert(stats.hits == 3);
+    assert(stats.misses == 2);
+    assert(stats.stores == 3);
+    assert(stats.evictions == 1);
+    assert(stats.bytes == 8);
+}
+
+TEST_CASE(test_cache_persist) {
+    auto directory = fresh_directory("grlang_cache_persist");
+    {
+        grlang::codegen::Cache cache(directory, 1024);
+        cache.store(42, "hello");
+    }
+    grlang::codegen::Cache cache(directory, 1024);
+    assert(cache.load(42) == "hello");
+    assert(cache.stats().bytes == 5);
+}
+
+TEST_CASE(test_cache_stray_files) {
+    auto directory = fresh_directory("grlang_cache_stray");
+    {
+        grlang::codegen::Cache cache(directory, 1024);
+        cache.store(0xff, "hello");
+    }
+    for (auto name: {"notes.grc", "12xyz.grc", "ff.grc", "0ff.grc"}) {
+        std::ofstream(directory / name) << "stray";
+    }
+    grlang::codegen::Cache cache(directory, 1024);
+    assert(cache.load(0xff) == "hello");
+    assert(cache.stats().bytes == 5);
+}
+
+TEST_CASE(test_cache_codegen) {
+    grlang::codegen::Cache cache(fresh_directory("grlang_cache_codegen"), 1 << 20);
+    std::string code = "f:= (x:int) -> int { return x*2 } g:= (x:int) -> int { return x+1 }";
+    std::ostringstream first;
+    grlang::codegen::gen_llvm_ir(grlang::parse::parse_unit(code), first, {.cache = &cache});
+    assert(cache.stats().misses == 2 && cache.stats().stores == 2);
+
+    std::ostringstream second;
+    grlang::codegen::gen_llvm_ir(grlang::parse::parse_unit(code), second, {.cache = &cache});
+    assert(cache.stats().hits == 2);
+    assert(first.str() == second.str());
+
+    std::string edited = "f:= (x:int) -> int { return x*2 } g:= (x:int) -> int { return x+3 }";
+    std::ostringstream third;
+    grlang::codegen::gen_llvm_ir(grlang::parse::parse_unit(edited), third, {.cache = &cache});
+    assert(cache.stats().hits == 3 && cache.stats().misses == 3);
+}
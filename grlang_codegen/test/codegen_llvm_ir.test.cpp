@@ -6,6 +6,7 @@
 
 #include "grlang/parse.h"
 #include "grlang/codegen.h"
+#include "grlang/opt.h"
 
 
 namespace {
@@ -27,27 +28,50 @@ namespace {
         "    ret i32 %ret\n"
         "}\n";
 
-    int codegen(std::unordered_map<std::string_view, grlang::node::Node::Ptr> exports, std::ostream& output) {
+    int codegen(std::unordered_map<std::string_view, grlang::node::Node::Ptr> exports, std::ostream& output, const grlang::codegen::Options& options) {
         output << MAIN_SHIM << "\n";
-        return grlang::codegen::gen_llvm_ir(exports, output) ? 0 : 1;
+        return grlang::codegen::gen_llvm_ir(exports, output, options) ? 0 : 1;
     }
 }
 
 int main(int argc, char* argv[]) {
     if (argc < 2) {
-        std::cerr << "Usage:\n    " << argv[0] << " input.grl [-o output.ll]" << std::endl;
+        std::cerr << "Usage:\n    " << argv[0] << " input.grl [-o output.ll] [--optimize] [--instrument] [--profile input.profile]" << std::endl;
         return 1;
     }
+    std::string_view output_path;
+    grlang::codegen::Options options;
+    grlang::node::Profile profile;
+    bool optimize = false;
+    for (int i=2; i<argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "-o" && i+1 < argc) {
+            output_path = argv[++i];
+        } else if (arg == "--optimize") {
+            optimize = true;
+        } else if (arg == "--instrument") {
+            options.instrument = true;
+        } else if (arg == "--profile" && i+1 < argc) {
+            std::ifstream input(argv[++i]);
+            profile = grlang::node::read_profile(input);
+            options.profile = &profile;
+        } else {
+            std::cerr << "Unknown argument " << arg << std::endl;
+            return 1;
+        }
+    }
     std::cerr << "Compiling " << argv[1] << "..." << std::endl;
     std::ifstream input(argv[1]);
     std::string code((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
     auto exports = grlang::parse::parse_unit(code);
-    if (argc > 3 && argv[2] == std::string_view{"-o"}) {
-        std::cerr << "Ouputting " << argv[3] << "..." << std::endl;
-        std::ofstream output(argv[3]);
-        return codegen(std::move(exports), output);
+    if (optimize) {
+        grlang::opt::optimize_unit(exports);
+    }
+    if (!output_path.empty()) {
+        std::cerr << "Ouputting " << output_path << "..." << std::endl;
+        std::ofstream output{std::string(output_path)};
+        return codegen(std::move(exports), output, options);
     } else {
-        std::ofstream output(argv[3]);
-        return codegen(std::move(exports), std::cout);
+        return codegen(std::move(exports), std::cout, options);
     }
 }
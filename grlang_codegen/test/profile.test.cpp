@@ -0,0 +1,60 @@
+#include <sstream>
+
+#include "grtest.h"
+#include "grlang/parse.h"
+#include "grlang/graph.h"
+#include "grlang/codegen.h"
+
+
+namespace {
+    constexpr std::string_view PICK = "pick:= (n:int)->int { s:= 0 if n>5 s=n*2 else s=n+1 return s }";
+
+    // NOTE: the IFELSE of func and its projects, by the value of the project
+    std::uint32_t find_branch(const grlang::node::Graph& graph, std::uint32_t (&arms)[2]) {
+        for (std::uint32_t id: graph.control_rpo()) {
+            if (graph.node(id).type == grlang::node::Node::Type::CONTROL_IFELSE) {
+                for (std::uint32_t user: graph.outputs(id)) {
+                    arms[graph.node(user).value] = user;
+                }
+                return id;
+            }
+        }
+        return grlang::node::Graph::NO_NODE;
+    }
+}
+
+TEST_CASE(test_profile_layout) {
+    std::string code(PICK);
+    auto exports = grlang::parse::parse_unit(code);
+    auto& func = exports.at("pick");
+    grlang::node::Graph graph(*func);
+    std::uint32_t arms[2];
+    auto branch = find_branch(graph, arms);
+    assert(branch != grlang::node::Graph::NO_NODE);
+
+    std::ostringstream plain;
+    assert(grlang::codegen::gen_llvm_ir(exports, plain));
+    assert(plain.str().find("!prof") == std::string::npos);
+
+    grlang::node::Profile profile;
+    profile.branches[{grlang::node::hash_graph(func), branch}] = {{0, 1000}};
+    std::ostringstream weighted;
+    assert(grlang::codegen::gen_llvm_ir(exports, weighted, {.profile = &profile}));
+    auto ir = weighted.str();
+    assert(ir.find("!{!\"branch_weights\", i32 0, i32 1000}") != std::string::npos);
+    // NOTE: the arm that was never taken goes after the return
+    auto cold = ir.find("b" + std::to_string(arms[0]) + ":");
+    auto hot = ir.find("b" + std::to_string(arms[1]) + ":");
+    assert(hot < ir.find("ret ") && ir.find("ret ") < cold && cold != std::string::npos);
+}
+
+TEST_CASE(test_profile_instrument) {
+    std::string code(PICK);
+    auto exports = grlang::parse::parse_unit(code);
+    std::ostringstream output;
+    assert(grlang::codegen::gen_llvm_ir(exports, output, {.instrument = true}));
+    auto ir = output.str();
+    assert(ir.find("@grlang.counts.pick = internal global [2 x i64] zeroinitializer") != std::string::npos);
+    assert(ir.find("@llvm.global_dtors") != std::string::npos);
+    assert(ir.find("GRLANG_PROFILE") != std::string::npos);
+}
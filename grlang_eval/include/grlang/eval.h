@@ -2,11 +2,31 @@
 
 #include <cstdint>
 #include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
 #include <vector>
 
 #include "grlang/node.h"
+#include "grlang/image.h"
+#include "grlang/profile.h"
 
 
 namespace grlang::eval {
-    int eval_call(const node::Node::Ptr& func, int arg);
+    // NOTE: values of every integer type are passed and returned as they are held in Value, see node::normalize
+    std::int64_t eval_call(const node::Node::Ptr& func, std::span<const std::int64_t> args);
+    // NOTE: also counts the arms every IFELSE the call runs through takes into profile
+    std::int64_t eval_call(const node::Node::Ptr& func, std::span<const std::int64_t> args, node::Profile& profile);
+    // NOTE: for folding calls at compile time, nullopt if the call takes more than max_steps control steps, nests
+    // too deeply or would fault
+    std::optional<std::int64_t> try_eval_call(const node::Node::Ptr& func, std::span<const std::int64_t> args, std::size_t max_steps);
+    // NOTE: runs on the image in place, without loading it into nodes
+    std::int64_t eval_call(const node::ImageView& image, std::string_view func, std::span<const std::int64_t> args);
+
+    inline std::int64_t eval_call(const node::Node::Ptr& func, std::int64_t arg) {
+        return eval_call(func, std::span<const std::int64_t>(&arg, 1));
+    }
+    inline std::int64_t eval_call(const node::ImageView& image, std::string_view func, std::int64_t arg) {
+        return eval_call(image, func, std::span<const std::int64_t>(&arg, 1));
+    }
 }
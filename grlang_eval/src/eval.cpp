@@ -1,139 +1,429 @@
 #include <cassert>
+#include <format>
 #include <stdexcept>
-#include <map>
-#include <set>
-#include <algorithm>
+#include <span>
+#include <unordered_map>
+#include <vector>
 
 #include "grlang/node.h"
+#include "grlang/graph.h"
+#include "grlang/image.h"
+#include "grlang/profile.h"
+#include "grlang/stats.h"
 #include "grlang/eval.h"
 
 
 namespace {
-    const grlang::node::Node::Ptr& find_start(const grlang::node::Node::Ptr& node) {
-        switch (node->type) {
-            case grlang::node::Node::Type::CONTROL_START:
-                return node;
-            case grlang::node::Node::Type::CONTROL_STOP:
-            case grlang::node::Node::Type::CONTROL_RETURN:
-            case grlang::node::Node::Type::CONTROL_IFELSE:
-            case grlang::node::Node::Type::CONTROL_PROJECT:
-                return find_start(node->inputs.at(0));
-            case grlang::node::Node::Type::CONTROL_REGION:
-                return find_start(node->inputs.at(1));
-            default:
-                throw std::runtime_error("unknown node type");
+    // NOTE: graph adaptors let the interpreter run on linked nodes and on flat images alike, both numbered densely
+    struct PtrGraph {
+        using Handle = std::uint32_t;
+        static constexpr Handle NONE = grlang::node::Graph::NO_NODE;
+        using Functions = std::unordered_map<const grlang::node::Node*, grlang::node::Graph>;  // NOTE: numbered on first call
+
+        const grlang::node::Graph& graph;
+        Functions& functions;
+
+        static PtrGraph number(const grlang::node::Node& func, Functions& functions) {
+            grlang::node::ensure_built(func);
+            grlang::node::PhaseTimer timer(grlang::node::Phase::SCHEDULE);
+            return {functions.try_emplace(&func, func).first->second, functions};
+        }
+
+        std::size_t size() const { return graph.size(); }
+        grlang::node::Node::Type type(Handle node) const { return graph.node(node).type; }
+        std::uint8_t value(Handle node) const { return graph.node(node).value; }
+        Handle input(Handle node, std::size_t i) const { return graph.inputs(node)[i]; }
+        std::size_t inputs_size(Handle node) const { return graph.inputs(node).size(); }
+        std::span<const Handle> outputs(Handle node) const { return graph.outputs(node); }
+        bool is_const(Handle node) const { return grlang::node::is_const(graph.node(node)); }
+        std::int64_t get_value_i64(Handle node) const { return grlang::node::get_value_i64(graph.node(node)); }
+        grlang::node::Value::Type value_type(Handle node) const { return graph.node(node).value_type; }
+        grlang::node::Value::Signature signature(Handle func) const { return grlang::node::get_signature(graph.node(func)); }
+        std::pair<PtrGraph, Handle> function(Handle func) const {
+            auto callee = number(graph.node(func), functions);
+            return {callee, callee.graph.stop()};
+        }
+    };
+
+    struct ImageGraph {
+        using Handle = std::uint32_t;
+        static constexpr Handle NONE = grlang::node::ImageView::NO_NODE;
+
+        const grlang::node::ImageView& image;
+
+        std::size_t size() const { return image.size(); }
+        grlang::node::Node::Type type(Handle node) const { return image.type(node); }
+        std::uint8_t value(Handle node) const { return image.value(node); }
+        Handle input(Handle node, std::size_t i) const { return image.inputs(node)[i]; }
+        std::size_t inputs_size(Handle node) const { return image.inputs(node).size(); }
+        std::span<const Handle> outputs(Handle node) const { return image.outputs(node); }
+        bool is_const(Handle node) const { return image.is_const(node); }
+        std::int64_t get_value_i64(Handle node) const { return image.get_value_i64(node); }
+        grlang::node::Value::Type value_type(Handle node) const { return image.value_type(node); }
+        grlang::node::Value::Signature signature(Handle func) const { return image.signature(func); }
+        std::pair<ImageGraph, Handle> function(Handle func) const { return {*this, image.inputs(func)[0]}; }
+    };
+
+    // NOTE: every control node leads back to the start through input 0, or input 1 for a region, which never closes a loop
+    template<typename Graph>
+    typename Graph::Handle find_start(const Graph& graph, typename Graph::Handle node) {
+        for (std::size_t steps=0; steps<graph.size(); ++steps) {
+            switch (graph.type(node)) {
+                case grlang::node::Node::Type::CONTROL_START:
+                    return node;
+                case grlang::node::Node::Type::CONTROL_STOP:
+                case grlang::node::Node::Type::CONTROL_RETURN:
+                case grlang::node::Node::Type::CONTROL_IFELSE:
+                case grlang::node::Node::Type::CONTROL_PROJECT:
+                case grlang::node::Node::Type::MEMORY_NEW:
+                case grlang::node::Node::Type::MEMORY_LOAD:
+                case grlang::node::Node::Type::MEMORY_STORE:
+                case grlang::node::Node::Type::MEMORY_CALL:
+                    if (graph.inputs_size(node) == 0) {
+                        throw std::runtime_error("function has no start");  // NOTE: a stop without returns
+                    }
+                    node = graph.input(node, 0);
+                    break;
+                case grlang::node::Node::Type::CONTROL_REGION:
+                    node = graph.input(node, 1);
+                    break;
+                default:
+                    throw std::runtime_error("unknown node type");
+            }
         }
+        throw std::runtime_error("function has no start");
     }
 
-    using Cache = std::map<const grlang::node::Node*, int>;
-    using NodeMap = std::map<const grlang::node::Node*, std::vector<const grlang::node::Node*>>;
+    // NOTE: arrays and structs that escape live as long as the outermost call, their value is their index here
+    using Heap = std::vector<std::vector<std::int64_t>>;
 
-    int eval_expression(const grlang::node::Node::Ptr& node, Cache& cache) {
-        if (grlang::node::is_const(*node)) {
-            return grlang::node::get_value_int(*node);
+    // NOTE: frames of all active calls on one stack, reused from call to call. A frame is the arguments of the call
+    // followed by the values of the callee's nodes, of which only phis and memory nodes are stored. Values of every
+    // width are held normalized in 64 bits, like Value holds them
+    struct Frame {
+        std::vector<std::int64_t>& stack;
+        Heap& heap;
+        std::size_t base;
+        std::size_t arity;
+
+        std::int64_t arg(std::size_t i) const { return stack[base + i]; }
+        std::vector<std::int64_t>& array(std::int64_t handle) {
+            if (handle < 0 || handle >= static_cast<std::int64_t>(heap.size())) {
+                throw std::runtime_error("not an array");  // NOTE: e.g. an int passed from outside
+            }
+            return heap[handle];
         }
-        if (cache.contains(node.get())) {
-            return cache.at(node.get());
+        std::int64_t& value(std::size_t node) { return stack[base + arity + node]; }
+    };
+
+    struct Unlimited {
+        void step() {}
+        void enter() {}
+        void leave() {}
+        void check(grlang::node::Node::Type, grlang::node::Value::Type, std::int64_t, std::int64_t) {}
+        void allocate(std::int64_t) {}
+        template<typename Graph>
+        void branch(const Graph&, typename Graph::Handle, std::uint8_t) {}
+    };
+
+    // NOTE: counts the arms each IFELSE takes, the hash of a function is computed on its first branch
+    struct Profiled: Unlimited {
+        grlang::node::Profile& profile;
+        std::unordered_map<const grlang::node::Node*, std::uint64_t> hashes;
+
+        explicit Profiled(grlang::node::Profile& profile_) : profile(profile_) {}
+
+        void branch(const PtrGraph& graph, PtrGraph::Handle ifelse, std::uint8_t taken) {
+            const auto& func = graph.graph.node(graph.graph.function());
+            auto [it, added] = hashes.try_emplace(&func);
+            if (added) {
+                it->second = grlang::node::hash_graph(func);
+            }
+            ++profile.branches[{it->second, ifelse}].taken[taken];
         }
-        if (is_binary_op(*node)) {
-            return op_func(node->type)(
-                eval_expression(node->inputs.at(0), cache),
-                eval_expression(node->inputs.at(1), cache));
+    };
+
+    // NOTE: for running code at compile time, which may not terminate or may fault
+    struct Limited {
+        struct Exceeded {};
+        static constexpr std::size_t MAX_DEPTH = 256;
+
+        std::size_t steps;
+        std::size_t depth = 0;
+
+        void step() {
+            if (steps-- == 0) {
+                throw Exceeded{};
+            }
+        }
+        void enter() {
+            if (++depth > MAX_DEPTH) {
+                throw Exceeded{};
+            }
+            step();
+        }
+        void leave() { --depth; }
+        void check(grlang::node::Node::Type type, grlang::node::Value::Type width, std::int64_t a, std::int64_t b) {
+            if (!grlang::node::can_fold_sized(type, width, a, b)) {
+                throw Exceeded{};
+            }
         }
-        switch (node->type) {
+        // NOTE: an element costs a step, so compile time allocations stay within the budget
+        void allocate(std::int64_t length) {
+            if (length > static_cast<std::int64_t>(steps)) {
+                throw Exceeded{};
+            }
+            steps -= length;
+        }
+        template<typename Graph>
+        void branch(const Graph&, typename Graph::Handle, std::uint8_t) {}
+    };
+
+    template<typename Graph, typename Limit>
+    std::int64_t eval_function(const Graph& graph, typename Graph::Handle stop, Frame frame, Limit& limit);
+
+    template<typename Graph, typename Limit>
+    std::int64_t eval_call_node(const Graph& graph, typename Graph::Handle node, std::size_t callee_input, Frame& frame, Limit& limit);
+
+    template<typename Graph, typename Limit>
+    std::int64_t eval_expression(const Graph& graph, typename Graph::Handle node, Frame& frame, Limit& limit) {
+        if (graph.is_const(node)) {
+            return graph.get_value_i64(node);
+        }
+        auto type = graph.type(node);
+        if (type > grlang::node::Node::Type::DATA_OP_BEGIN && type < grlang::node::Node::Type::DATA_OP_END) {
+            std::int64_t a = eval_expression(graph, graph.input(node, 0), frame, limit);
+            std::int64_t b = eval_expression(graph, graph.input(node, 1), frame, limit);
+            limit.check(type, graph.value_type(node), a, b);
+            return grlang::node::apply_sized_op(type, graph.value_type(node), a, b);
+        }
+        switch (type) {
+            case grlang::node::Node::Type::DATA_PHI:
+                return frame.value(node);
             case grlang::node::Node::Type::DATA_TERM:
                 throw std::runtime_error("unknown node value");
             case grlang::node::Node::Type::DATA_PROJECT:
-                assert(node->inputs.at(0)->type == grlang::node::Node::Type::CONTROL_START);
-                assert(node->value == 1);  // TODO: support different arities
-                return eval_expression(node->inputs.at(0), cache);
+                assert(graph.type(graph.input(node, 0)) == grlang::node::Node::Type::CONTROL_START);
+                if (graph.value(node) < 1 || graph.value(node) > frame.arity) {
+                    throw std::runtime_error("parameter out of range");  // NOTE: e.g. an image whose calls don't match its functions
+                }
+                return frame.arg(graph.value(node) - 1);
             case grlang::node::Node::Type::DATA_OP_NEG:
-                return -eval_expression(node->inputs.at(0), cache);
+                return grlang::node::apply_sized_op(type, graph.value_type(node), eval_expression(graph, graph.input(node, 0), frame, limit));
             case grlang::node::Node::Type::DATA_OP_NOT:
-                return eval_expression(node->inputs.at(0), cache) == 1 ? 0 : 1;
+                return eval_expression(graph, graph.input(node, 0), frame, limit) == 0 ? 1 : 0;
+            case grlang::node::Node::Type::DATA_OP_CONVERT:
+                return grlang::node::normalize(graph.value_type(node), eval_expression(graph, graph.input(node, 0), frame, limit));
             case grlang::node::Node::Type::DATA_CALL:
-                assert(node->inputs.size() == 2);
-                return grlang::eval::eval_call(node->inputs.at(0), eval_expression(node->inputs.at(1), cache));
+                return eval_call_node(graph, node, 0, frame, limit);
+            case grlang::node::Node::Type::DATA_LENGTH:
+                return static_cast<std::int64_t>(frame.array(eval_expression(graph, graph.input(node, 0), frame, limit)).size());
+            case grlang::node::Node::Type::DATA_STRUCT: {
+                // NOTE: structs are never changed, a new one is made every time
+                std::vector<std::int64_t> fields;
+                for (std::size_t i=0; i<graph.inputs_size(node); ++i) {
+                    fields.push_back(eval_expression(graph, graph.input(node, i), frame, limit));
+                }
+                limit.allocate(fields.size());
+                frame.heap.push_back(std::move(fields));
+                return static_cast<std::int64_t>(frame.heap.size() - 1);
+            }
+            case grlang::node::Node::Type::DATA_FIELD:
+                return frame.array(eval_expression(graph, graph.input(node, 0), frame, limit)).at(graph.value(node));
+            case grlang::node::Node::Type::MEMORY_NEW:
+            case grlang::node::Node::Type::MEMORY_LOAD:
+            case grlang::node::Node::Type::MEMORY_CALL:
+                return frame.value(node);  // NOTE: set when control reached it
             default:
                 throw std::runtime_error("unknown node type");
         }
     }
 
-    void build_node_maps(const grlang::node::Node *node, NodeMap& inv_ctl, NodeMap& reg2phi, std::set<const grlang::node::Node*>& visited) {
-        if (visited.contains(node)) {
-            return;
+    // NOTE: callee is input callee_input, the arguments follow it
+    template<typename Graph, typename Limit>
+    std::int64_t eval_call_node(const Graph& graph, typename Graph::Handle node, std::size_t callee_input, Frame& frame, Limit& limit) {
+        assert(graph.value(node) == grlang::node::DIRECT_CALL);
+        auto [callee, stop] = graph.function(graph.input(node, callee_input));
+        // NOTE: frames of calls made by the arguments are popped before the next argument is pushed
+        Frame callee_frame{frame.stack, frame.heap, frame.stack.size(), 0};
+        for (std::size_t i=callee_input+1; i<graph.inputs_size(node); ++i) {
+            std::int64_t arg = eval_expression(graph, graph.input(node, i), frame, limit);
+            frame.stack.push_back(arg);
+            ++callee_frame.arity;
         }
-        visited.insert(node);
-        switch (node->type) {
-            case grlang::node::Node::Type::DATA_PHI:
-                reg2phi[node->inputs.at(0).get()].push_back(node);
+        limit.enter();
+        std::int64_t result = eval_function(callee, stop, callee_frame, limit);
+        limit.leave();
+        frame.stack.resize(callee_frame.base);
+        return result;
+    }
+
+    // NOTE: the element a load or store refers to, throws if it is out of bounds whether or not the node still checks it
+    template<typename Graph, typename Limit>
+    std::int64_t& element(const Graph& graph, typename Graph::Handle node, Frame& frame, Limit& limit) {
+        std::int64_t handle = eval_expression(graph, graph.input(node, 1), frame, limit);
+        std::int64_t index = eval_expression(graph, graph.input(node, 2), frame, limit);
+        auto& array = frame.array(handle);  // NOTE: only now, calls made by the index may allocate and move the heap
+        if (index < 0 || index >= static_cast<std::int64_t>(array.size())) {
+            throw std::runtime_error("array index out of bounds");
+        }
+        return array[index];
+    }
+
+    template<typename Graph, typename Limit>
+    void eval_memory(const Graph& graph, typename Graph::Handle node, Frame& frame, Limit& limit) {
+        switch (graph.type(node)) {
+            case grlang::node::Node::Type::MEMORY_NEW: {
+                std::int64_t length = eval_expression(graph, graph.input(node, 1), frame, limit);
+                if (length < 0) {
+                    throw std::runtime_error("negative array length");
+                }
+                limit.allocate(length);
+                frame.heap.emplace_back(length);
+                frame.value(node) = static_cast<std::int64_t>(frame.heap.size() - 1);
+                break;
+            }
+            case grlang::node::Node::Type::MEMORY_LOAD:
+                frame.value(node) = element(graph, node, frame, limit);
                 break;
-            case grlang::node::Node::Type::CONTROL_STOP:
-            case grlang::node::Node::Type::CONTROL_RETURN:
-            case grlang::node::Node::Type::CONTROL_IFELSE:
-            case grlang::node::Node::Type::CONTROL_PROJECT:
-                inv_ctl[node->inputs.at(0).get()].push_back(node);
+            case grlang::node::Node::Type::MEMORY_STORE: {
+                std::int64_t value = eval_expression(graph, graph.input(node, 3), frame, limit);
+                element(graph, node, frame, limit) = value;
                 break;
-            case grlang::node::Node::Type::CONTROL_REGION:
-                inv_ctl[node->inputs.at(1).get()].push_back(node);
-                inv_ctl[node->inputs.at(2).get()].push_back(node);
+            }
+            case grlang::node::Node::Type::MEMORY_CALL:
+                frame.value(node) = eval_call_node(graph, node, 1, frame, limit);
                 break;
             default:
                 break;
         }
-        for (auto &child : node->inputs) {
-            if (child) {
-                build_node_maps(child.get(), inv_ctl, reg2phi, visited);
+    }
+
+    template<typename Graph>
+    typename Graph::Handle next_control(const Graph& graph, typename Graph::Handle ctl) {
+        typename Graph::Handle next = Graph::NONE;
+        for (auto user: graph.outputs(ctl)) {
+            // NOTE: memory nodes may also use the value of a memory node, only their input 0 continues control
+            bool follows = graph.type(user) == grlang::node::Node::Type::CONTROL_REGION || (graph.inputs_size(user) && graph.input(user, 0) == ctl);
+            if (graph.type(user) <= grlang::node::Node::Type::CONTROL_DEAD && follows) {
+                assert(next == Graph::NONE || next == user);
+                next = user;
             }
         }
+        return next;
     }
 
-    int eval_graph(const grlang::node::Node *ctl, Cache& cache, NodeMap &inv_ctl, NodeMap &reg2phi) {
-        assert(ctl->type == grlang::node::Node::Type::CONTROL_START);
-        const grlang::node::Node* prev = nullptr;
-        while (ctl->type != grlang::node::Node::Type::CONTROL_STOP) {
-            if (ctl->type == grlang::node::Node::Type::CONTROL_RETURN) {
-                return eval_expression(ctl->inputs.at(1), cache);
+    template<typename Graph, typename Limit>
+    std::int64_t eval_graph(const Graph& graph, typename Graph::Handle ctl, Frame& frame, Limit& limit) {
+        assert(graph.type(ctl) == grlang::node::Node::Type::CONTROL_START);
+        typename Graph::Handle prev = Graph::NONE;
+        std::vector<std::pair<typename Graph::Handle, std::int64_t>> phis;
+        while (graph.type(ctl) != grlang::node::Node::Type::CONTROL_STOP) {
+            limit.step();
+            if (graph.type(ctl) == grlang::node::Node::Type::CONTROL_RETURN) {
+                return eval_expression(graph, graph.input(ctl, 1), frame, limit);
             }
-            if (ctl->type == grlang::node::Node::Type::CONTROL_REGION) {
-                auto prev_idx = std::distance(ctl->inputs.begin(),
-                    std::find_if(ctl->inputs.begin(), ctl->inputs.end(), [&prev](auto& node) { return node.get() == prev; }));
-                Cache tmp;
-                for (auto& phi: reg2phi.at(ctl)) {
-                    tmp[phi] = eval_expression(phi->inputs.at(prev_idx), cache);
+            if (graph.type(ctl) == grlang::node::Node::Type::CONTROL_REGION) {
+                std::size_t prev_idx = 0;
+                while (graph.input(ctl, prev_idx) != prev) {
+                    ++prev_idx;
+                }
+                phis.clear();  // NOTE: all phis of a region switch at once
+                for (auto user: graph.outputs(ctl)) {
+                    if (graph.type(user) == grlang::node::Node::Type::DATA_PHI) {
+                        phis.emplace_back(user, eval_expression(graph, graph.input(user, prev_idx), frame, limit));
+                    }
+                }
+                for (auto [phi, value]: phis) {
+                    frame.value(phi) = value;
                 }
-                tmp.merge(cache);
-                cache.swap(tmp);
             }
-            if (ctl->type == grlang::node::Node::Type::CONTROL_IFELSE) {
-                const grlang::node::Node* next_ctl;
-                if (eval_expression(ctl->inputs.at(1), cache) == 1) {
-                    next_ctl = inv_ctl.at(ctl).at(0)->value==0 ? inv_ctl.at(ctl).at(0) : inv_ctl.at(ctl).at(1);
-                } else {
-                    next_ctl = inv_ctl.at(ctl).at(0)->value==0 ? inv_ctl.at(ctl).at(1) : inv_ctl.at(ctl).at(0);
+            eval_memory(graph, ctl, frame, limit);
+            prev = ctl;
+            if (graph.type(ctl) == grlang::node::Node::Type::CONTROL_IFELSE) {
+                std::uint8_t taken = eval_expression(graph, graph.input(ctl, 1), frame, limit) == 1 ? 0 : 1;
+                limit.branch(graph, ctl, taken);
+                for (auto user: graph.outputs(ctl)) {
+                    if (graph.type(user) == grlang::node::Node::Type::CONTROL_PROJECT && graph.value(user) == taken) {
+                        ctl = user;
+                    }
+                }
+                if (ctl == prev) {
+                    break;  // NOTE: no arm to take, only in a broken image
                 }
-                prev = ctl;
-                ctl = next_ctl;
             } else {
-                assert(inv_ctl.at(ctl).size() == 1);
-                prev = ctl;
-                ctl = inv_ctl.at(prev).front();
+                ctl = next_control(graph, ctl);
+                if (ctl == Graph::NONE) {
+                    break;
+                }
             }
         }
         throw std::runtime_error("function didn't return a value");
     }
+
+    template<typename Graph, typename Limit>
+    std::int64_t eval_function(const Graph& graph, typename Graph::Handle stop, Frame frame, Limit& limit) {
+        assert(graph.type(stop) == grlang::node::Node::Type::CONTROL_STOP);
+        assert(frame.stack.size() == frame.base + frame.arity);
+        auto start = find_start(graph, stop);
+        frame.stack.resize(frame.base + frame.arity + graph.size());
+        return eval_graph(graph, start, frame, limit);
+    }
+
+    // NOTE: checks the arguments of an outside call, calls made by the code were checked when it was parsed
+    template<typename Graph, typename Limit>
+    std::int64_t eval_entry(const Graph& graph, typename Graph::Handle func, std::span<const std::int64_t> args, Limit& limit) {
+        auto signature = graph.signature(func);
+        if (signature.params.size() != args.size()) {
+            throw std::runtime_error(std::format("expected {} arguments, but got {}", signature.params.size(), args.size()));
+        }
+        auto [callee, stop] = graph.function(func);
+        std::vector<std::int64_t> stack(args.begin(), args.end());
+        Heap heap;
+        for (std::size_t i=0; i<args.size(); ++i) {
+            if (grlang::node::is_int_type(signature.params[i])) {
+                stack[i] = grlang::node::normalize(signature.params[i], stack[i]);  // NOTE: wrapped around like a call in the code would
+            }
+        }
+        return eval_function(callee, stop, Frame{stack, heap, 0, args.size()}, limit);
+    }
 }
 
 namespace grlang::eval {
-    int eval_call(const node::Node::Ptr& func, int arg) {
-        assert(func->type == node::Node::Type::DATA_TERM);  // TODO: func ptr type
-        assert(func->inputs.at(0)->type == node::Node::Type::CONTROL_STOP);
-        const node::Node::Ptr& start = find_start(func->inputs.at(0));
-        Cache cache{{start.get(), arg}};
-        NodeMap inv_ctl;
-        NodeMap reg2phi;
-        std::set<const grlang::node::Node*> visited;
-        build_node_maps(func->inputs.at(0).get(), inv_ctl, reg2phi, visited);
-        return eval_graph(start.get(), cache, inv_ctl, reg2phi);
+    std::int64_t eval_call(const node::Node::Ptr& func, std::span<const std::int64_t> args) {
+        PtrGraph::Functions functions;
+        auto graph = PtrGraph::number(*func, functions);
+        Unlimited limit;
+        return eval_entry(graph, graph.graph.function(), args, limit);
+    }
+
+    std::int64_t eval_call(const node::Node::Ptr& func, std::span<const std::int64_t> args, node::Profile& profile) {
+        PtrGraph::Functions functions;
+        auto graph = PtrGraph::number(*func, functions);
+        Profiled limit(profile);
+        return eval_entry(graph, graph.graph.function(), args, limit);
+    }
+
+    std::optional<std::int64_t> try_eval_call(const node::Node::Ptr& func, std::span<const std::int64_t> args, std::size_t max_steps) {
+        PtrGraph::Functions functions;
+        auto graph = PtrGraph::number(*func, functions);
+        Limited limit{max_steps};
+        try {
+            return eval_entry(graph, graph.graph.function(), args, limit);
+        } catch (const Limited::Exceeded&) {
+            return std::nullopt;
+        } catch (const std::runtime_error&) {
+            return std::nullopt;  // NOTE: e.g. no return on the path taken, left for run time
+        }
+    }
+
+    std::int64_t eval_call(const node::ImageView& image, std::string_view func, std::span<const std::int64_t> args) {
+        auto node = image.find_export(func);
+        if (!node || !image.is_function(*node)) {
+            throw std::runtime_error("no such export");
+        }
+        ImageGraph graph{image};
+        Unlimited limit;
+        return eval_entry(graph, *node, args, limit);
     }
 }
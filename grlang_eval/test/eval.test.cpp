@@ -1,3 +1,5 @@
+#include <array>
+
 #include "grtest.h"
 #include "grlang/parse.h"
 #include "grlang/eval.h"
@@ -28,6 +30,21 @@ TEST_CASE(test_branches) {
     assert(run_in_main("if arg<0 if arg<-10 arg=-10 else arg=-1 else if arg>10 arg=10 else arg=1 return arg", 5) == 1);
 }
 
+TEST_CASE(test_rewrites) {
+    for (int arg=-20; arg<=20; ++arg) {
+        assert(run_in_main("return arg*8", arg) == arg*8);
+        assert(run_in_main("return 2*arg*3", arg) == arg*6);
+        assert(run_in_main("return (arg-5)+2", arg) == arg-3);
+        assert(run_in_main("return 0-arg", arg) == -arg);
+        assert(run_in_main("return arg/4", arg) == arg/4);
+        assert(run_in_main("return arg/-1", arg) == -arg);
+        assert(run_in_main("return (arg>3)*16/4", arg) == (arg>3 ? 4 : 0));
+        assert(run_in_main("return 3<arg", arg) == (arg>3 ? 1 : 0));
+        assert(run_in_main("return !(arg<=3)", arg) == (arg>3 ? 1 : 0));
+        assert(run_in_main("return (arg-arg)+(arg==arg)", arg) == 1);
+    }
+}
+
 TEST_CASE(test_loops) {
     assert(run_in_main("while arg<10 arg=arg+1 return arg", 9) == 10);
     assert(run_in_main("while arg<10 arg=arg+1 return arg", 10) == 10);
@@ -39,11 +56,30 @@ TEST_CASE(test_loops) {
     assert(run_in_main("a:=0 b:=1 i:=0 while i<arg { c:=a+b a=b b=c i=i+1 } return a", 10) == 55);
 }
 
+TEST_CASE(test_loop_branches) {
+    std::string code = "a:=0 i:=0 while i<arg { i=i+1 if i==3 continue b:=a if i==5 { b=0 break } a=b+i } return a";
+    assert(run_in_main(code, 2) == 3);
+    assert(run_in_main(code, 4) == 7);
+    assert(run_in_main(code, 10) == 7);
+    assert(run_in_main("a:=1 b:=2 c:=3 if arg>0 { a=10 if arg>5 c=30 } else b=20 return a+b+c", 1) == 15);
+    assert(run_in_main("a:=1 b:=2 c:=3 if arg>0 { a=10 if arg>5 c=30 } else b=20 return a+b+c", 6) == 42);
+    assert(run_in_main("a:=1 b:=2 c:=3 if arg>0 { a=10 if arg>5 c=30 } else b=20 return a+b+c", 0) == 24);
+}
+
 TEST_CASE(test_functions) {
-    // auto graph = grlang::parse::parse("f:= (x:int y:int) -> int { return x*y } return f(arg+1 13)");
-    // assert(grlang::eval::eval(graph, -1) == 0);
-    // assert(grlang::eval::eval(graph, 0) == 13);
-    // assert(grlang::eval::eval(graph, 2) == 26);
+    std::string code = "f:= (x:int y:int) -> int { return x*y } main:= (arg:int) -> int { return f(arg+1 13)+f(f(arg 2) arg) }";
+    auto nary = grlang::parse::parse_unit(code);
+    assert(grlang::eval::eval_call(nary.at("main"), -1) == 2);
+    assert(grlang::eval::eval_call(nary.at("main"), 0) == 13);
+    assert(grlang::eval::eval_call(nary.at("main"), 2) == 47);
+    assert(grlang::eval::eval_call(nary.at("f"), std::array<std::int64_t, 2>{3, 4}) == 12);
+    bool threw = false;
+    try {
+        grlang::eval::eval_call(nary.at("f"), 3);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
 
     auto exports = grlang::parse::parse_unit("fib:= (n:int) -> int { if n==0 return 0 if n==1 return 1 return fib(n-1)+fib(n-2) }");
     auto fib = exports.at("fib");
@@ -52,3 +88,99 @@ TEST_CASE(test_functions) {
     assert(grlang::eval::eval_call(fib, 5) == 5);
     assert(grlang::eval::eval_call(fib, 10) == 55);
 }
+
+TEST_CASE(test_lazy_functions) {
+    std::string code = "twice:= (n:int) -> int { return n*2 } unused:= (n:int) -> int { return n+ } main:= (n:int) -> int { return twice(n)+1 }";
+    auto exports = grlang::parse::parse_unit(code, {.lazy=true});  // NOTE: unused has a syntax error, but is never built
+    assert(exports.at("twice")->inputs.at(0)->inputs.empty());
+    assert(grlang::eval::eval_call(exports.at("main"), 4) == 9);
+    assert(exports.at("twice")->inputs.at(0)->inputs.size() == 1);
+    assert(exports.at("unused")->inputs.at(0)->inputs.empty());
+}
+
+TEST_CASE(test_sized_integers) {
+    auto exports = grlang::parse::parse_unit(
+        "sum:= (n:int)->i64 { s:i64=0 i:=0 while i<n { s=s+1000000000 i=i+1 } return s }\n"
+        "wrap:= (n:u8)->u8 { return n+200 }\n"
+        "half:= (n:u32)->u32 { return n/2 }\n"
+        "less:= (a:u16 b:i16)->int { return a<b }\n"
+        "narrow:= (n:i64)->i8 { x:i8=n return -x }\n");
+    assert(grlang::eval::eval_call(exports.at("sum"), 5) == 5000000000);
+    assert(grlang::eval::eval_call(exports.at("wrap"), 100) == 44);
+    assert(grlang::eval::eval_call(exports.at("wrap"), 300) == 244);  // NOTE: the argument wraps around too
+    assert(grlang::eval::eval_call(exports.at("half"), -2) == 0x7FFFFFFF);
+    assert(grlang::eval::eval_call(exports.at("less"), std::array<std::int64_t, 2>{1, -1}) == 1);  // NOTE: -1 compares as 65535
+    assert(grlang::eval::eval_call(exports.at("narrow"), 0x180) == -128);
+}
+
+TEST_CASE(test_arrays) {
+    auto exports = grlang::parse::parse_unit(
+        "sum:= (a:[]int)->int { s:=0 i:=0 while i<len(a) { s=s+a[i] i=i+1 } return s }\n"
+        "squares:= (n:int)->[]int { a:=[n]int i:=0 while i<n { a[i]=i*i i=i+1 } return a }\n"
+        "total:= (n:int)->int { return sum(squares(n)) }\n"
+        "bytes:= (n:int)->int { a:=[2]u8 a[0]=n a[1]=a[0]+1 return a[1] }\n"
+        "at:= (n:int)->int { a:=[4]int return a[n] }\n"
+        "grow:= (n:int)->int { b:=[3]int c:=[3]int return 1 }\n"
+        "grown:= (n:int)->int { a:=[2]int a[grow(n)] = 5 return a[grow(n)]+a[0] }\n");  // NOTE: the index allocates
+    assert(grlang::eval::eval_call(exports.at("total"), 4) == 14);
+    assert(grlang::eval::eval_call(exports.at("total"), 0) == 0);
+    assert(grlang::eval::eval_call(exports.at("bytes"), 255) == 0);
+    assert(grlang::eval::eval_call(exports.at("at"), 3) == 0);
+    assert(grlang::eval::eval_call(exports.at("grown"), 0) == 5);
+    for (int index: {-1, 4}) {
+        bool threw = false;
+        try {
+            grlang::eval::eval_call(exports.at("at"), index);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+}
+
+TEST_CASE(test_structs) {
+    auto exports = grlang::parse::parse_unit(
+        "make:= (x:int y:int)->{x:int y:int} { return {x=x y=y} }\n"
+        "swap:= (p:{x:int y:int})->{x:int y:int} { p = {x=p.y y=p.x} return p }\n"
+        "walk:= (n:int)->int { p:=make(0 1) i:=0 while i<n { p.x = p.x+p.y p.y = p.y*2 i=i+1 } return p.x }\n"
+        "nested:= (n:int)->int { s:={a={x=n y=2} b=3} s.a.y = s.b return swap(s.a).x }\n");
+    assert(grlang::eval::eval_call(exports.at("walk"), 0) == 0);
+    assert(grlang::eval::eval_call(exports.at("walk"), 4) == 15);
+    assert(grlang::eval::eval_call(exports.at("nested"), 7) == 3);
+}
+
+#include <sstream>
+#include <cstring>
+
+TEST_CASE(test_image) {
+    auto exports = grlang::parse::parse_unit("fib:= (n:int) -> int { if n<2 return n return fib(n-1)+fib(n-2) }");
+    std::ostringstream output;
+    grlang::node::write_image(exports, output);
+    std::string bytes = output.str();
+    std::vector<std::uint32_t> storage((bytes.size()+3)/4);
+    std::memcpy(storage.data(), bytes.data(), bytes.size());
+
+    grlang::node::ImageView image(std::as_bytes(std::span(storage)).first(bytes.size()));
+    assert(grlang::eval::eval_call(image, "fib", 1) == 1);
+    assert(grlang::eval::eval_call(image, "fib", 10) == 55);
+}
+
+TEST_CASE(test_image_structs) {
+    std::string code =
+        "add:= (a:{x:int y:i64} b:{x:int y:i64})->{x:int y:i64} { return {x=a.x+b.x y=a.y+b.y} }\n"
+        "nested:= (n:int)->{p:{x:int y:i64} n:u8} { return {p={x=n y=2} n=n} }\n"
+        "test_main:= (arg:int)->int { q:= add({x=arg y=1} {x=2 y=arg}) s:= nested(arg) return q.x*q.y+s.p.x+s.n }";
+    auto exports = grlang::parse::parse_unit(code);
+    std::ostringstream output;
+    grlang::node::write_image(exports, output);
+    std::string bytes = output.str();
+    std::vector<std::uint32_t> storage((bytes.size()+3)/4);
+    std::memcpy(storage.data(), bytes.data(), bytes.size());
+
+    grlang::node::ImageView image(std::as_bytes(std::span(storage)).first(bytes.size()));
+    assert(grlang::eval::eval_call(image, "test_main", 5) == grlang::eval::eval_call(exports.at("test_main"), 5));
+    auto loaded = grlang::node::load_image(image);
+    for (const char* name: {"add", "nested"}) {
+        assert(get_signature(*loaded.at(name)) == get_signature(*exports.at(name)));  // NOTE: the same struct types of this process
+    }
+}
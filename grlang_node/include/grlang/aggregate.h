@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "grlang/node.h"
+#include "grlang/graph.h"
+
+
+namespace grlang::node {
+    // Escape analysis. Indexed by node, true for struct values that leave the function: returned, passed to a call,
+    // or part of a struct or a phi that does. Only these have to be materialized in memory
+    std::vector<bool> find_escaping(const Graph& graph);
+
+    // Scalar replacement of aggregates. A struct phi that doesn't escape is replaced by a phi per field, so structs
+    // that are made and taken apart within the function end up as the values of their fields. Fields of structs
+    // made along the way are folded as they are taken, see peephole. Returns how many phis were replaced
+    std::size_t replace_aggregates(Node& func);
+}
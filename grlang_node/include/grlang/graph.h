@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "grlang/node.h"
+
+
+namespace grlang::node {
+    // Dense numbering of one function's nodes. Ids follow a depth-first walk over inputs starting at the function
+    // constant, so they are stable for a given graph. Other function constants are leaves, callees are graphs of their own.
+    class Graph {
+    public:
+        static constexpr std::uint32_t NO_NODE = 0xFFFFFFFF;
+
+        explicit Graph(const Node& func);  // NOTE: func has to be built already, see ensure_built
+        // NOTE: for passes that rewrite the nodes in place, see writable_node
+        explicit Graph(Node& func) : Graph(static_cast<const Node&>(func)) { writable = true; }
+
+        std::uint32_t size() const { return nodes.size(); }
+        const Node& node(std::uint32_t id) const { return *nodes[id]; }
+        Node& writable_node(std::uint32_t id) {
+            assert(writable);
+            return *nodes[id];
+        }
+        // NOTE: the graph only keeps plain pointers, owning ones are found in the inputs of users. The function only
+        // has one if it calls itself
+        std::vector<Node::Ptr> owned_nodes() const;
+        // NOTE: null inputs are NO_NODE, so positions match Node::inputs
+        std::span<const std::uint32_t> inputs(std::uint32_t id) const {
+            return std::span(input_edges).subspan(input_begin[id], input_begin[id+1] - input_begin[id]);
+        }
+        // NOTE: users in id order, a node used twice by the same user is listed twice
+        std::span<const std::uint32_t> outputs(std::uint32_t id) const {
+            return std::span(output_edges).subspan(output_begin[id], output_begin[id+1] - output_begin[id]);
+        }
+
+        std::uint32_t function() const { return 0; }
+        std::uint32_t stop() const { return 1; }
+        std::uint32_t start() const { return start_; }
+
+        // Control nodes reachable from start, each one before its successors except along loop back edges
+        std::span<const std::uint32_t> control_rpo() const { return rpo; }
+        // Data nodes, each one after its inputs except for phi inputs along loop back edges
+        std::span<const std::uint32_t> data_postorder() const { return postorder; }
+        bool is_back_edge(std::uint32_t region, std::size_t input) const;
+        // NOTE: whether control flows from one control node to the other, memory nodes also use memory nodes as values
+        bool is_control_edge(std::uint32_t from, std::uint32_t to) const {
+            return node(to).type == Node::Type::CONTROL_REGION || (!inputs(to).empty() && inputs(to)[0] == from);
+        }
+
+    private:
+        std::vector<Node*> nodes;
+        bool writable = false;
+        std::vector<std::uint32_t> input_begin;
+        std::vector<std::uint32_t> input_edges;
+        std::vector<std::uint32_t> output_begin;
+        std::vector<std::uint32_t> output_edges;
+        std::vector<std::uint32_t> rpo;
+        std::vector<std::uint32_t> rpo_index;  // NOTE: NO_NODE for nodes not in rpo
+        std::vector<std::uint32_t> postorder;
+        std::uint32_t start_ = NO_NODE;
+    };
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <ostream>
+#include <optional>
+#include <vector>
+
+#include "grlang/node.h"
+
+
+namespace grlang::node {
+    // Flat image of a unit: structure-of-arrays node table, input edge array, constant pool and export table.
+    // Every section is 4-byte aligned, so an image can be used in place straight out of mmap.
+    // NOTE: a constant takes two pool entries, the low and the high half. A function keeps its signature in the pool, as
+    // the parameter count, the parameter types and the result type
+    // NOTE: struct types are numbered by the image from STRUCT upward, as its struct table lists them, since the numbers
+    // of a process only hold within it. A struct only has fields of the structs listed before it
+    struct ImageHeader {
+        std::uint32_t magic;
+        std::uint32_t version;
+        std::uint32_t node_count;
+        std::uint32_t edge_count;
+        std::uint32_t constant_count;
+        std::uint32_t export_count;
+        std::uint32_t struct_count;
+        std::uint32_t field_count;
+        std::uint32_t name_bytes;
+    };
+
+    struct ImageExport {
+        std::uint32_t name_offset;
+        std::uint32_t name_size;
+        std::uint32_t node;
+    };
+
+    struct ImageField {
+        std::uint32_t name_offset;
+        std::uint32_t name_size;
+        std::uint32_t type;
+    };
+
+    class ImageView {
+    public:
+        static constexpr std::uint32_t MAGIC = 0x494C5247;  // "GRLI"
+        static constexpr std::uint32_t VERSION = 6;
+        static constexpr std::uint32_t NO_NODE = 0xFFFFFFFF;
+        static constexpr std::uint32_t NO_CONSTANT = 0xFFFFFFFF;
+
+        explicit ImageView(std::span<const std::byte> data);
+
+        std::uint32_t size() const { return header->node_count; }
+        Node::Type type(std::uint32_t node) const { return static_cast<Node::Type>(types[node]); }
+        std::uint8_t value(std::uint32_t node) const { return values[node]; }
+        Value::Type value_type(std::uint32_t node) const { return process_type(value_types[node]); }
+        std::span<const std::uint32_t> inputs(std::uint32_t node) const {
+            return {edges + edge_begin[node], edges + edge_begin[node+1]};
+        }
+        // NOTE: function constants are not users of their stop
+        std::span<const std::uint32_t> outputs(std::uint32_t node) const {
+            return std::span(output_edges).subspan(output_begin[node], output_begin[node+1] - output_begin[node]);
+        }
+        bool is_const(std::uint32_t node) const { return constants[node] != NO_CONSTANT && !is_function(node); }
+        int get_value_int(std::uint32_t node) const { return pool[constants[node]]; }
+        std::int64_t get_value_i64(std::uint32_t node) const {
+            auto low = static_cast<std::uint32_t>(pool[constants[node]]);
+            auto high = static_cast<std::uint32_t>(pool[constants[node]+1]);
+            return static_cast<std::int64_t>((std::uint64_t(high) << 32) | low);
+        }
+        bool is_function(std::uint32_t node) const { return type(node) == Node::Type::DATA_TERM && edge_begin[node] != edge_begin[node+1]; }
+        Value::Signature signature(std::uint32_t node) const;
+
+        std::uint32_t export_count() const { return header->export_count; }
+        std::string_view export_name(std::uint32_t index) const {
+            return {names + exports[index].name_offset, exports[index].name_size};
+        }
+        std::uint32_t export_node(std::uint32_t index) const { return exports[index].node; }
+        std::optional<std::uint32_t> find_export(std::string_view name) const;
+
+    private:
+        void validate() const;
+        void validate_inputs(std::uint32_t node) const;
+        Value::Type process_type(std::uint32_t type) const {
+            auto struct_index = type - static_cast<std::uint32_t>(Value::Type::STRUCT);
+            return type < static_cast<std::uint32_t>(Value::Type::STRUCT) ? static_cast<Value::Type>(type) : struct_types[struct_index];
+        }
+
+        const ImageHeader* header;
+        const std::uint8_t* types;
+        const std::uint8_t* values;
+        const std::uint16_t* value_types;
+        const std::uint32_t* edge_begin;
+        const std::uint32_t* edges;
+        const std::uint32_t* constants;
+        const std::int32_t* pool;
+        const ImageExport* exports;
+        const std::uint32_t* field_begin;
+        const ImageField* fields;
+        const char* names;
+        // NOTE: images only store inputs, users and the export index are built once when the view is made
+        std::vector<std::uint32_t> output_begin;
+        std::vector<std::uint32_t> output_edges;
+        std::unordered_map<std::string_view, std::uint32_t> export_index;
+        std::vector<Value::Type> struct_types;  // NOTE: of this process, indexed by the struct numbers of the image
+    };
+
+    void write_image(const std::unordered_map<std::string_view, Node::Ptr>& exports, std::ostream& output);
+    // NOTE: export names of the result point into the image. Only needed to optimize or lower an image, eval runs on
+    // the view itself
+    std::unordered_map<std::string_view, Node::Ptr> load_image(const ImageView& image);
+}
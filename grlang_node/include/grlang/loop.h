@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "grlang/node.h"
+#include "grlang/graph.h"
+#include "grlang/range.h"
+#include "grlang/profile.h"
+
+
+namespace grlang::node {
+    // A `while i<n` loop that counts i up by one from outside the loop to an n defined outside the loop. The loop
+    // has no other exit and no continue, its body is a chain of memory nodes and diamonds that merge again
+    struct CountedLoop {
+        std::uint32_t region = Graph::NO_NODE;
+        std::uint32_t ifelse = Graph::NO_NODE;
+        std::uint32_t counter = Graph::NO_NODE;  // NOTE: phi of the region
+        std::uint32_t limit = Graph::NO_NODE;
+        std::uint32_t body = Graph::NO_NODE;  // NOTE: project the body starts at
+        std::uint32_t exit = Graph::NO_NODE;  // NOTE: project leaving the loop
+        std::size_t entry = 1;  // NOTE: input of the region and its phis coming from before the loop
+        std::size_t back = 2;
+        // NOTE: control nodes from the body project to the back edge, an ifelse is followed by its first arm,
+        // its second arm and the region merging them
+        std::vector<std::uint32_t> nodes;
+    };
+
+    // NOTE: innermost loops only, in control order
+    std::vector<CountedLoop> find_counted_loops(const Graph& graph);
+
+    // NOTE: indexed by node, true for data nodes computed anew each iteration
+    std::vector<bool> loop_variant(const Graph& graph, const CountedLoop& loop);
+
+    // How a loop phi other than the counter carries its value over, each iteration folds in one more value
+    enum class Reduction : std::uint8_t {
+        ADD,
+        MUL,
+        AND,
+        MIN,  // NOTE: the phi is kept by one arm of a diamond that compares it, see match_vector_loop
+        MAX,
+    };
+
+    // A counted loop whose iterations can run side by side: every load and store is indexed by the counter, so each
+    // iteration only touches its own elements, even if arrays alias. Diamonds only load, so both arms can run
+    struct VectorLoop {
+        // NOTE: a diamond in the body, its phis take the value coming through the taken input of the merge region
+        // in the lanes whose condition holds
+        struct Select {
+            std::uint32_t merge;
+            std::uint32_t ifelse;
+            std::size_t taken;
+        };
+
+        std::vector<std::pair<std::uint32_t, Reduction>> reductions;
+        std::vector<Select> selects;
+        std::vector<std::uint32_t> arrays;  // NOTE: accessed by the loop, each iteration reads or writes one element
+    };
+
+    std::optional<VectorLoop> match_vector_loop(const Graph& graph, const CountedLoop& loop);
+
+    struct UnrollOptions {
+        std::uint32_t full_trips = 8;  // NOTE: loops known to run at most this many times are unrolled fully
+        std::uint32_t factor = 4;  // NOTE: a power of two, iterations a partially unrolled loop runs per check
+        std::size_t budget = 256;  // NOTE: nodes unrolling may add to a function
+        bool skip_vector_loops = true;  // NOTE: codegen runs those several iterations at once already
+    };
+
+    // Unrolls counted loops. A loop known to run only a few times is replaced by that many copies of its body. Others
+    // run factor copies per check while enough iterations are left, then the loop as it was for the rest. Trip counts
+    // come from the ranges of the bounds, else from counts if there are any, loops that never ran are left alone then.
+    // Returns how many loops were unrolled
+    std::size_t unroll_loops(Node& func, const UnrollOptions& options = {}, const BranchCounts& counts = {}, std::span<const Range> arguments = {});
+}
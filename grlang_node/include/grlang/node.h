@@ -1,12 +1,80 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <memory>
+#include <stdexcept>
+#include <utility>
 #include <vector>
 #include <ostream>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <type_traits>
+#include <string>
+
+#include "grlang/stats.h"
 
 
 namespace grlang::node {
+    struct Value {
+        enum class Class : std::uint8_t {
+            TOP_TYPE,
+            TOP_CONST,
+            CONSTANT,
+            VARIABLE,
+            BOT_TYPE,
+        };
+        enum class Type : std::uint16_t {
+            UNKNOWN,
+            INTEGER,  // NOTE: int, 32 bits wide
+            TUPLE,
+            FUNCTION,
+            I8,  // NOTE: put the other integer types between I8 and U64
+            I16,
+            I64,
+            U8,
+            U16,
+            U32,
+            U64,
+            ARRAY,  // NOTE: of int, put the other array types after it in the order of their elements, I8 to U64
+            ARRAY_I8,
+            ARRAY_I16,
+            ARRAY_I64,
+            ARRAY_U8,
+            ARRAY_U16,
+            ARRAY_U32,
+            ARRAY_U64,
+            STRUCT,  // NOTE: the first struct type, the others follow it in the order they are made, see struct_type
+        };
+        // Parameter and result types of a function value
+        struct Signature {
+            std::vector<Type> params;
+            Type result = Type::INTEGER;
+
+            bool operator==(const Signature&) const = default;
+        };
+        Class clazz = Class::TOP_TYPE;
+        Type type = Type::UNKNOWN;
+        union
+        {
+            std::int64_t integer;  // NOTE: sign or zero extended from the width of the type, see normalize
+            //std::vector<Value> tuple;
+        };
+        std::shared_ptr<const Signature> signature;  // NOTE: only set for functions
+
+        Value() : clazz(Class::TOP_TYPE), type(Type::UNKNOWN), integer(0) {}
+        Value(int v) : clazz(Class::CONSTANT), type(Type::INTEGER), integer(v) {}
+        Value(std::int64_t v, Type t) : clazz(Class::CONSTANT), type(t), integer(v) {}
+        Value(Type t) : clazz(Class::VARIABLE), type(t), integer(0) {}
+        Value(Signature s) : clazz(Class::CONSTANT), type(Type::FUNCTION), integer(0), signature(std::make_shared<const Signature>(std::move(s))) {}
+        ~Value() {
+            if (type == Type::TUPLE) {
+                //tuple.~vector();
+            }
+        }
+    };
+
     struct Node {
         using Ptr = std::shared_ptr<Node>;
         enum class Type : std::uint8_t {
@@ -16,15 +84,25 @@ namespace grlang::node {
             CONTROL_REGION,
             CONTROL_IFELSE,
             CONTROL_PROJECT,
+            // NOTE: memory nodes take part in control flow, which keeps them in order. Input 0 is the memory state
+            // they follow, their value is the new array, the loaded element or the result of the call
+            MEMORY_NEW,
+            MEMORY_LOAD,
+            MEMORY_STORE,
+            MEMORY_CALL,  // NOTE: a call that passes or returns arrays, input 1 is the callee
             CONTROL_DEAD,
 
             DATA_TERM,
             DATA_PROJECT,
             DATA_PHI,
             DATA_CALL,
+            DATA_LENGTH,
+            DATA_STRUCT,  // NOTE: a struct value made of its inputs, one per field
+            DATA_FIELD,  // NOTE: the field of its input numbered by value
 
             DATA_OP_NEG,
             DATA_OP_NOT,
+            DATA_OP_CONVERT,  // NOTE: to the value type of the node, from that of its input
             DATA_OP_BEGIN,  // NOTE: put binary operation tags between DATA_OP_BEGIN and DATA_OP_END
             DATA_OP_ADD,
             DATA_OP_SUB,
@@ -36,44 +114,22 @@ namespace grlang::node {
             DATA_OP_GEQ,
             DATA_OP_EQ,
             DATA_OP_NEQ,
+            DATA_OP_SHL,  // NOTE: shifts and masks only come from rewrites, there is no syntax for them
+            DATA_OP_SHR,
+            DATA_OP_AND,
             DATA_OP_END,
         };
         Type type;
         uint8_t value;
         uint16_t depth;
+        Value::Type value_type = Value::Type::INTEGER;  // NOTE: integer type data nodes compute in, comparisons give an int
+        [[no_unique_address]] NodeCount lifetime;  // NOTE: empty unless built with GRLANG_STATS
         std::vector<Ptr> inputs;
         // std::vector<Ptr::weak_type> outputs;
 
-        Node(Type type_, uint8_t value_, std::initializer_list<Ptr> inputs_) : type(type_), value(value_), depth(0), inputs(inputs_) {}
-    };
-
-    struct Value {
-        enum class Class : std::uint8_t {
-            TOP_TYPE,
-            TOP_CONST,
-            CONSTANT,
-            VARIABLE,
-            BOT_TYPE,
-        };
-        enum class Type : std::uint16_t {
-            UNKNOWN,
-            INTEGER,
-            TUPLE,
-        };
-        Class clazz = Class::TOP_TYPE;
-        Type type = Type::UNKNOWN;
-        union
-        {
-            int integer;
-            //std::vector<Value> tuple;
-        };
-
-        Value() : clazz(Class::TOP_TYPE), type(Type::UNKNOWN), integer(0) {}
-        Value(int v) : clazz(Class::CONSTANT), type(Type::INTEGER), integer(v) {}
-        Value(Type t) : clazz(Class::VARIABLE), type(t), integer(0) {}
-        ~Value() {
-            if (type == Type::TUPLE) {
-                //tuple.~vector();
+        Node(Type type_, uint8_t value_, std::initializer_list<Ptr> inputs_) : type(type_), value(value_), depth(0), inputs(inputs_) {
+            if (type_ == Type::DATA_PHI) {
+                grlang::node::count(Counter::PHIS_CREATED);
             }
         }
     };
@@ -82,6 +138,17 @@ namespace grlang::node {
         Value value;
     };
 
+    // Function whose body is built on first use, a DATA_TERM with value LAZY_FUNCTION
+    struct LazyFunctionNode : ValueNode {
+        mutable std::function<void()> build;  // NOTE: fills in the returns of the stop node in inputs[0]
+        mutable std::once_flag built;
+    };
+    inline constexpr std::uint8_t LAZY_FUNCTION = 1;
+    // NOTE: value of a DATA_CALL whose input 0 is a function constant, no need to look up the target at run time
+    inline constexpr std::uint8_t DIRECT_CALL = 1;
+    // NOTE: value of a MEMORY_LOAD or MEMORY_STORE whose index is not known to be in bounds
+    inline constexpr std::uint8_t BOUNDS_CHECK = 1;
+
     inline bool is_binary_op(const Node& node) {
         return node.type > Node::Type::DATA_OP_BEGIN && node.type <Node::Type::DATA_OP_END;
     }
@@ -92,13 +159,245 @@ namespace grlang::node {
         return !is_control(node);
     }
 
+    inline constexpr bool is_int_type(Value::Type type) {
+        return type == Value::Type::INTEGER || (type >= Value::Type::I8 && type <= Value::Type::U64);
+    }
+
+    inline bool is_memory(const Node& node) {
+        return node.type >= Node::Type::MEMORY_NEW && node.type <= Node::Type::MEMORY_CALL;
+    }
+
+    inline constexpr bool is_array_type(Value::Type type) {
+        return type >= Value::Type::ARRAY && type <= Value::Type::ARRAY_U64;
+    }
+
+    inline constexpr Value::Type array_type(Value::Type element) {
+        if (element == Value::Type::INTEGER) {
+            return Value::Type::ARRAY;
+        }
+        return static_cast<Value::Type>(static_cast<int>(Value::Type::ARRAY_I8) + static_cast<int>(element) - static_cast<int>(Value::Type::I8));
+    }
+
+    inline constexpr Value::Type element_type(Value::Type array) {
+        if (array == Value::Type::ARRAY) {
+            return Value::Type::INTEGER;
+        }
+        return static_cast<Value::Type>(static_cast<int>(Value::Type::I8) + static_cast<int>(array) - static_cast<int>(Value::Type::ARRAY_I8));
+    }
+
+    inline constexpr bool is_struct_type(Value::Type type) {
+        return type >= Value::Type::STRUCT;
+    }
+
+    // Names and types of the fields of a struct type, in order
+    struct StructLayout {
+        std::vector<std::string> names;
+        std::vector<Value::Type> types;
+
+        bool operator==(const StructLayout&) const = default;
+    };
+
+    // NOTE: struct types are made once per layout, so two structs with the same fields have the same type. Safe to
+    // call concurrently, a layout stays put once made
+    Value::Type struct_type(StructLayout layout);
+    const StructLayout& struct_layout(Value::Type type);
+
+    inline constexpr bool is_unsigned_type(Value::Type type) {
+        return type >= Value::Type::U8 && type <= Value::Type::U64;
+    }
+
+    // NOTE: calls f with a value of the C++ type that holds an integer type
+    template<typename F>
+    constexpr decltype(auto) visit_int_type(Value::Type type, F&& f) {
+        switch (type) {
+            case Value::Type::INTEGER: return f(std::int32_t{});
+            case Value::Type::I8: return f(std::int8_t{});
+            case Value::Type::I16: return f(std::int16_t{});
+            case Value::Type::I64: return f(std::int64_t{});
+            case Value::Type::U8: return f(std::uint8_t{});
+            case Value::Type::U16: return f(std::uint16_t{});
+            case Value::Type::U32: return f(std::uint32_t{});
+            case Value::Type::U64: return f(std::uint64_t{});
+            default: throw std::runtime_error("not an integer type");
+        }
+    }
+
+    // NOTE: value wrapped around to the width of the type, then extended back to how Value holds it
+    constexpr std::int64_t normalize(Value::Type type, std::int64_t value) {
+        return visit_int_type(type, [&](auto tag) { return static_cast<std::int64_t>(static_cast<decltype(tag)>(value)); });
+    }
+
     inline bool is_const(const Node& node) {
-        return node.type == Node::Type::DATA_TERM && static_cast<const ValueNode&>(node).value.clazz == Value::Class::CONSTANT;
+        return node.type == Node::Type::DATA_TERM && static_cast<const ValueNode&>(node).value.clazz == Value::Class::CONSTANT &&
+            is_int_type(static_cast<const ValueNode&>(node).value.type);
+    }
+
+    inline bool is_comparison(Node::Type type) {
+        return type >= Node::Type::DATA_OP_LT && type <= Node::Type::DATA_OP_NEQ;
+    }
+
+    // NOTE: type of the value a data node gives, comparisons compute in the type of their operands but give an int
+    inline Value::Type result_type(const Node& node) {
+        if (node.type == Node::Type::DATA_TERM) {
+            return static_cast<const ValueNode&>(node).value.type;
+        }
+        if (is_comparison(node.type) || node.type == Node::Type::DATA_OP_NOT) {
+            return Value::Type::INTEGER;
+        }
+        return node.value_type;
+    }
+
+    // NOTE: function constant, input 0 is its stop node
+    inline bool is_function(const Node& node) {
+        return node.type == Node::Type::DATA_TERM && static_cast<const ValueNode&>(node).value.type == Value::Type::FUNCTION;
     }
 
+    // NOTE: constants of type int only, see get_value_i64 for the others
     int get_value_int(const Node& node);
+    std::int64_t get_value_i64(const Node& node);
+    const Value::Signature& get_signature(const Node& node);
 
-    int (*op_func(grlang::node::Node::Type type))(int, int);
+    // Builds the body of a lazy function, does nothing for other nodes. Safe to call concurrently
+    void ensure_built(const Node& node);
 
+    // Integer semantics of an operation in type T, shared by constant folding, rewrites and evaluation. Arithmetic
+    // wraps around, comparisons give 0 or 1, shift amounts are taken modulo the width
+    template<Node::Type type, typename T = int>
+    constexpr T apply_op(T a, T b) {
+        using U = std::uint64_t;  // NOTE: narrow types would be promoted to int, which can overflow
+        constexpr int BITS = std::numeric_limits<std::make_unsigned_t<T>>::digits;
+        if constexpr (type == Node::Type::DATA_OP_ADD) {
+            return static_cast<T>(U(a) + U(b));
+        } else if constexpr (type == Node::Type::DATA_OP_SUB) {
+            return static_cast<T>(U(a) - U(b));
+        } else if constexpr (type == Node::Type::DATA_OP_MUL) {
+            return static_cast<T>(U(a) * U(b));
+        } else if constexpr (type == Node::Type::DATA_OP_DIV) {
+            return static_cast<T>(a / b);  // NOTE: see can_fold
+        } else if constexpr (type == Node::Type::DATA_OP_LT) {
+            return a < b ? 1 : 0;
+        } else if constexpr (type == Node::Type::DATA_OP_LEQ) {
+            return a <= b ? 1 : 0;
+        } else if constexpr (type == Node::Type::DATA_OP_GT) {
+            return a > b ? 1 : 0;
+        } else if constexpr (type == Node::Type::DATA_OP_GEQ) {
+            return a >= b ? 1 : 0;
+        } else if constexpr (type == Node::Type::DATA_OP_EQ) {
+            return a == b ? 1 : 0;
+        } else if constexpr (type == Node::Type::DATA_OP_NEQ) {
+            return a != b ? 1 : 0;
+        } else if constexpr (type == Node::Type::DATA_OP_SHL) {
+            return static_cast<T>(U(a) << (b & (BITS-1)));
+        } else if constexpr (type == Node::Type::DATA_OP_SHR) {
+            return static_cast<T>(a >> (b & (BITS-1)));  // NOTE: arithmetic for signed types, logical for unsigned ones
+        } else if constexpr (type == Node::Type::DATA_OP_AND) {
+            return static_cast<T>(a & b);
+        } else {
+            static_assert(type == Node::Type::DATA_OP_BEGIN, "not a binary operation");
+            return 0;
+        }
+    }
+
+    template<Node::Type type, typename T = int>
+    constexpr T apply_op(T a) {
+        if constexpr (type == Node::Type::DATA_OP_NEG) {
+            return static_cast<T>(0ull - static_cast<std::uint64_t>(a));
+        } else {
+            static_assert(type == Node::Type::DATA_OP_NOT, "not a unary operation");
+            return a == 0 ? 1 : 0;
+        }
+    }
+
+    // NOTE: switch over inlined kernels, compiles into a jump table
+    template<typename T>
+    constexpr T apply_op(Node::Type type, T a, T b) {
+        switch (type) {
+            case Node::Type::DATA_OP_ADD: return apply_op<Node::Type::DATA_OP_ADD>(a, b);
+            case Node::Type::DATA_OP_SUB: return apply_op<Node::Type::DATA_OP_SUB>(a, b);
+            case Node::Type::DATA_OP_MUL: return apply_op<Node::Type::DATA_OP_MUL>(a, b);
+            case Node::Type::DATA_OP_DIV: return apply_op<Node::Type::DATA_OP_DIV>(a, b);
+            case Node::Type::DATA_OP_LT: return apply_op<Node::Type::DATA_OP_LT>(a, b);
+            case Node::Type::DATA_OP_LEQ: return apply_op<Node::Type::DATA_OP_LEQ>(a, b);
+            case Node::Type::DATA_OP_GT: return apply_op<Node::Type::DATA_OP_GT>(a, b);
+            case Node::Type::DATA_OP_GEQ: return apply_op<Node::Type::DATA_OP_GEQ>(a, b);
+            case Node::Type::DATA_OP_EQ: return apply_op<Node::Type::DATA_OP_EQ>(a, b);
+            case Node::Type::DATA_OP_NEQ: return apply_op<Node::Type::DATA_OP_NEQ>(a, b);
+            case Node::Type::DATA_OP_SHL: return apply_op<Node::Type::DATA_OP_SHL>(a, b);
+            case Node::Type::DATA_OP_SHR: return apply_op<Node::Type::DATA_OP_SHR>(a, b);
+            case Node::Type::DATA_OP_AND: return apply_op<Node::Type::DATA_OP_AND>(a, b);
+            default: throw std::runtime_error("bad op");
+        }
+    }
+
+    template<typename T>
+    constexpr T apply_op(Node::Type type, T a) {
+        switch (type) {
+            case Node::Type::DATA_OP_NEG: return apply_op<Node::Type::DATA_OP_NEG>(a);
+            case Node::Type::DATA_OP_NOT: return apply_op<Node::Type::DATA_OP_NOT>(a);
+            default: throw std::runtime_error("bad op");
+        }
+    }
+
+    // NOTE: the kernel for the width the operation computes in, operands and result held as Value holds them
+    constexpr std::int64_t apply_sized_op(Node::Type type, Value::Type width, std::int64_t a, std::int64_t b) {
+        return visit_int_type(width, [&](auto tag) {
+            using T = decltype(tag);
+            return static_cast<std::int64_t>(apply_op<T>(type, static_cast<T>(a), static_cast<T>(b)));
+        });
+    }
+
+    constexpr std::int64_t apply_sized_op(Node::Type type, Value::Type width, std::int64_t a) {
+        return visit_int_type(width, [&](auto tag) {
+            using T = decltype(tag);
+            return static_cast<std::int64_t>(apply_op<T>(type, static_cast<T>(a)));
+        });
+    }
+
+    // False where apply_op is undefined, such operations are left for run time
+    template<typename T>
+    constexpr bool can_fold(Node::Type type, T a, T b) {
+        if (type != Node::Type::DATA_OP_DIV) {
+            return true;
+        }
+        if constexpr (std::is_signed_v<T>) {
+            return b != 0 && (a != std::numeric_limits<T>::min() || b != -1);
+        } else {
+            return b != 0;
+        }
+    }
+
+    constexpr bool can_fold_sized(Node::Type type, Value::Type width, std::int64_t a, std::int64_t b) {
+        return visit_int_type(width, [&](auto tag) {
+            using T = decltype(tag);
+            return can_fold(type, static_cast<T>(a), static_cast<T>(b));
+        });
+    }
+
+    namespace detail {
+        template<std::size_t... I>
+        constexpr auto make_op_table(std::index_sequence<I...>) {
+            constexpr auto first = static_cast<std::size_t>(Node::Type::DATA_OP_BEGIN) + 1;
+            return std::array<int (*)(int, int), sizeof...(I)>{&apply_op<static_cast<Node::Type>(first + I)>...};
+        }
+
+        inline constexpr auto OP_TABLE = make_op_table(std::make_index_sequence<
+            static_cast<std::size_t>(Node::Type::DATA_OP_END) - static_cast<std::size_t>(Node::Type::DATA_OP_BEGIN) - 1>());
+    }
+
+    constexpr int (*op_func(Node::Type type))(int, int) {
+        if (type <= Node::Type::DATA_OP_BEGIN || type >= Node::Type::DATA_OP_END) {
+            throw std::runtime_error("bad op");
+        }
+        return detail::OP_TABLE[static_cast<std::size_t>(type) - static_cast<std::size_t>(Node::Type::DATA_OP_BEGIN) - 1];
+    }
+
+    // NOTE: root is a function constant, callees show up as single nodes
     void print_dot(const node::Node::Ptr& root, std::ostream& output);
+
+    // Structural hash of everything reachable from root, independent of node addresses
+    // NOTE: callees are hashed by signature only, their nodes are appended to callees for whoever needs to tell them apart
+    std::uint64_t hash_graph(const Node& root, std::vector<const Node*>* callees = nullptr);
+    inline std::uint64_t hash_graph(const Node::Ptr& root, std::vector<const Node*>* callees = nullptr) {
+        return hash_graph(*root, callees);
+    }
 }
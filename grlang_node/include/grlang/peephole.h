@@ -0,0 +1,10 @@
+#pragma once
+
+#include "grlang/node.h"
+
+
+namespace grlang::node {
+    // Local rewrite of a freshly made node: constant folding, algebraic identities, reassociation, strength reduction
+    // and direct calls. Returns the node to use instead, possibly node itself with its inputs reordered
+    Node::Ptr peephole(Node::Ptr node);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <map>
+#include <ostream>
+#include <unordered_map>
+#include <utility>
+
+#include "grlang/node.h"
+
+
+namespace grlang::node {
+    // How often each IFELSE went either way over recorded runs. Branches are keyed by the hash of their function and
+    // their number in its Graph, both only depend on the structure of the code, so counts recorded from one parse
+    // apply to the next. Written as text, a header line followed by one line per branch:
+    //     grlang-profile 1
+    //     <function hash in hex> <ifelse> <times the first arm was taken> <times the second arm was taken>
+    struct Profile {
+        static constexpr std::uint32_t VERSION = 1;
+
+        struct Branch {
+            std::uint64_t taken[2] = {0, 0};  // NOTE: indexed by the value of the project taken
+        };
+
+        std::map<std::pair<std::uint64_t, std::uint32_t>, Branch> branches;  // NOTE: sorted, so output is stable
+    };
+
+    void write_profile(const Profile& profile, std::ostream& output);
+    Profile read_profile(std::istream& input);
+    // NOTE: adds the counts of other to those of profile
+    void merge_profile(Profile& profile, const Profile& other);
+
+    // NOTE: counts of the branches of one function, keyed by IFELSE node, for passes that change the graph
+    using BranchCounts = std::unordered_map<const Node*, Profile::Branch>;
+    BranchCounts branch_counts(const Profile& profile, const Node& func);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "grlang/node.h"
+#include "grlang/graph.h"
+
+
+namespace grlang::node {
+    // Closed interval of int values, empty when lo > hi
+    struct Range {
+        int lo = std::numeric_limits<int>::min();
+        int hi = std::numeric_limits<int>::max();
+
+        static constexpr Range empty() { return {1, 0}; }
+        static constexpr Range constant(int value) { return {value, value}; }
+
+        constexpr bool is_empty() const { return lo > hi; }
+        constexpr bool is_constant() const { return lo == hi; }
+        constexpr bool contains(int value) const { return lo <= value && value <= hi; }
+        constexpr bool operator==(const Range&) const = default;
+    };
+
+    // NOTE: smallest range holding both
+    constexpr Range join(Range a, Range b) {
+        if (a.is_empty()) {
+            return b;
+        }
+        if (b.is_empty()) {
+            return a;
+        }
+        return {a.lo < b.lo ? a.lo : b.lo, a.hi > b.hi ? a.hi : b.hi};
+    }
+
+    constexpr Range intersect(Range a, Range b) {
+        return {a.lo > b.lo ? a.lo : b.lo, a.hi < b.hi ? a.hi : b.hi};
+    }
+
+    // Integer ranges of one function's data nodes. Each control node sees the ranges narrowed by the branch
+    // conditions that lead to it, loop phis are widened to reach a fixed point
+    class RangeAnalysis {
+    public:
+        // NOTE: arguments are what the caller is known to pass, any value for those left out, see fold_branches
+        explicit RangeAnalysis(const Graph& graph, std::span<const Range> arguments = {});
+
+        // NOTE: range of a data node as seen at a control node, empty if control is unreachable
+        Range range(std::uint32_t node, std::uint32_t control) const;
+
+    private:
+        using Facts = std::vector<std::pair<std::uint32_t, Range>>;  // NOTE: sorted by node
+
+        bool propagate(bool widen);
+        Range evaluate(std::uint32_t node, const Facts& facts) const;
+        Range evaluate_node(std::uint32_t node, const Facts& facts) const;
+        Facts narrow(std::uint32_t project) const;
+        Facts merge(std::uint32_t region) const;
+        bool update_phis(std::uint32_t region, bool widen);
+
+        const Graph& graph;
+        std::vector<Range> arguments;
+        std::vector<Facts> facts;  // NOTE: indexed by control node
+        std::vector<bool> reachable;  // NOTE: indexed by control node
+        std::vector<Range> phis;  // NOTE: indexed by node, empty until the phi is first reached
+        std::vector<std::uint8_t> changes;
+        // NOTE: ranges computed by the current query, data graphs are DAGs
+        mutable std::vector<Range> memo;
+        mutable std::vector<std::uint32_t> memo_query;
+        mutable std::uint32_t query = 0;
+    };
+
+    // Replaces branch conditions the analysis decides with constants, returns how many were replaced. A function
+    // reachable from elsewhere has to be folded for any argument
+    std::size_t fold_branches(Node& func, std::span<const Range> arguments = {});
+
+    // Drops the bounds checks of loads and stores whose index is known to be in bounds, returns how many were
+    // dropped. The index has to be non-negative and below a length it is compared against on the way there
+    std::size_t eliminate_bounds_checks(Node& func, std::span<const Range> arguments = {});
+}
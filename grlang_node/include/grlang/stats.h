@@ -0,0 +1,154 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+
+namespace grlang::node {
+    // Compile time instrumentation. Builds without GRLANG_STATS compile every timer and counter below to nothing, the
+    // API stays so callers need no #ifdefs, a recorder just sees all zeros
+#ifdef GRLANG_STATS
+    inline constexpr bool STATS = true;
+#else
+    inline constexpr bool STATS = false;
+#endif
+
+    enum class Phase : std::uint8_t {
+        TOKENIZE,
+        PARSE,
+        PEEPHOLE,  // NOTE: runs once per node, only added up, not traced
+        OPTIMIZE,
+        SCHEDULE,  // NOTE: numbering and ordering nodes for eval and codegen
+        LOWER,
+        COUNT,
+    };
+
+    enum class Counter : std::uint8_t {
+        NODES_CREATED,
+        NODES_COLLECTED,
+        PHIS_CREATED,
+        PHIS_REMOVED,  // NOTE: replaced by peephole, once one side of their region is dead
+        REWRITES,  // NOTE: all peephole rewrites, see Stats::rewrites for them by rule
+        COUNT,
+    };
+
+    const char* phase_name(Phase phase);
+    const char* counter_name(Counter counter);
+
+    struct Stats {
+        struct PhaseTotal {
+            std::uint64_t nanoseconds = 0;  // NOTE: inclusive, parse includes the peepholes it runs and so on
+            std::uint64_t calls = 0;
+        };
+        // Complete event of a traced phase, times in nanoseconds since recording started
+        struct Event {
+            Phase phase;
+            std::uint32_t thread;  // NOTE: numbered in the order threads first record something
+            std::uint64_t begin;
+            std::uint64_t end;
+        };
+
+        std::array<PhaseTotal, static_cast<std::size_t>(Phase::COUNT)> phases = {};
+        std::array<std::uint64_t, static_cast<std::size_t>(Counter::COUNT)> counters = {};
+        std::map<std::string, std::uint64_t> rewrites;  // NOTE: by peephole rule
+        std::uint64_t peak_nodes = 0;  // NOTE: most nodes alive at once, counting from when recording started
+        std::uint64_t peak_bytes = 0;  // NOTE: peak_nodes times the size of a node, input lists and values not included
+        std::vector<Event> events;  // NOTE: in the order they ended
+
+        const PhaseTotal& phase(Phase phase) const { return phases[static_cast<std::size_t>(phase)]; }
+        std::uint64_t counter(Counter counter) const { return counters[static_cast<std::size_t>(counter)]; }
+    };
+
+    // Records what is compiled on any thread while it lives. One at a time, and work still running on other threads
+    // when it goes has to be done before it is destroyed
+    class StatsRecorder {
+    public:
+        StatsRecorder();
+        ~StatsRecorder();
+        StatsRecorder(const StatsRecorder&) = delete;
+        StatsRecorder& operator=(const StatsRecorder&) = delete;
+
+        Stats stats() const;  // NOTE: so far, recording goes on
+    };
+
+    void write_stats_json(const Stats& stats, std::ostream& output);
+    // NOTE: Chrome trace event format, for chrome://tracing or Perfetto. Counters are one sample at the end
+    void write_stats_trace(const Stats& stats, std::ostream& output);
+
+    namespace detail {
+        inline constexpr std::uint64_t NOT_TIMED = ~std::uint64_t(0);
+
+        std::uint64_t begin_phase(Phase phase);  // NOTE: NOT_TIMED when not recording or the phase is already open
+        void end_phase(Phase phase, std::uint64_t begin);
+        void count(Counter counter, std::uint64_t n);
+        void count_rewrite(const char* rule);
+        void node_created();
+        void node_collected();
+
+        class Timer {
+        public:
+            explicit Timer(Phase phase) : phase_(phase), begin_(begin_phase(phase)) {}
+            ~Timer() { stop(); }
+            Timer(const Timer&) = delete;
+            Timer& operator=(const Timer&) = delete;
+
+            void stop() {
+                if (begin_ != NOT_TIMED) {
+                    end_phase(phase_, begin_);
+                    begin_ = NOT_TIMED;
+                }
+            }
+
+        private:
+            Phase phase_;
+            std::uint64_t begin_;
+        };
+
+        struct NoTimer {
+            explicit NoTimer(Phase) {}
+            void stop() {}
+        };
+
+        // NOTE: member of every node, counts them in and out. A moved from node no longer counts
+        class NodeCount {
+        public:
+            NodeCount() { node_created(); }
+            NodeCount(const NodeCount&) { node_created(); }
+            NodeCount(NodeCount&& other) noexcept : counted(other.counted) { other.counted = false; }
+            NodeCount& operator=(const NodeCount&) { return *this; }
+            NodeCount& operator=(NodeCount&&) noexcept { return *this; }
+            ~NodeCount() {
+                if (counted) {
+                    node_collected();
+                }
+            }
+
+        private:
+            bool counted = true;
+        };
+
+        struct NoNodeCount {};
+    }
+
+    // Times the enclosing scope as a phase, a phase opened again inside itself only counts once
+    using PhaseTimer = std::conditional_t<STATS, detail::Timer, detail::NoTimer>;
+    using NodeCount = std::conditional_t<STATS, detail::NodeCount, detail::NoNodeCount>;
+
+    inline void count(Counter counter, std::uint64_t n = 1) {
+        if constexpr (STATS) {
+            detail::count(counter, n);
+        }
+    }
+
+    // NOTE: rule is a name that outlives the recorder, a string literal
+    inline void count_rewrite(const char* rule) {
+        if constexpr (STATS) {
+            detail::count_rewrite(rule);
+        }
+    }
+}
@@ -0,0 +1,163 @@
+#include <unordered_map>
+
+#include "grlang/aggregate.h"
+#include "grlang/peephole.h"
+
+
+namespace
+{
+    using namespace grlang::node;
+
+    bool is_struct(const Graph& graph, std::uint32_t node) {
+        return node != Graph::NO_NODE && is_data(graph.node(node)) && is_struct_type(result_type(graph.node(node)));
+    }
+
+    Node::Ptr make_field(const Node::Ptr& value, std::size_t index) {
+        auto field = std::make_shared<Node>(Node::Type::DATA_FIELD, static_cast<std::uint8_t>(index), std::initializer_list<Node::Ptr>{value});
+        field->value_type = struct_layout(result_type(*value)).types.at(index);
+        return peephole(field);
+    }
+
+    // NOTE: replaces the struct phis given by a phi per field, returns false if there were none
+    bool split_phis(Graph& graph, const std::vector<std::uint32_t>& phis) {
+        auto owned = graph.owned_nodes();
+
+        std::unordered_map<const Node*, std::vector<Node::Ptr>> fields;  // NOTE: the phis taking the place of a struct phi
+        for (std::uint32_t phi: phis) {
+            auto& split = fields[&graph.node(phi)];
+            for (Value::Type type: struct_layout(result_type(graph.node(phi))).types) {
+                split.push_back(std::make_shared<Node>(Node::Type::DATA_PHI, std::uint8_t(0), std::initializer_list<Node::Ptr>{owned[graph.inputs(phi)[0]]}));
+                split.back()->value_type = type;
+            }
+        }
+        // NOTE: a field of a struct made from a field of a replaced phi may fold to that field, it's replaced as well
+        auto resolve = [&](Node::Ptr value) {
+            if (value->type == Node::Type::DATA_FIELD) {
+                if (auto it = fields.find(value->inputs.at(0).get()); it != fields.end()) {
+                    return it->second.at(value->value);
+                }
+            }
+            return value;
+        };
+        for (std::uint32_t phi: phis) {
+            auto& split = fields.at(&graph.node(phi));
+            for (std::uint32_t input: graph.inputs(phi).subspan(1)) {
+                auto it = fields.find(&graph.node(input));
+                for (std::size_t i=0; i<split.size(); ++i) {
+                    split[i]->inputs.push_back(it != fields.end() ? it->second[i] : resolve(make_field(owned[input], i)));
+                }
+            }
+        }
+        auto replace = [&](std::uint32_t user, std::uint32_t old_value, const Node::Ptr& new_value) {
+            for (Node::Ptr& input: graph.writable_node(user).inputs) {
+                if (input.get() == &graph.node(old_value)) {
+                    input = new_value;
+                }
+            }
+        };
+        for (std::uint32_t phi: phis) {
+            auto& split = fields.at(&graph.node(phi));
+            Node::Ptr materialized;  // NOTE: the struct made where the phi escapes, once
+            for (std::uint32_t user: graph.outputs(phi)) {
+                if (fields.contains(&graph.node(user))) {
+                    continue;
+                }
+                if (graph.node(user).type == Node::Type::DATA_FIELD) {
+                    for (std::uint32_t field_user: graph.outputs(user)) {
+                        replace(field_user, user, split.at(graph.node(user).value));
+                    }
+                    continue;
+                }
+                if (!materialized) {
+                    materialized = std::make_shared<Node>(Node::Type::DATA_STRUCT, std::uint8_t(0), std::initializer_list<Node::Ptr>{});
+                    materialized->inputs = split;
+                    materialized->value_type = graph.node(phi).value_type;
+                }
+                replace(user, phi, materialized);
+            }
+        }
+        return !phis.empty();
+    }
+}
+
+namespace grlang::node {
+    std::vector<bool> find_escaping(const Graph& graph) {
+        std::vector<bool> escaping(graph.size());
+        std::vector<std::uint32_t> work;
+        auto escape = [&](std::uint32_t node) {
+            if (is_struct(graph, node) && !escaping[node]) {
+                escaping[node] = true;
+                work.push_back(node);
+            }
+        };
+        for (std::uint32_t id=0; id<graph.size(); ++id) {
+            auto inputs = graph.inputs(id);
+            switch (graph.node(id).type) {
+                case Node::Type::CONTROL_RETURN:
+                    escape(inputs[1]);
+                    break;
+                case Node::Type::DATA_CALL:
+                case Node::Type::MEMORY_CALL:
+                    for (std::uint32_t arg: inputs) {
+                        escape(arg);  // NOTE: the callee is a function, not a struct
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+        while (!work.empty()) {
+            std::uint32_t node = work.back();
+            work.pop_back();
+            if (graph.node(node).type == Node::Type::DATA_PHI || graph.node(node).type == Node::Type::DATA_STRUCT) {
+                for (std::uint32_t input: graph.inputs(node)) {
+                    escape(input);
+                }
+            }
+        }
+        return escaping;
+    }
+
+    std::size_t replace_aggregates(Node& func) {
+        if (func.inputs.at(0)->inputs.empty()) {
+            return 0;
+        }
+        std::size_t replaced = 0;
+        // NOTE: fields that are structs themselves get phis of their own, which are split in the next round
+        while (true) {
+            Graph graph(func);
+            auto escaping = find_escaping(graph);
+            std::vector<bool> split(graph.size());
+            for (std::uint32_t id=0; id<graph.size(); ++id) {
+                split[id] = graph.node(id).type == Node::Type::DATA_PHI && is_struct(graph, id);
+            }
+            // NOTE: a phi that escapes is only split if it's made of structs built here, then the struct is only made
+            // where it escapes. One that is passed around in memory anyway is left as it is
+            for (bool changed = true; changed;) {
+                changed = false;
+                for (std::uint32_t id=0; id<graph.size(); ++id) {
+                    if (!split[id] || !escaping[id]) {
+                        continue;
+                    }
+                    for (std::uint32_t input: graph.inputs(id).subspan(1)) {
+                        if (graph.node(input).type != Node::Type::DATA_STRUCT && !split[input]) {
+                            split[id] = false;
+                            changed = true;
+                            break;
+                        }
+                    }
+                }
+            }
+            std::vector<std::uint32_t> phis;
+            for (std::uint32_t id=0; id<graph.size(); ++id) {
+                if (split[id]) {
+                    phis.push_back(id);
+                }
+            }
+            if (!split_phis(graph, phis)) {
+                return replaced;
+            }
+            replaced += phis.size();
+        }
+    }
+}
@@ -0,0 +1,139 @@
+#include <cassert>
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "grlang/graph.h"
+
+
+namespace grlang::node {
+    Graph::Graph(const Node& func) {
+        assert(is_function(func));
+
+        // NOTE: explicit stacks, graphs of long functions are too deep to recurse over
+        std::unordered_map<const Node*, std::uint32_t> ids;
+        std::vector<std::pair<Node*, std::size_t>> stack;
+        auto visit = [&](Node* node) {
+            ids.emplace(node, nodes.size());
+            nodes.push_back(node);
+            stack.emplace_back(node, 0);
+        };
+        // NOTE: the other nodes are reached through owning pointers, the function is only handed out writable by
+        // writable_node when the graph was made from a non-const one
+        visit(const_cast<Node*>(&func));
+        while (!stack.empty()) {
+            auto& [node, next] = stack.back();
+            bool leaf = is_function(*node) && node != &func;
+            if (leaf || next == node->inputs.size()) {
+                stack.pop_back();
+                continue;
+            }
+            Node* child = node->inputs[next++].get();
+            if (child && !ids.contains(child)) {
+                visit(child);
+            }
+        }
+
+        input_begin.reserve(nodes.size()+1);
+        output_begin.assign(nodes.size()+1, 0);
+        for (std::uint32_t id=0; id<nodes.size(); ++id) {
+            input_begin.push_back(input_edges.size());
+            if (is_function(*nodes[id]) && id != function()) {
+                continue;
+            }
+            for (const Node::Ptr& child: nodes[id]->inputs) {
+                input_edges.push_back(child ? ids.at(child.get()) : NO_NODE);
+                if (child) {
+                    ++output_begin[input_edges.back()+1];
+                }
+            }
+            if (nodes[id]->type == Node::Type::CONTROL_START) {
+                start_ = id;
+            }
+        }
+        input_begin.push_back(input_edges.size());
+        for (std::uint32_t id=0; id<nodes.size(); ++id) {
+            output_begin[id+1] += output_begin[id];
+        }
+        output_edges.resize(output_begin.back());
+        std::vector<std::uint32_t> output_end(output_begin.begin(), output_begin.end()-1);
+        for (std::uint32_t id=0; id<nodes.size(); ++id) {
+            for (std::uint32_t input: inputs(id)) {
+                if (input != NO_NODE) {
+                    output_edges[output_end[input]++] = id;
+                }
+            }
+        }
+        if (start_ == NO_NODE) {
+            throw std::runtime_error("function has no start");
+        }
+
+        std::vector<bool> seen(nodes.size());
+        std::vector<std::pair<std::uint32_t, std::size_t>> walk{{start_, 0}};
+        seen[start_] = true;
+        while (!walk.empty()) {
+            auto& [id, next] = walk.back();
+            if (next == outputs(id).size()) {
+                rpo.push_back(id);
+                walk.pop_back();
+                continue;
+            }
+            std::uint32_t user = outputs(id)[next++];
+            if (is_control(*nodes[user]) && !seen[user] && is_control_edge(id, user)) {
+                seen[user] = true;
+                walk.emplace_back(user, 0);
+            }
+        }
+        std::ranges::reverse(rpo);
+        rpo_index.assign(nodes.size(), NO_NODE);
+        for (std::uint32_t i=0; i<rpo.size(); ++i) {
+            rpo_index[rpo[i]] = i;
+        }
+
+        seen.assign(nodes.size(), false);
+        for (std::uint32_t root=0; root<nodes.size(); ++root) {
+            if (seen[root] || !is_data(*nodes[root])) {
+                continue;
+            }
+            seen[root] = true;
+            walk.emplace_back(root, 0);
+            while (!walk.empty()) {
+                auto& [id, next] = walk.back();
+                if (next == inputs(id).size()) {
+                    postorder.push_back(id);
+                    walk.pop_back();
+                    continue;
+                }
+                std::size_t position = next++;
+                std::uint32_t input = inputs(id)[position];
+                if (input == NO_NODE || seen[input] || !is_data(*nodes[input])) {
+                    continue;
+                }
+                if (nodes[id]->type == Node::Type::DATA_PHI && position > 0 && is_back_edge(inputs(id)[0], position)) {
+                    continue;  // NOTE: visited as a root of its own later on
+                }
+                seen[input] = true;
+                walk.emplace_back(input, 0);
+            }
+        }
+    }
+
+    std::vector<Node::Ptr> Graph::owned_nodes() const {
+        std::vector<Node::Ptr> owned(size());
+        for (std::uint32_t id=0; id<size(); ++id) {
+            auto edges = inputs(id);
+            for (std::size_t i=0; i<edges.size(); ++i) {
+                if (edges[i] != NO_NODE) {
+                    owned[edges[i]] = nodes[id]->inputs[i];
+                }
+            }
+        }
+        return owned;
+    }
+
+    bool Graph::is_back_edge(std::uint32_t region, std::size_t input) const {
+        std::uint32_t predecessor = inputs(region)[input];
+        return predecessor != NO_NODE && rpo_index[region] != NO_NODE && rpo_index[predecessor] != NO_NODE &&
+            rpo_index[predecessor] >= rpo_index[region];
+    }
+}
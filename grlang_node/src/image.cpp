@@ -0,0 +1,445 @@
+#include <cassert>
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+#include <limits>
+
+#include "grlang/image.h"
+
+
+namespace
+{
+    using namespace grlang::node;
+
+    std::size_t align4(std::size_t size) {
+        return (size + 3) & ~std::size_t(3);
+    }
+
+    struct ImageBuilder {
+        std::unordered_map<const Node*, std::uint32_t> node_ids;
+        std::vector<const Node*> nodes;
+
+        // NOTE: explicit stack like Graph, callees are numbered along with their callers
+        std::uint32_t add_node(const Node* root) {
+            if (auto it = node_ids.find(root); it != node_ids.end()) {
+                return it->second;
+            }
+            std::vector<std::pair<const Node*, std::size_t>> stack;
+            auto visit = [&](const Node* node) {
+                ensure_built(*node);
+                node_ids.emplace(node, nodes.size());
+                nodes.push_back(node);
+                stack.emplace_back(node, 0);
+            };
+            visit(root);
+            while (!stack.empty()) {
+                auto& [node, next] = stack.back();
+                if (next == node->inputs.size()) {
+                    stack.pop_back();
+                    continue;
+                }
+                const Node* child = node->inputs[next++].get();
+                if (child && !node_ids.contains(child)) {
+                    visit(child);
+                }
+            }
+            return node_ids.at(root);
+        }
+
+        std::unordered_map<Value::Type, std::uint32_t> struct_ids;
+        std::vector<Value::Type> structs;
+
+        // NOTE: numbers structs as the image does, the structs of their fields first
+        std::uint32_t add_type(Value::Type type) {
+            if (!is_struct_type(type)) {
+                return static_cast<std::uint32_t>(type);
+            }
+            auto it = struct_ids.find(type);
+            if (it == struct_ids.end()) {
+                for (Value::Type field: struct_layout(type).types) {
+                    add_type(field);
+                }
+                it = struct_ids.emplace(type, structs.size()).first;
+                structs.push_back(type);
+            }
+            return static_cast<std::uint32_t>(Value::Type::STRUCT) + it->second;
+        }
+    };
+
+    template<typename T>
+    void write_array(std::ostream& output, const std::vector<T>& array) {
+        output.write(reinterpret_cast<const char*>(array.data()), array.size()*sizeof(T));
+        static const char padding[4] = {};
+        output.write(padding, align4(array.size()*sizeof(T)) - array.size()*sizeof(T));
+    }
+
+    template<typename T>
+    const T* read_array(std::span<const std::byte> data, std::size_t& offset, std::size_t count) {
+        if (offset + count*sizeof(T) > data.size()) {
+            throw std::runtime_error("truncated image");
+        }
+        auto result = reinterpret_cast<const T*>(data.data() + offset);
+        offset = align4(offset + count*sizeof(T));
+        return result;
+    }
+}
+
+namespace grlang::node {
+    ImageView::ImageView(std::span<const std::byte> data) {
+        if (reinterpret_cast<std::uintptr_t>(data.data()) % 4 != 0) {
+            throw std::runtime_error("misaligned image");
+        }
+        std::size_t offset = 0;
+        header = read_array<ImageHeader>(data, offset, 1);
+        if (header->magic != MAGIC || header->version != VERSION) {
+            throw std::runtime_error("bad image header");
+        }
+        types = read_array<std::uint8_t>(data, offset, header->node_count);
+        values = read_array<std::uint8_t>(data, offset, header->node_count);
+        value_types = read_array<std::uint16_t>(data, offset, header->node_count);
+        edge_begin = read_array<std::uint32_t>(data, offset, header->node_count + 1);
+        edges = read_array<std::uint32_t>(data, offset, header->edge_count);
+        constants = read_array<std::uint32_t>(data, offset, header->node_count);
+        pool = read_array<std::int32_t>(data, offset, header->constant_count);
+        exports = read_array<ImageExport>(data, offset, header->export_count);
+        field_begin = read_array<std::uint32_t>(data, offset, std::size_t(header->struct_count) + 1);
+        fields = read_array<ImageField>(data, offset, header->field_count);
+        names = read_array<char>(data, offset, header->name_bytes);
+        validate();
+
+        for (std::uint32_t index=0; index<header->struct_count; ++index) {
+            StructLayout layout;
+            for (std::uint32_t field=field_begin[index]; field<field_begin[index+1]; ++field) {
+                layout.names.emplace_back(names + fields[field].name_offset, fields[field].name_size);
+                layout.types.push_back(process_type(fields[field].type));  // NOTE: only of structs made before this one
+            }
+            struct_types.push_back(struct_type(std::move(layout)));
+        }
+
+        output_begin.assign(header->node_count+1, 0);
+        for (std::uint32_t node=0; node<header->node_count; ++node) {
+            for (std::uint32_t input: inputs(node)) {
+                if (input != NO_NODE && type(node) != Node::Type::DATA_TERM) {
+                    ++output_begin[input+1];
+                }
+            }
+        }
+        for (std::uint32_t node=0; node<header->node_count; ++node) {
+            output_begin[node+1] += output_begin[node];
+        }
+        output_edges.resize(output_begin.back());
+        std::vector<std::uint32_t> output_end(output_begin.begin(), output_begin.end()-1);
+        for (std::uint32_t node=0; node<header->node_count; ++node) {
+            for (std::uint32_t input: inputs(node)) {
+                if (input != NO_NODE && type(node) != Node::Type::DATA_TERM) {
+                    output_edges[output_end[input]++] = node;
+                }
+            }
+        }
+        for (std::uint32_t index=0; index<header->export_count; ++index) {
+            export_index.try_emplace(export_name(index), export_node(index));
+        }
+    }
+
+    // NOTE: checks every index once, so the accessors can trust them
+    void ImageView::validate() const {
+        auto corrupt = []() { throw std::runtime_error("corrupt image"); };
+        if (edge_begin[0] != 0 || edge_begin[header->node_count] != header->edge_count) {
+            corrupt();
+        }
+        for (std::uint32_t node=0; node<header->node_count; ++node) {
+            if (edge_begin[node] > edge_begin[node+1]) {
+                corrupt();
+            }
+        }
+        auto type_count = std::uint64_t(Value::Type::STRUCT) + header->struct_count;
+        if (field_begin[0] != 0 || field_begin[header->struct_count] != header->field_count) {
+            corrupt();
+        }
+        for (std::uint32_t index=0; index<header->struct_count; ++index) {
+            if (field_begin[index] >= field_begin[index+1] || field_begin[index+1] - field_begin[index] > std::numeric_limits<std::uint8_t>::max()) {
+                corrupt();  // NOTE: 1 to 255 fields, as the parser allows
+            }
+        }
+        // NOTE: integers, arrays and the structs listed before, like the fields the parser allows
+        auto field_type = [](std::uint32_t type, std::uint32_t index) {
+            if (type >= static_cast<std::uint32_t>(Value::Type::STRUCT)) {
+                return type - static_cast<std::uint32_t>(Value::Type::STRUCT) < index;
+            }
+            return is_int_type(static_cast<Value::Type>(type)) || is_array_type(static_cast<Value::Type>(type));
+        };
+        for (std::uint32_t index=0; index<header->struct_count; ++index) {
+            for (std::uint32_t field=field_begin[index]; field<field_begin[index+1]; ++field) {
+                if (!field_type(fields[field].type, index) || std::uint64_t(fields[field].name_offset) + fields[field].name_size > header->name_bytes) {
+                    corrupt();
+                }
+            }
+        }
+        for (std::uint32_t node=0; node<header->node_count; ++node) {
+            if (types[node] >= static_cast<std::uint8_t>(Node::Type::DATA_OP_END) || value_types[node] >= type_count) {
+                corrupt();
+            }
+            for (std::uint32_t input: inputs(node)) {
+                if (input != NO_NODE && input >= header->node_count) {
+                    corrupt();
+                }
+            }
+            if (constants[node] == NO_CONSTANT) {
+                continue;
+            }
+            std::uint64_t entry = constants[node];
+            if (entry >= header->constant_count) {
+                corrupt();
+            }
+            std::uint64_t entry_size = 2;  // NOTE: the two halves of a constant, or the parameter count and result type
+            if (is_function(node)) {
+                if (pool[entry] < 0) {
+                    corrupt();
+                }
+                entry_size += pool[entry];
+            }
+            if (entry + entry_size > header->constant_count) {
+                corrupt();
+            }
+            if (is_function(node)) {
+                for (std::uint64_t i=1; i<entry_size; ++i) {
+                    if (pool[entry+i] < 0 || static_cast<std::uint64_t>(pool[entry+i]) >= type_count) {
+                        corrupt();
+                    }
+                }
+            }
+        }
+        for (std::uint32_t node=0; node<header->node_count; ++node) {
+            validate_inputs(node);
+        }
+        for (std::uint32_t index=0; index<header->export_count; ++index) {
+            if (exports[index].node >= header->node_count ||
+                std::uint64_t(exports[index].name_offset) + exports[index].name_size > header->name_bytes) {
+                corrupt();
+            }
+        }
+    }
+
+    // NOTE: the number and kind of inputs each type of node needs, so code running on the image can follow them unchecked
+    void ImageView::validate_inputs(std::uint32_t node) const {
+        auto corrupt = []() { throw std::runtime_error("corrupt image"); };
+        auto count = inputs(node).size();
+        auto input = [&](std::size_t i) { return inputs(node)[i]; };
+        auto control = [&](std::uint32_t input) { return input != NO_NODE && type(input) <= Node::Type::CONTROL_DEAD; };
+        auto data = [&](std::uint32_t input) {
+            if (input == NO_NODE) {
+                return false;
+            }
+            auto t = type(input);
+            return t >= Node::Type::DATA_TERM || t == Node::Type::MEMORY_NEW || t == Node::Type::MEMORY_LOAD || t == Node::Type::MEMORY_CALL;
+        };
+        auto data_from = [&](std::size_t first) {
+            for (std::size_t i=first; i<count; ++i) {
+                if (!data(input(i))) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        // NOTE: callee at input first, one argument per parameter after it
+        auto call = [&](std::size_t first) {
+            return value(node) == DIRECT_CALL && count > first && is_function(input(first)) && count - first - 1 == static_cast<std::size_t>(pool[constants[input(first)]]) && data_from(first+1);
+        };
+
+        bool valid = false;
+        switch (type(node)) {
+            case Node::Type::CONTROL_START:
+            case Node::Type::CONTROL_DEAD:
+                valid = count == 0;
+                break;
+            case Node::Type::CONTROL_STOP:
+                valid = std::ranges::all_of(inputs(node), [&](std::uint32_t input) { return input != NO_NODE && type(input) == Node::Type::CONTROL_RETURN; });
+                break;
+            case Node::Type::CONTROL_RETURN:
+            case Node::Type::CONTROL_IFELSE:
+            case Node::Type::MEMORY_NEW:
+                valid = count == 2 && control(input(0)) && data(input(1));
+                break;
+            case Node::Type::CONTROL_REGION:
+                valid = count >= 2 && control(input(1)) &&
+                    std::ranges::all_of(inputs(node).subspan(2), [&](std::uint32_t input) { return input == NO_NODE || control(input); });
+                break;
+            case Node::Type::CONTROL_PROJECT:
+                valid = count == 1 && input(0) != NO_NODE && type(input(0)) == Node::Type::CONTROL_IFELSE;
+                break;
+            case Node::Type::MEMORY_LOAD:
+                valid = count == 3 && control(input(0)) && data_from(1);
+                break;
+            case Node::Type::MEMORY_STORE:
+                valid = count == 4 && control(input(0)) && data_from(1);
+                break;
+            case Node::Type::MEMORY_CALL:
+                valid = control(input(0)) && call(1);
+                break;
+            case Node::Type::DATA_TERM:
+                valid = constants[node] != NO_CONSTANT && (count == 0 || (count == 1 && input(0) != NO_NODE && type(input(0)) == Node::Type::CONTROL_STOP));
+                break;
+            case Node::Type::DATA_PROJECT:
+                valid = count == 1 && input(0) != NO_NODE && type(input(0)) == Node::Type::CONTROL_START && value(node) >= 1;
+                break;
+            case Node::Type::DATA_PHI: {
+                // NOTE: one value for every way into the region, missing only where the region has no way in yet
+                if (count == 0 || input(0) == NO_NODE || type(input(0)) != Node::Type::CONTROL_REGION || inputs(input(0)).size() != count) {
+                    break;
+                }
+                valid = true;
+                for (std::size_t i=1; i<count; ++i) {
+                    valid = valid && (inputs(input(0))[i] == NO_NODE || data(input(i)));
+                }
+                break;
+            }
+            case Node::Type::DATA_CALL:
+                valid = call(0);
+                break;
+            case Node::Type::DATA_STRUCT:
+                valid = data_from(0);
+                break;
+            case Node::Type::DATA_LENGTH:
+            case Node::Type::DATA_FIELD:
+            case Node::Type::DATA_OP_NEG:
+            case Node::Type::DATA_OP_NOT:
+            case Node::Type::DATA_OP_CONVERT:
+                valid = count == 1 && data(input(0));
+                break;
+            case Node::Type::DATA_OP_BEGIN:
+            case Node::Type::DATA_OP_END:
+                break;
+            default:
+                valid = count == 2 && data_from(0);  // NOTE: binary operations
+                break;
+        }
+        if (!valid) {
+            corrupt();
+        }
+    }
+
+    std::optional<std::uint32_t> ImageView::find_export(std::string_view name) const {
+        if (auto it = export_index.find(name); it != export_index.end()) {
+            return it->second;
+        }
+        return std::nullopt;
+    }
+
+    Value::Signature ImageView::signature(std::uint32_t node) const {
+        assert(is_function(node));
+        const std::int32_t* entry = pool + constants[node];
+        Value::Signature result{{}, process_type(entry[entry[0]+1])};
+        for (std::int32_t i=0; i<entry[0]; ++i) {
+            result.params.push_back(process_type(entry[i+1]));
+        }
+        return result;
+    }
+
+    void write_image(const std::unordered_map<std::string_view, Node::Ptr>& exports, std::ostream& output) {
+        std::vector<std::pair<std::string_view, const Node*>> sorted;
+        for (auto& [name, node]: exports) {
+            sorted.emplace_back(name, node.get());
+        }
+        std::ranges::sort(sorted);  // NOTE: stable node numbering regardless of hash map order
+
+        ImageBuilder builder;
+        std::vector<ImageExport> export_table;
+        std::vector<char> names;
+        for (auto& [name, node]: sorted) {
+            export_table.push_back({static_cast<std::uint32_t>(names.size()), static_cast<std::uint32_t>(name.size()), builder.add_node(node)});
+            names.insert(names.end(), name.begin(), name.end());
+        }
+
+        std::vector<std::uint8_t> types;
+        std::vector<std::uint8_t> values;
+        std::vector<std::uint16_t> value_types;
+        std::vector<std::uint32_t> edge_begin;
+        std::vector<std::uint32_t> edges;
+        std::vector<std::uint32_t> constants;
+        std::vector<std::int32_t> pool;
+        for (const Node* node: builder.nodes) {
+            types.push_back(static_cast<std::uint8_t>(node->type));
+            values.push_back(node->type == Node::Type::DATA_TERM ? 0 : node->value);  // NOTE: lazy functions are built by now, store them as plain ones
+            value_types.push_back(builder.add_type(node->type == Node::Type::DATA_TERM ? result_type(*node) : node->value_type));
+            edge_begin.push_back(edges.size());
+            for (const Node::Ptr& child: node->inputs) {
+                edges.push_back(child ? builder.node_ids.at(child.get()) : ImageView::NO_NODE);
+            }
+            if (is_const(*node)) {
+                constants.push_back(pool.size());
+                std::uint64_t value = static_cast<std::uint64_t>(get_value_i64(*node));
+                pool.push_back(static_cast<std::int32_t>(value));
+                pool.push_back(static_cast<std::int32_t>(value >> 32));
+            } else if (is_function(*node)) {
+                constants.push_back(pool.size());
+                pool.push_back(get_signature(*node).params.size());
+                for (Value::Type param: get_signature(*node).params) {
+                    pool.push_back(builder.add_type(param));
+                }
+                pool.push_back(builder.add_type(get_signature(*node).result));
+            } else {
+                assert(node->type != Node::Type::DATA_TERM);
+                constants.push_back(ImageView::NO_CONSTANT);
+            }
+        }
+        edge_begin.push_back(edges.size());
+
+        std::vector<std::uint32_t> field_begin;
+        std::vector<ImageField> fields;
+        for (Value::Type type: builder.structs) {
+            field_begin.push_back(fields.size());
+            auto& layout = struct_layout(type);
+            for (std::size_t i=0; i<layout.names.size(); ++i) {
+                fields.push_back({static_cast<std::uint32_t>(names.size()), static_cast<std::uint32_t>(layout.names[i].size()), builder.add_type(layout.types[i])});
+                names.insert(names.end(), layout.names[i].begin(), layout.names[i].end());
+            }
+        }
+        field_begin.push_back(fields.size());
+
+        ImageHeader header{
+            ImageView::MAGIC, ImageView::VERSION,
+            static_cast<std::uint32_t>(types.size()), static_cast<std::uint32_t>(edges.size()),
+            static_cast<std::uint32_t>(pool.size()), static_cast<std::uint32_t>(export_table.size()),
+            static_cast<std::uint32_t>(builder.structs.size()), static_cast<std::uint32_t>(fields.size()),
+            static_cast<std::uint32_t>(names.size()),
+        };
+        output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        write_array(output, types);
+        write_array(output, values);
+        write_array(output, value_types);
+        write_array(output, edge_begin);
+        write_array(output, edges);
+        write_array(output, constants);
+        write_array(output, pool);
+        write_array(output, export_table);
+        write_array(output, field_begin);
+        write_array(output, fields);
+        write_array(output, names);
+    }
+
+    std::unordered_map<std::string_view, Node::Ptr> load_image(const ImageView& image) {
+        std::vector<Node::Ptr> nodes;
+        nodes.reserve(image.size());
+        for (std::uint32_t i=0; i<image.size(); ++i) {
+            if (image.is_const(i)) {
+                nodes.push_back(std::make_shared<ValueNode>(Node(image.type(i), image.value(i), {}), Value(image.get_value_i64(i), image.value_type(i))));
+            } else if (image.is_function(i)) {
+                nodes.push_back(std::make_shared<ValueNode>(Node(image.type(i), image.value(i), {}), Value(image.signature(i))));
+            } else {
+                nodes.push_back(std::make_shared<Node>(image.type(i), image.value(i), std::initializer_list<Node::Ptr>{}));
+                nodes.back()->value_type = image.value_type(i);
+            }
+        }
+        for (std::uint32_t i=0; i<image.size(); ++i) {
+            for (std::uint32_t input: image.inputs(i)) {
+                nodes.at(i)->inputs.push_back(input == ImageView::NO_NODE ? nullptr : nodes.at(input));
+            }
+        }
+        std::unordered_map<std::string_view, Node::Ptr> exports;
+        for (std::uint32_t i=0; i<image.export_count(); ++i) {
+            exports[image.export_name(i)] = nodes.at(image.export_node(i));
+        }
+        return exports;
+    }
+}
@@ -0,0 +1,319 @@
+#include <algorithm>
+
+#include "grlang/loop.h"
+
+
+namespace
+{
+    using namespace grlang::node;
+
+    std::uint32_t next_control(const Graph& graph, std::uint32_t control) {
+        for (std::uint32_t user: graph.outputs(control)) {
+            if (is_control(graph.node(user)) && graph.is_control_edge(control, user)) {
+                return user;
+            }
+        }
+        return Graph::NO_NODE;
+    }
+
+    std::uint32_t find_project(const Graph& graph, std::uint32_t ifelse, std::uint8_t value) {
+        for (std::uint32_t user: graph.outputs(ifelse)) {
+            if (graph.node(user).type == Node::Type::CONTROL_PROJECT && graph.node(user).value == value) {
+                return user;
+            }
+        }
+        return Graph::NO_NODE;
+    }
+
+    // NOTE: follows control from a project to the region it ends at, NO_NODE if it leaves any other way. Diamonds
+    // along the way are walked arm by arm
+    std::uint32_t walk_chain(const Graph& graph, std::uint32_t control, std::vector<std::uint32_t>& nodes) {
+        while (control != Graph::NO_NODE) {
+            const Node& node = graph.node(control);
+            if (node.type == Node::Type::CONTROL_REGION) {
+                return control;
+            }
+            nodes.push_back(control);
+            if (node.type == Node::Type::CONTROL_IFELSE) {
+                std::uint32_t first = find_project(graph, control, 0);
+                std::uint32_t second = find_project(graph, control, 1);
+                if (first == Graph::NO_NODE || second == Graph::NO_NODE) {
+                    return Graph::NO_NODE;
+                }
+                std::uint32_t merge = walk_chain(graph, first, nodes);
+                if (merge == Graph::NO_NODE || merge != walk_chain(graph, second, nodes) || graph.inputs(merge).size() != 3) {
+                    return Graph::NO_NODE;
+                }
+                nodes.push_back(merge);
+                control = merge;
+            } else if (node.type != Node::Type::CONTROL_PROJECT && !is_memory(node)) {
+                return Graph::NO_NODE;
+            }
+            control = next_control(graph, control);
+        }
+        return Graph::NO_NODE;
+    }
+
+    bool is_increment(const Graph& graph, std::uint32_t node, std::uint32_t counter) {
+        if (graph.node(node).type != Node::Type::DATA_OP_ADD || graph.node(node).value_type != Value::Type::INTEGER) {
+            return false;
+        }
+        auto inputs = graph.inputs(node);
+        auto is_one = [&](std::uint32_t input) { return is_const(graph.node(input)) && get_value_i64(graph.node(input)) == 1; };
+        return (inputs[0] == counter && is_one(inputs[1])) || (inputs[1] == counter && is_one(inputs[0]));
+    }
+
+    // NOTE: input of a merge region that comes through the first arm of its ifelse. Arms may hold diamonds of their
+    // own, merged holds the ifelse of those
+    std::size_t taken_input(const Graph& graph, std::uint32_t merge, std::uint32_t ifelse, const std::vector<std::uint32_t>& merged) {
+        std::uint32_t control = graph.inputs(merge)[1];
+        while (graph.node(control).type != Node::Type::CONTROL_PROJECT || graph.inputs(control)[0] != ifelse) {
+            control = graph.node(control).type == Node::Type::CONTROL_REGION ? merged[control] : graph.inputs(control)[0];
+        }
+        return graph.node(control).value == 0 ? 1 : 2;
+    }
+
+    // NOTE: loads of the same element with no store in between give the same value, each a[i] is a load of its own
+    bool same_value(const Graph& graph, const CountedLoop& loop, std::uint32_t a, std::uint32_t b) {
+        if (a == b) {
+            return true;
+        }
+        if (graph.node(a).type != Node::Type::MEMORY_LOAD || graph.node(b).type != Node::Type::MEMORY_LOAD) {
+            return false;
+        }
+        if (graph.inputs(a)[1] != graph.inputs(b)[1] || graph.inputs(a)[2] != graph.inputs(b)[2]) {
+            return false;
+        }
+        auto first = std::ranges::find(loop.nodes, a);
+        auto second = std::ranges::find(loop.nodes, b);
+        if (first == loop.nodes.end() || second == loop.nodes.end()) {
+            return false;
+        }
+        if (second < first) {
+            std::swap(first, second);
+        }
+        return std::none_of(first, second, [&](std::uint32_t control) { return graph.node(control).type == Node::Type::MEMORY_STORE; });
+    }
+
+    bool is_vector_op(const Node& node) {
+        switch (node.type) {
+            case Node::Type::DATA_OP_DIV:
+                return false;  // NOTE: both arms of a diamond run, a guarded division could trap
+            case Node::Type::DATA_OP_NEG:
+            case Node::Type::DATA_OP_NOT:
+            case Node::Type::DATA_OP_CONVERT:
+            case Node::Type::DATA_PHI:
+                return is_int_type(node.value_type);
+            default:
+                return is_binary_op(node) && is_int_type(node.value_type);
+        }
+    }
+}
+
+namespace grlang::node {
+    std::vector<CountedLoop> find_counted_loops(const Graph& graph) {
+        std::vector<CountedLoop> loops;
+        for (std::uint32_t region: graph.control_rpo()) {
+            if (graph.node(region).type != Node::Type::CONTROL_REGION || graph.inputs(region).size() != 3 || graph.is_back_edge(region, 1) || !graph.is_back_edge(region, 2)) {
+                continue;
+            }
+            CountedLoop loop;
+            loop.region = region;
+            loop.ifelse = next_control(graph, region);
+            if (loop.ifelse == Graph::NO_NODE || graph.node(loop.ifelse).type != Node::Type::CONTROL_IFELSE) {
+                continue;
+            }
+            loop.body = find_project(graph, loop.ifelse, 0);
+            loop.exit = find_project(graph, loop.ifelse, 1);
+            if (loop.body == Graph::NO_NODE || loop.exit == Graph::NO_NODE) {
+                continue;
+            }
+            if (walk_chain(graph, loop.body, loop.nodes) != region || loop.nodes.back() != graph.inputs(region)[loop.back]) {
+                continue;
+            }
+
+            std::uint32_t condition = graph.inputs(loop.ifelse)[1];
+            const Node& compare = graph.node(condition);
+            if (compare.value_type != Value::Type::INTEGER) {
+                continue;
+            }
+            if (compare.type == Node::Type::DATA_OP_LT) {
+                loop.counter = graph.inputs(condition)[0];
+                loop.limit = graph.inputs(condition)[1];
+            } else if (compare.type == Node::Type::DATA_OP_GT) {
+                loop.counter = graph.inputs(condition)[1];
+                loop.limit = graph.inputs(condition)[0];
+            } else {
+                continue;
+            }
+            const Node& counter = graph.node(loop.counter);
+            if (counter.type != Node::Type::DATA_PHI || graph.inputs(loop.counter)[0] != region || !is_increment(graph, graph.inputs(loop.counter)[loop.back], loop.counter)) {
+                continue;
+            }
+            if (loop_variant(graph, loop)[loop.limit]) {
+                continue;
+            }
+            loops.push_back(std::move(loop));
+        }
+        return loops;
+    }
+
+    std::vector<bool> loop_variant(const Graph& graph, const CountedLoop& loop) {
+        std::vector<bool> variant(graph.size());
+        std::vector<bool> inside(graph.size());
+        inside[loop.region] = inside[loop.ifelse] = true;
+        for (std::uint32_t control: loop.nodes) {
+            inside[control] = true;
+            variant[control] = is_memory(graph.node(control));  // NOTE: loads are values too
+        }
+        for (std::uint32_t id: graph.data_postorder()) {
+            auto inputs = graph.inputs(id);
+            if (graph.node(id).type == Node::Type::DATA_PHI) {
+                variant[id] = inside[inputs[0]];
+                continue;
+            }
+            variant[id] = std::ranges::any_of(inputs, [&](std::uint32_t input) { return input != Graph::NO_NODE && variant[input]; });
+        }
+        return variant;
+    }
+
+    std::optional<VectorLoop> match_vector_loop(const Graph& graph, const CountedLoop& loop) {
+        auto variant = loop_variant(graph, loop);
+        VectorLoop result;
+
+        // NOTE: variant data nodes the loop computes, other than the counter and its increment
+        std::vector<bool> used(graph.size());
+        std::vector<std::uint32_t> work;
+        auto use = [&](std::uint32_t node) {
+            if (variant[node] && is_data(graph.node(node)) && !used[node]) {
+                used[node] = true;
+                work.push_back(node);
+            }
+        };
+
+        std::vector<std::uint32_t> diamonds;  // NOTE: ifelse nodes of the diamonds being walked
+        std::vector<std::uint32_t> merged(graph.size(), Graph::NO_NODE);  // NOTE: ifelse of a merge region
+        for (std::uint32_t control: loop.nodes) {
+            const Node& node = graph.node(control);
+            auto inputs = graph.inputs(control);
+            switch (node.type) {
+                case Node::Type::CONTROL_PROJECT:
+                    break;
+                case Node::Type::CONTROL_IFELSE:
+                    diamonds.push_back(control);
+                    use(inputs[1]);
+                    break;
+                case Node::Type::CONTROL_REGION:
+                    merged[control] = diamonds.back();
+                    diamonds.pop_back();
+                    result.selects.push_back({control, merged[control], taken_input(graph, control, merged[control], merged)});
+                    break;
+                case Node::Type::MEMORY_STORE:
+                    if (!diamonds.empty()) {
+                        return std::nullopt;
+                    }
+                    use(inputs[3]);
+                    [[fallthrough]];
+                case Node::Type::MEMORY_LOAD:
+                    if (inputs[2] != loop.counter || variant[inputs[1]]) {
+                        return std::nullopt;
+                    }
+                    if (std::ranges::find(result.arrays, inputs[1]) == result.arrays.end()) {
+                        result.arrays.push_back(inputs[1]);
+                    }
+                    break;
+                default:
+                    return std::nullopt;
+            }
+        }
+
+        std::vector<std::uint32_t> phis;
+        for (std::uint32_t phi: graph.outputs(loop.region)) {
+            if (graph.node(phi).type == Node::Type::DATA_PHI && phi != loop.counter && std::ranges::find(phis, phi) == phis.end()) {
+                phis.push_back(phi);
+                use(graph.inputs(phi)[loop.back]);
+            }
+        }
+        while (!work.empty()) {
+            std::uint32_t node = work.back();
+            work.pop_back();
+            if (node == loop.counter) {
+                continue;
+            }
+            if (!is_vector_op(graph.node(node))) {
+                return std::nullopt;
+            }
+            auto inputs = graph.inputs(node);
+            if (graph.node(node).type == Node::Type::DATA_PHI) {
+                if (inputs[0] == loop.region) {
+                    continue;
+                }
+                inputs = inputs.subspan(1);
+            }
+            for (std::uint32_t input: inputs) {
+                use(input);
+            }
+        }
+
+        for (std::uint32_t phi: phis) {
+            if (!is_int_type(graph.node(phi).value_type)) {
+                return std::nullopt;
+            }
+            std::uint32_t back = graph.inputs(phi)[loop.back];
+            const Node& node = graph.node(back);
+            auto inputs = graph.inputs(back);
+            std::optional<Reduction> reduction;
+            std::vector<std::uint32_t> allowed{back};  // NOTE: nodes that may use the phi
+            if (is_binary_op(node) && (inputs[0] == phi) != (inputs[1] == phi)) {
+                switch (node.type) {
+                    case Node::Type::DATA_OP_ADD: reduction = Reduction::ADD; break;
+                    case Node::Type::DATA_OP_MUL: reduction = Reduction::MUL; break;
+                    case Node::Type::DATA_OP_AND: reduction = Reduction::AND; break;
+                    default: break;
+                }
+            } else if (node.type == Node::Type::DATA_PHI && merged[inputs[0]] != Graph::NO_NODE && (inputs[1] == phi) != (inputs[2] == phi)) {
+                std::uint32_t ifelse = merged[inputs[0]];
+                std::uint32_t condition = graph.inputs(ifelse)[1];
+                auto operands = graph.inputs(condition);
+                std::uint32_t taken = inputs[taken_input(graph, inputs[0], ifelse, merged)];  // NOTE: kept when the condition holds
+                std::uint32_t other = inputs[1] == taken ? inputs[2] : inputs[1];
+                Node::Type compare = graph.node(condition).type;
+                bool less = compare == Node::Type::DATA_OP_LT || compare == Node::Type::DATA_OP_LEQ;
+                bool greater = compare == Node::Type::DATA_OP_GT || compare == Node::Type::DATA_OP_GEQ;
+                auto same = [&](std::uint32_t a, std::uint32_t b) { return same_value(graph, loop, a, b); };
+                bool compares = operands.size() == 2 && ((same(operands[0], taken) && same(operands[1], other)) || (same(operands[0], other) && same(operands[1], taken)));
+                if ((less || greater) && compares) {
+                    reduction = less == same(operands[0], taken) ? Reduction::MIN : Reduction::MAX;
+                    allowed.push_back(condition);
+                }
+            }
+            if (!reduction) {
+                return std::nullopt;
+            }
+
+            // NOTE: each lane keeps a partial result, nothing else in the loop may see it
+            std::vector<bool> depends(graph.size());
+            depends[phi] = true;
+            for (std::uint32_t id: graph.data_postorder()) {
+                if (id == phi || !used[id]) {
+                    continue;
+                }
+                bool loop_phi = graph.node(id).type == Node::Type::DATA_PHI && graph.inputs(id)[0] == loop.region;
+                depends[id] = !loop_phi && std::ranges::any_of(graph.inputs(id), [&](std::uint32_t input) { return input != Graph::NO_NODE && depends[input]; });
+                if (depends[id] && std::ranges::find(allowed, id) == allowed.end()) {
+                    return std::nullopt;
+                }
+            }
+            for (std::uint32_t control: loop.nodes) {
+                auto inputs = graph.inputs(control);
+                bool stores = graph.node(control).type == Node::Type::MEMORY_STORE && depends[inputs[3]];
+                bool branches = graph.node(control).type == Node::Type::CONTROL_IFELSE && depends[inputs[1]] && std::ranges::find(allowed, inputs[1]) == allowed.end();
+                if (stores || branches) {
+                    return std::nullopt;
+                }
+            }
+            result.reductions.emplace_back(phi, *reduction);
+        }
+        return result;
+    }
+}
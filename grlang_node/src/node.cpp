@@ -1,8 +1,13 @@
 #include <cassert>
 #include <stdexcept>
-#include <map>
+#include <unordered_map>
+#include <span>
+#include <deque>
+#include <algorithm>
+#include <mutex>
 
 #include "grlang/node.h"
+#include "grlang/graph.h"
 
 
 namespace
@@ -17,13 +22,21 @@ namespace
             case Node::Type::CONTROL_REGION: return "REGION";
             case Node::Type::CONTROL_IFELSE: return "IFELSE";
             case Node::Type::CONTROL_PROJECT: return "PROJECT";
+            case Node::Type::MEMORY_NEW: return "NEW";
+            case Node::Type::MEMORY_LOAD: return "LOAD";
+            case Node::Type::MEMORY_STORE: return "STORE";
+            case Node::Type::MEMORY_CALL: return "CALL";
             case Node::Type::CONTROL_DEAD: return "DEAD";
             case Node::Type::DATA_TERM: return "TERM";
             case Node::Type::DATA_PROJECT: return "PROJECT";
             case Node::Type::DATA_PHI: return "PHI";
             case Node::Type::DATA_CALL: return "CALL";
+            case Node::Type::DATA_LENGTH: return "LENGTH";
+            case Node::Type::DATA_STRUCT: return "STRUCT";
+            case Node::Type::DATA_FIELD: return "FIELD";
             case Node::Type::DATA_OP_NEG: return "OP_NEG";
             case Node::Type::DATA_OP_NOT: return "OP_NOT";
+            case Node::Type::DATA_OP_CONVERT: return "OP_CONVERT";
             case Node::Type::DATA_OP_BEGIN: return "OP_BEGIN";
             case Node::Type::DATA_OP_ADD: return "OP_ADD";
             case Node::Type::DATA_OP_SUB: return "OP_SUB";
@@ -35,6 +48,9 @@ namespace
             case Node::Type::DATA_OP_GEQ: return "OP_GEQ";
             case Node::Type::DATA_OP_EQ: return "OP_EQ";
             case Node::Type::DATA_OP_NEQ: return "OP_NEQ";
+            case Node::Type::DATA_OP_SHL: return "OP_SHL";
+            case Node::Type::DATA_OP_SHR: return "OP_SHR";
+            case Node::Type::DATA_OP_AND: return "OP_AND";
             case Node::Type::DATA_OP_END: return "OP_END";
             default: return "FIXME";
         }
@@ -50,13 +66,22 @@ namespace
             case Node::Type::CONTROL_PROJECT:
             case Node::Type::CONTROL_DEAD:
                 return "box";
+            case Node::Type::MEMORY_NEW:
+            case Node::Type::MEMORY_LOAD:
+            case Node::Type::MEMORY_STORE:
+            case Node::Type::MEMORY_CALL:
+                return "box3d";
             case Node::Type::DATA_PHI:
                 return "hexagon";
             case Node::Type::DATA_TERM:
             case Node::Type::DATA_PROJECT:
             case Node::Type::DATA_CALL:
+            case Node::Type::DATA_LENGTH:
+            case Node::Type::DATA_STRUCT:
+            case Node::Type::DATA_FIELD:
             case Node::Type::DATA_OP_NEG:
             case Node::Type::DATA_OP_NOT:
+            case Node::Type::DATA_OP_CONVERT:
             case Node::Type::DATA_OP_BEGIN:
             case Node::Type::DATA_OP_ADD:
             case Node::Type::DATA_OP_SUB:
@@ -68,6 +93,9 @@ namespace
             case Node::Type::DATA_OP_GEQ:
             case Node::Type::DATA_OP_EQ:
             case Node::Type::DATA_OP_NEQ:
+            case Node::Type::DATA_OP_SHL:
+            case Node::Type::DATA_OP_SHR:
+            case Node::Type::DATA_OP_AND:
             case Node::Type::DATA_OP_END:
                 return "ellipse";
             default:
@@ -75,63 +103,180 @@ namespace
         }
     }
 
-    void print_dot_helper(const Node::Ptr& root, std::ostream& output, std::map<const Node*, std::size_t>& node_ids) {
-        assert(!node_ids.contains(root.get()));
+    struct GraphHasher {
+        std::uint64_t hash = 0xcbf29ce484222325ull;
 
-        std::size_t root_id = node_ids[root.get()] = node_ids.size();
-        output << "  " << root_id << " [label=\""<< get_node_label(root->type) << "\" shape=\""<< get_node_shape(root->type) << "\"]\n";
-        for (const Node::Ptr& child: root->inputs) {
-            if (!child) {
-                continue;
+        void add(std::uint64_t value) {
+            for (int i=0; i<8; ++i) {
+                hash = (hash ^ ((value >> (i*8)) & 0xFF)) * 0x100000001b3ull;  // NOTE: FNV-1a
             }
-            if (!node_ids.contains(child.get())) {
-                print_dot_helper(child, output, node_ids);
+        }
+
+        // NOTE: struct types by their layout, the number a layout gets depends on the order it was first made in
+        void add_type(Value::Type type) {
+            if (!is_struct_type(type)) {
+                add(static_cast<std::uint64_t>(type));
+                return;
+            }
+            auto& layout = struct_layout(type);
+            add(static_cast<std::uint64_t>(Value::Type::STRUCT));
+            add(layout.types.size());
+            for (std::size_t i=0; i<layout.types.size(); ++i) {
+                for (char c: layout.names[i]) {
+                    add(static_cast<std::uint8_t>(c));
+                }
+                add(0xFF);
+                add_type(layout.types[i]);
             }
-            int child_id = node_ids.at(child.get());
-            output << "  " << root_id << "->" << child_id << "\n";
         }
-    }
+
+        void add_node(const Node& node) {
+            add(static_cast<std::uint64_t>(node.type));
+            add(node.type == Node::Type::DATA_TERM ? 0 : node.value);  // NOTE: so lazy functions hash like eagerly built ones
+            add_type(node.type == Node::Type::DATA_TERM ? result_type(node) : node.value_type);
+            add(is_const(node) ? static_cast<std::uint64_t>(static_cast<const ValueNode&>(node).value.integer) : 0);
+            if (is_function(node)) {
+                add(get_signature(node).params.size());
+                for (Value::Type param: get_signature(node).params) {
+                    add_type(param);
+                }
+                add_type(get_signature(node).result);
+            }
+        }
+
+        void add_inputs(std::span<const std::uint32_t> inputs) {
+            add(inputs.size());
+            for (std::uint32_t input: inputs) {
+                add(input);  // NOTE: Graph::NO_NODE for a missing input
+            }
+        }
+    };
 }
 
 namespace grlang::node {
+    namespace {
+        // NOTE: layouts are never dropped, a deque keeps them in place as more are made
+        std::mutex struct_types_mutex;
+        std::deque<StructLayout> struct_types;
+    }
+
+    Value::Type struct_type(StructLayout layout) {
+        assert(layout.names.size() == layout.types.size());
+        std::lock_guard lock(struct_types_mutex);
+        auto it = std::ranges::find(struct_types, layout);
+        if (it == struct_types.end()) {
+            if (struct_types.size() > std::numeric_limits<std::uint16_t>::max() - static_cast<std::size_t>(Value::Type::STRUCT)) {
+                throw std::runtime_error("too many struct types");
+            }
+            it = struct_types.insert(struct_types.end(), std::move(layout));
+        }
+        return static_cast<Value::Type>(static_cast<std::size_t>(Value::Type::STRUCT) + (it - struct_types.begin()));
+    }
+
+    const StructLayout& struct_layout(Value::Type type) {
+        assert(is_struct_type(type));
+        std::lock_guard lock(struct_types_mutex);
+        return struct_types.at(static_cast<std::size_t>(type) - static_cast<std::size_t>(Value::Type::STRUCT));
+    }
+
     int get_value_int(const Node& node) {
         assert(is_const(node));
         assert(static_cast<const ValueNode&>(node).value.type == Value::Type::INTEGER);
+        return static_cast<int>(static_cast<const ValueNode&>(node).value.integer);
+    }
+
+    std::int64_t get_value_i64(const Node& node) {
+        assert(is_const(node));
         return static_cast<const ValueNode&>(node).value.integer;
     }
 
-    int (*op_func(grlang::node::Node::Type type))(int, int) {
-        switch (type) {
-            case grlang::node::Node::Type::DATA_OP_MUL:
-                return [](int a, int b)->int { return a*b; };
-            case grlang::node::Node::Type::DATA_OP_DIV:
-                return [](int a, int b)->int { return a/b; };
-            case grlang::node::Node::Type::DATA_OP_ADD:
-                return [](int a, int b)->int { return a+b; };
-            case grlang::node::Node::Type::DATA_OP_SUB:
-                return [](int a, int b)->int { return a-b; };
-            case grlang::node::Node::Type::DATA_OP_GT:
-                return [](int a, int b)->int { return a>b ? 1 : 0; };
-            case grlang::node::Node::Type::DATA_OP_GEQ:
-                return [](int a, int b)->int { return a>=b ? 1 : 0; };
-            case grlang::node::Node::Type::DATA_OP_LT:
-                return [](int a, int b)->int { return a<b ? 1 : 0; };
-            case grlang::node::Node::Type::DATA_OP_LEQ:
-                return [](int a, int b)->int { return a<=b ? 1 : 0; };
-            case grlang::node::Node::Type::DATA_OP_EQ:
-                return [](int a, int b)->int { return a==b ? 1 : 0; };
-            case grlang::node::Node::Type::DATA_OP_NEQ:
-                return [](int a, int b)->int { return a!=b ? 1 : 0; };
-            default:
-                throw std::runtime_error("bad op");
+    const Value::Signature& get_signature(const Node& node) {
+        assert(is_function(node));
+        return *static_cast<const ValueNode&>(node).value.signature;
+    }
+
+    void ensure_built(const Node& node) {
+        if (node.type != Node::Type::DATA_TERM || node.value != LAZY_FUNCTION) {
+            return;
         }
+        auto& function = static_cast<const LazyFunctionNode&>(node);
+        std::call_once(function.built, [&]() {
+            function.build();
+            function.build = nullptr;  // NOTE: releases whatever the body was built from
+        });
     }
 
     void print_dot(const Node::Ptr& root, std::ostream& output) {
-        std::map<const Node*, std::size_t> nodes;
+        ensure_built(*root);
+        Graph graph(*root);
         output << "digraph {\n";
         output << "  rankdir=\"BT\"\n";
-        print_dot_helper(root, output, nodes);
+        for (std::uint32_t id=0; id<graph.size(); ++id) {
+            output << "  " << id << " [label=\""<< get_node_label(graph.node(id).type) << "\" shape=\""<< get_node_shape(graph.node(id).type) << "\"]\n";
+            for (std::uint32_t input: graph.inputs(id)) {
+                if (input != Graph::NO_NODE) {
+                    output << "  " << id << "->" << input << "\n";
+                }
+            }
+        }
         output << "}" << std::endl;
     }
+
+    std::uint64_t hash_graph(const Node& root, std::vector<const Node*>* callees) {
+        GraphHasher hasher;
+        auto add_callee = [&](const Node& node) {
+            if (callees) {
+                callees->push_back(&node);
+            }
+        };
+        ensure_built(root);
+        if (is_function(root) && !root.inputs.at(0)->inputs.empty()) {
+            Graph graph(root);
+            for (std::uint32_t id=0; id<graph.size(); ++id) {
+                hasher.add_node(graph.node(id));
+                hasher.add_inputs(graph.inputs(id));
+                if (id != graph.function() && is_function(graph.node(id))) {
+                    add_callee(graph.node(id));
+                }
+            }
+            return hasher.hash;
+        }
+
+        // NOTE: values and functions without returns have no start to build a Graph from, numbered the same way here
+        std::unordered_map<const Node*, std::uint32_t> ids;
+        std::vector<const Node*> nodes;
+        std::vector<std::pair<const Node*, std::size_t>> stack;
+        auto visit = [&](const Node* node) {
+            ids.emplace(node, nodes.size());
+            nodes.push_back(node);
+            stack.emplace_back(node, 0);
+        };
+        visit(&root);
+        while (!stack.empty()) {
+            auto& [node, next] = stack.back();
+            bool leaf = is_function(*node) && node != &root;
+            if (leaf || next == node->inputs.size()) {
+                stack.pop_back();
+                continue;
+            }
+            const Node* child = node->inputs[next++].get();
+            if (child && !ids.contains(child)) {
+                visit(child);
+            }
+        }
+        std::vector<std::uint32_t> inputs;
+        for (const Node* node: nodes) {
+            inputs.clear();
+            if (is_function(*node) && node != &root) {
+                add_callee(*node);
+            } else {
+                for (const Node::Ptr& child: node->inputs) {
+                    inputs.push_back(child ? ids.at(child.get()) : Graph::NO_NODE);
+                }
+            }
+            hasher.add_node(*node);
+            hasher.add_inputs(inputs);
+        }
+        return hasher.hash;
+    }
 }
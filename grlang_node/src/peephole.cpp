@@ -0,0 +1,361 @@
+#include <bit>
+#include <array>
+#include <iterator>
+#include <stdexcept>
+
+#include "grlang/peephole.h"
+
+
+namespace
+{
+    using namespace grlang::node;
+
+    Node::Ptr make_node(Node::Type type, std::initializer_list<Node::Ptr> inputs, Value::Type width = Value::Type::INTEGER) {
+        auto node = std::make_shared<Node>(type, std::uint8_t(0), inputs);
+        node->value_type = width;
+        return node;
+    }
+
+    Node::Ptr make_value_node(std::int64_t value, Value::Type type) {
+        return std::make_shared<ValueNode>(Node(Node::Type::DATA_TERM, 0, {}), Value(normalize(type, value), type));
+    }
+
+    bool is_commutative(Node::Type type) {
+        switch (type) {
+            case Node::Type::DATA_OP_ADD:
+            case Node::Type::DATA_OP_MUL:
+            case Node::Type::DATA_OP_EQ:
+            case Node::Type::DATA_OP_NEQ:
+            case Node::Type::DATA_OP_AND:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // NOTE: comparison that gives the same result with its operands swapped
+    Node::Type mirror(Node::Type type) {
+        switch (type) {
+            case Node::Type::DATA_OP_LT: return Node::Type::DATA_OP_GT;
+            case Node::Type::DATA_OP_LEQ: return Node::Type::DATA_OP_GEQ;
+            case Node::Type::DATA_OP_GT: return Node::Type::DATA_OP_LT;
+            case Node::Type::DATA_OP_GEQ: return Node::Type::DATA_OP_LEQ;
+            default: return type;
+        }
+    }
+
+    // NOTE: comparison that gives the opposite result, or DATA_OP_END for other nodes
+    Node::Type negate(Node::Type type) {
+        switch (type) {
+            case Node::Type::DATA_OP_LT: return Node::Type::DATA_OP_GEQ;
+            case Node::Type::DATA_OP_LEQ: return Node::Type::DATA_OP_GT;
+            case Node::Type::DATA_OP_GT: return Node::Type::DATA_OP_LEQ;
+            case Node::Type::DATA_OP_GEQ: return Node::Type::DATA_OP_LT;
+            case Node::Type::DATA_OP_EQ: return Node::Type::DATA_OP_NEQ;
+            case Node::Type::DATA_OP_NEQ: return Node::Type::DATA_OP_EQ;
+            default: return Node::Type::DATA_OP_END;
+        }
+    }
+
+    // NOTE: from the node alone, peepholes run while the graph is still being built so range analysis is not an option
+    bool is_nonnegative(const Node& node) {
+        if (is_const(node)) {
+            return get_value_i64(node) >= 0;
+        }
+        if (is_unsigned_type(result_type(node))) {
+            return true;
+        }
+        switch (node.type) {
+            case Node::Type::DATA_OP_NOT:
+            case Node::Type::DATA_OP_LT:
+            case Node::Type::DATA_OP_LEQ:
+            case Node::Type::DATA_OP_GT:
+            case Node::Type::DATA_OP_GEQ:
+            case Node::Type::DATA_OP_EQ:
+            case Node::Type::DATA_OP_NEQ:
+                return true;
+            case Node::Type::DATA_OP_AND:
+                return is_nonnegative(*node.inputs.at(0)) || is_nonnegative(*node.inputs.at(1));
+            case Node::Type::DATA_OP_SHR:
+                return is_nonnegative(*node.inputs.at(0));
+            default:
+                return false;
+        }
+    }
+
+    enum class Match : std::uint8_t {
+        ANY,
+        SAME,  // NOTE: right operand only, the very node on the left
+        CONST,
+        ZERO,
+        ONE,
+        MINUS_ONE,  // NOTE: signed types only, all ones divides unsigned ones differently
+        POWER_OF_TWO,  // NOTE: 2^k for 0 < k < 63
+        NONNEGATIVE,
+        SAME_OP_CONST,  // NOTE: left operand only, the same operation with a constant on the right
+    };
+
+    enum class Rewrite : std::uint8_t {
+        LEFT,
+        ZERO,
+        ONE,
+        NEG_LEFT,
+        NEG_RIGHT,
+        ADD_NEGATED,  // NOTE: x - c is x + -c, so constants only ever get added
+        SHIFT_LEFT,
+        SHIFT_RIGHT,
+        REASSOCIATE,  // NOTE: (x op c1) op c2 is x op (c1 op c2)
+    };
+
+    struct Rule {
+        Node::Type type;
+        Match left;
+        Match right;
+        Rewrite rewrite;
+        const char* name;  // NOTE: for stats
+    };
+
+    // NOTE: operands are canonical by the time rules run, constants on the right. The first matching rule wins,
+    // rules of one operation have to be adjacent
+    constexpr Rule RULES[] = {
+        {Node::Type::DATA_OP_ADD, Match::ANY, Match::ZERO, Rewrite::LEFT, "add_zero"},
+        {Node::Type::DATA_OP_ADD, Match::SAME_OP_CONST, Match::CONST, Rewrite::REASSOCIATE, "add_reassociate"},
+
+        {Node::Type::DATA_OP_SUB, Match::ANY, Match::SAME, Rewrite::ZERO, "sub_same"},
+        {Node::Type::DATA_OP_SUB, Match::ANY, Match::ZERO, Rewrite::LEFT, "sub_zero"},
+        {Node::Type::DATA_OP_SUB, Match::ZERO, Match::ANY, Rewrite::NEG_RIGHT, "zero_sub"},
+        {Node::Type::DATA_OP_SUB, Match::ANY, Match::CONST, Rewrite::ADD_NEGATED, "sub_const"},
+
+        {Node::Type::DATA_OP_MUL, Match::ANY, Match::ZERO, Rewrite::ZERO, "mul_zero"},
+        {Node::Type::DATA_OP_MUL, Match::ANY, Match::ONE, Rewrite::LEFT, "mul_one"},
+        {Node::Type::DATA_OP_MUL, Match::ANY, Match::MINUS_ONE, Rewrite::NEG_LEFT, "mul_minus_one"},
+        {Node::Type::DATA_OP_MUL, Match::SAME_OP_CONST, Match::CONST, Rewrite::REASSOCIATE, "mul_reassociate"},
+        {Node::Type::DATA_OP_MUL, Match::ANY, Match::POWER_OF_TWO, Rewrite::SHIFT_LEFT, "mul_power_of_two"},
+
+        {Node::Type::DATA_OP_DIV, Match::ANY, Match::ONE, Rewrite::LEFT, "div_one"},
+        {Node::Type::DATA_OP_DIV, Match::ANY, Match::MINUS_ONE, Rewrite::NEG_LEFT, "div_minus_one"},
+        {Node::Type::DATA_OP_DIV, Match::NONNEGATIVE, Match::POWER_OF_TWO, Rewrite::SHIFT_RIGHT, "div_power_of_two"},  // NOTE: division rounds negatives up
+
+        {Node::Type::DATA_OP_LT, Match::ANY, Match::SAME, Rewrite::ZERO, "lt_same"},
+        {Node::Type::DATA_OP_LEQ, Match::ANY, Match::SAME, Rewrite::ONE, "leq_same"},
+        {Node::Type::DATA_OP_GT, Match::ANY, Match::SAME, Rewrite::ZERO, "gt_same"},
+        {Node::Type::DATA_OP_GEQ, Match::ANY, Match::SAME, Rewrite::ONE, "geq_same"},
+        {Node::Type::DATA_OP_EQ, Match::ANY, Match::SAME, Rewrite::ONE, "eq_same"},
+        {Node::Type::DATA_OP_NEQ, Match::ANY, Match::SAME, Rewrite::ZERO, "neq_same"},
+
+        {Node::Type::DATA_OP_SHL, Match::ANY, Match::ZERO, Rewrite::LEFT, "shl_zero"},
+        {Node::Type::DATA_OP_SHR, Match::ANY, Match::ZERO, Rewrite::LEFT, "shr_zero"},
+
+        {Node::Type::DATA_OP_AND, Match::ANY, Match::ZERO, Rewrite::ZERO, "and_zero"},
+        {Node::Type::DATA_OP_AND, Match::ANY, Match::MINUS_ONE, Rewrite::LEFT, "and_minus_one"},
+        {Node::Type::DATA_OP_AND, Match::ANY, Match::SAME, Rewrite::LEFT, "and_same"},
+        {Node::Type::DATA_OP_AND, Match::SAME_OP_CONST, Match::CONST, Rewrite::REASSOCIATE, "and_reassociate"},
+    };
+
+    struct RuleRange {
+        std::size_t begin = 0;
+        std::size_t end = 0;
+    };
+
+    // NOTE: rules of each operation, so matching a node only looks at the rules that can apply
+    constexpr auto RULES_BY_TYPE = []() {
+        std::array<RuleRange, static_cast<std::size_t>(Node::Type::DATA_OP_END)> ranges{};
+        for (std::size_t i=0; i<std::size(RULES); ++i) {
+            auto& range = ranges[static_cast<std::size_t>(RULES[i].type)];
+            if (range.end == 0) {
+                range.begin = i;
+            } else if (range.end != i) {
+                throw std::logic_error("rules of one operation have to be adjacent");
+            }
+            range.end = i+1;
+        }
+        return ranges;
+    }();
+
+    bool matches(Match match, const Node::Ptr& operand, const Node::Ptr& node) {
+        switch (match) {
+            case Match::ANY:
+                return true;
+            case Match::SAME:
+                return operand == node->inputs.at(0);
+            case Match::CONST:
+                return is_const(*operand);
+            case Match::ZERO:
+                return is_const(*operand) && get_value_i64(*operand) == 0;
+            case Match::ONE:
+                return is_const(*operand) && get_value_i64(*operand) == 1;
+            case Match::MINUS_ONE:
+                return is_const(*operand) && !is_unsigned_type(node->value_type) && get_value_i64(*operand) == -1;
+            case Match::POWER_OF_TWO:
+                return is_const(*operand) && get_value_i64(*operand) > 1 && std::has_single_bit(static_cast<std::uint64_t>(get_value_i64(*operand)));
+            case Match::NONNEGATIVE:
+                return is_nonnegative(*operand);
+            case Match::SAME_OP_CONST:
+                return operand->type == node->type && operand->value_type == node->value_type && is_const(*operand->inputs.at(1));
+        }
+        return false;
+    }
+
+    Node::Ptr rewrite(Rewrite rewrite, const Node::Ptr& node) {
+        const Node::Ptr& left = node->inputs.at(0);
+        const Node::Ptr& right = node->inputs.at(1);
+        const auto width = node->value_type;
+        switch (rewrite) {
+            case Rewrite::LEFT:
+                return left;
+            case Rewrite::ZERO:
+                return make_value_node(0, result_type(*node));
+            case Rewrite::ONE:
+                return make_value_node(1, result_type(*node));
+            case Rewrite::NEG_LEFT:
+                return peephole(make_node(Node::Type::DATA_OP_NEG, {left}, width));
+            case Rewrite::NEG_RIGHT:
+                return peephole(make_node(Node::Type::DATA_OP_NEG, {right}, width));
+            case Rewrite::ADD_NEGATED:
+                return peephole(make_node(Node::Type::DATA_OP_ADD, {left, make_value_node(apply_sized_op(Node::Type::DATA_OP_NEG, width, get_value_i64(*right)), width)}, width));
+            case Rewrite::SHIFT_LEFT:
+                return make_node(Node::Type::DATA_OP_SHL, {left, make_value_node(std::countr_zero(static_cast<std::uint64_t>(get_value_i64(*right))), width)}, width);
+            case Rewrite::SHIFT_RIGHT:
+                return make_node(Node::Type::DATA_OP_SHR, {left, make_value_node(std::countr_zero(static_cast<std::uint64_t>(get_value_i64(*right))), width)}, width);
+            case Rewrite::REASSOCIATE:
+                return peephole(make_node(node->type, {left->inputs.at(0), make_value_node(apply_sized_op(node->type, width, get_value_i64(*left->inputs.at(1)), get_value_i64(*right)), width)}, width));
+        }
+        return node;
+    }
+
+    Node::Ptr peephole_binary(Node::Ptr node) {
+        Node::Ptr& left = node->inputs.at(0);
+        Node::Ptr& right = node->inputs.at(1);
+        if (is_const(*left) && is_const(*right)) {
+            if (can_fold_sized(node->type, node->value_type, get_value_i64(*left), get_value_i64(*right))) {
+                count_rewrite("fold_binary");
+                return make_value_node(apply_sized_op(node->type, node->value_type, get_value_i64(*left), get_value_i64(*right)), result_type(*node));
+            }
+            return node;
+        }
+        if (is_const(*left) && (is_commutative(node->type) || mirror(node->type) != node->type)) {
+            std::swap(left, right);
+            node->type = mirror(node->type);
+        }
+        auto [begin, end] = RULES_BY_TYPE[static_cast<std::size_t>(node->type)];
+        for (std::size_t i=begin; i<end; ++i) {
+            if (matches(RULES[i].left, left, node) && matches(RULES[i].right, right, node)) {
+                count_rewrite(RULES[i].name);
+                return rewrite(RULES[i].rewrite, node);
+            }
+        }
+        return node;
+    }
+}
+
+namespace grlang::node {
+    Node::Ptr peephole(Node::Ptr node) {
+        PhaseTimer timer(Phase::PEEPHOLE);
+        if (is_binary_op(*node)) {
+            return peephole_binary(std::move(node));
+        }
+        switch (node->type) {
+            case Node::Type::DATA_OP_NEG:
+                if (is_const(*node->inputs.at(0))) {
+                    count_rewrite("fold_neg");
+                    return make_value_node(apply_sized_op(Node::Type::DATA_OP_NEG, node->value_type, get_value_i64(*node->inputs.at(0))), node->value_type);
+                }
+                if (node->inputs.at(0)->type == Node::Type::DATA_OP_NEG) {
+                    count_rewrite("neg_neg");
+                    return node->inputs.at(0)->inputs.at(0);
+                }
+                break;
+            case Node::Type::DATA_OP_NOT:
+                if (is_const(*node->inputs.at(0))) {
+                    count_rewrite("fold_not");
+                    return make_value_node(get_value_i64(*node->inputs.at(0)) == 0 ? 1 : 0, Value::Type::INTEGER);
+                }
+                if (auto inverse = negate(node->inputs.at(0)->type); inverse != Node::Type::DATA_OP_END) {
+                    count_rewrite("not_compare");
+                    return peephole(make_node(inverse, {node->inputs.at(0)->inputs.at(0), node->inputs.at(0)->inputs.at(1)}, node->inputs.at(0)->value_type));
+                }
+                break;
+            case Node::Type::DATA_OP_CONVERT:
+                if (is_const(*node->inputs.at(0))) {
+                    count_rewrite("fold_convert");
+                    return make_value_node(get_value_i64(*node->inputs.at(0)), node->value_type);
+                }
+                if (result_type(*node->inputs.at(0)) == node->value_type) {
+                    count_rewrite("convert_same");
+                    return node->inputs.at(0);
+                }
+                break;
+            case Node::Type::DATA_CALL:
+                if (is_function(*node->inputs.at(0))) {
+                    node->value = DIRECT_CALL;
+                }
+                break;
+            case Node::Type::MEMORY_CALL:
+                if (is_function(*node->inputs.at(1))) {
+                    node->value = DIRECT_CALL;
+                }
+                break;
+            case Node::Type::DATA_LENGTH:
+                if (node->inputs.at(0)->type == Node::Type::MEMORY_NEW) {
+                    count_rewrite("length_new");
+                    return node->inputs.at(0)->inputs.at(1);
+                }
+                break;
+            case Node::Type::DATA_FIELD:
+                if (node->inputs.at(0)->type == Node::Type::DATA_STRUCT) {
+                    count_rewrite("field_struct");
+                    return node->inputs.at(0)->inputs.at(node->value);
+                }
+                break;
+            case Node::Type::DATA_STRUCT: {
+                // NOTE: every field taken in order from one struct of the same type, that struct again
+                const Node::Ptr& source = node->inputs.at(0)->type == Node::Type::DATA_FIELD ? node->inputs.at(0)->inputs.at(0) : node->inputs.at(0);
+                bool copy = result_type(*source) == node->value_type;
+                for (std::size_t i=0; i<node->inputs.size() && copy; ++i) {
+                    const Node& field = *node->inputs[i];
+                    copy = field.type == Node::Type::DATA_FIELD && field.value == i && field.inputs.at(0) == source;
+                }
+                if (copy) {
+                    count_rewrite("struct_copy");
+                    return source;
+                }
+                break;
+            }
+            case Node::Type::DATA_PHI:
+                if (node->inputs.at(0)->inputs.at(1)->type == Node::Type::CONTROL_DEAD) {
+                    count_rewrite("phi_dead");
+                    count(Counter::PHIS_REMOVED);
+                    return node->inputs.at(2);
+                }
+                if (node->inputs.at(0)->inputs.at(2)->type == Node::Type::CONTROL_DEAD) {
+                    count_rewrite("phi_dead");
+                    count(Counter::PHIS_REMOVED);
+                    return node->inputs.at(1);
+                }
+                break;
+            case Node::Type::CONTROL_PROJECT:
+                if (node->inputs.at(0)->type == Node::Type::CONTROL_IFELSE && is_const(*node->inputs.at(0)->inputs.at(1))) {
+                    count_rewrite("project_const");
+                    if ((node->value==0) == (get_value_i64(*node->inputs.at(0)->inputs.at(1))==1)) {
+                        return node->inputs.at(0)->inputs.at(0);
+                    } else {
+                        return make_node(Node::Type::CONTROL_DEAD, {});
+                    }
+                }
+                break;
+            case Node::Type::CONTROL_REGION:
+                if (node->inputs.at(1)->type == Node::Type::CONTROL_DEAD) {
+                    count_rewrite("region_dead");
+                    return node->inputs.at(2);
+                }
+                if (node->inputs.at(2)->type == Node::Type::CONTROL_DEAD) {
+                    count_rewrite("region_dead");
+                    return node->inputs.at(1);
+                }
+                break;
+            default:
+                break;
+        }
+        return node;
+    }
+}
@@ -0,0 +1,60 @@
+#include <format>
+#include <stdexcept>
+#include <string>
+
+#include "grlang/profile.h"
+#include "grlang/graph.h"
+
+
+namespace grlang::node {
+    void write_profile(const Profile& profile, std::ostream& output) {
+        output << "grlang-profile " << Profile::VERSION << "\n";
+        for (const auto& [key, branch]: profile.branches) {
+            output << std::format("{:016x} {} {} {}\n", key.first, key.second, branch.taken[0], branch.taken[1]);
+        }
+    }
+
+    Profile read_profile(std::istream& input) {
+        std::string magic;
+        std::uint32_t version = 0;
+        if (!(input >> magic >> version) || magic != "grlang-profile" || version != Profile::VERSION) {
+            throw std::runtime_error("not a profile");
+        }
+        Profile profile;
+        std::uint64_t function;
+        std::uint32_t ifelse;
+        Profile::Branch branch;
+        while (input >> std::hex >> function >> std::dec >> ifelse >> branch.taken[0] >> branch.taken[1]) {
+            profile.branches[{function, ifelse}] = branch;
+        }
+        if (!input.eof()) {
+            throw std::runtime_error("bad profile entry");
+        }
+        return profile;
+    }
+
+    void merge_profile(Profile& profile, const Profile& other) {
+        for (const auto& [key, branch]: other.branches) {
+            auto& counts = profile.branches[key];
+            counts.taken[0] += branch.taken[0];
+            counts.taken[1] += branch.taken[1];
+        }
+    }
+
+    BranchCounts branch_counts(const Profile& profile, const Node& func) {
+        BranchCounts counts;
+        std::uint64_t function = hash_graph(func);
+        auto it = profile.branches.lower_bound({function, 0});
+        if (it == profile.branches.end() || it->first.first != function) {
+            return counts;
+        }
+        Graph graph(func);
+        for (; it != profile.branches.end() && it->first.first == function; ++it) {
+            std::uint32_t ifelse = it->first.second;
+            if (ifelse < graph.size() && graph.node(ifelse).type == Node::Type::CONTROL_IFELSE) {
+                counts[&graph.node(ifelse)] = it->second;
+            }
+        }
+        return counts;
+    }
+}
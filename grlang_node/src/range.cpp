@@ -0,0 +1,427 @@
+#include <cassert>
+#include <algorithm>
+#include <optional>
+
+#include "grlang/range.h"
+
+
+namespace
+{
+    using namespace grlang::node;
+
+    constexpr std::int64_t MIN = std::numeric_limits<int>::min();
+    constexpr std::int64_t MAX = std::numeric_limits<int>::max();
+
+    // NOTE: arithmetic wraps around, so a result that doesn't fit could be anything
+    Range make_range(std::int64_t lo, std::int64_t hi) {
+        if (lo < MIN || hi > MAX) {
+            return {};
+        }
+        return {static_cast<int>(lo), static_cast<int>(hi)};
+    }
+
+    Range truth(bool always, bool never) {
+        return always ? Range::constant(1) : never ? Range::constant(0) : Range{0, 1};
+    }
+
+    Range apply_range(Node::Type type, Range a, Range b) {
+        if (a.is_empty() || b.is_empty()) {
+            return Range::empty();
+        }
+        if (a.is_constant() && b.is_constant() && can_fold(type, a.lo, b.lo)) {
+            return Range::constant(apply_op(type, a.lo, b.lo));
+        }
+        switch (type) {
+            case Node::Type::DATA_OP_ADD:
+                return make_range(std::int64_t(a.lo) + b.lo, std::int64_t(a.hi) + b.hi);
+            case Node::Type::DATA_OP_SUB:
+                return make_range(std::int64_t(a.lo) - b.hi, std::int64_t(a.hi) - b.lo);
+            case Node::Type::DATA_OP_MUL:
+            case Node::Type::DATA_OP_DIV: {
+                if (type == Node::Type::DATA_OP_DIV && b.contains(0)) {
+                    return {};
+                }
+                // NOTE: monotonic in each operand while the divisor keeps its sign, so the corners are the extremes
+                auto corner = [&](std::int64_t x, std::int64_t y) { return type == Node::Type::DATA_OP_MUL ? x*y : x/y; };
+                std::int64_t corners[] = {corner(a.lo, b.lo), corner(a.lo, b.hi), corner(a.hi, b.lo), corner(a.hi, b.hi)};
+                return make_range(std::ranges::min(corners), std::ranges::max(corners));
+            }
+            case Node::Type::DATA_OP_LT:
+                return truth(a.hi < b.lo, a.lo >= b.hi);
+            case Node::Type::DATA_OP_LEQ:
+                return truth(a.hi <= b.lo, a.lo > b.hi);
+            case Node::Type::DATA_OP_GT:
+                return truth(a.lo > b.hi, a.hi <= b.lo);
+            case Node::Type::DATA_OP_GEQ:
+                return truth(a.lo >= b.hi, a.hi < b.lo);
+            case Node::Type::DATA_OP_EQ:
+                return truth(false, intersect(a, b).is_empty());
+            case Node::Type::DATA_OP_NEQ:
+                return truth(intersect(a, b).is_empty(), false);
+            case Node::Type::DATA_OP_SHL:
+                if (b.is_constant()) {
+                    std::int64_t scale = std::int64_t(1) << (b.lo & 31);
+                    return make_range(a.lo * scale, a.hi * scale);
+                }
+                return {};
+            case Node::Type::DATA_OP_SHR:
+                if (b.is_constant()) {
+                    return {a.lo >> (b.lo & 31), a.hi >> (b.lo & 31)};
+                }
+                return {std::min(a.lo, 0), std::max(a.hi, -1)};
+            case Node::Type::DATA_OP_AND:
+                if (a.lo >= 0 || b.lo >= 0) {
+                    return {0, a.lo >= 0 && b.lo >= 0 ? std::min(a.hi, b.hi) : a.lo >= 0 ? a.hi : b.hi};
+                }
+                return {};
+            default:
+                return {};
+        }
+    }
+
+    void add_fact(std::vector<std::pair<std::uint32_t, Range>>& facts, std::uint32_t node, Range range) {
+        auto it = std::ranges::lower_bound(facts, node, {}, [](auto& fact) { return fact.first; });
+        if (it != facts.end() && it->first == node) {
+            it->second = intersect(it->second, range);
+        } else {
+            facts.emplace(it, node, range);
+        }
+    }
+
+    bool is_checked(const Node& node) {
+        return (node.type == Node::Type::MEMORY_LOAD || node.type == Node::Type::MEMORY_STORE) && node.value == BOUNDS_CHECK;
+    }
+
+    // NOTE: index < length of array at control, either by their ranges or by a comparison of the two known to hold there
+    bool below_length(const Graph& graph, const RangeAnalysis& analysis, std::uint32_t array, std::uint32_t index, std::uint32_t control) {
+        std::uint32_t length = graph.node(array).type == Node::Type::MEMORY_NEW ? graph.inputs(array)[1] : Graph::NO_NODE;
+        if (length != Graph::NO_NODE && analysis.range(index, control).hi < analysis.range(length, control).lo) {
+            return true;
+        }
+        auto is_length = [&](std::uint32_t node) {
+            return node == length || (graph.node(node).type == Node::Type::DATA_LENGTH && graph.inputs(node)[0] == array);
+        };
+        for (std::uint32_t user: graph.outputs(index)) {
+            if (!is_comparison(graph.node(user).type) || graph.inputs(user)[0] == graph.inputs(user)[1]) {
+                continue;
+            }
+            bool left = graph.inputs(user)[0] == index;
+            if (!is_length(graph.inputs(user)[left ? 1 : 0])) {
+                continue;
+            }
+            // NOTE: as if index was on the left
+            Node::Type type = graph.node(user).type;
+            if (!left) {
+                type = type == Node::Type::DATA_OP_GT ? Node::Type::DATA_OP_LT : type == Node::Type::DATA_OP_LEQ ? Node::Type::DATA_OP_GEQ : Node::Type::DATA_OP_END;
+            }
+            Range holds = analysis.range(user, control);
+            if ((type == Node::Type::DATA_OP_LT && holds == Range::constant(1)) || (type == Node::Type::DATA_OP_GEQ && holds == Range::constant(0))) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const Range* find_fact(const std::vector<std::pair<std::uint32_t, Range>>& facts, std::uint32_t node) {
+        auto it = std::ranges::lower_bound(facts, node, {}, [](auto& fact) { return fact.first; });
+        return it != facts.end() && it->first == node ? &it->second : nullptr;
+    }
+}
+
+namespace grlang::node {
+    RangeAnalysis::RangeAnalysis(const Graph& graph_, std::span<const Range> arguments_) : graph(graph_), arguments(arguments_.begin(), arguments_.end()), facts(graph_.size()), reachable(graph_.size()),
+            phis(graph_.size(), Range::empty()), changes(graph_.size()), memo(graph_.size()), memo_query(graph_.size()) {
+        bool loops = std::ranges::any_of(graph.control_rpo(), [&](std::uint32_t control) {
+            auto inputs = graph.inputs(control);
+            for (std::size_t i=1; graph.node(control).type == Node::Type::CONTROL_REGION && i<inputs.size(); ++i) {
+                if (graph.is_back_edge(control, i)) {
+                    return true;
+                }
+            }
+            return false;
+        });
+        if (!loops) {
+            propagate(false);  // NOTE: predecessors come first in rpo, one pass is enough
+            return;
+        }
+
+        // NOTE: widen until nothing changes, then recompute without widening to win back loop bounds
+        constexpr int MAX_ROUNDS = 16;
+        bool changed = true;
+        for (int round=0; changed; ++round) {
+            if (round == MAX_ROUNDS) {
+                std::ranges::fill(phis, Range{});  // NOTE: not settling down, give up on phis
+                break;
+            }
+            changed = propagate(true);
+        }
+        propagate(false);
+        propagate(false);
+    }
+
+    bool RangeAnalysis::propagate(bool widen) {
+        bool changed = false;
+        for (std::uint32_t control: graph.control_rpo()) {
+            switch (graph.node(control).type) {
+                case Node::Type::CONTROL_START:
+                    reachable[control] = true;
+                    break;
+                case Node::Type::CONTROL_PROJECT:
+                    facts[control] = narrow(control);
+                    reachable[control] = reachable[graph.inputs(control)[0]] &&
+                        std::ranges::none_of(facts[control], [](auto& fact) { return fact.second.is_empty(); });
+                    break;
+                case Node::Type::CONTROL_REGION:
+                    facts[control] = merge(control);
+                    changed |= update_phis(control, widen);
+                    break;
+                default:
+                    reachable[control] = reachable[graph.inputs(control)[0]];
+                    facts[control] = facts[graph.inputs(control)[0]];
+                    break;
+            }
+        }
+        return changed;
+    }
+
+    Range RangeAnalysis::range(std::uint32_t node, std::uint32_t control) const {
+        if (!reachable[control]) {
+            return Range::empty();
+        }
+        return evaluate(node, facts[control]);
+    }
+
+    Range RangeAnalysis::evaluate(std::uint32_t node, const Facts& facts_) const {
+        ++query;
+        return evaluate_node(node, facts_);
+    }
+
+    Range RangeAnalysis::evaluate_node(std::uint32_t node, const Facts& facts_) const {
+        if (auto fact = find_fact(facts_, node)) {
+            return *fact;
+        }
+        if (memo_query[node] == query) {
+            return memo[node];
+        }
+        const Node& data = graph.node(node);
+        Range result;
+        if (data.type != Node::Type::DATA_TERM && data.value_type != Value::Type::INTEGER) {
+            // NOTE: ranges only track int, other widths are left unknown
+            if (is_comparison(data.type) || data.type == Node::Type::DATA_OP_NOT) {
+                result = Range{0, 1};
+            }
+        } else if (is_const(data)) {
+            result = result_type(data) == Value::Type::INTEGER ? Range::constant(get_value_int(data)) : Range{};
+        } else if (is_binary_op(data)) {
+            Range a = evaluate_node(graph.inputs(node)[0], facts_);
+            Range b = evaluate_node(graph.inputs(node)[1], facts_);
+            result = apply_range(data.type, a, b);
+        } else if (data.type == Node::Type::DATA_OP_NEG) {
+            Range a = evaluate_node(graph.inputs(node)[0], facts_);
+            result = a.is_empty() ? a : a.lo == MIN ? Range{} : Range{-a.hi, -a.lo};
+        } else if (data.type == Node::Type::DATA_OP_NOT) {
+            Range a = evaluate_node(graph.inputs(node)[0], facts_);
+            result = a.is_empty() ? a : truth(a == Range::constant(0), !a.contains(0));
+        } else if (data.type == Node::Type::DATA_LENGTH) {
+            result = Range{0, static_cast<int>(MAX)};
+        } else if (data.type == Node::Type::DATA_PHI) {
+            result = phis[node];
+        } else if (data.type == Node::Type::DATA_PROJECT) {
+            result = data.value <= arguments.size() ? arguments[data.value - 1] : Range{};
+        }
+        memo_query[node] = query;
+        memo[node] = result;
+        return result;
+    }
+
+    RangeAnalysis::Facts RangeAnalysis::narrow(std::uint32_t project) const {
+        std::uint32_t ifelse = graph.inputs(project)[0];
+        Facts result = facts[ifelse];
+        if (graph.node(ifelse).type != Node::Type::CONTROL_IFELSE) {
+            return result;
+        }
+        // NOTE: the first arm is taken when the condition is exactly 1
+        bool taken = graph.node(project).value == 0;
+        std::uint32_t condition = graph.inputs(ifelse)[1];
+        Range value = evaluate(condition, facts[ifelse]);
+        if (taken) {
+            add_fact(result, condition, intersect(value, Range::constant(1)));
+        } else if (value == Range::constant(1)) {
+            add_fact(result, condition, Range::empty());
+        } else if (value.lo == 1) {
+            add_fact(result, condition, {2, value.hi});
+        } else if (value.hi == 1) {
+            add_fact(result, condition, {value.lo, 0});
+        }
+
+        const Node& compare = graph.node(condition);
+        if (!is_binary_op(compare) || compare.value_type != Value::Type::INTEGER || !value.contains(0) || !value.contains(1) || value.lo < 0 || value.hi > 1) {
+            return result;
+        }
+        std::uint32_t left = graph.inputs(condition)[0];
+        std::uint32_t right = graph.inputs(condition)[1];
+        Range a = evaluate(left, facts[ifelse]);
+        Range b = evaluate(right, facts[ifelse]);
+        Node::Type type = compare.type;
+        if (!taken) {
+            switch (type) {
+                case Node::Type::DATA_OP_LT: type = Node::Type::DATA_OP_GEQ; break;
+                case Node::Type::DATA_OP_LEQ: type = Node::Type::DATA_OP_GT; break;
+                case Node::Type::DATA_OP_GT: type = Node::Type::DATA_OP_LEQ; break;
+                case Node::Type::DATA_OP_GEQ: type = Node::Type::DATA_OP_LT; break;
+                case Node::Type::DATA_OP_EQ: type = Node::Type::DATA_OP_NEQ; break;
+                case Node::Type::DATA_OP_NEQ: type = Node::Type::DATA_OP_EQ; break;
+                default: return result;
+            }
+        }
+        // NOTE: x <= y-gap, the other comparisons are turned around to match
+        auto less = [](Range& x, Range& y, int gap) {
+            std::int64_t x_hi = std::min<std::int64_t>(x.hi, std::int64_t(y.hi) - gap);
+            std::int64_t y_lo = std::max<std::int64_t>(y.lo, std::int64_t(x.lo) + gap);
+            x = x_hi < MIN ? Range::empty() : Range{x.lo, static_cast<int>(x_hi)};
+            y = y_lo > MAX ? Range::empty() : Range{static_cast<int>(y_lo), y.hi};
+        };
+        switch (type) {
+            case Node::Type::DATA_OP_LT: less(a, b, 1); break;
+            case Node::Type::DATA_OP_LEQ: less(a, b, 0); break;
+            case Node::Type::DATA_OP_GT: less(b, a, 1); break;
+            case Node::Type::DATA_OP_GEQ: less(b, a, 0); break;
+            case Node::Type::DATA_OP_EQ: a = b = intersect(a, b); break;
+            case Node::Type::DATA_OP_NEQ:
+                if (b.is_constant() && a.lo == b.lo) {
+                    a = a.is_constant() ? Range::empty() : Range{a.lo + 1, a.hi};
+                } else if (b.is_constant() && a.hi == b.lo) {
+                    a = Range{a.lo, a.hi - 1};
+                }
+                break;
+            default:
+                return result;
+        }
+        if (!is_const(graph.node(left))) {
+            add_fact(result, left, a);
+        }
+        if (!is_const(graph.node(right))) {
+            add_fact(result, right, b);
+        }
+        return result;
+    }
+
+    RangeAnalysis::Facts RangeAnalysis::merge(std::uint32_t region) const {
+        // NOTE: facts around a back edge are about the previous iteration, only those on entry hold for the loop
+        std::optional<Facts> result;
+        for (std::size_t i=1; i<graph.inputs(region).size(); ++i) {
+            std::uint32_t predecessor = graph.inputs(region)[i];
+            if (predecessor == Graph::NO_NODE || !reachable[predecessor] || graph.is_back_edge(region, i)) {
+                continue;
+            }
+            if (!result) {
+                result = facts[predecessor];
+                continue;
+            }
+            Facts joined;
+            for (auto& [node, range]: *result) {
+                if (auto other = find_fact(facts[predecessor], node)) {
+                    joined.emplace_back(node, join(range, *other));
+                }
+            }
+            result = std::move(joined);
+        }
+        return result.value_or(Facts{});
+    }
+
+    bool RangeAnalysis::update_phis(std::uint32_t region, bool widen) {
+        bool entered = false;
+        for (std::size_t i=1; i<graph.inputs(region).size(); ++i) {
+            std::uint32_t predecessor = graph.inputs(region)[i];
+            entered |= predecessor != Graph::NO_NODE && reachable[predecessor] && !graph.is_back_edge(region, i);
+        }
+        reachable[region] = entered;
+
+        bool changed = false;
+        for (std::uint32_t phi: graph.outputs(region)) {
+            if (graph.node(phi).type != Node::Type::DATA_PHI || graph.inputs(phi)[0] != region) {
+                continue;
+            }
+            Range result = Range::empty();
+            for (std::size_t i=1; i<graph.inputs(region).size(); ++i) {
+                std::uint32_t predecessor = graph.inputs(region)[i];
+                if (predecessor != Graph::NO_NODE && reachable[predecessor]) {
+                    result = join(result, evaluate(graph.inputs(phi)[i], facts[predecessor]));
+                }
+            }
+            if (widen) {
+                result = join(result, phis[phi]);
+                if (result != phis[phi] && ++changes[phi] > 2) {
+                    // NOTE: bounds that keep moving go all the way
+                    if (result.lo < phis[phi].lo) {
+                        result.lo = MIN;
+                    }
+                    if (result.hi > phis[phi].hi) {
+                        result.hi = MAX;
+                    }
+                }
+            }
+            changed |= result != phis[phi];
+            phis[phi] = result;
+        }
+        return changed;
+    }
+
+    std::size_t fold_branches(Node& func, std::span<const Range> arguments) {
+        if (func.inputs.at(0)->inputs.empty()) {
+            return 0;  // NOTE: never returns, nothing to fold
+        }
+        Graph graph(func);
+        bool undecided = std::ranges::any_of(graph.control_rpo(), [&](std::uint32_t control) {
+            return graph.node(control).type == Node::Type::CONTROL_IFELSE && !is_const(graph.node(graph.inputs(control)[1]));
+        });
+        if (!undecided) {
+            return 0;
+        }
+        RangeAnalysis analysis(graph, arguments);
+        std::size_t folded = 0;
+        for (std::uint32_t control: graph.control_rpo()) {
+            if (graph.node(control).type != Node::Type::CONTROL_IFELSE || is_const(graph.node(graph.inputs(control)[1]))) {
+                continue;
+            }
+            Range condition = analysis.range(graph.inputs(control)[1], control);
+            if (condition.is_empty()) {
+                continue;
+            }
+            if (condition == Range::constant(1) || !condition.contains(1)) {
+                graph.writable_node(control).inputs.at(1) = std::make_shared<ValueNode>(Node(Node::Type::DATA_TERM, 0, {}), Value(condition == Range::constant(1) ? 1 : 0));
+                ++folded;
+            }
+        }
+        return folded;
+    }
+
+    std::size_t eliminate_bounds_checks(Node& func, std::span<const Range> arguments) {
+        if (func.inputs.at(0)->inputs.empty()) {
+            return 0;
+        }
+        Graph graph(func);
+        if (std::ranges::none_of(graph.control_rpo(), [&](std::uint32_t control) { return is_checked(graph.node(control)); })) {
+            return 0;
+        }
+        RangeAnalysis analysis(graph, arguments);
+        std::size_t removed = 0;
+        for (std::uint32_t control: graph.control_rpo()) {
+            if (!is_checked(graph.node(control))) {
+                continue;
+            }
+            std::uint32_t array = graph.inputs(control)[1];
+            std::uint32_t index = graph.inputs(control)[2];
+            if (result_type(graph.node(index)) != Value::Type::INTEGER) {
+                continue;  // NOTE: ranges only track int
+            }
+            Range range = analysis.range(index, control);
+            if (range.is_empty() || range.lo < 0 || !below_length(graph, analysis, array, index, control)) {
+                continue;
+            }
+            graph.writable_node(control).value = 0;
+            ++removed;
+        }
+        return removed;
+    }
+}
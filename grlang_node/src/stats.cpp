@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <format>
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+
+#include "grlang/stats.h"
+#include "grlang/node.h"
+
+
+namespace {
+    using namespace grlang::node;
+
+    constexpr std::size_t PHASES = static_cast<std::size_t>(Phase::COUNT);
+    constexpr std::size_t COUNTERS = static_cast<std::size_t>(Counter::COUNT);
+
+    struct Recording {
+        std::uint64_t id;  // NOTE: a new recording may reuse the address of an old one
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        std::array<std::atomic<std::uint64_t>, PHASES> nanoseconds = {};
+        std::array<std::atomic<std::uint64_t>, PHASES> calls = {};
+        std::array<std::atomic<std::uint64_t>, COUNTERS> counters = {};
+        std::atomic<std::int64_t> live_nodes = 0;  // NOTE: goes below 0 as nodes made before recording are collected
+        std::atomic<std::int64_t> peak_nodes = 0;
+        std::atomic<std::uint32_t> threads = 0;
+        mutable std::mutex mutex;  // NOTE: guards rewrites and events
+        std::unordered_map<std::string_view, std::uint64_t> rewrites;
+        std::vector<Stats::Event> events;
+
+        explicit Recording(std::uint64_t id_) : id(id_) {}
+
+        std::uint64_t now() const {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+        }
+    };
+
+    std::atomic<Recording*> active = nullptr;
+    std::atomic<std::uint64_t> recordings = 0;
+
+    // NOTE: per thread, the recording its number belongs to and the phases it has open
+    struct ThreadState {
+        std::uint64_t recording = 0;  // NOTE: id, 0 before the thread first records
+        std::uint32_t number = 0;
+        std::uint32_t open = 0;  // NOTE: bit per phase
+    };
+    thread_local ThreadState thread_state;
+
+    ThreadState& thread_of(Recording& recording) {
+        if (thread_state.recording != recording.id) {
+            thread_state = {recording.id, recording.threads++, 0};
+        }
+        return thread_state;
+    }
+
+    constexpr bool is_traced(Phase phase) {
+        return phase != Phase::PEEPHOLE;
+    }
+
+    void write_json_string(std::string_view text, std::ostream& output) {
+        output << '"';
+        for (char c: text) {
+            if (c == '"' || c == '\\') {
+                output << '\\' << c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                output << std::format("\\u{:04x}", static_cast<int>(c));
+            } else {
+                output << c;
+            }
+        }
+        output << '"';
+    }
+
+    std::string microseconds(std::uint64_t nanoseconds) {
+        return std::format("{}.{:03}", nanoseconds / 1000, nanoseconds % 1000);
+    }
+}
+
+namespace grlang::node {
+    const char* phase_name(Phase phase) {
+        switch (phase) {
+            case Phase::TOKENIZE: return "tokenize";
+            case Phase::PARSE: return "parse";
+            case Phase::PEEPHOLE: return "peephole";
+            case Phase::OPTIMIZE: return "optimize";
+            case Phase::SCHEDULE: return "schedule";
+            case Phase::LOWER: return "lower";
+            default: throw std::runtime_error("bad phase");
+        }
+    }
+
+    const char* counter_name(Counter counter) {
+        switch (counter) {
+            case Counter::NODES_CREATED: return "nodes_created";
+            case Counter::NODES_COLLECTED: return "nodes_collected";
+            case Counter::PHIS_CREATED: return "phis_created";
+            case Counter::PHIS_REMOVED: return "phis_removed";
+            case Counter::REWRITES: return "rewrites";
+            default: throw std::runtime_error("bad counter");
+        }
+    }
+
+    StatsRecorder::StatsRecorder() {
+        Recording* expected = nullptr;
+        auto recording = new Recording(++recordings);
+        if (!active.compare_exchange_strong(expected, recording)) {
+            delete recording;
+            throw std::runtime_error("stats are already being recorded");
+        }
+    }
+
+    StatsRecorder::~StatsRecorder() {
+        delete active.exchange(nullptr);
+    }
+
+    Stats StatsRecorder::stats() const {
+        Stats stats;
+        const Recording& recording = *active.load();
+        for (std::size_t i=0; i<PHASES; ++i) {
+            stats.phases[i] = {recording.nanoseconds[i].load(), recording.calls[i].load()};
+        }
+        for (std::size_t i=0; i<COUNTERS; ++i) {
+            stats.counters[i] = recording.counters[i].load();
+        }
+        stats.peak_nodes = recording.peak_nodes.load();
+        stats.peak_bytes = stats.peak_nodes * sizeof(Node);
+        std::lock_guard lock(recording.mutex);
+        for (auto& [rule, n]: recording.rewrites) {
+            stats.rewrites.emplace(rule, n);
+        }
+        stats.events = recording.events;
+        return stats;
+    }
+
+    void write_stats_json(const Stats& stats, std::ostream& output) {
+        output << "{\n  \"phases\": {";
+        for (std::size_t i=0; i<PHASES; ++i) {
+            output << (i ? ",\n" : "\n") << "    \"" << phase_name(static_cast<Phase>(i)) << "\": {\"nanoseconds\": " << stats.phases[i].nanoseconds << ", \"calls\": " << stats.phases[i].calls << "}";
+        }
+        output << "\n  },\n  \"counters\": {";
+        for (std::size_t i=0; i<COUNTERS; ++i) {
+            output << (i ? ",\n" : "\n") << "    \"" << counter_name(static_cast<Counter>(i)) << "\": " << stats.counters[i];
+        }
+        output << "\n  },\n  \"rewrites\": {";
+        bool first = true;
+        for (auto& [rule, n]: stats.rewrites) {
+            output << (first ? "\n" : ",\n") << "    ";
+            write_json_string(rule, output);
+            output << ": " << n;
+            first = false;
+        }
+        output << (first ? "" : "\n  ") << "},\n";
+        output << "  \"peak_nodes\": " << stats.peak_nodes << ",\n";
+        output << "  \"peak_bytes\": " << stats.peak_bytes << "\n}\n";
+    }
+
+    void write_stats_trace(const Stats& stats, std::ostream& output) {
+        output << "{\"traceEvents\": [";
+        std::uint64_t end = 0;
+        for (auto& event: stats.events) {
+            output << "\n  {\"name\": \"" << phase_name(event.phase) << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread
+                << ", \"ts\": " << microseconds(event.begin) << ", \"dur\": " << microseconds(event.end - event.begin) << "},";
+            end = std::max(end, event.end);
+        }
+        output << "\n  {\"name\": \"counters\", \"ph\": \"C\", \"pid\": 1, \"tid\": 0, \"ts\": " << microseconds(end) << ", \"args\": {";
+        for (std::size_t i=0; i<COUNTERS; ++i) {
+            output << (i ? ", " : "") << "\"" << counter_name(static_cast<Counter>(i)) << "\": " << stats.counters[i];
+        }
+        output << "}}\n], \"displayTimeUnit\": \"ns\"}\n";
+    }
+}
+
+namespace grlang::node::detail {
+    std::uint64_t begin_phase(Phase phase) {
+        Recording* recording = active.load(std::memory_order_acquire);
+        if (!recording) {
+            return NOT_TIMED;
+        }
+        auto& thread = thread_of(*recording);
+        auto bit = std::uint32_t(1) << static_cast<std::uint32_t>(phase);
+        if (thread.open & bit) {
+            return NOT_TIMED;
+        }
+        thread.open |= bit;
+        return recording->now();
+    }
+
+    void end_phase(Phase phase, std::uint64_t begin) {
+        Recording* recording = active.load(std::memory_order_acquire);
+        if (!recording || thread_state.recording != recording->id) {
+            return;
+        }
+        thread_state.open &= ~(std::uint32_t(1) << static_cast<std::uint32_t>(phase));
+        std::uint64_t end = recording->now();
+        recording->nanoseconds[static_cast<std::size_t>(phase)] += end - begin;
+        ++recording->calls[static_cast<std::size_t>(phase)];
+        if (is_traced(phase)) {
+            std::lock_guard lock(recording->mutex);
+            recording->events.push_back({phase, thread_state.number, begin, end});
+        }
+    }
+
+    void count(Counter counter, std::uint64_t n) {
+        if (Recording* recording = active.load(std::memory_order_acquire)) {
+            recording->counters[static_cast<std::size_t>(counter)].fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    void count_rewrite(const char* rule) {
+        if (Recording* recording = active.load(std::memory_order_acquire)) {
+            recording->counters[static_cast<std::size_t>(Counter::REWRITES)].fetch_add(1, std::memory_order_relaxed);
+            std::lock_guard lock(recording->mutex);
+            ++recording->rewrites[rule];
+        }
+    }
+
+    void node_created() {
+        if (Recording* recording = active.load(std::memory_order_acquire)) {
+            recording->counters[static_cast<std::size_t>(Counter::NODES_CREATED)].fetch_add(1, std::memory_order_relaxed);
+            auto live = recording->live_nodes.fetch_add(1, std::memory_order_relaxed) + 1;
+            auto peak = recording->peak_nodes.load(std::memory_order_relaxed);
+            while (live > peak && !recording->peak_nodes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+            }
+        }
+    }
+
+    void node_collected() {
+        if (Recording* recording = active.load(std::memory_order_acquire)) {
+            recording->counters[static_cast<std::size_t>(Counter::NODES_COLLECTED)].fetch_add(1, std::memory_order_relaxed);
+            recording->live_nodes.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+}
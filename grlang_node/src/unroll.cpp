@@ -0,0 +1,281 @@
+#include <algorithm>
+#include <unordered_set>
+
+#include "grlang/loop.h"
+#include "grlang/peephole.h"
+
+
+namespace
+{
+    using namespace grlang::node;
+
+    Node::Ptr make_node(Node::Type type, Value::Type value_type, std::initializer_list<Node::Ptr> inputs) {
+        auto node = std::make_shared<Node>(type, std::uint8_t(0), inputs);
+        node->value_type = value_type;
+        return node;
+    }
+
+    // One iteration of a counted loop, the control nodes of its body and the data nodes they compute anew
+    class LoopBody {
+    public:
+        LoopBody(const Graph& graph_, const CountedLoop& loop_, const std::vector<Node::Ptr>& owned_) : graph(graph_), loop(loop_), owned(owned_), needed(graph_.size()) {
+            for (std::uint32_t user: graph.outputs(loop.region)) {
+                if (graph.node(user).type == Node::Type::DATA_PHI && std::ranges::find(phis, user) == phis.end()) {
+                    phis.push_back(user);
+                }
+            }
+            auto variant = loop_variant(graph, loop);
+            std::vector<std::uint32_t> work;
+            auto use = [&](std::uint32_t node) {
+                if (node != Graph::NO_NODE && variant[node] && is_data(graph.node(node)) && !needed[node] && !is_loop_phi(node)) {
+                    needed[node] = true;
+                    work.push_back(node);
+                }
+            };
+            for (std::uint32_t control: loop.nodes) {
+                for (std::uint32_t input: graph.inputs(control)) {
+                    use(input);
+                }
+            }
+            for (std::uint32_t phi: phis) {
+                use(graph.inputs(phi)[loop.back]);
+            }
+            while (!work.empty()) {
+                std::uint32_t node = work.back();
+                work.pop_back();
+                for (std::uint32_t input: graph.inputs(node)) {
+                    use(input);
+                }
+            }
+            for (std::uint32_t id: graph.data_postorder()) {
+                if (needed[id]) {
+                    data.push_back(id);
+                }
+            }
+        }
+
+        // NOTE: nodes a copy of the body adds
+        std::size_t size() const { return loop.nodes.size() - 1 + data.size(); }
+
+        // NOTE: copies the body to run after control, with the loop phis taking values. Returns the control the copy
+        // ends at, values become those the phis take in the next iteration
+        Node::Ptr copy(Node::Ptr control, std::vector<Node::Ptr>& values) const {
+            std::vector<Node::Ptr> copies(graph.size());
+            for (std::size_t i=0; i<phis.size(); ++i) {
+                copies[phis[i]] = values[i];
+            }
+            copies[loop.body] = std::move(control);
+            std::vector<bool> pending(graph.size());  // NOTE: control nodes whose inputs aren't filled in yet
+            for (std::uint32_t id: std::span(loop.nodes).subspan(1)) {
+                copies[id] = std::make_shared<Node>(graph.node(id).type, graph.node(id).value, std::initializer_list<Node::Ptr>{});
+                copies[id]->value_type = graph.node(id).value_type;
+                pending[id] = true;
+            }
+            auto input = [&](std::uint32_t id) -> Node::Ptr {
+                return id == Graph::NO_NODE ? nullptr : copies[id] ? copies[id] : owned[id];
+            };
+            for (std::uint32_t id: data) {
+                auto node = std::make_shared<Node>(graph.node(id).type, graph.node(id).value, std::initializer_list<Node::Ptr>{});
+                node->value_type = graph.node(id).value_type;
+                bool ready = node->type != Node::Type::DATA_PHI;  // NOTE: peephole looks at the region of a phi
+                for (std::uint32_t in: graph.inputs(id)) {
+                    node->inputs.push_back(input(in));
+                    ready = ready && (in == Graph::NO_NODE || !pending[in]);
+                }
+                copies[id] = ready ? peephole(node) : node;
+            }
+            for (std::uint32_t id: std::span(loop.nodes).subspan(1)) {
+                for (std::uint32_t in: graph.inputs(id)) {
+                    copies[id]->inputs.push_back(input(in));
+                }
+            }
+            std::vector<Node::Ptr> next;
+            for (std::uint32_t phi: phis) {
+                next.push_back(input(graph.inputs(phi)[loop.back]));
+            }
+            values = std::move(next);
+            return copies[loop.nodes.back()];
+        }
+
+        // NOTE: the value a node used after the loop has once the phis took their last values
+        Node::Ptr after(std::uint32_t node, const std::vector<Node::Ptr>& values, std::vector<Node::Ptr>& copies) const {
+            if (auto phi = std::ranges::find(phis, node); phi != phis.end()) {
+                return values[phi - phis.begin()];
+            }
+            if (!needed[node]) {
+                return owned[node];
+            }
+            if (!copies[node]) {
+                auto copy = std::make_shared<Node>(graph.node(node).type, graph.node(node).value, std::initializer_list<Node::Ptr>{});
+                copy->value_type = graph.node(node).value_type;
+                for (std::uint32_t in: graph.inputs(node)) {
+                    copy->inputs.push_back(in == Graph::NO_NODE ? nullptr : after(in, values, copies));
+                }
+                copies[node] = peephole(copy);
+            }
+            return copies[node];
+        }
+
+        bool is_loop_phi(std::uint32_t node) const {
+            return graph.node(node).type == Node::Type::DATA_PHI && graph.inputs(node)[0] == loop.region;
+        }
+        bool is_needed(std::uint32_t node) const { return needed[node]; }
+
+        std::vector<std::uint32_t> phis;
+
+    private:
+        const Graph& graph;
+        const CountedLoop& loop;
+        const std::vector<Node::Ptr>& owned;
+        std::vector<bool> needed;  // NOTE: variant data nodes the body uses, loop phis aside
+        std::vector<std::uint32_t> data;  // NOTE: the needed nodes, each after its inputs
+    };
+
+    void replace_input(Graph& graph, std::uint32_t user, std::uint32_t old_input, const Node::Ptr& new_input) {
+        auto& inputs = graph.writable_node(user).inputs;
+        for (std::size_t i=0; i<inputs.size(); ++i) {
+            if (graph.inputs(user)[i] == old_input) {
+                inputs[i] = new_input;
+            }
+        }
+    }
+
+    // NOTE: replaces the loop by trips copies of its body, whatever used the loop uses the last copy
+    void unroll_fully(Graph& graph, const CountedLoop& loop, const LoopBody& body, const std::vector<Node::Ptr>& owned, std::uint32_t trips) {
+        Node::Ptr control = owned[graph.inputs(loop.region)[loop.entry]];
+        std::vector<Node::Ptr> values;
+        for (std::uint32_t phi: body.phis) {
+            values.push_back(owned[graph.inputs(phi)[loop.entry]]);
+        }
+        for (std::uint32_t i=0; i<trips; ++i) {
+            control = body.copy(control, values);
+        }
+
+        std::unordered_set<std::uint32_t> inside(loop.nodes.begin(), loop.nodes.end());
+        inside.insert({loop.region, loop.ifelse, loop.exit});
+        std::vector<Node::Ptr> copies(graph.size());
+        for (std::uint32_t id=0; id<graph.size(); ++id) {
+            if (inside.contains(id) || body.is_needed(id) || body.is_loop_phi(id)) {
+                continue;
+            }
+            auto inputs = graph.inputs(id);
+            for (std::uint32_t input: std::vector<std::uint32_t>(inputs.begin(), inputs.end())) {
+                if (input == loop.exit) {
+                    replace_input(graph, id, input, control);
+                } else if (input != Graph::NO_NODE && (body.is_needed(input) || body.is_loop_phi(input))) {
+                    replace_input(graph, id, input, body.after(input, values, copies));
+                }
+            }
+        }
+        // NOTE: nothing uses the loop anymore, dropping its inputs breaks its cycles so it can be freed
+        graph.writable_node(loop.region).inputs.clear();
+        for (std::uint32_t phi: body.phis) {
+            graph.writable_node(phi).inputs.clear();
+        }
+    }
+
+    // NOTE: puts a loop running factor copies of the body per check in front of the loop, which then runs the
+    // iterations that are left. The check is done in i64, so counter+factor-1 can't wrap around
+    void unroll_partially(Graph& graph, const CountedLoop& loop, const LoopBody& body, const std::vector<Node::Ptr>& owned, std::uint32_t factor) {
+        auto region = std::make_shared<Node>(Node::Type::CONTROL_REGION, std::uint8_t(0), std::initializer_list<Node::Ptr>{nullptr, owned[graph.inputs(loop.region)[loop.entry]], nullptr});
+        std::vector<Node::Ptr> phis;
+        Node::Ptr counter;
+        for (std::uint32_t phi: body.phis) {
+            phis.push_back(make_node(Node::Type::DATA_PHI, graph.node(phi).value_type, {region, owned[graph.inputs(phi)[loop.entry]], nullptr}));
+            if (phi == loop.counter) {
+                counter = phis.back();
+            }
+        }
+        auto wide = [](Node::Ptr value) {
+            return peephole(make_node(Node::Type::DATA_OP_CONVERT, Value::Type::I64, {std::move(value)}));
+        };
+        auto last = std::make_shared<ValueNode>(Node(Node::Type::DATA_TERM, 0, {}), Value(std::int64_t(factor-1), Value::Type::I64));
+        auto check = peephole(make_node(Node::Type::DATA_OP_LT, Value::Type::I64, {
+            peephole(make_node(Node::Type::DATA_OP_ADD, Value::Type::I64, {wide(counter), last})),
+            wide(owned[loop.limit]),
+        }));
+        auto ifelse = make_node(Node::Type::CONTROL_IFELSE, Value::Type::INTEGER, {region, check});
+        Node::Ptr control = std::make_shared<Node>(Node::Type::CONTROL_PROJECT, std::uint8_t(0), std::initializer_list<Node::Ptr>{ifelse});
+        auto exit = std::make_shared<Node>(Node::Type::CONTROL_PROJECT, std::uint8_t(1), std::initializer_list<Node::Ptr>{ifelse});
+
+        std::vector<Node::Ptr> values = phis;
+        for (std::uint32_t i=0; i<factor; ++i) {
+            control = body.copy(control, values);
+        }
+        region->inputs[2] = control;
+        for (std::size_t i=0; i<phis.size(); ++i) {
+            phis[i]->inputs[2] = values[i];
+        }
+
+        graph.writable_node(loop.region).inputs[loop.entry] = exit;
+        for (std::size_t i=0; i<phis.size(); ++i) {
+            graph.writable_node(body.phis[i]).inputs[loop.entry] = phis[i];
+        }
+    }
+
+    // NOTE: times the loop body runs each time the loop is entered, nullopt if not known
+    std::optional<std::uint64_t> known_trips(const Graph& graph, const CountedLoop& loop, const RangeAnalysis& analysis) {
+        std::uint32_t entry = graph.inputs(loop.region)[loop.entry];
+        Range start = analysis.range(graph.inputs(loop.counter)[loop.entry], entry);
+        Range limit = analysis.range(loop.limit, entry);
+        if (start.is_empty() || limit.is_empty() || !start.is_constant() || !limit.is_constant()) {
+            return std::nullopt;
+        }
+        return limit.lo > start.lo ? std::int64_t(limit.lo) - start.lo : 0;
+    }
+}
+
+namespace grlang::node {
+    std::size_t unroll_loops(Node& func, const UnrollOptions& options, const BranchCounts& counts, std::span<const Range> arguments) {
+        if (func.inputs.at(0)->inputs.empty()) {
+            return 0;
+        }
+        std::size_t unrolled = 0;
+        std::size_t budget = options.budget;
+        std::unordered_set<const Node*> seen;  // NOTE: regions of loops already looked at, a partially unrolled one stays
+        while (true) {
+            Graph graph(func);
+            auto loops = find_counted_loops(graph);
+            auto loop = std::ranges::find_if(loops, [&](const CountedLoop& loop) { return !seen.contains(&graph.node(loop.region)); });
+            if (loop == loops.end()) {
+                return unrolled;
+            }
+            seen.insert(&graph.node(loop->region));
+
+            RangeAnalysis analysis(graph, arguments);
+            std::optional<std::uint64_t> trips = known_trips(graph, *loop, analysis);
+            if (trips == 0) {
+                continue;  // NOTE: never runs, fold_branches takes care of it
+            }
+            auto owned = graph.owned_nodes();
+            LoopBody body(graph, *loop, owned);
+            if (trips && *trips <= options.full_trips && *trips * body.size() <= budget) {
+                unroll_fully(graph, *loop, body, owned, *trips);
+                budget -= *trips * body.size();
+                ++unrolled;
+                continue;
+            }
+
+            if (!trips && !counts.empty()) {
+                auto it = counts.find(&graph.node(loop->ifelse));
+                if (it == counts.end() || it->second.taken[1] == 0) {
+                    continue;  // NOTE: never ran, or never left, nothing to go by
+                }
+                trips = it->second.taken[0] / it->second.taken[1];
+            }
+            std::uint32_t factor = std::max<std::uint32_t>(options.factor, 1);
+            while (trips && factor > *trips) {
+                factor /= 2;  // NOTE: the unrolled loop would rarely run otherwise
+            }
+            if (factor < 2 || factor * body.size() > budget) {
+                continue;
+            }
+            if (options.skip_vector_loops && match_vector_loop(graph, *loop)) {
+                continue;
+            }
+            unroll_partially(graph, *loop, body, owned, factor);
+            budget -= factor * body.size();
+            ++unrolled;
+        }
+    }
+}
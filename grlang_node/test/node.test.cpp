@@ -1,2 +1,263 @@
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+
 #include "grtest.h"
 #include "grlang/node.h"
+#include "grlang/image.h"
+#include "grlang/graph.h"
+#include "grlang/peephole.h"
+
+
+namespace {
+    grlang::node::Node::Ptr make_value_node(int value) {
+        return std::make_shared<grlang::node::ValueNode>(grlang::node::Node(grlang::node::Node::Type::DATA_TERM, 0, {}), grlang::node::Value(value));
+    }
+
+    // NOTE: (x:int)->int { return x+5 }
+    grlang::node::Node::Ptr make_function() {
+        using grlang::node::Node;
+        auto start = std::make_shared<Node>(Node::Type::CONTROL_START, 0, std::initializer_list<Node::Ptr>{});
+        auto param = std::make_shared<Node>(Node::Type::DATA_PROJECT, 1, std::initializer_list<Node::Ptr>{start});
+        auto add = std::make_shared<Node>(Node::Type::DATA_OP_ADD, 0, std::initializer_list<Node::Ptr>{param, make_value_node(5)});
+        auto ret = std::make_shared<Node>(Node::Type::CONTROL_RETURN, 0, std::initializer_list<Node::Ptr>{start, add});
+        auto stop = std::make_shared<Node>(Node::Type::CONTROL_STOP, 0, std::initializer_list<Node::Ptr>{ret});
+        using grlang::node::Value;
+        return std::make_shared<grlang::node::ValueNode>(Node(Node::Type::DATA_TERM, 0, {stop}), Value(Value::Signature{{Value::Type::INTEGER}, Value::Type::INTEGER}));
+    }
+}
+
+TEST_CASE(test_image_roundtrip) {
+    std::unordered_map<std::string_view, grlang::node::Node::Ptr> exports{{"f", make_function()}, {"c", make_value_node(7)}};
+    std::ostringstream output;
+    grlang::node::write_image(exports, output);
+    std::string bytes = output.str();
+    std::vector<std::uint32_t> storage((bytes.size()+3)/4);
+    std::memcpy(storage.data(), bytes.data(), bytes.size());
+
+    grlang::node::ImageView image(std::as_bytes(std::span(storage)).first(bytes.size()));
+    assert(image.export_count() == 2);
+    assert(image.export_name(0) == "c");
+    assert(image.get_value_int(image.export_node(0)) == 7);
+
+    auto func = *image.find_export("f");
+    assert(image.type(func) == grlang::node::Node::Type::DATA_TERM);
+    assert(image.is_function(func) && !image.is_const(func));
+    assert(image.signature(func) == get_signature(*exports.at("f")));
+    auto stop = image.inputs(func)[0];
+    assert(image.type(stop) == grlang::node::Node::Type::CONTROL_STOP);
+    auto ret = image.inputs(stop)[0];
+    assert(image.type(ret) == grlang::node::Node::Type::CONTROL_RETURN);
+    assert(image.type(image.inputs(ret)[1]) == grlang::node::Node::Type::DATA_OP_ADD);
+    assert(image.outputs(stop).empty());  // NOTE: the function is not a user of its stop
+    assert(std::ranges::equal(image.outputs(ret), std::vector<std::uint32_t>{stop}));
+    assert(!image.find_export("g"));
+
+    auto loaded = grlang::node::load_image(image);
+    assert(grlang::node::hash_graph(loaded.at("f")) == grlang::node::hash_graph(exports.at("f")));
+    assert(get_value_int(*loaded.at("c")) == 7);
+}
+
+TEST_CASE(test_image_corrupt) {
+    std::unordered_map<std::string_view, grlang::node::Node::Ptr> exports{{"f", make_function()}};
+    std::ostringstream output;
+    grlang::node::write_image(exports, output);
+    std::string bytes = output.str();
+    auto header = reinterpret_cast<const grlang::node::ImageHeader*>(bytes.data());
+    std::size_t sections = (header->node_count + 3) & ~std::size_t(3);
+    std::size_t value_types = (2*header->node_count + 3) & ~std::size_t(3);
+    std::size_t edges = sizeof(grlang::node::ImageHeader) + 2*sections + value_types + 4*(header->node_count + 1);
+    std::size_t export_table = edges + 4*header->edge_count + 4*header->node_count + 4*header->constant_count;
+
+    auto corrupt = [&](std::size_t offset, std::uint32_t word) {
+        std::vector<std::uint32_t> storage((bytes.size()+3)/4);
+        std::memcpy(storage.data(), bytes.data(), bytes.size());
+        storage[offset/4] = word;
+        try {
+            grlang::node::ImageView image(std::as_bytes(std::span(storage)).first(bytes.size()));
+        } catch (const std::runtime_error&) {
+            return true;
+        }
+        return false;
+    };
+    assert(!corrupt(edges, 1));
+    assert(corrupt(edges, header->node_count));  // NOTE: edge past the last node
+    assert(corrupt(edges, 2));  // NOTE: function whose input is not a stop
+    assert(corrupt(edges + 12, grlang::node::ImageView::NO_NODE));  // NOTE: return without a value
+    assert(corrupt(edges - 4*header->node_count, header->edge_count + 1));  // NOTE: edges going backwards
+    assert(corrupt(export_table + 8, header->node_count));  // NOTE: export of a node that is not there
+    assert(corrupt(export_table, header->name_bytes));  // NOTE: name past the end
+}
+
+TEST_CASE(test_graph_numbering) {
+    using grlang::node::Node;
+    auto func = make_function();
+    grlang::node::Graph graph(*func);
+    assert(graph.size() == 7);
+    assert(&graph.node(graph.function()) == func.get());
+    assert(&graph.node(graph.stop()) == func->inputs[0].get());
+    assert(graph.node(graph.start()).type == Node::Type::CONTROL_START);
+
+    auto rpo = graph.control_rpo();
+    assert(rpo.size() == 3);
+    assert(rpo.front() == graph.start());
+    assert(rpo.back() == graph.stop());
+
+    auto postorder = graph.data_postorder();
+    assert(postorder.size() == 4);
+    std::vector<std::uint32_t> position(graph.size(), grlang::node::Graph::NO_NODE);
+    for (std::uint32_t i=0; i<postorder.size(); ++i) {
+        position[postorder[i]] = i;
+    }
+    for (std::uint32_t id: postorder) {
+        for (std::uint32_t input: graph.inputs(id)) {
+            assert(!grlang::node::is_data(graph.node(input)) || position[input] < position[id]);
+        }
+        for (std::uint32_t user: graph.outputs(id)) {
+            auto users = graph.inputs(user);
+            assert(std::ranges::find(users, id) != users.end());
+        }
+    }
+}
+
+TEST_CASE(test_peephole_rules) {
+    using grlang::node::Node;
+    auto start = std::make_shared<Node>(Node::Type::CONTROL_START, 0, std::initializer_list<Node::Ptr>{});
+    auto x = std::make_shared<Node>(Node::Type::DATA_PROJECT, 1, std::initializer_list<Node::Ptr>{start});
+    auto op = [](Node::Type type, Node::Ptr a, Node::Ptr b) {
+        return grlang::node::peephole(std::make_shared<Node>(type, 0, std::initializer_list<Node::Ptr>{a, b}));
+    };
+    auto is_op = [&](const Node::Ptr& node, Node::Type type, int right) {
+        return node->type == type && node->inputs.at(0) == x && get_value_int(*node->inputs.at(1)) == right;
+    };
+
+    assert(get_value_int(*op(Node::Type::DATA_OP_ADD, make_value_node(2), make_value_node(3))) == 5);
+    assert(!is_const(*op(Node::Type::DATA_OP_DIV, make_value_node(1), make_value_node(0))));
+    assert(op(Node::Type::DATA_OP_ADD, make_value_node(0), x) == x);
+    assert(op(Node::Type::DATA_OP_MUL, x, make_value_node(1)) == x);
+    assert(get_value_int(*op(Node::Type::DATA_OP_SUB, x, x)) == 0);
+    assert(get_value_int(*op(Node::Type::DATA_OP_MUL, x, make_value_node(0))) == 0);
+    assert(is_op(op(Node::Type::DATA_OP_SUB, x, make_value_node(2)), Node::Type::DATA_OP_ADD, -2));
+    assert(is_op(op(Node::Type::DATA_OP_ADD, op(Node::Type::DATA_OP_ADD, x, make_value_node(2)), make_value_node(3)), Node::Type::DATA_OP_ADD, 5));
+    assert(is_op(op(Node::Type::DATA_OP_MUL, make_value_node(8), x), Node::Type::DATA_OP_SHL, 3));
+    assert(is_op(op(Node::Type::DATA_OP_LT, make_value_node(4), x), Node::Type::DATA_OP_GT, 4));
+    assert(op(Node::Type::DATA_OP_DIV, x, make_value_node(4))->type == Node::Type::DATA_OP_DIV);
+
+    auto flag = op(Node::Type::DATA_OP_LT, x, make_value_node(1));
+    assert(op(Node::Type::DATA_OP_DIV, flag, make_value_node(4))->type == Node::Type::DATA_OP_SHR);
+    auto inverse = grlang::node::peephole(std::make_shared<Node>(Node::Type::DATA_OP_NOT, 0, std::initializer_list<Node::Ptr>{flag}));
+    assert(is_op(inverse, Node::Type::DATA_OP_GEQ, 1));
+}
+
+TEST_CASE(test_sized_kernels) {
+    using grlang::node::Node;
+    using grlang::node::Value;
+    static_assert(grlang::node::apply_sized_op(Node::Type::DATA_OP_ADD, Value::Type::U8, 200, 100) == 44);
+    static_assert(grlang::node::apply_sized_op(Node::Type::DATA_OP_ADD, Value::Type::I8, 100, 100) == -56);
+    static_assert(grlang::node::apply_sized_op(Node::Type::DATA_OP_MUL, Value::Type::I64, 1ll << 40, 4) == 1ll << 42);
+    static_assert(grlang::node::apply_sized_op(Node::Type::DATA_OP_SHR, Value::Type::U32, 0xFFFFFFFF, 4) == 0x0FFFFFFF);
+    static_assert(grlang::node::apply_sized_op(Node::Type::DATA_OP_LT, Value::Type::U16, 0xFFFF, 1) == 0);
+    static_assert(grlang::node::apply_sized_op(Node::Type::DATA_OP_NEG, Value::Type::U64, 1) == -1);
+    static_assert(!grlang::node::can_fold_sized(Node::Type::DATA_OP_DIV, Value::Type::I16, -32768, -1));
+    static_assert(grlang::node::can_fold_sized(Node::Type::DATA_OP_DIV, Value::Type::U16, 0xFFFF, 0xFFFF));
+
+    auto typed = [](Node::Ptr node, Value::Type width) {
+        node->value_type = width;
+        return node;
+    };
+    auto constant = [](std::int64_t value, Value::Type type) -> Node::Ptr {
+        return std::make_shared<grlang::node::ValueNode>(Node(Node::Type::DATA_TERM, 0, {}), Value(value, type));
+    };
+    auto start = std::make_shared<Node>(Node::Type::CONTROL_START, 0, std::initializer_list<Node::Ptr>{});
+    auto x = typed(std::make_shared<Node>(Node::Type::DATA_PROJECT, 1, std::initializer_list<Node::Ptr>{start}), Value::Type::U32);
+    auto op = [&](Node::Type type, Node::Ptr a, Node::Ptr b) {
+        return grlang::node::peephole(typed(std::make_shared<Node>(type, 0, std::initializer_list<Node::Ptr>{a, b}), Value::Type::U32));
+    };
+
+    auto sum = op(Node::Type::DATA_OP_ADD, constant(0xFFFFFFFF, Value::Type::U32), constant(2, Value::Type::U32));
+    assert(get_value_i64(*sum) == 1 && grlang::node::result_type(*sum) == Value::Type::U32);
+    assert(op(Node::Type::DATA_OP_DIV, x, constant(0xFFFFFFFF, Value::Type::U32))->type == Node::Type::DATA_OP_DIV);
+    assert(op(Node::Type::DATA_OP_DIV, x, constant(4, Value::Type::U32))->type == Node::Type::DATA_OP_SHR);  // NOTE: unsigned, never negative
+    auto less = op(Node::Type::DATA_OP_LT, x, x);
+    assert(get_value_int(*less) == 0 && grlang::node::result_type(*less) == Value::Type::INTEGER);
+
+    auto wide = typed(std::make_shared<Node>(Node::Type::DATA_OP_CONVERT, 0, std::initializer_list<Node::Ptr>{constant(-1, Value::Type::INTEGER)}), Value::Type::U16);
+    assert(get_value_i64(*grlang::node::peephole(wide)) == 0xFFFF);
+}
+
+TEST_CASE(test_struct_types) {
+    using grlang::node::Node;
+    using grlang::node::Value;
+    auto point = grlang::node::struct_type({{"x", "y"}, {Value::Type::INTEGER, Value::Type::INTEGER}});
+    assert(grlang::node::is_struct_type(point));
+    assert(point == grlang::node::struct_type({{"x", "y"}, {Value::Type::INTEGER, Value::Type::INTEGER}}));
+    assert(point != grlang::node::struct_type({{"y", "x"}, {Value::Type::INTEGER, Value::Type::INTEGER}}));
+    assert(grlang::node::struct_layout(point).names.at(1) == "y");
+
+    auto start = std::make_shared<Node>(Node::Type::CONTROL_START, 0, std::initializer_list<Node::Ptr>{});
+    auto x = std::make_shared<Node>(Node::Type::DATA_PROJECT, 1, std::initializer_list<Node::Ptr>{start});
+    auto make = [&](Node::Ptr a, Node::Ptr b) {
+        auto node = std::make_shared<Node>(Node::Type::DATA_STRUCT, 0, std::initializer_list<Node::Ptr>{a, b});
+        node->value_type = point;
+        return grlang::node::peephole(node);
+    };
+    auto field = [](Node::Ptr value, std::uint8_t index) {
+        return grlang::node::peephole(std::make_shared<Node>(Node::Type::DATA_FIELD, index, std::initializer_list<Node::Ptr>{value}));
+    };
+    auto p = make(x, make_value_node(2));
+    assert(field(p, 0) == x);
+    assert(get_value_int(*field(p, 1)) == 2);
+    x->value_type = point;
+    assert(make(field(x, 0), field(x, 1)) == x);
+    assert(make(field(x, 1), field(x, 0))->type == Node::Type::DATA_STRUCT);
+}
+
+TEST_CASE(test_stats) {
+    using grlang::node::Node;
+    using grlang::node::Counter;
+    using grlang::node::Phase;
+    grlang::node::Stats stats;
+    {
+        grlang::node::StatsRecorder recorder;
+        bool second = false;
+        try {
+            grlang::node::StatsRecorder other;
+        } catch (const std::runtime_error&) {
+            second = true;
+        }
+        assert(second);
+
+        auto start = std::make_shared<Node>(Node::Type::CONTROL_START, 0, std::initializer_list<Node::Ptr>{});
+        auto x = std::make_shared<Node>(Node::Type::DATA_PROJECT, 1, std::initializer_list<Node::Ptr>{start});
+        assert(grlang::node::peephole(std::make_shared<Node>(Node::Type::DATA_OP_ADD, 0, std::initializer_list<Node::Ptr>{x, make_value_node(0)})) == x);
+        auto sum = grlang::node::peephole(std::make_shared<Node>(Node::Type::DATA_OP_ADD, 0, std::initializer_list<Node::Ptr>{make_value_node(2), make_value_node(3)}));
+        assert(get_value_int(*sum) == 5);
+        {
+            grlang::node::PhaseTimer outer(Phase::LOWER);
+            grlang::node::PhaseTimer inner(Phase::LOWER);
+        }
+        stats = recorder.stats();
+    }
+
+    std::ostringstream json;
+    grlang::node::write_stats_json(stats, json);
+    std::ostringstream trace;
+    grlang::node::write_stats_trace(stats, trace);
+    assert(trace.str().starts_with("{\"traceEvents\": ["));
+    if constexpr (grlang::node::STATS) {
+        // NOTE: start, x, 0, x+0, 2, 3, 2+3 and 5, everything made for the sums but 5 is gone again
+        assert(stats.counter(Counter::NODES_CREATED) == 8);
+        assert(stats.counter(Counter::NODES_COLLECTED) == 5);
+        assert(stats.peak_nodes == 6 && stats.peak_bytes == 6*sizeof(Node));
+        assert(stats.counter(Counter::REWRITES) == 2);
+        assert(stats.rewrites.at("add_zero") == 1 && stats.rewrites.at("fold_binary") == 1);
+        assert(stats.phase(Phase::PEEPHOLE).calls == 2);
+        assert(stats.phase(Phase::LOWER).calls == 1);
+        assert(stats.events.size() == 1 && stats.events[0].phase == Phase::LOWER);  // NOTE: peepholes are not traced
+        assert(json.str().find("\"add_zero\": 1") != std::string::npos);
+        assert(trace.str().find("\"name\": \"lower\", \"ph\": \"X\"") != std::string::npos);
+    } else {
+        assert(stats.counter(Counter::NODES_CREATED) == 0 && stats.rewrites.empty() && stats.events.empty());
+        assert(json.str().find("\"nodes_created\": 0") != std::string::npos);
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <unordered_map>
+
+#include "grlang/node.h"
+#include "grlang/loop.h"
+#include "grlang/profile.h"
+
+
+namespace grlang::opt {
+    struct Options {
+        std::size_t clone_budget = 512;  // NOTE: nodes that specialized copies of functions may add to the unit
+        std::size_t eval_steps = 10000;  // NOTE: control steps a call with known arguments may take to be folded
+        node::UnrollOptions unroll = {};
+        const node::Profile* profile = nullptr;  // NOTE: branch counts of the unit as parsed, see eval::eval_call
+    };
+
+    // Interprocedural constant propagation. Functions reachable from exports are rebuilt with call results that
+    // can be computed at compile time folded in, and calls with known argument ranges go to copies specialized for
+    // them where that decides branches or shrinks the callee. Loops are unrolled after, see node::unroll_loops.
+    // Exported functions still take any arguments
+    void optimize_unit(std::unordered_map<std::string_view, node::Node::Ptr>& exports, const Options& options = {});
+}
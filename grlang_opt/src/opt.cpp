@@ -0,0 +1,280 @@
+#include <map>
+#include <unordered_set>
+#include <algorithm>
+
+#include "grlang/opt.h"
+#include "grlang/graph.h"
+#include "grlang/range.h"
+#include "grlang/peephole.h"
+#include "grlang/loop.h"
+#include "grlang/eval.h"
+#include "grlang/stats.h"
+
+
+namespace
+{
+    using namespace grlang::node;
+
+    bool returns(const Node& func) {
+        return !func.inputs.at(0)->inputs.empty();
+    }
+
+    Node::Ptr make_value_node(std::int64_t value, Value::Type type) {
+        return std::make_shared<ValueNode>(Node(Node::Type::DATA_TERM, 0, {}), Value(value, type));
+    }
+
+    // NOTE: empty copy of func, with a fresh stop and the same signature
+    Node::Ptr make_function_node(const Node& func) {
+        auto stop = std::make_shared<Node>(Node::Type::CONTROL_STOP, 0, std::initializer_list<Node::Ptr>{});
+        return std::make_shared<ValueNode>(Node(Node::Type::DATA_TERM, 0, {stop}), static_cast<const ValueNode&>(func).value);
+    }
+
+    std::size_t decided_branches(const Graph& graph) {
+        return std::ranges::count_if(graph.control_rpo(), [&](std::uint32_t control) {
+            return graph.node(control).type == Node::Type::CONTROL_IFELSE && is_const(graph.node(graph.inputs(control)[1]));
+        });
+    }
+
+    // NOTE: data is evaluated where it is used, so the arguments of a call are narrowed by the facts of every control
+    // node that uses the call, memory nodes included. Phi inputs are used at the end of the matching region predecessor
+    std::vector<std::vector<Range>> call_arguments(const Graph& graph, const RangeAnalysis& analysis) {
+        std::vector<std::vector<Range>> arguments(graph.size());
+        std::vector<std::uint32_t> seen(graph.size(), Graph::NO_NODE);
+        std::vector<std::uint32_t> stack;
+        auto visit = [&](std::uint32_t root, std::uint32_t control) {
+            stack.push_back(root);
+            while (!stack.empty()) {
+                std::uint32_t node = stack.back();
+                stack.pop_back();
+                if (node == Graph::NO_NODE || seen[node] == control || is_control(graph.node(node))) {
+                    continue;
+                }
+                seen[node] = control;
+                if (graph.node(node).type == Node::Type::DATA_PHI || graph.node(node).type == Node::Type::DATA_TERM) {
+                    continue;
+                }
+                if (graph.node(node).type == Node::Type::DATA_CALL) {
+                    auto inputs = graph.inputs(node);
+                    arguments[node].resize(inputs.size()-1, Range::empty());
+                    for (std::size_t i=1; i<inputs.size(); ++i) {
+                        arguments[node][i-1] = join(arguments[node][i-1], analysis.range(inputs[i], control));
+                    }
+                }
+                for (std::uint32_t input: graph.inputs(node)) {
+                    stack.push_back(input);
+                }
+            }
+        };
+        for (std::uint32_t control: graph.control_rpo()) {
+            switch (graph.node(control).type) {
+                case Node::Type::CONTROL_RETURN:
+                case Node::Type::CONTROL_IFELSE:
+                    visit(graph.inputs(control)[1], control);
+                    break;
+                case Node::Type::MEMORY_NEW:
+                case Node::Type::MEMORY_LOAD:
+                case Node::Type::MEMORY_STORE:
+                case Node::Type::MEMORY_CALL:
+                    for (std::size_t i=1; i<graph.inputs(control).size(); ++i) {
+                        visit(graph.inputs(control)[i], control);
+                    }
+                    break;
+                case Node::Type::CONTROL_REGION:
+                    for (std::uint32_t phi: graph.outputs(control)) {
+                        if (graph.node(phi).type != Node::Type::DATA_PHI) {
+                            continue;
+                        }
+                        for (std::size_t i=1; i<graph.inputs(control).size(); ++i) {
+                            if (graph.inputs(control)[i] != Graph::NO_NODE) {
+                                visit(graph.inputs(phi)[i], graph.inputs(control)[i]);
+                            }
+                        }
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+        return arguments;
+    }
+
+    class UnitOptimizer {
+    public:
+        explicit UnitOptimizer(const grlang::opt::Options& options_) : options(options_), budget(options_.clone_budget) {}
+
+        // NOTE: rebuilt copy that takes any argument, its body is filled in by run
+        Node::Ptr general(const Node::Ptr& func) {
+            ensure_built(*func);
+            if (!returns(*func)) {
+                return func;  // NOTE: nothing to gain, and no start to number the graph from
+            }
+            auto [it, added] = generals.try_emplace(func.get());
+            if (added) {
+                it->second = make_function_node(*func);
+                pending.emplace_back(func, it->second);
+            }
+            return it->second;
+        }
+
+        // NOTE: function to call with arguments in the given ranges
+        Node::Ptr specialized(const Node::Ptr& func, const std::vector<Range>& arguments) {
+            Node::Ptr fallback = general(func);
+            bool unknown = std::ranges::all_of(arguments, [](Range argument) { return argument == Range{}; });
+            bool unreachable = std::ranges::any_of(arguments, &Range::is_empty);
+            if (unknown || unreachable || fallback == func || building.contains(func.get())) {
+                return fallback;
+            }
+            std::pair<const Node*, std::vector<int>> key{func.get(), {}};
+            for (Range argument: arguments) {
+                key.second.push_back(argument.lo);
+                key.second.push_back(argument.hi);
+            }
+            if (auto it = clones.find(key); it != clones.end()) {
+                return it->second;
+            }
+            clones.emplace(key, fallback);  // NOTE: stands in while the copy is built, and for good if it doesn't pay off
+            Graph graph(*func);
+            if (graph.size() > budget) {
+                return fallback;
+            }
+            auto clone = make_function_node(*func);
+            building.insert(func.get());  // NOTE: recursive calls shift the range every time, so don't nest copies
+            rebuild(func, clone, arguments);
+            building.erase(func.get());
+            Graph specialized_graph(*clone);
+            bool pays_off = decided_branches(specialized_graph) > decided_branches(graph) || specialized_graph.size() < graph.size();
+            if (!pays_off || specialized_graph.size() > budget) {
+                return fallback;
+            }
+            budget -= specialized_graph.size();
+            return clones[key] = clone;
+        }
+
+        void run() {
+            while (!pending.empty()) {
+                auto [func, copy] = std::move(pending.back());
+                pending.pop_back();
+                rebuild(func, copy, {});
+            }
+        }
+
+    private:
+        void rebuild(const Node::Ptr& func, const Node::Ptr& copy, const std::vector<Range>& arguments);
+
+        const grlang::opt::Options& options;
+        std::size_t budget;
+        std::unordered_map<const Node*, Node::Ptr> generals;
+        std::map<std::pair<const Node*, std::vector<int>>, Node::Ptr> clones;  // NOTE: keyed by argument bounds
+        std::unordered_set<const Node*> building;
+        std::vector<std::pair<Node::Ptr, Node::Ptr>> pending;
+    };
+
+    // NOTE: copies nodes with peephole, control first so data can refer to it, then data inputs first, then the
+    // inputs of control and phis, which may refer to data further down
+    void UnitOptimizer::rebuild(const Node::Ptr& func, const Node::Ptr& copy, const std::vector<Range>& arguments) {
+        Graph graph(*func);
+        auto owned = graph.owned_nodes();
+        owned[graph.function()] = func;
+        RangeAnalysis analysis(graph, arguments);
+        auto passed = call_arguments(graph, analysis);
+
+        std::vector<Node::Ptr> copies(graph.size());
+        copies[graph.function()] = general(func);  // NOTE: recursive calls may pass anything
+        for (std::uint32_t id=0; id<graph.size(); ++id) {
+            if (is_control(graph.node(id))) {
+                copies[id] = id == graph.stop() ? copy->inputs.at(0) : std::make_shared<Node>(graph.node(id).type, graph.node(id).value, std::initializer_list<Node::Ptr>{});
+                copies[id]->value_type = graph.node(id).value_type;
+            }
+        }
+        auto copy_inputs = [&](std::uint32_t id, Node& node) {
+            node.inputs.clear();
+            for (std::uint32_t input: graph.inputs(id)) {
+                node.inputs.push_back(input == Graph::NO_NODE ? nullptr : copies[input]);
+            }
+        };
+
+        for (std::uint32_t id: graph.data_postorder()) {
+            const Node& node = graph.node(id);
+            if (id == graph.function()) {
+                continue;
+            }
+            if (is_function(node)) {
+                copies[id] = general(owned[id]);
+                continue;
+            }
+            if (is_const(node)) {
+                copies[id] = owned[id];
+                continue;
+            }
+            Range known = analysis.range(id, graph.start());
+            if (known.is_constant()) {
+                copies[id] = make_value_node(known.lo, result_type(node));
+                continue;
+            }
+            auto result = std::make_shared<Node>(node.type, node.value, std::initializer_list<Node::Ptr>{});
+            result->value_type = node.value_type;
+            copy_inputs(id, *result);
+            if (node.type == Node::Type::DATA_PHI) {
+                copies[id] = result;  // NOTE: inputs along back edges are filled in below
+                continue;
+            }
+            std::uint32_t callee = node.type == Node::Type::DATA_CALL ? graph.inputs(id)[0] : Graph::NO_NODE;
+            if (callee != Graph::NO_NODE && is_function(graph.node(callee))) {
+                if (std::ranges::all_of(passed[id], &Range::is_constant)) {
+                    std::vector<std::int64_t> values;
+                    for (Range argument: passed[id]) {
+                        values.push_back(argument.lo);
+                    }
+                    if (auto value = grlang::eval::try_eval_call(owned[callee], values, options.eval_steps)) {
+                        copies[id] = make_value_node(*value, node.value_type);
+                        continue;
+                    }
+                }
+                result->inputs.at(0) = specialized(owned[callee], passed[id]);
+            }
+            copies[id] = peephole(result);
+        }
+
+        for (std::uint32_t id=0; id<graph.size(); ++id) {
+            if (is_control(graph.node(id)) || graph.node(id).type == Node::Type::DATA_PHI) {
+                if (copies[id] && copies[id]->type == graph.node(id).type) {
+                    copy_inputs(id, *copies[id]);
+                }
+            }
+        }
+        fold_branches(*copy, arguments);
+        eliminate_bounds_checks(*copy, arguments);
+
+        // NOTE: the profile counts branches of the function as parsed, they carry over to the copies of them. A
+        // function the profile never saw branch is left as it is
+        BranchCounts counts;
+        if (options.profile) {
+            auto parsed = branch_counts(*options.profile, *func);
+            for (std::uint32_t id=0; id<graph.size(); ++id) {
+                if (auto it = parsed.find(&graph.node(id)); it != parsed.end() && copies[id]) {
+                    counts[copies[id].get()] = it->second;
+                }
+            }
+        }
+        if (options.profile && counts.empty()) {
+            return;
+        }
+        if (unroll_loops(*copy, options.unroll, counts, arguments) != 0) {
+            fold_branches(*copy, arguments);  // NOTE: copies of the body may know more, e.g. a counter that is constant
+            eliminate_bounds_checks(*copy, arguments);
+        }
+    }
+}
+
+namespace grlang::opt {
+    void optimize_unit(std::unordered_map<std::string_view, node::Node::Ptr>& exports, const Options& options) {
+        node::PhaseTimer timer(node::Phase::OPTIMIZE);
+        UnitOptimizer optimizer(options);
+        for (auto& [name, node]: exports) {
+            if (is_function(*node)) {
+                node = optimizer.general(node);
+            }
+        }
+        optimizer.run();
+    }
+}
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <sstream>
+
+#include "grtest.h"
+#include "grlang/parse.h"
+#include "grlang/eval.h"
+#include "grlang/opt.h"
+#include "grlang/graph.h"
+
+
+namespace {
+    const char* FIB = "fib:= (n:int) -> int {\n    if n<2 return n\n    return fib(n-1)+fib(n-2)\n}\n";
+
+    // NOTE: callee of the call returned by main, null if main returns something else
+    grlang::node::Node::Ptr returned_callee(const grlang::node::Node::Ptr& main) {
+        auto value = main->inputs.at(0)->inputs.at(0)->inputs.at(1);
+        return value->type == grlang::node::Node::Type::DATA_CALL ? value->inputs.at(0) : nullptr;
+    }
+
+    std::size_t count_loops(const grlang::node::Node::Ptr& func) {
+        grlang::node::Graph graph(*func);
+        return std::ranges::count_if(graph.control_rpo(), [&](std::uint32_t control) {
+            return graph.node(control).type == grlang::node::Node::Type::CONTROL_REGION && graph.is_back_edge(control, 2);
+        });
+    }
+}
+
+TEST_CASE(test_fold_calls) {
+    auto code = std::string(FIB) + "main:= (arg:int)->int { return fib(10) }";
+    auto exports = grlang::parse::parse_unit(code);
+    grlang::opt::optimize_unit(exports);
+    auto result = exports.at("main")->inputs.at(0)->inputs.at(0)->inputs.at(1);
+    assert(is_const(*result) && get_value_int(*result) == 55);
+    assert(grlang::eval::eval_call(exports.at("fib"), 12) == 144);
+
+    code = "mad:= (a:int b:int c:int)->int { return a*b+c }\nmain:= (arg:int)->int { return mad(2 3 4) }";
+    exports = grlang::parse::parse_unit(code);
+    grlang::opt::optimize_unit(exports);
+    result = exports.at("main")->inputs.at(0)->inputs.at(0)->inputs.at(1);
+    assert(is_const(*result) && get_value_int(*result) == 10);
+}
+
+TEST_CASE(test_specialize_calls) {
+    auto code = std::string(FIB) + "main:= (arg:int)->int { return fib(20) }";
+    auto exports = grlang::parse::parse_unit(code);
+    grlang::opt::optimize_unit(exports, {.eval_steps=100});
+    auto callee = returned_callee(exports.at("main"));
+    assert(callee && callee != exports.at("fib"));  // NOTE: fib for n=20, too long to run at compile time
+    assert(grlang::eval::eval_call(exports.at("main"), 0) == 6765);
+    assert(grlang::eval::eval_call(exports.at("fib"), 20) == 6765);
+
+    exports = grlang::parse::parse_unit(code);
+    grlang::opt::optimize_unit(exports, {.clone_budget=0, .eval_steps=100});
+    assert(returned_callee(exports.at("main")) == exports.at("fib"));
+    assert(grlang::eval::eval_call(exports.at("main"), 0) == 6765);
+
+    exports = grlang::parse::parse_unit(
+        "clamp:= (n:int)->int { if n<0 return 0 if n>100 return 100 return n }\n"
+        "main:= (arg:int)->int { if arg<0 return 0 if arg>50 return clamp(arg) return clamp(arg) }");
+    grlang::opt::optimize_unit(exports);
+    auto main = exports.at("main");
+    for (int arg: {-5, 0, 7, 50, 51, 99, 100, 101, 1000}) {
+        assert(grlang::eval::eval_call(main, arg) == std::clamp(arg, 0, 100));
+    }
+    auto stop = main->inputs.at(0);
+    assert(stop->inputs.at(1)->inputs.at(1)->inputs.at(0) != exports.at("clamp"));  // NOTE: arg>50
+    assert(stop->inputs.at(2)->inputs.at(1)->inputs.at(0) != exports.at("clamp"));  // NOTE: 0<=arg<=50
+
+    // NOTE: the call is also used by a store, where n may be anything
+    const char* code_with_store =
+        "f:= (x:int)->int { if x>0 return 1 return 2 }\n"
+        "main:= (n:int)->int { a:=[1]int r:=f(n) if n>5 { return r } a[0]=r return a[0] }";
+    auto expected = grlang::parse::parse_unit(code_with_store);
+    exports = grlang::parse::parse_unit(code_with_store);
+    grlang::opt::optimize_unit(exports);
+    for (int arg: {-3, 0, 1, 5, 6, 20}) {
+        assert(grlang::eval::eval_call(exports.at("main"), arg) == grlang::eval::eval_call(expected.at("main"), arg));
+    }
+}
+
+TEST_CASE(test_unroll_loops) {
+    const char* code =
+        "poly:= (x:int)->int { s:=0 i:=0 while i<4 { s=s*x+i i=i+1 } return s }\n"
+        "fib:= (n:int)->int { a:=0 b:=1 i:=0 while i<n { c:=a+b a=b b=c i=i+1 } return a }\n"
+        "squares:= (n:int)->int { a:=[n]int i:=0 while i<n { a[i]=i*i i=i+1 } s:=0 j:=0 while j<n { s=s+a[j]*(j-n/2) j=j+1 } return s }\n";
+    auto expected = grlang::parse::parse_unit(code);
+    auto exports = grlang::parse::parse_unit(code);
+    grlang::opt::optimize_unit(exports);
+    assert(count_loops(exports.at("poly")) == 0);
+    assert(count_loops(exports.at("fib")) == 2);  // NOTE: four iterations per check, then the rest one by one
+    for (int arg: {0, 1, 2, 3, 4, 5, 9, 23}) {
+        for (auto name: {"poly", "fib", "squares"}) {
+            assert(grlang::eval::eval_call(exports.at(name), arg) == grlang::eval::eval_call(expected.at(name), arg));
+        }
+    }
+    assert(grlang::eval::eval_call(exports.at("poly"), -3) == grlang::eval::eval_call(expected.at("poly"), -3));
+    assert(grlang::eval::eval_call(exports.at("fib"), -1) == 0);
+
+    exports = grlang::parse::parse_unit(code);
+    grlang::opt::optimize_unit(exports, {.unroll={.budget=0}});
+    assert(count_loops(exports.at("poly")) == 1 && count_loops(exports.at("fib")) == 1);
+
+    // NOTE: loops that ran once or never are left alone, and so are functions that never ran
+    grlang::node::Profile profile;
+    std::int64_t one = 1;
+    grlang::eval::eval_call(expected.at("fib"), std::span(&one, 1), profile);
+    std::stringstream text;
+    grlang::node::write_profile(profile, text);
+    auto loaded = grlang::node::read_profile(text);
+    assert(loaded.branches.size() == 1 && loaded.branches.begin()->second.taken[0] == 1 && loaded.branches.begin()->second.taken[1] == 1);
+    exports = grlang::parse::parse_unit(code);
+    grlang::opt::optimize_unit(exports, {.profile=&loaded});
+    assert(count_loops(exports.at("fib")) == 1 && count_loops(exports.at("poly")) == 1);
+
+    std::int64_t many = 40;
+    grlang::eval::eval_call(expected.at("fib"), std::span(&many, 1), profile);
+    exports = grlang::parse::parse_unit(code);
+    grlang::opt::optimize_unit(exports, {.profile=&profile});
+    assert(count_loops(exports.at("fib")) == 2);
+    assert(grlang::eval::eval_call(exports.at("fib"), 11) == 89);
+}
@@ -2,6 +2,9 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
+#include <span>
+#include <unordered_map>
 
 
 namespace grlang::parse::detail {
@@ -9,6 +12,14 @@ namespace grlang::parse::detail {
         IDENTIFIER,
         LITERAL_INT,
 
+        KEYWORD_RETURN,
+        KEYWORD_IF,
+        KEYWORD_ELSE,
+        KEYWORD_WHILE,
+        KEYWORD_BREAK,
+        KEYWORD_CONTINUE,
+        KEYWORD_LEN,  // NOTE: not a statement, keep it after the statement keywords
+
         META_BINARY_BEGIN,  // NOTE: put binary operation tags between META_BINARY_BEGIN and META_BINARY_END
         OPERATOR_PLUS,
         OPERATOR_MINUS,
@@ -30,6 +41,7 @@ namespace grlang::parse::detail {
         COMMA,
         SEMICOLON,
         ARROW,
+        DOT,
 
         OPEN_CURLY,
         CLOSE_CURLY,
@@ -38,14 +50,30 @@ namespace grlang::parse::detail {
         OPEN_SQUARE,
         CLOSE_SQUARE,
 
-        END_OF_INPUT,
+        END_OF_INPUT,  // NOTE: keep END_OF_INPUT and INVALID_INPUT last, both terminate a token stream
         INVALID_INPUT,
     };
 
+    using Symbol = std::uint32_t;
+
+    struct SymbolTable {
+        std::unordered_map<std::string_view, Symbol> ids;
+        std::vector<std::string_view> names;
+
+        Symbol intern(std::string_view name);
+    };
+
     struct Token {
         TokenType type;
         std::string_view value;
+        Symbol symbol = 0;  // NOTE: only set for identifiers
     };
 
-    Token read_token(std::string_view& code);
+    Token read_token(std::string_view& code, SymbolTable& symbols);
+    // Batch mode: fills buffer ahead of the parser, stopping after END_OF_INPUT/INVALID_INPUT, returns the number of tokens read
+    std::size_t read_tokens(std::string_view& code, SymbolTable& symbols, std::span<Token> buffer);
+    // Whole input, always terminated by an END_OF_INPUT or INVALID_INPUT token
+    std::vector<Token> tokenize(std::string_view code, SymbolTable& symbols);
+
+    int svtoi(std::string_view digits);
 }
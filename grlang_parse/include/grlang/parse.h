@@ -1,11 +1,51 @@
 #pragma once
 
 
+#include <cstddef>
+#include <memory>
 #include <string>
+#include <vector>
 #include <unordered_map>
 #include "grlang/node.h"
 
 
 namespace grlang::parse {
-    std::unordered_map<std::string_view, grlang::node::Node::Ptr> parse_unit(std::string_view code);
+    struct ParseOptions {
+        std::size_t threads = 0;  // NOTE: 0 means one per hardware thread
+        bool lazy = false;  // NOTE: top-level function bodies are parsed on first use, see node::ensure_built
+    };
+
+    // Top-level function bodies are parsed concurrently, each into its own graph. Returned nodes refer into code
+    std::unordered_map<std::string_view, grlang::node::Node::Ptr> parse_unit(std::string_view code, const ParseOptions& options = {});
+
+    struct TextEdit {
+        std::size_t offset;
+        std::size_t length;  // NOTE: number of bytes replaced
+        std::string_view text;
+    };
+
+    // Parsed unit that owns its code, so edits only rebuild the top-level functions they can affect
+    class Unit {
+    public:
+        struct Function {
+            std::size_t begin;  // NOTE: byte range of the function expression in the code
+            std::size_t end;
+            std::vector<std::pair<std::string, node::Node::Ptr>> uses;  // NOTE: names in the body and the globals they referred to
+            node::Node::Ptr node;
+        };
+
+        explicit Unit(std::string code, const ParseOptions& options = {});
+
+        // Returns the names of exports that were added, removed or changed, sorted
+        std::vector<std::string> edit(const TextEdit& edit);
+
+        const std::string& code() const { return *code_; }
+        const std::unordered_map<std::string_view, node::Node::Ptr>& exports() const { return exports_; }
+
+    private:
+        std::shared_ptr<const std::string> code_;  // NOTE: shared with bodies not built yet
+        ParseOptions options_;
+        std::unordered_map<std::string_view, node::Node::Ptr> exports_;
+        std::unordered_map<std::string, Function> functions_;
+    };
 }
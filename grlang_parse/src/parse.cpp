@@ -2,23 +2,28 @@
 #include <cstdint>
 #include <cassert>
 #include <format>
-#include <unordered_set>
 #include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <span>
+#include <optional>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <limits>
+#include <ranges>
 
 #include "grlang/detail/token.h"
 #include "grlang/parse.h"
+#include "grlang/peephole.h"
+#include "grlang/range.h"
+#include "grlang/aggregate.h"
+#include "grlang/stats.h"
 
 
 namespace {
     using grlang::parse::detail::TokenType;
-
-    int svtoi(const std::string_view& sv) {
-        int result = 0;
-        for (char c: sv) {
-            result = result*10 + c - '0';
-        }
-        return result;
-    }
+    using grlang::parse::detail::svtoi;
 
     grlang::node::Node::Type operation_type(grlang::parse::detail::TokenType token) {
         switch (token) {
@@ -83,69 +88,20 @@ namespace {
         return make_node(type, 0, {});
     }
 
+    std::shared_ptr<grlang::node::LazyFunctionNode> make_lazy_function_node(grlang::node::Node::Ptr stop, grlang::node::Value::Signature signature) {
+        return std::make_shared<grlang::node::LazyFunctionNode>(grlang::node::ValueNode{grlang::node::Node(grlang::node::Node::Type::DATA_TERM, grlang::node::LAZY_FUNCTION, {stop}), grlang::node::Value(std::move(signature))});
+    }
+
+    grlang::node::Node::Ptr make_function_node(grlang::node::Node::Ptr stop, grlang::node::Value::Signature signature) {
+        return std::make_shared<grlang::node::ValueNode>(grlang::node::Node(grlang::node::Node::Type::DATA_TERM, 0, {stop}), grlang::node::Value(std::move(signature)));
+    }
+
     grlang::node::Node::Ptr make_value_node(int value) {
         // TODO: cache constants like 0 and 1
         return std::make_shared<grlang::node::ValueNode>(grlang::node::Node(grlang::node::Node::Type::DATA_TERM, 0, {}), grlang::node::Value(value));
     }
 
-    grlang::node::Node::Ptr peephole(grlang::node::Node::Ptr node) {
-        if (grlang::node::is_binary_op(*node) && is_const(*node->inputs.at(0)) && is_const(*node->inputs.at(1))) {
-            return make_value_node(op_func(node->type)(get_value_int(*node->inputs.at(0)), get_value_int(*node->inputs.at(1))));
-        }
-        switch (node->type) {
-            case grlang::node::Node::Type::DATA_OP_NEG:
-                if (is_const(*node->inputs.at(0))) {
-                    return make_value_node(-get_value_int(*node->inputs.at(0)));
-                }
-                break;
-            case grlang::node::Node::Type::DATA_OP_NOT:
-                if (is_const(*node->inputs.at(0))) {
-                    return make_value_node(get_value_int(*node->inputs.at(0)) == 0 ? 1 : 0);
-                }
-                break;
-            case grlang::node::Node::Type::DATA_OP_ADD:
-                if (is_const(*node->inputs.at(0))) {
-                    std::swap(node->inputs.at(0), node->inputs.at(1));
-                }
-                if (is_const(*node->inputs.at(1))) {
-                    if (get_value_int(*node->inputs.at(1))==0) {
-                        return node->inputs.at(0);
-                    }
-                    if (node->inputs.at(0)->type == grlang::node::Node::Type::DATA_OP_ADD && is_const(*node->inputs.at(0)->inputs.at(1))) {
-                        return make_node(grlang::node::Node::Type::DATA_OP_ADD, {node->inputs.at(0)->inputs.at(0), make_value_node(get_value_int(*node->inputs.at(0)->inputs.at(1)) + get_value_int(*node->inputs.at(1)))});
-                    }
-                }
-                break;
-            case grlang::node::Node::Type::DATA_PHI:
-                if (node->inputs.at(0)->inputs.at(1)->type == grlang::node::Node::Type::CONTROL_DEAD) {
-                    return node->inputs.at(2);
-                }
-                if (node->inputs.at(0)->inputs.at(2)->type == grlang::node::Node::Type::CONTROL_DEAD) {
-                    return node->inputs.at(1);
-                }
-                break;
-            case grlang::node::Node::Type::CONTROL_PROJECT:
-                if (node->inputs.at(0)->type == grlang::node::Node::Type::CONTROL_IFELSE && is_const(*node->inputs.at(0)->inputs.at(1))) {
-                    if ((node->value==0) == (get_value_int(*node->inputs.at(0)->inputs.at(1))==1)) {
-                        return node->inputs.at(0)->inputs.at(0);
-                    } else {
-                        return make_node(grlang::node::Node::Type::CONTROL_DEAD);
-                    }
-                }
-                break;
-            case grlang::node::Node::Type::CONTROL_REGION:
-                if (node->inputs.at(1)->type == grlang::node::Node::Type::CONTROL_DEAD) {
-                    return node->inputs.at(2);
-                }
-                if (node->inputs.at(2)->type == grlang::node::Node::Type::CONTROL_DEAD) {
-                    return node->inputs.at(1);
-                }
-                break;
-            default:
-                return node;
-        }
-        return node;
-    }
+    using grlang::node::peephole;
 
     grlang::node::Node::Ptr make_peep_node(grlang::node::Node::Type type, std::initializer_list<grlang::node::Node::Ptr> inputs) {
         return peephole(make_node(type, inputs));
@@ -155,98 +111,469 @@ namespace {
         return peephole(make_node(type, value, inputs));
     }
 
-    struct Scope {
-        using Dict = std::unordered_map<std::string_view, grlang::node::Node::Ptr>;
+    grlang::node::Node::Ptr make_typed_peep_node(grlang::node::Node::Type type, grlang::node::Value::Type width, std::initializer_list<grlang::node::Node::Ptr> inputs) {
+        auto node = make_node(type, inputs);
+        node->value_type = width;
+        return peephole(node);
+    }
+
+    // NOTE: integer type of a value, nullopt for functions and the like
+    std::optional<grlang::node::Value::Type> int_type(const grlang::node::Node& node) {
+        auto type = grlang::node::result_type(node);
+        return grlang::node::is_int_type(type) ? std::optional(type) : std::nullopt;
+    }
+
+    // NOTE: integers, arrays and structs, the values a node can hold and a struct field can be
+    bool is_value_type(grlang::node::Value::Type type) {
+        return grlang::node::is_int_type(type) || grlang::node::is_array_type(type) || grlang::node::is_struct_type(type);
+    }
+
+    // NOTE: type a phi or a parameter holding the value takes, int for functions and the like
+    grlang::node::Value::Type value_type(const grlang::node::Node& node) {
+        auto type = grlang::node::result_type(node);
+        return is_value_type(type) ? type : grlang::node::Value::Type::INTEGER;
+    }
+
+    int int_bits(grlang::node::Value::Type type) {
+        return grlang::node::visit_int_type(type, [](auto tag) { return static_cast<int>(sizeof(tag) * 8); });
+    }
 
-        std::vector<Dict> stack;
+    grlang::node::Value::Type make_struct_type(grlang::node::StructLayout layout) {
+        if (layout.names.empty() || layout.names.size() > std::numeric_limits<std::uint8_t>::max()) {
+            throw std::runtime_error("a struct has 1 to 255 fields");
+        }
+        for (std::size_t i=0; i<layout.names.size(); ++i) {
+            if (!is_value_type(layout.types[i])) {
+                throw std::runtime_error("struct fields hold integers, arrays or structs");
+            }
+            if (std::ranges::count(layout.names, layout.names[i]) > 1) {
+                throw std::runtime_error(std::format("field {} defined twice", layout.names[i]));
+            }
+        }
+        return grlang::node::struct_type(std::move(layout));
+    }
+
+    grlang::node::Node::Ptr make_struct(grlang::node::Value::Type type, std::vector<grlang::node::Node::Ptr> fields) {
+        auto node = make_node(grlang::node::Node::Type::DATA_STRUCT);
+        node->inputs = std::move(fields);
+        node->value_type = type;
+        return peephole(node);
+    }
+
+    grlang::node::Node::Ptr make_field(const grlang::node::Node::Ptr& value, std::uint8_t index) {
+        auto node = make_node(grlang::node::Node::Type::DATA_FIELD, index, {value});
+        node->value_type = grlang::node::struct_layout(grlang::node::result_type(*value)).types.at(index);
+        return peephole(node);
+    }
+
+    std::vector<grlang::node::Node::Ptr> make_fields(const grlang::node::Node::Ptr& value) {
+        std::vector<grlang::node::Node::Ptr> fields;
+        for (std::size_t i=0; i<grlang::node::struct_layout(grlang::node::result_type(*value)).types.size(); ++i) {
+            fields.push_back(make_field(value, static_cast<std::uint8_t>(i)));
+        }
+        return fields;
+    }
+
+    grlang::node::Node::Ptr convert_struct(grlang::node::Node::Ptr node, grlang::node::Value::Type type);
+
+    // Implicit conversion of an integer value to another integer type, other values are left as they are
+    grlang::node::Node::Ptr convert(grlang::node::Node::Ptr node, grlang::node::Value::Type type) {
+        if (grlang::node::is_struct_type(type) || grlang::node::is_struct_type(grlang::node::result_type(*node))) {
+            return convert_struct(std::move(node), type);
+        }
+        auto source = grlang::node::result_type(*node);
+        if (grlang::node::is_int_type(type) && (grlang::node::is_array_type(source) || source == grlang::node::Value::Type::FUNCTION)) {
+            throw std::runtime_error("arrays and functions don't convert to integers");
+        }
+        if (grlang::node::is_array_type(type) && source != type) {
+            throw std::runtime_error("array types don't match");
+        }
+        auto from = int_type(*node);
+        if (!from || !grlang::node::is_int_type(type) || *from == type) {
+            return node;
+        }
+        return make_typed_peep_node(grlang::node::Node::Type::DATA_OP_CONVERT, type, {node});
+    }
+
+    // NOTE: a struct converts to a struct type with the same field names, field by field
+    grlang::node::Node::Ptr convert_struct(grlang::node::Node::Ptr node, grlang::node::Value::Type type) {
+        auto from = grlang::node::result_type(*node);
+        if (from == type || (!grlang::node::is_struct_type(type) && !is_value_type(type))) {
+            return node;  // NOTE: functions and the like, which are not checked yet
+        }
+        if (!grlang::node::is_struct_type(from) || !grlang::node::is_struct_type(type) || grlang::node::struct_layout(from).names != grlang::node::struct_layout(type).names) {
+            throw std::runtime_error("struct types don't match");
+        }
+        auto fields = make_fields(node);
+        for (std::size_t i=0; i<fields.size(); ++i) {
+            fields[i] = convert(std::move(fields[i]), grlang::node::struct_layout(type).types[i]);
+        }
+        return make_struct(type, std::move(fields));
+    }
+
+    // NOTE: type both operands of a binary operation are converted to. An int constant takes the type of the other
+    // operand, otherwise the wider type wins and unsigned wins a tie
+    grlang::node::Value::Type common_type(const grlang::node::Node& left, const grlang::node::Node& right) {
+        auto a = int_type(left).value_or(grlang::node::Value::Type::INTEGER);
+        auto b = int_type(right).value_or(grlang::node::Value::Type::INTEGER);
+        if (a == b) {
+            return a;
+        }
+        if (is_const(left) && a == grlang::node::Value::Type::INTEGER) {
+            return b;
+        }
+        if (is_const(right) && b == grlang::node::Value::Type::INTEGER) {
+            return a;
+        }
+        if (int_bits(a) != int_bits(b)) {
+            return int_bits(a) > int_bits(b) ? a : b;
+        }
+        return grlang::node::is_unsigned_type(a) ? a : b;
+    }
+
+    using grlang::parse::detail::Symbol;
+
+    // Variable changes since a Scope::Mark, enough to rebuild that state without copying the whole scope
+    struct Snapshot {
         grlang::node::Node::Ptr control;
+        std::unordered_map<Symbol, std::pair<grlang::node::Node::Ptr, grlang::node::Node::Ptr>> changes;  // NOTE: value at the mark, value at the snapshot
+    };
+
+    // Every value a unit scope variable takes, so function bodies parsed later see globals as of their declaration
+    struct GlobalHistory {
+        std::vector<std::vector<std::pair<std::size_t, grlang::node::Node::Ptr>>> values;  // NOTE: indexed by symbol, (version, value) in version order
+        std::size_t version = 0;
+
+        void record(Symbol name, const grlang::node::Node::Ptr& value) {
+            if (name >= values.size()) {
+                values.resize(name+1);
+            }
+            values[name].emplace_back(version, value);
+        }
 
-        grlang::node::Node::Ptr lookup(const std::string_view& name) const {
-            for (auto dict = stack.rbegin(); dict!=stack.rend(); ++dict) {
-                if (auto it = dict->find(name); it != dict->end()) {
-                    return it->second;
+        grlang::node::Node::Ptr lookup(Symbol name, std::size_t at) const {
+            if (name >= values.size()) {
+                return nullptr;
+            }
+            auto it = std::ranges::upper_bound(values[name], at, {}, &std::pair<std::size_t, grlang::node::Node::Ptr>::first);
+            return it == values[name].begin() ? nullptr : std::prev(it)->second;
+        }
+    };
+
+    // What top-level function bodies are parsed from, shared by their build functions
+    struct UnitSource {
+        std::shared_ptr<const std::string> code;  // NOTE: set when the code is owned by a Unit, tokens point into it
+        std::vector<grlang::parse::detail::Token> tokens;
+        GlobalHistory history;
+    };
+
+    bool same_value(const grlang::node::Node::Ptr& a, const grlang::node::Node::Ptr& b) {
+        if (a == b) {
+            return true;
+        }
+        if (!a || !b || is_function(*a)) {
+            return false;  // NOTE: functions are the same only by identity, their graph may still be unbuilt
+        }
+        std::vector<const grlang::node::Node*> a_callees;
+        std::vector<const grlang::node::Node*> b_callees;
+        return grlang::node::hash_graph(a, &a_callees) == grlang::node::hash_graph(b, &b_callees) && a_callees == b_callees;
+    }
+
+    // Top-level functions of a Unit before an edit, reused when neither their text nor the globals they name changed
+    struct Reparse {
+        const std::unordered_map<std::string, grlang::parse::Unit::Function>* previous;
+        grlang::parse::TextEdit edit;
+        std::unordered_map<std::string, grlang::parse::Unit::Function>* functions;  // NOTE: filled in for the edited code
+        std::string_view code;
+        const grlang::parse::detail::SymbolTable* symbols = nullptr;
+
+        bool unchanged(const grlang::parse::Unit::Function& before, const grlang::parse::Unit::Function& after) const {
+            if (before.end <= edit.offset) {
+                if (after.begin != before.begin || after.end != before.end) {
+                    return false;
+                }
+            } else if (before.begin >= edit.offset + edit.length) {
+                std::size_t shift = edit.text.size() - edit.length;  // NOTE: wraps around for deletions, as do the offsets
+                if (after.begin != before.begin + shift || after.end != before.end + shift) {
+                    return false;
                 }
+            } else {
+                return false;
+            }
+            return std::ranges::equal(before.uses, after.uses, [](auto& a, auto& b) { return a.first == b.first && same_value(a.second, b.second); });
+        }
+    };
+
+    // Top-level function whose body is parsed separately from the rest of the unit
+    struct FunctionBody {
+        Symbol name;
+        std::vector<Symbol> params;
+        std::vector<std::pair<Symbol, grlang::node::Node::Ptr>> globals;  // NOTE: global frame at the point of declaration
+        const GlobalHistory* history;  // NOTE: globals are looked up here instead when set
+        std::size_t version;
+        std::span<const grlang::parse::detail::Token> tokens;  // NOTE: from the opening brace to the matching closing one
+        grlang::node::Node::Ptr func_ptr;
+    };
+
+    struct Scope {
+        struct Mark {
+            std::size_t trail_size;
+            std::size_t frame_size;
+        };
+        struct Undo {
+            Symbol name;
+            grlang::node::Node::Ptr value;
+        };
+        struct Loop {
+            grlang::node::Node::Ptr region;
+            std::optional<std::vector<Symbol>> assigned;  // NOTE: sorted, empty optional when anything may be assigned
+            std::vector<std::pair<Symbol, grlang::node::Node::Ptr>> phis;
+        };
+
+        std::vector<grlang::node::Node::Ptr> values;  // NOTE: indexed by symbol, null when not in scope
+        std::vector<std::vector<Symbol>> stack;  // NOTE: symbols declared in each frame
+        grlang::node::Node::Ptr control;
+        std::vector<Undo> trail;  // NOTE: overwritten values, only recorded while a mark is open
+        std::size_t open_marks = 0;
+        std::vector<Loop> loops;
+        std::vector<std::uint32_t> loop_depth;  // NOTE: indexed by symbol, number of enclosing loops the value already accounts for
+        std::shared_ptr<UnitSource> unit;  // NOTE: set on the unit scope, records globals for function bodies parsed later
+        std::vector<grlang::node::Node::Ptr>* deferred = nullptr;  // NOTE: set on the unit scope, functions whose bodies are not built yet
+        Reparse* reparse = nullptr;  // NOTE: set on the unit scope of a Unit
+        const GlobalHistory* globals = nullptr;  // NOTE: set on function scopes, globals are brought into scope on first use
+        std::size_t globals_version = 0;
+        grlang::node::Value::Type return_type = grlang::node::Value::Type::INTEGER;  // NOTE: returned values are converted to it
+
+        grlang::node::Node::Ptr lookup(Symbol name) {
+            if (bound(name)) {
+                enter_loops(name);
+                return values[name];
             }
             throw std::runtime_error("not defined");
         }
 
-        void update(const std::string_view& name, grlang::node::Node::Ptr node) {
-            for (auto dict = stack.rbegin(); dict!=stack.rend(); ++dict) {
-                if (auto it = dict->find(name); it != dict->end()) {
-                    it->second = node;
-                    return;
-                }
+        void update(Symbol name, grlang::node::Node::Ptr node) {
+            if (bound(name)) {
+                enter_loops(name);
+                set(name, node);
+                return;
             }
             throw std::runtime_error("not defined");
         }
 
-        void declare(const std::string_view& name, grlang::node::Node::Ptr node) {
-            for (auto dict = stack.rbegin(); dict!=stack.rend(); ++dict) {
-                if (auto it = dict->find(name); it != dict->end()) {
-                    throw std::runtime_error("already defined");
-                }
+        void declare(Symbol name, grlang::node::Node::Ptr node) {
+            if (bound(name)) {
+                throw std::runtime_error("already defined");
+            }
+            if (name >= values.size()) {
+                values.resize(name+1);
+                loop_depth.resize(name+1);
             }
-            stack.back()[name] = node;
+            set(name, node);
+            loop_depth[name] = loops.size();
+            stack.back().push_back(name);
         }
 
-        grlang::node::Node::Ptr merge(const Scope& src1, const Scope& src2) {
-            auto region = make_node(grlang::node::Node::Type::CONTROL_REGION, {nullptr, src1.control, src2.control});
-            for (std::size_t i=0; i<stack.size(); ++i) {
-                for (auto& [key, val] : stack.at(i)) {
-                    if (src1.stack.at(i).at(key) != src2.stack.at(i).at(key)) {  // TODO: make into a value comparison
-                        val = make_peep_node(grlang::node::Node::Type::DATA_PHI, {region, src1.stack.at(i).at(key), src2.stack.at(i).at(key)});
-                    } else {
-                        val = src1.stack.at(i).at(key);
-                    }
-                }
+        void push_frame() {
+            stack.emplace_back();
+        }
+
+        void pop_frame() {
+            for (Symbol name: stack.back()) {
+                assign(name, nullptr);
             }
-            return control = peephole(region);
+            stack.pop_back();
         }
 
-        grlang::node::Node::Ptr start_loop() {
-            auto region = make_node(grlang::node::Node::Type::CONTROL_REGION, {nullptr, control, nullptr});
-            for (std::size_t i=0; i<stack.size(); ++i) {
-                for (auto& [key, val] : stack.at(i)) {
-                    val = make_node(grlang::node::Node::Type::DATA_PHI, {region, val, nullptr});
+        Mark mark() {
+            ++open_marks;
+            return {trail.size(), stack.back().size()};
+        }
+
+        Snapshot snapshot(const Mark& mark) const {
+            Snapshot result{control, {}};
+            for (std::size_t i=mark.trail_size; i<trail.size(); ++i) {
+                result.changes.try_emplace(trail[i].name, trail[i].value, nullptr);
+            }
+            std::erase_if(result.changes, [](auto& change) { return !change.second.first; });  // NOTE: declared after the mark
+            for (auto& [name, change]: result.changes) {
+                change.second = values[name];
+            }
+            return result;
+        }
+
+        void rollback(const Mark& mark) {
+            while (trail.size() > mark.trail_size) {
+                assign(trail.back().name, std::move(trail.back().value));
+                trail.pop_back();
+            }
+            stack.back().resize(mark.frame_size);
+        }
+
+        void release() {
+            if (--open_marks == 0) {
+                trail.clear();
+            }
+        }
+
+        void apply(const Snapshot& snapshot) {
+            for (auto& [name, change]: snapshot.changes) {
+                set(name, change.second);
+            }
+            control = snapshot.control;
+        }
+
+        void start_loop(const grlang::node::Node::Ptr& region, std::optional<std::vector<Symbol>> assigned) {
+            loops.push_back({region, std::move(assigned), {}});
+        }
+
+        // Returns the phis created for the loop, their back edge still to be filled in
+        std::vector<std::pair<Symbol, grlang::node::Node::Ptr>> end_loop() {
+            auto phis = std::move(loops.back().phis);
+            loops.pop_back();
+            for (auto& [name, phi]: phis) {
+                loop_depth[name] = loops.size();
+                if (open_marks) {
+                    trail.push_back({name, phi->inputs.at(1)});  // NOTE: as if the phi was set when the loop started
                 }
             }
-            return region;
+            return phis;
         }
 
-        void end_loop(const Scope& loop_scope) {
-            for (std::size_t i=0; i<stack.size(); ++i) {
-                for (auto& [key, val] : stack.at(i)) {
-                    assert(val->type == grlang::node::Node::Type::DATA_PHI);
-                    assert(val->inputs.at(2) == nullptr);
-                    if (val != loop_scope.stack.at(i).at(key)) {
-                        val->inputs.at(2) = loop_scope.stack.at(i).at(key);
-                    } else {
-                        val->inputs.at(2) = val->inputs.at(1);
-                    }
+        // Phis are only made for loops that may assign the variable, the first time the variable is used inside them
+        void enter_loops(Symbol name) {
+            for (auto depth = loop_depth[name]; depth < loops.size(); ++depth) {
+                auto& loop = loops.at(depth);
+                if (!loop.assigned || std::ranges::binary_search(*loop.assigned, name)) {
+                    // NOTE: not recorded in the trail, the value has been this phi since the loop started
+                    auto phi = make_node(grlang::node::Node::Type::DATA_PHI, {loop.region, values[name], nullptr});
+                    phi->value_type = value_type(*values[name]);
+                    values[name] = std::move(phi);
+                    loop.phis.emplace_back(name, values[name]);
                 }
             }
+            loop_depth[name] = loops.size();
+        }
+
+        bool bound(Symbol name) {
+            if (name < values.size() && values[name]) {
+                return true;
+            }
+            auto global = globals ? globals->lookup(name, globals_version) : nullptr;
+            if (!global) {
+                return false;
+            }
+            if (name >= values.size()) {
+                values.resize(name+1);
+                loop_depth.resize(name+1);
+            }
+            values[name] = std::move(global);  // NOTE: not recorded in the trail, the global has been in scope all along
+            loop_depth[name] = 0;
+            stack.front().push_back(name);
+            return true;
+        }
+
+        void set(Symbol name, grlang::node::Node::Ptr node) {
+            if (open_marks) {
+                trail.push_back({name, std::move(values[name])});
+            }
+            assign(name, std::move(node));
+        }
+
+        void assign(Symbol name, grlang::node::Node::Ptr node) {
+            if (unit) {
+                unit->history.record(name, node);
+            }
+            values[name] = std::move(node);
         }
     };
 
+    Snapshot merge(const Snapshot& src1, const Snapshot& src2) {
+        auto region = make_node(grlang::node::Node::Type::CONTROL_REGION, {nullptr, src1.control, src2.control});
+        Snapshot result;
+        auto merge_value = [&](Symbol name, const grlang::node::Node::Ptr& base) {
+            auto value1 = src1.changes.contains(name) ? src1.changes.at(name).second : base;
+            auto value2 = src2.changes.contains(name) ? src2.changes.at(name).second : base;
+            if (value1 != value2) {  // TODO: make into a value comparison
+                auto width = value1 ? value_type(*value1) : grlang::node::Value::Type::INTEGER;
+                result.changes.try_emplace(name, base, make_typed_peep_node(grlang::node::Node::Type::DATA_PHI, width, {region, value1, value2}));
+            } else {
+                result.changes.try_emplace(name, base, value1);
+            }
+        };
+        for (auto& [name, change]: src1.changes) {
+            merge_value(name, change.first);
+        }
+        for (auto& [name, change]: src2.changes) {
+            if (!result.changes.contains(name)) {
+                merge_value(name, change.first);
+            }
+        }
+        result.control = peephole(region);
+        return result;
+    }
+
     struct LoopState {
-        Scope* break_;
-        Scope* continue_;
+        Scope::Mark mark;
+        std::optional<Snapshot>* break_;
+        std::optional<Snapshot>* continue_;
     };
 
     struct Parser {
-        std::string_view code;
+        std::span<const grlang::parse::detail::Token> tokens;
+        std::size_t position = 0;  // NOTE: index of next_token
         grlang::parse::detail::Token next_token;
 
-        Parser(std::string_view code_) : code(code_) {
-            read_next_token();
-        }
+        Parser(std::span<const grlang::parse::detail::Token> tokens_) : tokens(tokens_), next_token(tokens_.front()) {}
 
         const grlang::parse::detail::Token& read_next_token() {
-            next_token = grlang::parse::detail::read_token(code);
+            position = std::min(position+1, tokens.size()-1);  // NOTE: keep returning the terminating token
+            next_token = tokens[position];
             return next_token;
         }
     };
 
+    // Variables assigned in a braced loop body, found by scanning ahead from the loop condition
+    std::optional<std::vector<Symbol>> scan_loop_assignments(const Parser& parser) {
+        auto tokens = parser.tokens.subspan(parser.position);
+        std::size_t i = 0;
+        for (int round_depth = 0; i < tokens.size(); ++i) {
+            auto type = tokens[i].type;
+            if (type == TokenType::OPEN_ROUND) {
+                ++round_depth;
+            } else if (type == TokenType::CLOSE_ROUND) {
+                --round_depth;
+            } else if (type == TokenType::OPEN_CURLY && round_depth == 0) {
+                auto previous = i ? tokens[i-1].type : TokenType::KEYWORD_WHILE;
+                if (previous != TokenType::IDENTIFIER && previous != TokenType::LITERAL_INT && previous != TokenType::CLOSE_ROUND &&
+                        previous != TokenType::CLOSE_SQUARE && previous != TokenType::CLOSE_CURLY) {
+                    return std::nullopt;  // NOTE: where an operand goes, a struct literal and not the body
+                }
+                break;
+            } else if ((type >= TokenType::KEYWORD_RETURN && type <= TokenType::KEYWORD_CONTINUE) ||
+                       (type >= TokenType::DECLARE_TYPE && type <= TokenType::REBIND) ||
+                       type == TokenType::ARROW || type >= TokenType::END_OF_INPUT) {
+                return std::nullopt;  // NOTE: single statement body or a function literal, assume anything may be assigned
+            }
+        }
+        std::vector<Symbol> assigned;
+        for (int curly_depth = 0; i+1 < tokens.size(); ++i) {
+            if (tokens[i].type == TokenType::OPEN_CURLY) {
+                ++curly_depth;
+            } else if (tokens[i].type == TokenType::CLOSE_CURLY && --curly_depth == 0) {
+                break;
+            } else if (tokens[i].type == TokenType::IDENTIFIER && tokens[i+1].type == TokenType::REBIND) {
+                std::size_t variable = i;  // NOTE: p.x = v assigns p
+                while (variable >= 2 && tokens[variable-1].type == TokenType::DOT && tokens[variable-2].type == TokenType::IDENTIFIER) {
+                    variable -= 2;
+                }
+                assigned.push_back(tokens[variable].symbol);
+            }
+        }
+        std::ranges::sort(assigned);
+        return assigned;
+    }
+
     const grlang::parse::detail::Token& expect_token(TokenType type, Parser& parser) {
         if (parser.next_token.type != type) {
             throw std::runtime_error(std::format("Expected {}, but got {}", static_cast<std::uint8_t>(type), parser.next_token.value));  // TODO: report line etc...
@@ -254,19 +581,122 @@ namespace {
         return parser.read_next_token();   
     }
 
-    grlang::node::Node::Ptr parse_expression(Parser& parser, const Scope& scope, std::uint8_t prev_precedence=255) {
+    void check_call(const grlang::node::Node& call) {
+        auto& callee = *call.inputs.at(0);
+        if (!is_function(callee)) {
+            throw std::runtime_error("not a function");  // NOTE: also a value that may hold one of several, calls are always direct
+        }
+        if (get_signature(callee).params.size() != call.inputs.size()-1) {
+            throw std::runtime_error(std::format("expected {} arguments, but got {}", get_signature(callee).params.size(), call.inputs.size()-1));
+        }
+    }
+
+    // NOTE: arguments are converted to the parameter types, the call gives the result type
+    void convert_call(grlang::node::Node& call) {
+        auto& callee = *call.inputs.at(0);
+        if (!is_function(callee)) {
+            return;
+        }
+        auto& signature = get_signature(callee);
+        for (std::size_t i=0; i<signature.params.size(); ++i) {
+            call.inputs.at(i+1) = convert(call.inputs.at(i+1), signature.params[i]);
+        }
+        if (is_value_type(signature.result)) {
+            call.value_type = signature.result;
+        }
+    }
+
+    bool holds_array(grlang::node::Value::Type type) {
+        if (grlang::node::is_struct_type(type)) {
+            return std::ranges::any_of(grlang::node::struct_layout(type).types, holds_array);
+        }
+        return grlang::node::is_array_type(type);
+    }
+
+    // NOTE: calls that may touch memory have to stay in order with loads and stores
+    bool uses_memory(const grlang::node::Node& call) {
+        auto& callee = *call.inputs.at(0);
+        if (!is_function(callee)) {
+            return false;
+        }
+        auto& signature = get_signature(callee);
+        return holds_array(signature.result) || std::ranges::any_of(signature.params, holds_array);
+    }
+
+    // Appends a memory node to the control flow of the scope, input 0 is filled in with the current control
+    grlang::node::Node::Ptr append_memory(Scope& scope, grlang::node::Node::Type type, std::uint8_t value, grlang::node::Value::Type value_type, const std::vector<grlang::node::Node::Ptr>& inputs) {
+        if (scope.unit) {
+            throw std::runtime_error("memory can only be used inside functions");
+        }
+        auto node = make_node(type, value, {scope.control});
+        node->inputs.insert(node->inputs.end(), inputs.begin(), inputs.end());
+        node->value_type = value_type;
+        scope.control = grlang::node::peephole(node);
+        return scope.control;
+    }
+
+    grlang::node::Value::Type check_array(const grlang::node::Node& array) {
+        auto type = grlang::node::result_type(array);
+        if (!grlang::node::is_array_type(type)) {
+            throw std::runtime_error("not an array");
+        }
+        return type;
+    }
+
+    grlang::node::Node::Ptr check_index(grlang::node::Node::Ptr index) {
+        if (!int_type(*index)) {
+            throw std::runtime_error("array index is not an integer");
+        }
+        return index;
+    }
+
+    grlang::node::Value::Type check_struct(const grlang::node::Node& value) {
+        auto type = grlang::node::result_type(value);
+        if (!grlang::node::is_struct_type(type)) {
+            throw std::runtime_error("not a struct");
+        }
+        return type;
+    }
+
+    grlang::node::Node::Ptr check_operand(grlang::node::Node::Ptr operand) {
+        auto type = grlang::node::result_type(*operand);
+        if (grlang::node::is_struct_type(type)) {
+            throw std::runtime_error("structs can't be used in arithmetic");
+        }
+        if (grlang::node::is_array_type(type) || type == grlang::node::Value::Type::FUNCTION) {
+            throw std::runtime_error("arrays and functions can't be used in arithmetic");
+        }
+        return operand;
+    }
+
+    std::uint8_t field_index(grlang::node::Value::Type type, std::string_view name) {
+        auto& names = grlang::node::struct_layout(type).names;
+        auto it = std::ranges::find(names, name);
+        if (it == names.end()) {
+            throw std::runtime_error(std::format("no field {}", name));
+        }
+        return static_cast<std::uint8_t>(it - names.begin());
+    }
+
+    grlang::node::Value::Type parse_type(Parser& parser);
+
+    grlang::node::Node::Ptr parse_expression(Parser& parser, Scope& scope, std::uint8_t prev_precedence=255) {
         grlang::node::Node::Ptr result;
         switch (parser.next_token.type) {
             case TokenType::OPERATOR_MINUS: {
                 parser.read_next_token();
                 auto precedence = operation_precedence(grlang::node::Node::Type::DATA_OP_NEG);
-                result = make_peep_node(grlang::node::Node::Type::DATA_OP_NEG, {parse_expression(parser, scope, precedence)});
+                auto operand = check_operand(parse_expression(parser, scope, precedence));
+                auto width = int_type(*operand).value_or(grlang::node::Value::Type::INTEGER);
+                result = make_typed_peep_node(grlang::node::Node::Type::DATA_OP_NEG, width, {operand});
                 break;
             }
             case TokenType::OPERATOR_NOT: {
                 parser.read_next_token();
                 auto precedence = operation_precedence(grlang::node::Node::Type::DATA_OP_NOT);
-                result = make_peep_node(grlang::node::Node::Type::DATA_OP_NOT, {parse_expression(parser, scope, precedence)});
+                auto operand = check_operand(parse_expression(parser, scope, precedence));
+                auto width = int_type(*operand).value_or(grlang::node::Value::Type::INTEGER);
+                result = make_typed_peep_node(grlang::node::Node::Type::DATA_OP_NOT, width, {operand});
                 break;
             }
             case TokenType::OPEN_ROUND:
@@ -275,7 +705,7 @@ namespace {
                 expect_token(TokenType::CLOSE_ROUND, parser);
                 break;
             case TokenType::IDENTIFIER:
-                result = scope.lookup(parser.next_token.value);
+                result = scope.lookup(parser.next_token.symbol);
                 parser.read_next_token();
                 if (parser.next_token.type != TokenType::OPEN_ROUND) {
                     break;
@@ -286,16 +716,74 @@ namespace {
                     result->inputs.push_back(parse_expression(parser, scope));
                 } while (parser.next_token.type != TokenType::CLOSE_ROUND);
                 parser.read_next_token();
-                result = peephole(result);  // TODO: type check
+                check_call(*result);
+                convert_call(*result);
+                if (uses_memory(*result)) {
+                    result = append_memory(scope, grlang::node::Node::Type::MEMORY_CALL, 0, result->value_type, result->inputs);
+                    break;
+                }
+                result = peephole(result);
                 break;
             case TokenType::LITERAL_INT:
                 result = make_value_node(svtoi(parser.next_token.value));
                 parser.read_next_token();
                 break;
+            case TokenType::OPEN_SQUARE: {
+                // NOTE: [n]int, a new array of n elements, all zero
+                parser.read_next_token();
+                auto length = parse_expression(parser, scope);
+                expect_token(TokenType::CLOSE_SQUARE, parser);
+                auto element = parse_type(parser);
+                if (!grlang::node::is_int_type(element) || !int_type(*length)) {
+                    throw std::runtime_error("expected an integer length and element type");
+                }
+                result = append_memory(scope, grlang::node::Node::Type::MEMORY_NEW, 0, grlang::node::array_type(element), {convert(length, grlang::node::Value::Type::INTEGER)});
+                break;
+            }
+            case TokenType::OPEN_CURLY: {
+                // NOTE: {x=1 y=2}, a struct whose fields take the types of their values
+                parser.read_next_token();
+                grlang::node::StructLayout layout;
+                std::vector<grlang::node::Node::Ptr> fields;
+                while (parser.next_token.type == TokenType::IDENTIFIER) {
+                    layout.names.emplace_back(parser.next_token.value);
+                    parser.read_next_token();
+                    expect_token(TokenType::REBIND, parser);
+                    fields.push_back(parse_expression(parser, scope));
+                    layout.types.push_back(grlang::node::result_type(*fields.back()));
+                }
+                expect_token(TokenType::CLOSE_CURLY, parser);
+                result = make_struct(make_struct_type(std::move(layout)), std::move(fields));
+                break;
+            }
+            case TokenType::KEYWORD_LEN: {
+                parser.read_next_token();
+                expect_token(TokenType::OPEN_ROUND, parser);
+                result = parse_expression(parser, scope);
+                expect_token(TokenType::CLOSE_ROUND, parser);
+                check_array(*result);
+                result = make_peep_node(grlang::node::Node::Type::DATA_LENGTH, {result});
+                break;
+            }
             default:
                 throw std::runtime_error("Expected operand!");
         }
 
+        while (parser.next_token.type == TokenType::OPEN_SQUARE || parser.next_token.type == TokenType::DOT) {
+            if (parser.next_token.type == TokenType::DOT) {
+                auto struct_type = check_struct(*result);
+                auto field = parser.read_next_token().value;
+                expect_token(TokenType::IDENTIFIER, parser);
+                result = make_field(result, field_index(struct_type, field));
+                continue;
+            }
+            auto array_type = check_array(*result);
+            parser.read_next_token();
+            auto index = check_index(parse_expression(parser, scope));
+            expect_token(TokenType::CLOSE_SQUARE, parser);
+            result = append_memory(scope, grlang::node::Node::Type::MEMORY_LOAD, grlang::node::BOUNDS_CHECK, grlang::node::element_type(array_type), {result, index});
+        }
+
         while (parser.next_token.type > TokenType::META_BINARY_BEGIN && parser.next_token.type < TokenType::META_BINARY_END) {
             auto node_type = operation_type(parser.next_token.type);
             auto precedence = operation_precedence(node_type);
@@ -303,69 +791,226 @@ namespace {
                 break;
             }
             parser.read_next_token();
-            result = make_peep_node(node_type, {result, parse_expression(parser, scope, precedence)});
+            auto right = check_operand(parse_expression(parser, scope, precedence));
+            check_operand(result);
+            auto width = common_type(*result, *right);
+            result = make_typed_peep_node(node_type, width, {convert(result, width), convert(right, width)});
         }
 
         return result;
     }
 
-    void parse_type(Parser& parser)
+    grlang::node::Value::Type parse_type(Parser& parser)
     {
         if (parser.next_token.type == TokenType::OPEN_CURLY) {
-            // TODO: parse structure type
+            // NOTE: {x:int y:int}, fields in the order they are listed
+            parser.read_next_token();
+            grlang::node::StructLayout layout;
+            while (parser.next_token.type == TokenType::IDENTIFIER) {
+                layout.names.emplace_back(parser.next_token.value);
+                parser.read_next_token();
+                expect_token(TokenType::DECLARE_TYPE, parser);
+                layout.types.push_back(parse_type(parser));
+            }
+            expect_token(TokenType::CLOSE_CURLY, parser);
+            return make_struct_type(std::move(layout));
+        } else if (parser.next_token.type == TokenType::OPEN_SQUARE) {
+            parser.read_next_token();
+            expect_token(TokenType::CLOSE_SQUARE, parser);
+            auto element = parse_type(parser);
+            if (!grlang::node::is_int_type(element)) {
+                throw std::runtime_error("arrays only hold integers");
+            }
+            return grlang::node::array_type(element);
         } else if (parser.next_token.type == TokenType::OPEN_ROUND) {
-            // TODO: parse function type
+            // NOTE: (int)->int, the signature is not kept, values of function type are only ever known functions
+            parser.read_next_token();
+            while (parser.next_token.type != TokenType::CLOSE_ROUND) {
+                parse_type(parser);
+            }
+            parser.read_next_token();
+            expect_token(TokenType::ARROW, parser);
+            parse_type(parser);
+            return grlang::node::Value::Type::FUNCTION;
         } else {
-            static std::unordered_set<std::string_view> builtin_types = {"int", "struct", "funct"};
-            assert(builtin_types.contains(parser.next_token.value));
+            static const std::unordered_map<std::string_view, grlang::node::Value::Type> builtin_types = {
+                {"int", grlang::node::Value::Type::INTEGER},
+                {"i8", grlang::node::Value::Type::I8},
+                {"i16", grlang::node::Value::Type::I16},
+                {"i32", grlang::node::Value::Type::INTEGER},
+                {"i64", grlang::node::Value::Type::I64},
+                {"u8", grlang::node::Value::Type::U8},
+                {"u16", grlang::node::Value::Type::U16},
+                {"u32", grlang::node::Value::Type::U32},
+                {"u64", grlang::node::Value::Type::U64},
+                {"struct", grlang::node::Value::Type::TUPLE},
+                {"funct", grlang::node::Value::Type::FUNCTION},
+            };
+            auto it = builtin_types.find(parser.next_token.value);
+            if (it == builtin_types.end()) {
+                throw std::runtime_error(std::format("Unknown type {}", parser.next_token.value));
+            }
             parser.read_next_token();
-            return;
+            return it->second;
         }
     }
 
-    std::vector<std::string_view> parse_named_type_list(Parser& parser) {
-        std::vector<std::string_view> result;
+    std::vector<Symbol> parse_named_type_list(Parser& parser, std::vector<grlang::node::Value::Type>& types) {
+        std::vector<Symbol> result;
         while (parser.next_token.type == TokenType::IDENTIFIER) {
-            auto name = parser.next_token.value;  // TODO: check is not a keyword
-            result.push_back(name);
+            result.push_back(parser.next_token.symbol);
             parser.read_next_token();
             expect_token(TokenType::DECLARE_TYPE, parser);
-            parse_type(parser);
+            types.push_back(parse_type(parser));
         }
         return result;
     }
 
     void parse_block(Parser& parser, Scope& scope, const LoopState& loop, const grlang::node::Node::Ptr& stop);
 
-    grlang::node::Node::Ptr parse_function_expression(const std::string_view& name, Parser& parser, Scope& scope) {
-        assert(parser.next_token.type == TokenType::OPEN_ROUND);
-        parser.read_next_token();
-        auto params = parse_named_type_list(parser);
-        expect_token(TokenType::CLOSE_ROUND, parser);
-        expect_token(TokenType::ARROW, parser);
-        parse_type(parser);  // TODO do something with return type
-        expect_token(TokenType::OPEN_CURLY, parser);
+    // Skips to the token after the matching closing brace, without building anything
+    void skip_braced(Parser& parser) {
+        assert(parser.next_token.type == TokenType::OPEN_CURLY);
+        for (int depth = 0; parser.next_token.type != TokenType::END_OF_INPUT; ) {
+            if (parser.next_token.type == TokenType::OPEN_CURLY) {
+                ++depth;
+            } else if (parser.next_token.type == TokenType::CLOSE_CURLY && --depth == 0) {
+                parser.read_next_token();
+                return;
+            }
+            parser.read_next_token();
+        }
+    }
 
-        auto func_stop = make_node(grlang::node::Node::Type::CONTROL_STOP);
-        auto func_ptr = make_value_node(0x0FEFEFE0);  // TODO: Add function pointer type
-        func_ptr->inputs.push_back(func_stop);
+    void parse_function_body(Parser& parser, const FunctionBody& body) {
+        grlang::node::PhaseTimer timer(grlang::node::Phase::PARSE);
+        expect_token(TokenType::OPEN_CURLY, parser);
 
+        // NOTE: scopes are indexed by symbol, reusing them keeps the cost of a function proportional to its own size
+        thread_local std::vector<Scope> spare_scopes;
         Scope func_scope;
-        func_scope.stack.push_back(scope.stack.front());
-        func_scope.stack.emplace_back();
-        func_scope.declare(name, func_ptr);
+        if (!spare_scopes.empty()) {
+            func_scope = std::move(spare_scopes.back());
+            spare_scopes.pop_back();
+        }
+        func_scope.globals = body.history;
+        func_scope.globals_version = body.version;
+        auto& signature = get_signature(*body.func_ptr);
+        func_scope.return_type = signature.result;
+        func_scope.push_frame();
+        for (auto& [global, value]: body.globals) {
+            func_scope.declare(global, value);
+        }
+        func_scope.push_frame();
+        func_scope.declare(body.name, body.func_ptr);
         func_scope.control = make_node(grlang::node::Node::Type::CONTROL_START);
-        for (std::size_t i=0; i<params.size(); ++i) {
-            func_scope.declare(params.at(i), make_node(grlang::node::Node::Type::DATA_PROJECT, static_cast<uint8_t>(i+1), {func_scope.control}));
+        for (std::size_t i=0; i<body.params.size(); ++i) {
+            auto param = make_node(grlang::node::Node::Type::DATA_PROJECT, static_cast<uint8_t>(i+1), {func_scope.control});
+            if (is_value_type(signature.params.at(i))) {
+                param->value_type = signature.params.at(i);
+            }
+            func_scope.declare(body.params.at(i), param);
         }
 
-        parse_block(parser, func_scope, {nullptr, nullptr}, func_stop);
+        // NOTE: built into a fresh stop that is only installed once the body parsed, a failed build leaves nothing behind
+        auto stop = make_node(grlang::node::Node::Type::CONTROL_STOP);
+        parse_block(parser, func_scope, {{}, nullptr, nullptr}, stop);
         expect_token(TokenType::CLOSE_CURLY, parser);
+        body.func_ptr->inputs.at(0) = std::move(stop);
+        {
+            grlang::node::PhaseTimer optimize(grlang::node::Phase::OPTIMIZE);
+            grlang::node::replace_aggregates(*body.func_ptr);
+            grlang::node::fold_branches(*body.func_ptr);
+            grlang::node::eliminate_bounds_checks(*body.func_ptr);
+        }
 
+        while (!func_scope.stack.empty()) {
+            func_scope.pop_frame();
+        }
+        func_scope.control = nullptr;  // NOTE: a spare scope must not keep the graph or the unit of its last function alive
+        func_scope.globals = nullptr;
+        spare_scopes.push_back(std::move(func_scope));
+    }
+
+    grlang::node::Node::Ptr defer_function_body(Scope& scope, FunctionBody body, grlang::node::Node::Ptr func_stop, grlang::node::Value::Signature signature) {
+        auto func_ptr = make_lazy_function_node(std::move(func_stop), std::move(signature));
+        // NOTE: the unit owns this node through its history, so the body only holds it weakly, see keep_unit
+        func_ptr->build = [unit=std::weak_ptr<UnitSource>(scope.unit), body=std::move(body), self=std::weak_ptr<grlang::node::Node>(func_ptr)]() {
+            auto source = unit.lock();
+            if (!source) {
+                throw std::runtime_error("unit of a function body is gone");
+            }
+            FunctionBody building = body;
+            building.func_ptr = self.lock();
+            Parser body_parser(building.tokens);
+            parse_function_body(body_parser, building);
+        };
+        scope.deferred->push_back(func_ptr);
         return func_ptr;
     }
 
-    grlang::node::Node::Ptr parse_bind_expression(const std::string_view& name, Parser& parser, Scope& scope) {
+    grlang::node::Node::Ptr reparse_function(Reparse& reparse, Symbol name, std::span<const grlang::parse::detail::Token> expression, const Scope& scope, auto&& make_function) {
+        auto offset = [&](const char* position) { return static_cast<std::size_t>(position - reparse.code.data()); };
+        auto& last = expression.back().value;
+        grlang::parse::Unit::Function function{offset(expression.front().value.data()), offset(last.data() + last.size()), {}, nullptr};
+        for (auto& token: expression) {
+            if (token.type == TokenType::IDENTIFIER) {
+                bool bound = token.symbol < scope.values.size() && scope.values[token.symbol];
+                function.uses.emplace_back(token.value, bound ? scope.values[token.symbol] : nullptr);
+            }
+        }
+        std::ranges::sort(function.uses, {}, [](auto& use) { return use.first; });
+        auto duplicates = std::ranges::unique(function.uses, {}, [](auto& use) { return use.first; });
+        function.uses.erase(duplicates.begin(), duplicates.end());
+
+        std::string key(reparse.symbols->names.at(name));
+        auto previous = reparse.previous->find(key);
+        if (previous != reparse.previous->end() && reparse.unchanged(previous->second, function)) {
+            function.node = previous->second.node;
+        } else {
+            function.node = make_function();
+        }
+        return reparse.functions->insert_or_assign(std::move(key), std::move(function)).first->second.node;
+    }
+
+    grlang::node::Node::Ptr parse_function_expression(Symbol name, Parser& parser, Scope& scope) {
+        assert(parser.next_token.type == TokenType::OPEN_ROUND);
+        auto expression_begin = parser.position;
+        parser.read_next_token();
+        grlang::node::Value::Signature signature;
+        auto params = parse_named_type_list(parser, signature.params);
+        expect_token(TokenType::CLOSE_ROUND, parser);
+        expect_token(TokenType::ARROW, parser);
+        signature.result = parse_type(parser);
+        if (std::ranges::find(signature.params, grlang::node::Value::Type::FUNCTION) != signature.params.end() || signature.result == grlang::node::Value::Type::FUNCTION) {
+            throw std::runtime_error("functions can't be passed to or returned from functions");
+        }
+
+        auto func_stop = make_node(grlang::node::Node::Type::CONTROL_STOP);
+        FunctionBody body{name, std::move(params), {}, scope.globals, scope.globals_version, {}, nullptr};
+        if (scope.deferred && scope.stack.size() == 1) {
+            // NOTE: the function node stands in for references until its body is built, by parse_unit or on first use
+            body.history = &scope.unit->history;
+            body.version = scope.unit->history.version++;
+            auto begin = parser.position;
+            skip_braced(parser);
+            body.tokens = parser.tokens.subspan(begin, parser.position - begin);
+            if (scope.reparse) {
+                auto expression = parser.tokens.subspan(expression_begin, parser.position - expression_begin);
+                return reparse_function(*scope.reparse, name, expression, scope, [&]() { return defer_function_body(scope, std::move(body), func_stop, std::move(signature)); });
+            }
+            return defer_function_body(scope, std::move(body), func_stop, std::move(signature));
+        }
+
+        body.func_ptr = make_function_node(func_stop, std::move(signature));
+        for (Symbol global: scope.stack.front()) {
+            body.globals.emplace_back(global, scope.values.at(global));
+        }
+        parse_function_body(parser, body);
+        return body.func_ptr;
+    }
+
+    grlang::node::Node::Ptr parse_bind_expression(Symbol name, Parser& parser, Scope& scope) {
         if (parser.next_token.type == TokenType::OPEN_ROUND) {
             Parser tmp_parser = parser;
             if (tmp_parser.read_next_token().type == TokenType::IDENTIFIER &&
@@ -379,69 +1024,87 @@ namespace {
     void parse_statement(Parser &parser, Scope &scope, const LoopState &loop, const grlang::node::Node::Ptr &stop);
 
     void parse_ifelse(Parser& parser, Scope& scope, const LoopState& loop, const grlang::node::Node::Ptr& stop) {
-        assert(parser.next_token.value == "if");
+        assert(parser.next_token.type == TokenType::KEYWORD_IF);
         parser.read_next_token();
-        auto condition = parse_expression(parser, scope, 255);
+        auto condition = check_operand(parse_expression(parser, scope, 255));
         auto ifelse = make_peep_node(grlang::node::Node::Type::CONTROL_IFELSE, {scope.control, condition});
-        
-        auto true_scope = scope;
-        true_scope.control = make_peep_node(grlang::node::Node::Type::CONTROL_PROJECT, 0, {ifelse});
-        parse_statement(parser, true_scope, loop, stop);
-        
-        auto false_scope = scope;
-        false_scope.control = make_peep_node(grlang::node::Node::Type::CONTROL_PROJECT, 1, {ifelse});
-        if (parser.next_token.value == "else")
+
+        auto mark = scope.mark();
+        scope.control = make_peep_node(grlang::node::Node::Type::CONTROL_PROJECT, 0, {ifelse});
+        parse_statement(parser, scope, loop, stop);
+        auto true_branch = scope.snapshot(mark);
+        scope.rollback(mark);
+
+        scope.control = make_peep_node(grlang::node::Node::Type::CONTROL_PROJECT, 1, {ifelse});
+        if (parser.next_token.type == TokenType::KEYWORD_ELSE)
         {
             parser.read_next_token();
-            parse_statement(parser, false_scope, loop, stop);
+            parse_statement(parser, scope, loop, stop);
         }
-        scope.merge(true_scope, false_scope);
+        auto false_branch = scope.snapshot(mark);
+        scope.rollback(mark);
+        scope.release();
+
+        scope.apply(merge(true_branch, false_branch));
     }
 
     void parse_while(Parser& parser, Scope& scope, const grlang::node::Node::Ptr& stop) {
-        assert(parser.next_token.value == "while");
+        assert(parser.next_token.type == TokenType::KEYWORD_WHILE);
         parser.read_next_token();
-        auto loop_region = scope.start_loop();
-        auto condition = parse_expression(parser, scope, 255);
-        auto ifelse = make_node(grlang::node::Node::Type::CONTROL_IFELSE, {loop_region, condition});
-        scope.control = make_node(grlang::node::Node::Type::CONTROL_PROJECT, 1, {ifelse});
-        auto loop_scope = scope;
-        loop_scope.control = make_node(grlang::node::Node::Type::CONTROL_PROJECT, 0, {ifelse});
-
-        auto base_scope = scope;
-        Scope continue_scope{};
-        continue_scope.control = loop_scope.control;
-        parse_statement(parser, loop_scope, {&scope, &continue_scope}, stop);
-        if (continue_scope.stack.empty()) {
-            continue_scope = loop_scope;
-        } else {
-            continue_scope.merge(continue_scope, loop_scope);
+        auto loop_region = make_node(grlang::node::Node::Type::CONTROL_REGION, {nullptr, scope.control, nullptr});
+        scope.start_loop(loop_region, scan_loop_assignments(parser));
+        scope.control = loop_region;  // NOTE: loads in the condition happen on every iteration
+        auto condition = check_operand(parse_expression(parser, scope, 255));
+        auto ifelse = make_node(grlang::node::Node::Type::CONTROL_IFELSE, {scope.control, condition});
+        auto exit_control = make_node(grlang::node::Node::Type::CONTROL_PROJECT, 1, {ifelse});
+
+        std::optional<Snapshot> break_branch;
+        std::optional<Snapshot> continue_branch;
+        auto mark = scope.mark();
+        scope.control = make_node(grlang::node::Node::Type::CONTROL_PROJECT, 0, {ifelse});
+        parse_statement(parser, scope, {mark, &break_branch, &continue_branch}, stop);
+        auto back_branch = scope.snapshot(mark);
+        if (continue_branch) {
+            back_branch = merge(*continue_branch, back_branch);
+        }
+        scope.rollback(mark);
+        scope.release();
+
+        loop_region->inputs.at(2) = back_branch.control;
+        for (auto& [name, phi]: scope.end_loop()) {
+            assert(phi->inputs.at(2) == nullptr);
+            if (auto it = back_branch.changes.find(name); it != back_branch.changes.end() && it->second.second != phi) {
+                phi->inputs.at(2) = it->second.second;
+            } else {
+                phi->inputs.at(2) = phi->inputs.at(1);
+            }
+        }
+
+        scope.control = exit_control;
+        if (break_branch) {
+            scope.apply(merge(*break_branch, Snapshot{exit_control, {}}));
         }
-        loop_region->inputs.at(2) = continue_scope.control;
-        base_scope.end_loop(continue_scope);
     }
 
     void parse_break(Parser& parser, Scope& scope, const LoopState& loop) {
-        assert(parser.next_token.value == "break");
+        assert(parser.next_token.type == TokenType::KEYWORD_BREAK);
         parser.read_next_token();
         if (loop.break_ == nullptr) {
            throw std::runtime_error("break outside of a loop!");
         }
-        loop.break_->merge(scope, *loop.break_);
+        auto branch = scope.snapshot(loop.mark);
+        *loop.break_ = *loop.break_ ? merge(branch, **loop.break_) : std::move(branch);
         scope.control = make_node(grlang::node::Node::Type::CONTROL_DEAD);
     }
 
     void parse_continue(Parser& parser, Scope& scope, const LoopState& loop) {
-        assert(parser.next_token.value == "continue");
+        assert(parser.next_token.type == TokenType::KEYWORD_CONTINUE);
         parser.read_next_token();
         if (loop.continue_ == nullptr) {
            throw std::runtime_error("continue outside of a loop!");
         }
-        if (loop.continue_->stack.empty()) {
-            *loop.continue_ = scope;
-        } else {
-            loop.continue_->merge(*loop.continue_, scope);
-        }
+        auto branch = scope.snapshot(loop.mark);
+        *loop.continue_ = *loop.continue_ ? merge(**loop.continue_, branch) : std::move(branch);
         scope.control = make_node(grlang::node::Node::Type::CONTROL_DEAD);
     }
 
@@ -453,27 +1116,64 @@ namespace {
 
     void parse_identifier_things(Parser& parser, Scope& scope) {
         assert(parser.next_token.type == TokenType::IDENTIFIER);
-        auto name = parser.next_token.value;  // TODO: check is not a keyword
+        auto name = parser.next_token.symbol;
         parser.read_next_token();
-        auto scope_update = &Scope::update;
         switch (parser.next_token.type) {
             case TokenType::DECLARE_AUTO:
                 parser.read_next_token();
-                scope_update = &Scope::declare;
+                scope.declare(name, parse_bind_expression(name, parser, scope));
                 break;
-            case TokenType::DECLARE_TYPE:
+            case TokenType::DECLARE_TYPE: {
                 parser.read_next_token();
-                parse_type(parser);  // TODO: handle different types
-                scope_update = &Scope::declare;
+                auto type = parse_type(parser);  // TODO: check function and structure types
                 expect_token(TokenType::REBIND, parser);
+                scope.declare(name, convert(parse_bind_expression(name, parser, scope), type));
                 break;
-            case TokenType::REBIND:
+            }
+            case TokenType::OPEN_SQUARE: {
+                auto array = scope.lookup(name);
+                auto array_type = check_array(*array);
                 parser.read_next_token();
+                auto index = check_index(parse_expression(parser, scope));
+                expect_token(TokenType::CLOSE_SQUARE, parser);
+                expect_token(TokenType::REBIND, parser);
+                auto value = convert(parse_expression(parser, scope), grlang::node::element_type(array_type));
+                append_memory(scope, grlang::node::Node::Type::MEMORY_STORE, grlang::node::BOUNDS_CHECK, grlang::node::Value::Type::INTEGER, {array, index, value});
                 break;
+            }
+            case TokenType::DOT: {
+                // NOTE: p.x = v makes p a copy of itself with the field replaced, nested structs are copied inside out
+                std::vector<std::pair<grlang::node::Node::Ptr, std::uint8_t>> path;
+                auto value = scope.lookup(name);
+                while (parser.next_token.type == TokenType::DOT) {
+                    auto field = parser.read_next_token().value;
+                    expect_token(TokenType::IDENTIFIER, parser);
+                    path.emplace_back(value, field_index(check_struct(*value), field));
+                    value = make_field(value, path.back().second);
+                }
+                expect_token(TokenType::REBIND, parser);
+                value = parse_expression(parser, scope);
+                for (auto& [outer, index]: path | std::views::reverse) {
+                    auto type = grlang::node::result_type(*outer);
+                    auto fields = make_fields(outer);
+                    fields[index] = convert(std::move(value), grlang::node::struct_layout(type).types[index]);
+                    value = make_struct(type, std::move(fields));
+                }
+                scope.update(name, std::move(value));
+                break;
+            }
+            case TokenType::REBIND: {
+                parser.read_next_token();
+                auto value = parse_bind_expression(name, parser, scope);
+                // NOTE: a variable keeps the integer or struct type it was declared with
+                auto type = grlang::node::result_type(*scope.lookup(name));
+                bool keeps = grlang::node::is_int_type(type) || grlang::node::is_struct_type(type);
+                scope.update(name, keeps ? convert(std::move(value), type) : std::move(value));
+                break;
+            }
             default:
                 throw std::runtime_error("Expected declaration or assignment");
         }
-        (scope.*scope_update)(name, parse_bind_expression(name, parser, scope));
     }
 
     void parse_statement(Parser& parser, Scope& scope, const LoopState& loop, const grlang::node::Node::Ptr& stop) {
@@ -482,42 +1182,161 @@ namespace {
                 break;
             case TokenType::OPEN_CURLY: {
                 parser.read_next_token();
-                scope.stack.emplace_back();
+                scope.push_frame();
                 parse_block(parser, scope, loop, stop);
                 expect_token(TokenType::CLOSE_CURLY, parser);
-                scope.stack.pop_back();
+                scope.pop_frame();
                 break;
             }
-            case TokenType::IDENTIFIER: {
-                if (parser.next_token.value == "return") {
-                    parser.read_next_token();
-                    auto result = make_peep_node(grlang::node::Node::Type::CONTROL_RETURN, {scope.control, parse_expression(parser, scope, 255)});
-                    stop->inputs.push_back(result);
-                    scope.control = make_node(grlang::node::Node::Type::CONTROL_DEAD);
-                } else if (parser.next_token.value == "if") {
-                    parse_ifelse(parser, scope, loop, stop);
-                } else if (parser.next_token.value == "while") {
-                    parse_while(parser, scope, stop);
-                } else if (parser.next_token.value == "break") {
-                    parse_break(parser, scope, loop);
-                } else if (parser.next_token.value == "continue") {
-                    parse_continue(parser, scope, loop);
-                } else {
-                    parse_identifier_things(parser, scope);
-                }
+            case TokenType::KEYWORD_RETURN: {
+                parser.read_next_token();
+                auto value = convert(parse_expression(parser, scope, 255), scope.return_type);
+                auto result = make_peep_node(grlang::node::Node::Type::CONTROL_RETURN, {scope.control, value});
+                stop->inputs.push_back(result);
+                scope.control = make_node(grlang::node::Node::Type::CONTROL_DEAD);
                 break;
             }
+            case TokenType::KEYWORD_IF:
+                parse_ifelse(parser, scope, loop, stop);
+                break;
+            case TokenType::KEYWORD_WHILE:
+                parse_while(parser, scope, stop);
+                break;
+            case TokenType::KEYWORD_BREAK:
+                parse_break(parser, scope, loop);
+                break;
+            case TokenType::KEYWORD_CONTINUE:
+                parse_continue(parser, scope, loop);
+                break;
+            case TokenType::IDENTIFIER:
+                parse_identifier_things(parser, scope);
+                break;
             default:
                 throw std::runtime_error("Unexpected token");
         }
     }
 }
 
-std::unordered_map<std::string_view, grlang::node::Node::Ptr> grlang::parse::parse_unit(std::string_view code) {
-    Parser parser(code);
-    Scope scope{{{}}, make_node(grlang::node::Node::Type::CONTROL_START)};
-    auto stop = make_node(grlang::node::Node::Type::CONTROL_STOP);
-    parse_block(parser, scope, {}, stop);
-    assert(scope.stack.size() == 1);
-    return std::move(scope.stack.front());
+namespace {
+    std::unordered_map<std::string_view, grlang::node::Node::Ptr> parse_source(std::string_view code, std::shared_ptr<const std::string> owner, const grlang::parse::ParseOptions& options, Reparse* reparse) {
+        grlang::parse::detail::SymbolTable symbols;
+        auto unit = std::make_shared<UnitSource>();
+        unit->code = std::move(owner);
+        {
+            grlang::node::PhaseTimer timer(grlang::node::Phase::TOKENIZE);
+            unit->tokens = grlang::parse::detail::tokenize(code, symbols);
+        }
+        grlang::node::PhaseTimer timer(grlang::node::Phase::PARSE);
+        Parser parser(unit->tokens);
+        std::vector<grlang::node::Node::Ptr> functions;
+        Scope scope;
+        scope.push_frame();
+        scope.unit = unit;
+        scope.deferred = &functions;
+        if (reparse) {
+            reparse->code = code;
+            reparse->symbols = &symbols;
+            scope.reparse = reparse;
+        }
+        scope.control = make_node(grlang::node::Node::Type::CONTROL_START);
+        auto stop = make_node(grlang::node::Node::Type::CONTROL_STOP);
+        parse_block(parser, scope, {}, stop);
+        assert(scope.stack.size() == 1);
+        timer.stop();  // NOTE: bodies time themselves, on whichever thread builds them
+
+        // NOTE: bodies hold their unit weakly, so the functions given out keep it alive while they are left to build.
+        // Only the ones made here, reused functions already keep the unit they came from
+        std::unordered_set<const grlang::node::Node*> made;
+        for (auto& function: functions) {
+            made.insert(function.get());
+        }
+        auto keep_unit = [&](grlang::node::Node::Ptr& node) {
+            if (node && made.contains(node.get()) && static_cast<const grlang::node::LazyFunctionNode&>(*node).build) {
+                auto owner = std::make_shared<std::pair<std::shared_ptr<UnitSource>, grlang::node::Node::Ptr>>(unit, node);
+                node = grlang::node::Node::Ptr(owner, node.get());
+            }
+        };
+
+        if (options.lazy) {
+            functions.clear();
+        }
+        // NOTE: bodies only share nodes and history they read, and the symbol table is complete after tokenizing
+        std::vector<std::exception_ptr> errors(functions.size());
+        std::atomic<std::size_t> next_function = 0;
+        auto worker = [&]() {
+            for (std::size_t i = next_function++; i < functions.size(); i = next_function++) {
+                try {
+                    grlang::node::ensure_built(*functions.at(i));
+                } catch (...) {
+                    errors.at(i) = std::current_exception();
+                }
+            }
+        };
+
+        std::size_t n_threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+        n_threads = std::min(n_threads, functions.size());
+        {
+            std::vector<std::jthread> pool;
+            for (std::size_t i = 1; i < n_threads; ++i) {
+                pool.emplace_back(worker);
+            }
+            worker();
+        }
+        for (auto& error: errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        std::unordered_map<std::string_view, grlang::node::Node::Ptr> exports;
+        for (Symbol name: scope.stack.front()) {
+            keep_unit(exports[symbols.names.at(name)] = scope.values.at(name));
+        }
+        if (reparse) {
+            for (auto& [name, function]: *reparse->functions) {
+                keep_unit(function.node);
+            }
+        }
+        return exports;
+    }
+}
+
+std::unordered_map<std::string_view, grlang::node::Node::Ptr> grlang::parse::parse_unit(std::string_view code, const ParseOptions& options) {
+    return parse_source(code, nullptr, options, nullptr);
+}
+
+grlang::parse::Unit::Unit(std::string code, const ParseOptions& options) : code_(std::make_shared<const std::string>(std::move(code))), options_(options) {
+    std::unordered_map<std::string, Function> none;
+    Reparse reparse{&none, {0, 0, {}}, &functions_, {}};
+    exports_ = parse_source(*code_, code_, options_, &reparse);
+}
+
+std::vector<std::string> grlang::parse::Unit::edit(const TextEdit& edit) {
+    if (edit.offset > code_->size() || edit.length > code_->size() - edit.offset) {
+        throw std::out_of_range("edit outside of the code");
+    }
+    auto code = std::make_shared<std::string>(*code_);
+    code->replace(edit.offset, edit.length, edit.text);
+    // NOTE: the whole unit is tokenized again, it's cheap and tokens point into the new code
+    std::unordered_map<std::string, Function> functions;
+    Reparse reparse{&functions_, edit, &functions, {}};
+    auto exports = parse_source(*code, code, options_, &reparse);
+
+    std::vector<std::string> changed;
+    for (auto& [name, node]: exports_) {
+        if (auto it = exports.find(name); it == exports.end() || !same_value(node, it->second)) {
+            changed.emplace_back(name);
+        }
+    }
+    for (auto& [name, node]: exports) {
+        if (!exports_.contains(name)) {
+            changed.emplace_back(name);
+        }
+    }
+    std::ranges::sort(changed);
+
+    code_ = std::move(code);
+    exports_ = std::move(exports);
+    functions_ = std::move(functions);
+    return changed;
 }
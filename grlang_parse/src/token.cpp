@@ -1,10 +1,82 @@
+#include <array>
+#include <bit>
+#include <limits>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GRLANG_LEX_SSE2 1
+#endif
+
 #include "grlang/detail/token.h"
 
 
 namespace {
-    std::string_view::size_type count_class(const std::string_view& code, int (*isclass)(int)) {
+    enum CharClass : std::uint8_t {
+        CLASS_SPACE = 1,
+        CLASS_DIGIT = 2,
+        CLASS_IDENT_START = 4,
+        CLASS_IDENT = 8,
+    };
+
+    constexpr std::array<std::uint8_t, 256> make_class_table() {
+        std::array<std::uint8_t, 256> table{};
+        for (int ch: {' ', '\t', '\n', '\v', '\f', '\r'}) {
+            table[ch] = CLASS_SPACE;
+        }
+        for (int ch='0'; ch<='9'; ++ch) {
+            table[ch] = CLASS_DIGIT | CLASS_IDENT;
+        }
+        for (int ch='a'; ch<='z'; ++ch) {
+            table[ch] = table[ch-'a'+'A'] = CLASS_IDENT_START | CLASS_IDENT;
+        }
+        table['_'] = CLASS_IDENT_START | CLASS_IDENT;
+        return table;
+    }
+
+    constexpr std::array<std::uint8_t, 256> CLASS_TABLE = make_class_table();
+
+    bool is_class(char ch, std::uint8_t mask) {
+        return CLASS_TABLE[static_cast<std::uint8_t>(ch)] & mask;
+    }
+
+#ifdef GRLANG_LEX_SSE2
+    __m128i in_range(__m128i chars, char lo, char hi) {
+        // NOTE: bytes >= 0x80 compare as negative and never fall in an ASCII range
+        return _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8(lo-1)), _mm_cmplt_epi8(chars, _mm_set1_epi8(hi+1)));
+    }
+
+    __m128i match_class(__m128i chars, std::uint8_t mask) {
+        __m128i result = _mm_setzero_si128();
+        if (mask & CLASS_SPACE) {
+            result = _mm_or_si128(result, _mm_cmpeq_epi8(chars, _mm_set1_epi8(' ')));
+            result = _mm_or_si128(result, in_range(chars, '\t', '\r'));
+        }
+        if (mask & (CLASS_DIGIT | CLASS_IDENT)) {
+            result = _mm_or_si128(result, in_range(chars, '0', '9'));
+        }
+        if (mask & CLASS_IDENT) {
+            result = _mm_or_si128(result, in_range(chars, 'a', 'z'));
+            result = _mm_or_si128(result, in_range(chars, 'A', 'Z'));
+            result = _mm_or_si128(result, _mm_cmpeq_epi8(chars, _mm_set1_epi8('_')));
+        }
+        return result;
+    }
+#endif
+
+    std::string_view::size_type count_class(const std::string_view& code, std::uint8_t mask) {
         std::string_view::size_type n = 0;
-        while (n<code.size() && isclass(code[n])) {
+#ifdef GRLANG_LEX_SSE2
+        while (n+16 <= code.size()) {
+            __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(code.data()+n));
+            unsigned matches = static_cast<unsigned>(_mm_movemask_epi8(match_class(chars, mask)));
+            if (matches != 0xFFFF) {
+                return n + std::countr_one(matches);
+            }
+            n += 16;
+        }
+#endif
+        while (n<code.size() && is_class(code[n], mask)) {
             n = n+1;
         }
         return n;
@@ -16,35 +88,98 @@ namespace {
         return result;
     }
 
-    std::string_view read_class(std::string_view& code, int (*isclass)(int)) {
-        auto n = count_class(code, isclass);
+    std::string_view read_class(std::string_view& code, std::uint8_t mask) {
+        auto n = count_class(code, mask);
         return read_chars(code, n);
     }
 
     void skip_whitespace(std::string_view& code) {
-        code.remove_prefix(count_class(code, isspace));
+        code.remove_prefix(count_class(code, CLASS_SPACE));
     }
 
     std::string_view read_number(std::string_view& code) {
-        return read_class(code, std::isdigit);
+        return read_class(code, CLASS_DIGIT);
     }
 
     std::string_view read_identifier(std::string_view& code) {
-        return read_class(code, [](int ch) { return std::isalnum(ch) | (ch=='_'); });
+        return read_class(code, CLASS_IDENT);
+    }
+
+    using grlang::parse::detail::TokenType;
+
+    struct Keyword {
+        std::string_view name;
+        TokenType type;
+    };
+
+    constexpr std::array<Keyword, 7> KEYWORDS = {{
+        {"return", TokenType::KEYWORD_RETURN},
+        {"if", TokenType::KEYWORD_IF},
+        {"else", TokenType::KEYWORD_ELSE},
+        {"while", TokenType::KEYWORD_WHILE},
+        {"break", TokenType::KEYWORD_BREAK},
+        {"continue", TokenType::KEYWORD_CONTINUE},
+        {"len", TokenType::KEYWORD_LEN},
+    }};
+
+    constexpr std::size_t keyword_hash(std::string_view word) {
+        return (word.front() + word.back() + 2*word.size()) & 15;
+    }
+
+    constexpr std::array<Keyword, 16> make_keyword_table() {
+        std::array<Keyword, 16> table{};
+        for (auto& keyword: KEYWORDS) {
+            if (!table.at(keyword_hash(keyword.name)).name.empty()) {
+                throw "keyword hash collision";  // NOTE: fails constant evaluation, pick a different keyword_hash
+            }
+            table.at(keyword_hash(keyword.name)) = keyword;
+        }
+        return table;
+    }
+
+    constexpr std::array<Keyword, 16> KEYWORD_TABLE = make_keyword_table();
+
+    TokenType identifier_type(std::string_view word) {
+        const Keyword& candidate = KEYWORD_TABLE[keyword_hash(word)];
+        return candidate.name == word ? candidate.type : TokenType::IDENTIFIER;
     }
 }
 
 namespace grlang::parse::detail {
-    Token read_token(std::string_view& code) {
+    Symbol SymbolTable::intern(std::string_view name) {
+        auto [it, inserted] = ids.try_emplace(name, static_cast<Symbol>(names.size()));
+        if (inserted) {
+            names.push_back(name);
+        }
+        return it->second;
+    }
+
+    int svtoi(std::string_view digits) {
+        int result = 0;
+        for (char c: digits) {
+            if (result > (std::numeric_limits<int>::max() - (c - '0')) / 10) {
+                throw std::runtime_error("integer literal out of range");
+            }
+            result = result*10 + c - '0';
+        }
+        return result;
+    }
+
+    Token read_token(std::string_view& code, SymbolTable& symbols) {
         skip_whitespace(code);
         if (code.empty()) {
             return {TokenType::END_OF_INPUT, code};
         }
-        if (isdigit(code[0])) {
+        if (is_class(code[0], CLASS_DIGIT)) {
             return {TokenType::LITERAL_INT, read_number(code)};
         }
-        if (isalpha(code[0])) {
-            return {TokenType::IDENTIFIER, read_identifier(code)};
+        if (is_class(code[0], CLASS_IDENT_START)) {
+            auto word = read_identifier(code);
+            auto type = identifier_type(word);
+            if (type != TokenType::IDENTIFIER) {
+                return {type, word};
+            }
+            return {type, word, symbols.intern(word)};
         }
         switch (code[0]) {
             case '+':
@@ -65,8 +200,14 @@ namespace grlang::parse::detail {
                 return {TokenType::OPEN_ROUND, read_chars(code, 1)};
             case ')':
                 return {TokenType::CLOSE_ROUND, read_chars(code, 1)};
+            case '[':
+                return {TokenType::OPEN_SQUARE, read_chars(code, 1)};
+            case ']':
+                return {TokenType::CLOSE_SQUARE, read_chars(code, 1)};
             case ',':
                 return {TokenType::COMMA, read_chars(code, 1)};
+            case '.':
+                return {TokenType::DOT, read_chars(code, 1)};
             case ':':
                 return code.size() > 1 && code[1] == '=' ?
                     Token{TokenType::DECLARE_AUTO, read_chars(code, 2)} :
@@ -90,4 +231,26 @@ namespace grlang::parse::detail {
         }
         return {TokenType::INVALID_INPUT, code};
     }
+
+    std::size_t read_tokens(std::string_view& code, SymbolTable& symbols, std::span<Token> buffer) {
+        std::size_t n = 0;
+        while (n < buffer.size()) {
+            buffer[n] = read_token(code, symbols);
+            if (buffer[n++].type >= TokenType::END_OF_INPUT) {
+                break;
+            }
+        }
+        return n;
+    }
+
+    std::vector<Token> tokenize(std::string_view code, SymbolTable& symbols) {
+        std::vector<Token> tokens;
+        tokens.reserve(code.size() / 4);
+        std::array<Token, 256> buffer;
+        while (tokens.empty() || tokens.back().type < TokenType::END_OF_INPUT) {
+            std::size_t n = read_tokens(code, symbols, buffer);
+            tokens.insert(tokens.end(), buffer.begin(), buffer.begin()+n);
+        }
+        return tokens;
+    }
 }
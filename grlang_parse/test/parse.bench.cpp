@@ -0,0 +1,49 @@
+#include <string>
+#include <format>
+
+#include "grtest.h"
+#include "grlang/parse.h"
+
+
+namespace {
+    std::string generate_source(std::size_t n_functions) {
+        std::string code;
+        for (std::size_t i=0; i<n_functions; ++i) {
+            code += std::format(
+                "function_{}:= (argument_{}:int) -> int {{\n"
+                "    accumulator := 0\n"
+                "    counter_value := {}\n"
+                "    while counter_value < argument_{} {{\n"
+                "        if accumulator >= 1000 accumulator = accumulator - 1000 else accumulator = accumulator + counter_value*{}\n"
+                "        counter_value = counter_value + 1\n"
+                "    }}\n"
+                "    return accumulator\n"
+                "}}\n\n", i, i, i % 97, i, i % 13);
+        }
+        return code;
+    }
+
+    constexpr std::size_t N_FUNCTIONS = 2000;
+
+    void bench_parse(grtest::Benchmark& benchmark, const grlang::parse::ParseOptions& options) {
+        std::string code = generate_source(N_FUNCTIONS);
+        benchmark.set_items(N_FUNCTIONS);
+        benchmark.set_bytes(code.size());
+        benchmark.measure([&]() {
+            auto exports = grlang::parse::parse_unit(code, options);
+            grtest::do_not_optimize(exports.size());
+        });
+    }
+}
+
+BENCHMARK_CASE(bench_parse_unit) {
+    bench_parse(benchmark, {.threads=1});
+}
+
+BENCHMARK_CASE(bench_parse_unit_threads) {
+    bench_parse(benchmark, {.threads=0});  // NOTE: one per hardware thread
+}
+
+BENCHMARK_CASE(bench_parse_unit_lazy) {
+    bench_parse(benchmark, {.lazy=true});
+}
@@ -1,5 +1,8 @@
 #include "grtest.h"
 #include "grlang/parse.h"
+#include "grlang/detail/token.h"
+#include "grlang/graph.h"
+#include "grlang/loop.h"
 
 grlang::node::Node::Ptr run_in_main(std::string code) {
     std::string main = "main:= (arg:int)->int {\n" + code + "\n}";
@@ -88,7 +91,8 @@ TEST_CASE(test_function) {
     assert(ret->type == grlang::node::Node::Type::CONTROL_RETURN);
     assert(ret->inputs.at(1)->type == grlang::node::Node::Type::DATA_CALL);
     assert(ret->inputs.at(1)->inputs.size() == 3);
-    assert(get_value_int(*ret->inputs.at(1)->inputs.at(0)) == 0x0FEFEFE0);
+    assert(is_function(*ret->inputs.at(1)->inputs.at(0)));
+    assert(ret->inputs.at(1)->value == grlang::node::DIRECT_CALL);
     assert(ret->inputs.at(1)->inputs.at(1)->type == grlang::node::Node::Type::DATA_OP_ADD);
     assert(ret->inputs.at(1)->inputs.at(2)->type == grlang::node::Node::Type::DATA_TERM);
     auto func_ptr = ret->inputs.at(1)->inputs.at(0);
@@ -100,6 +104,27 @@ TEST_CASE(test_function) {
     grlang::parse::parse_unit("f:= (n:int) -> int { if n==0 return 0 if n==1 return 1 return f(n-1)+f(n-2) }");
 }
 
+TEST_CASE(test_function_types) {
+    using grlang::node::Value;
+    auto exports = grlang::parse::parse_unit("f:= (x:i64) -> int { return x } g:(i64)->int = f h:= (x:int) -> int { return g(x) }");
+    assert((get_signature(*exports.at("f")) == Value::Signature{{Value::Type::I64}, Value::Type::INTEGER}));
+    assert(exports.at("g") == exports.at("f"));
+
+    // NOTE: calls are always direct, a function can't be passed around where its callee isn't known
+    for (const char* code: {"main:= (arg:int) -> int { return f(1 2) }", "main:= (arg:int) -> int { return f() }",
+                            "main:= (arg:int) -> int { g:=1 return g(1) }", "main:= (arg:int) -> int { k:=f if arg k=twice return k(1) }",
+                            "twice:= (f:(int)->int x:int) -> int { return f(f(x)) }", "make:= (x:int) -> (int)->int { return f }",
+                            "main:= (arg:int) -> int { return twice(f) }"}) {
+        bool threw = false;
+        try {
+            grlang::parse::parse_unit(std::string("f:= (x:int) -> int { return x } twice:= (x:int) -> int { return f(f(x)) } ") + code);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+}
+
 TEST_CASE(test_if_else) {
     auto node = run_in_main("a:int=0 if arg<0 a=-arg else a=2*arg return a");
     assert(node->type == grlang::node::Node::Type::CONTROL_STOP);
@@ -126,7 +151,7 @@ TEST_CASE(test_if_else) {
     auto phi = node->inputs.at(1);
     assert(phi->inputs.at(0) == node->inputs.at(0));
     assert(phi->inputs.at(1)->type == grlang::node::Node::Type::DATA_OP_NEG);
-    assert(phi->inputs.at(2)->type == grlang::node::Node::Type::DATA_OP_MUL);
+    assert(phi->inputs.at(2)->type == grlang::node::Node::Type::DATA_OP_SHL);  // NOTE: 2*a
 }
 
 TEST_CASE(test_if_else_peep) {
@@ -217,6 +242,166 @@ TEST_CASE(test_while_continue) {
     assert(get_value_int(*arg_phi->inputs.at(2)) == 5);
 }
 
+TEST_CASE(test_while_lazy_phi) {
+    auto node = run_in_main("a:=5 i:=0 while i<arg { i=i+a } return a");
+    node = node->inputs.at(0);
+    assert(node->type == grlang::node::Node::Type::CONTROL_RETURN);
+    assert(node->inputs.at(1)->type == grlang::node::Node::Type::DATA_TERM);  // NOTE: a is never assigned in the loop
+    assert(get_value_int(*node->inputs.at(1)) == 5);
+
+    auto cond = node->inputs.at(0)->inputs.at(0)->inputs.at(1);
+    assert(cond->inputs.at(0)->type == grlang::node::Node::Type::DATA_PHI);
+    assert(cond->inputs.at(1)->type == grlang::node::Node::Type::DATA_PROJECT);  // NOTE: arg is never assigned in the loop
+}
+
+TEST_CASE(test_range_branches) {
+    auto conditions = [](std::string code) {
+        std::string main = "main:= (arg:int)->int {\n" + code + "\n}";
+        auto exports = grlang::parse::parse_unit(main);
+        grlang::node::Graph graph(*exports.at("main"));
+        std::vector<int> result;  // NOTE: -1 for conditions left to run time
+        for (std::uint32_t control: graph.control_rpo()) {
+            if (graph.node(control).type == grlang::node::Node::Type::CONTROL_IFELSE) {
+                auto& condition = graph.node(graph.inputs(control)[1]);
+                result.push_back(is_const(condition) ? get_value_int(condition) : -1);
+            }
+        }
+        return result;
+    };
+    assert((conditions("if arg>5 { if arg>3 return 1 } return 0") == std::vector{-1, 1}));
+    assert((conditions("if arg<0 return 0 else if arg<0 return 1 return 2") == std::vector{-1, 0}));
+    assert((conditions("if arg!=3 return 0 if arg==3 return 1 return 2") == std::vector{-1, 1}));
+    assert((conditions("i:=0 while i<10 { if i<10 arg=arg+1 i=i+1 } return arg") == std::vector{-1, 1}));
+    assert((conditions("i:=0 while i<arg { if i>=0 arg=arg-1 i=i+1 } return arg") == std::vector{-1, 1}));
+    assert((conditions("i:=0 while i<10 { if i<9 arg=arg+1 i=i+1 } return arg") == std::vector{-1, -1}));
+    assert((conditions("i:=0 while i<arg { if i<arg-1 arg=arg+1 i=i+1 } return arg") == std::vector{-1, -1}));
+}
+
+TEST_CASE(test_bounds_checks) {
+    auto checks = [](std::string code) {
+        std::string main = "main:= (arg:int a:[]int)->int {\n" + code + "\n}";
+        auto exports = grlang::parse::parse_unit(main);
+        grlang::node::Graph graph(*exports.at("main"));
+        std::vector<int> result;  // NOTE: 1 for accesses still checked at run time
+        for (std::uint32_t control: graph.control_rpo()) {
+            if (graph.node(control).type == grlang::node::Node::Type::MEMORY_LOAD || graph.node(control).type == grlang::node::Node::Type::MEMORY_STORE) {
+                result.push_back(graph.node(control).value);
+            }
+        }
+        return result;
+    };
+    assert((checks("b:=[4]int b[3]=1 return b[arg]") == std::vector{0, 1}));
+    assert((checks("b:=[arg+1]int return b[arg]") == std::vector{1}));
+    assert((checks("s:=0 i:=0 while i<len(a) { s=s+a[i] i=i+1 } return s") == std::vector{0}));
+    assert((checks("i:=0 while i<len(a) { a[i]=a[i+1] i=i+1 } return 0") == std::vector{1, 0}));
+    assert((checks("b:=[arg]int i:=0 while i<arg { b[i]=i i=i+1 } return b[0]") == std::vector{0, 1}));
+    assert((checks("i:=len(a) while i>0 { i=i-1 a[i]=0 } return 0") == std::vector{1}));
+
+    for (std::string code: {"a:=[4]int", "main:= (arg:int)->int { a:=[3]int return a+1 }", "main:= (arg:int)->int { a:=[3]int b:int = a return b }",
+                            "main:= (arg:int)->int { a:=[3]int return -a }", "main:= (arg:int)->int { a:=[3]u8 b:[]int = a return 0 }",
+                            "main:= (arg:int)->int { return arg+main }", "main:= (arg:int)->int { return main }"}) {
+        bool threw = false;
+        try {
+            grlang::parse::parse_unit(code);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+}
+
+TEST_CASE(test_counted_loops) {
+    using grlang::node::Reduction;
+    auto reductions = [](std::string code) {
+        std::string main = "main:= (arg:int a:[]int)->int {\n" + code + "\n}";
+        auto exports = grlang::parse::parse_unit(main);
+        grlang::node::Graph graph(*exports.at("main"));
+        std::vector<std::vector<Reduction>> result;  // NOTE: one entry per vectorizable loop
+        for (const auto& loop: grlang::node::find_counted_loops(graph)) {
+            if (auto vector = grlang::node::match_vector_loop(graph, loop)) {
+                result.emplace_back();
+                for (auto [phi, reduction]: vector->reductions) {
+                    result.back().push_back(reduction);
+                }
+            }
+        }
+        return result;
+    };
+    using Result = std::vector<std::vector<Reduction>>;
+    assert((reductions("i:=0 while i<len(a) { a[i]=a[i]*a[i] i=i+1 } return 0") == Result{{}}));
+    assert((reductions("s:=0 i:=0 while i<len(a) { s=s+a[i] i=i+1 } return s") == Result{{Reduction::ADD}}));
+    assert((reductions("m:=a[0] i:=1 while i<len(a) { if a[i]<m m=a[i] i=i+1 } return m") == Result{{Reduction::MIN}}));
+    assert((reductions("m:=a[0] i:=1 while i<len(a) { if m<a[i] m=a[i] i=i+1 } return m") == Result{{Reduction::MAX}}));
+    assert((reductions("i:=0 while i<len(a) { x:=a[i] if x>9 x=9 a[i]=x i=i+1 } return 0") == Result{{}}));
+    assert((reductions("i:=0 while i<len(a) { a[i]=a[i+1] i=i+1 } return 0") == Result{}));
+    assert((reductions("x:=0 y:=1 i:=0 while i<arg { t:=x+y x=y y=t i=i+1 } return x") == Result{}));
+    assert((reductions("s:=0 i:=0 while i<len(a) { if a[i]<0 a[i]=0 s=s+a[i] i=i+1 } return s") == Result{}));
+    assert((reductions("s:=0 i:=0 while i<arg { s=s+i i=i+2 } return s") == Result{}));
+}
+
+TEST_CASE(test_structs) {
+    auto count = [](std::string code, grlang::node::Node::Type type) {
+        std::string main = "main:= (arg:int)->{x:int y:int} {\n" + code + "\n}";
+        auto exports = grlang::parse::parse_unit(main);
+        grlang::node::Graph graph(*exports.at("main"));
+        std::size_t result = 0;
+        for (std::uint32_t id=0; id<graph.size(); ++id) {
+            result += graph.node(id).type == type;
+        }
+        return result;
+    };
+    using Type = grlang::node::Node::Type;
+    // NOTE: a struct that never leaves the function is taken apart, one that does is only made where it leaves
+    std::string walk = "p:={x=0 y=0} i:=0 while i<arg { if i<3 p.x=p.x+1 else p.y=p.y+i i=i+1 } ";
+    assert(count(walk + "return {x=p.x+p.y y=0}", Type::DATA_FIELD) == 0);
+    assert(count(walk + "return {x=p.x+p.y y=0}", Type::DATA_STRUCT) == 1);
+    assert(count(walk + "return p", Type::DATA_FIELD) == 0);
+    assert(count(walk + "return p", Type::DATA_STRUCT) == 1);
+    assert(count("p:={x=arg y=1} q:={x=p.y y=p.x} return {x=q.y y=q.x}", Type::DATA_STRUCT) == 1);
+    assert(count("p:={x=arg y=1} q:={x=p.x y=p.y} return q", Type::DATA_FIELD) == 0);
+    assert(count("p:={a={x=arg y=1} b=2} p.a.x=p.b return p.a", Type::DATA_STRUCT) == 1);
+
+    for (std::string code: {"p:={x=1} return p.y", "p:={x=1} return p+1", "p:={x=1} if p return 1 return 0",
+                            "p:={x=1 x=2} return 0", "p:={x=1} p={y=1} return 0", "p:={x=1} p.y=2 return 0"}) {
+        bool threw = false;
+        try {
+            run_in_main(code);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+}
+
+TEST_CASE(test_keywords) {
+    using grlang::parse::detail::TokenType;
+    grlang::parse::detail::SymbolTable symbols;
+    std::string_view code = "while whilex if iff else return break continue len x whilex";
+    assert(read_token(code, symbols).type == TokenType::KEYWORD_WHILE);
+    auto whilex = read_token(code, symbols);
+    assert(whilex.type == TokenType::IDENTIFIER);
+    assert(read_token(code, symbols).type == TokenType::KEYWORD_IF);
+    assert(read_token(code, symbols).type == TokenType::IDENTIFIER);
+    assert(read_token(code, symbols).type == TokenType::KEYWORD_ELSE);
+    assert(read_token(code, symbols).type == TokenType::KEYWORD_RETURN);
+    assert(read_token(code, symbols).type == TokenType::KEYWORD_BREAK);
+    assert(read_token(code, symbols).type == TokenType::KEYWORD_CONTINUE);
+    assert(read_token(code, symbols).type == TokenType::KEYWORD_LEN);
+    auto x = read_token(code, symbols);
+    assert(x.symbol != whilex.symbol);
+    assert(read_token(code, symbols).symbol == whilex.symbol);
+    assert(symbols.names.at(x.symbol) == "x");
+
+    bool threw = false;
+    try {
+        run_in_main("while:=1 return while");
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+}
+
+#include <format>
 #include <sstream>
 #include <random>
 #include <vector>
@@ -354,3 +539,97 @@ TEST_CASE(test_fuzz) {
     generate(VectorRandomGen{{0, 4, 1, 2, 3}}, stream);
     auto exports = grlang::parse::parse_unit(stream.str());
 }
+
+TEST_CASE(test_graph_hash) {
+    std::string code = "f:= (n:int) -> int { a:=0 while a<n a=a+1 return a } g:= (n:int) -> int { return f(n)+1 }";
+    auto first = grlang::parse::parse_unit(code);
+    auto second = grlang::parse::parse_unit(code);
+    assert(grlang::node::hash_graph(first.at("f")) == grlang::node::hash_graph(second.at("f")));
+    assert(grlang::node::hash_graph(first.at("g")) == grlang::node::hash_graph(second.at("g")));
+    assert(grlang::node::hash_graph(first.at("f")) != grlang::node::hash_graph(first.at("g")));
+
+    auto edited = grlang::parse::parse_unit("f:= (n:int) -> int { a:=0 while a<n a=a+2 return a } g:= (n:int) -> int { return f(n)+1 }");
+    assert(grlang::node::hash_graph(first.at("f")) != grlang::node::hash_graph(edited.at("f")));
+    assert(grlang::node::hash_graph(first.at("g")) == grlang::node::hash_graph(edited.at("g")));  // NOTE: callees are hashed by signature
+
+    std::vector<const grlang::node::Node*> callees;
+    grlang::node::hash_graph(edited.at("g"), &callees);
+    assert(callees == std::vector<const grlang::node::Node*>{edited.at("f").get()});
+}
+
+TEST_CASE(test_parallel_parse) {
+    std::string code = "base:= 7 ";
+    for (int i=0; i<32; ++i) {
+        code += std::format("f{}:= (n:int) -> int {{ a:=0 while a<n {{ a=a+{} }} return a+base }} ", i, i+1);
+        code += std::format("g{}:= (n:int) -> int {{ return f{}(n)*2 }} ", i, i);
+    }
+    auto sequential = grlang::parse::parse_unit(code, {.threads=1});
+    auto parallel = grlang::parse::parse_unit(code, {.threads=4});
+    assert(sequential.size() == 65);
+    assert(parallel.size() == 65);
+    for (auto& [name, node]: sequential) {
+        assert(grlang::node::hash_graph(node) == grlang::node::hash_graph(parallel.at(name)));
+    }
+
+    auto call = parallel.at("g3")->inputs.at(0)->inputs.at(0)->inputs.at(1)->inputs.at(0);
+    assert(call->type == grlang::node::Node::Type::DATA_CALL);
+    assert(call->inputs.at(0) == parallel.at("f3"));  // NOTE: references resolve to the callee's own node
+}
+
+TEST_CASE(test_lazy_parse) {
+    std::string code = "base:= 7 f:= (n:int) -> int { return n+base } base = 8 g:= (n:int) -> int { return f(n)*base }";
+    auto eager = grlang::parse::parse_unit(code);
+    auto lazy = grlang::parse::parse_unit(code, {.lazy=true});
+    assert(lazy.at("f")->inputs.at(0)->inputs.empty());
+    assert(grlang::node::hash_graph(eager.at("g")) == grlang::node::hash_graph(lazy.at("g")));  // NOTE: hashing builds g, but not f
+    assert(lazy.at("f")->inputs.at(0)->inputs.empty());
+}
+
+TEST_CASE(test_lazy_parse_lifetime) {
+    std::string code = "f:= (n:int) -> int { return n+1 } g:= (n:int) -> int { return f(n)*2 } h:= (n:int) -> int { return n }";
+    auto lazy = grlang::parse::parse_unit(code, {.lazy=true});
+    std::weak_ptr<grlang::node::Node> f = lazy.at("f");
+    std::weak_ptr<grlang::node::Node> h = lazy.at("h");
+    std::weak_ptr<grlang::node::Node> g = lazy.at("g");
+    grlang::node::ensure_built(*lazy.at("g"));
+    assert(lazy.at("g")->inputs.at(0)->inputs.size() == 1);
+    lazy.clear();
+    assert(f.expired() && g.expired() && h.expired());  // NOTE: built or not, nothing is left once the exports are gone
+}
+
+TEST_CASE(test_lazy_parse_failure) {
+    auto lazy = grlang::parse::parse_unit("f:= (n:int) -> int { return n+missing }", {.lazy=true});
+    auto& f = *lazy.at("f");
+    for (int attempt=0; attempt<2; ++attempt) {
+        try {
+            grlang::node::ensure_built(f);
+            assert(false);
+        } catch (const std::runtime_error&) {
+        }
+        assert(f.inputs.at(0)->inputs.empty());  // NOTE: a failed build leaves no partial returns behind
+    }
+}
+
+TEST_CASE(test_unit_edit) {
+    grlang::parse::Unit unit("base:= 7 f:= (n:int) -> int { return n+base } g:= (n:int) -> int { return f(n)*2 } h:= (n:int) -> int { return n }");
+    auto f = unit.exports().at("f");
+    auto g = unit.exports().at("g");
+    auto h = unit.exports().at("h");
+
+    auto changed = unit.edit({unit.code().find("return n }") + 8, 0, "+1"});
+    assert(changed == std::vector<std::string>{"h"});
+    assert(unit.exports().at("f") == f);
+    assert(unit.exports().at("g") == g);
+    assert(unit.exports().at("h") != h);
+    h = unit.exports().at("h");
+    assert(get_value_int(*h->inputs.at(0)->inputs.at(0)->inputs.at(1)->inputs.at(1)) == 1);
+
+    changed = unit.edit({unit.code().find("7"), 1, "8"});
+    assert((changed == std::vector<std::string>{"base", "f", "g"}));  // NOTE: g calls f, whose graph is new
+    assert(unit.exports().at("h") == h);
+
+    changed = unit.edit({0, 0, "k:= (n:int) -> int { return n }\n"});
+    assert(changed == std::vector<std::string>{"k"});
+    assert(unit.exports().at("h") == h);
+    assert(unit.code().starts_with("k:="));
+}
@@ -0,0 +1,37 @@
+#include <string>
+#include <format>
+
+#include "grtest.h"
+#include "grlang/detail/token.h"
+
+
+namespace {
+    std::string generate_source(std::size_t min_size) {
+        std::string code;
+        for (std::size_t i=0; code.size() < min_size; ++i) {
+            code += std::format(
+                "function_{}:= (argument_{}:int) -> int {{\n"
+                "    accumulator := 0\n"
+                "    counter_value := {}\n"
+                "    while counter_value < argument_{} {{\n"
+                "        if accumulator >= 1000 accumulator = accumulator - 1000 else accumulator = accumulator + counter_value*{}\n"
+                "        counter_value = counter_value + 1\n"
+                "    }}\n"
+                "    return accumulator\n"
+                "}}\n\n", i, i, i % 97, i, i % 13);
+        }
+        return code;
+    }
+}
+
+BENCHMARK_CASE(bench_tokenize) {
+    std::string code = generate_source(1 << 20);
+    grlang::parse::detail::SymbolTable counting;
+    benchmark.set_items(grlang::parse::detail::tokenize(code, counting).size());
+    benchmark.set_bytes(code.size());
+    benchmark.measure([&]() {
+        grlang::parse::detail::SymbolTable symbols;
+        auto tokens = grlang::parse::detail::tokenize(code, symbols);
+        grtest::do_not_optimize(tokens.data());
+    });
+}
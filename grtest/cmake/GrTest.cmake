@@ -1,3 +1,5 @@
+set(GRTEST_BENCHMARK_TOLERANCE 5 CACHE STRING "Percent the median of a benchmark may grow over its baseline")
+
 function(grtest_discover_tests target)
     set(ctest_file_base "${CMAKE_CURRENT_BINARY_DIR}/${target}")
     set(ctest_include_file "${ctest_file_base}_include.cmake")
@@ -19,3 +21,45 @@ function(grtest_discover_tests target)
         APPEND PROPERTY TEST_INCLUDE_FILES "${ctest_include_file}"
     )
 endfunction()
+
+# Benchmarks run once as tests labelled benchmark, so they keep working. Properly they run through the
+# <target>_benchmark target, which writes <target>.benchmark.json and, when GRTEST_BENCHMARK_BASELINE names a
+# directory holding an earlier <target>.benchmark.json, fails on regressions. The benchmarks target runs them all
+function(grtest_discover_benchmarks target)
+    set(ctest_file_base "${CMAKE_CURRENT_BINARY_DIR}/${target}")
+    set(ctest_include_file "${ctest_file_base}_benchmarks_include.cmake")
+    set(ctest_tests_file "${ctest_file_base}_benchmarks.cmake")
+    add_custom_command(
+        TARGET ${target} POST_BUILD
+        BYPRODUCTS "${ctest_tests_file}"
+        COMMAND ${target} list-benchmarks ${target} "${ctest_tests_file}"
+        VERBATIM
+    )
+    file(WRITE "${ctest_include_file}"
+      "if(EXISTS \"${ctest_tests_file}\")\n"
+      "  include(\"${ctest_tests_file}\")\n"
+      "else()\n"
+      "  add_test(${target}_NOT_BUILT ${target}_NOT_BUILT)\n"
+      "endif()\n"
+    )
+    set_property(DIRECTORY
+        APPEND PROPERTY TEST_INCLUDE_FILES "${ctest_include_file}"
+    )
+
+    set(results "${CMAKE_CURRENT_BINARY_DIR}/${target}.benchmark.json")
+    set(compare)
+    if(GRTEST_BENCHMARK_BASELINE)
+        set(compare --baseline "${GRTEST_BENCHMARK_BASELINE}/${target}.benchmark.json" --tolerance ${GRTEST_BENCHMARK_TOLERANCE})
+    endif()
+    add_custom_target(
+        ${target}_benchmark
+        COMMAND ${target} run-benchmarks --json "${results}" ${compare}
+        BYPRODUCTS "${results}"
+        USES_TERMINAL
+        VERBATIM
+    )
+    if(NOT TARGET benchmarks)
+        add_custom_target(benchmarks)
+    endif()
+    add_dependencies(benchmarks ${target}_benchmark)
+endfunction()
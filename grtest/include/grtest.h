@@ -2,9 +2,86 @@
 #include <source_location>
 #include <iostream>
 #include <fstream>
+#include <format>
 #include <vector>
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
 
+#if defined(__linux__) && __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define GRTEST_PERF_EVENTS 1
+#endif
+
+
+namespace grtest {
+    // NOTE: makes the compiler assume value is read, so the work that computed it can't be dropped
+    template<typename T>
+    inline void do_not_optimize(const T& value) {
+#if defined(__GNUC__) || defined(__clang__)
+        asm volatile("" : : "r,m"(value) : "memory");
+#else
+        static const void* volatile sink;
+        sink = &value;
+#endif
+    }
+
+    struct BenchmarkOptions {
+        std::size_t warmup = 3;  // NOTE: samples thrown away, they also pick the number of iterations per sample
+        std::size_t repetitions = 50;  // NOTE: samples kept
+        std::chrono::nanoseconds min_sample = std::chrono::milliseconds(2);
+        bool perf = false;  // NOTE: read hardware counters too, where perf_event_open is allowed
+    };
+
+    // Times per call in nanoseconds over all samples, and hardware counters per call
+    struct BenchmarkResult {
+        std::size_t samples = 0;
+        std::size_t iterations = 0;  // NOTE: calls per sample
+        double min = 0;
+        double median = 0;
+        double p99 = 0;
+        std::uint64_t items = 0;  // NOTE: per call, for throughput
+        std::uint64_t bytes = 0;
+        std::vector<std::pair<std::string, double>> counters;
+    };
+
+    // Handed to each BENCHMARK_CASE, which sets up its input and then calls measure once with the code to time
+    class Benchmark {
+    public:
+        explicit Benchmark(const BenchmarkOptions& options) : options_(options) {}
+
+        void set_items(std::uint64_t items) { result_.items = items; }
+        void set_bytes(std::uint64_t bytes) { result_.bytes = bytes; }
+
+        template<typename F>
+        void measure(F&& f);
+
+        bool measured() const { return result_.samples > 0; }
+        const BenchmarkResult& result() const { return result_; }
+
+    private:
+        template<typename F>
+        std::chrono::nanoseconds sample(F& f, std::size_t iterations) {
+            auto begin = std::chrono::steady_clock::now();
+            for (std::size_t i=0; i<iterations; ++i) {
+                f();
+            }
+            return std::chrono::steady_clock::now() - begin;
+        }
+
+        BenchmarkOptions options_;
+        BenchmarkResult result_;
+    };
+}
 
 namespace {
     struct TestInfo {
@@ -19,6 +96,117 @@ namespace {
         }
     };
 
+    struct BenchmarkInfo {
+        void(*func)(grtest::Benchmark&);
+        const char* name;
+        std::source_location loc;
+    };
+    std::vector<BenchmarkInfo> registered_benchmarks;
+    struct benchmark_register {
+        benchmark_register(void(*func)(grtest::Benchmark&), const char* name, std::source_location loc) {
+            registered_benchmarks.emplace_back(func, name, loc);
+        }
+    };
+
+#ifdef GRTEST_PERF_EVENTS
+    // NOTE: one group of user space counters for this thread, counters the kernel refuses are left out
+    class PerfCounters {
+    public:
+        PerfCounters() {
+            const std::pair<const char*, std::uint64_t> events[] = {
+                {"cycles", PERF_COUNT_HW_CPU_CYCLES},
+                {"instructions", PERF_COUNT_HW_INSTRUCTIONS},
+                {"branch_misses", PERF_COUNT_HW_BRANCH_MISSES},
+                {"cache_misses", PERF_COUNT_HW_CACHE_MISSES},
+            };
+            for (auto [name, config]: events) {
+                perf_event_attr attr{};
+                attr.size = sizeof(attr);
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = config;
+                attr.disabled = leader < 0;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                attr.read_format = PERF_FORMAT_GROUP;
+                int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+                if (fd < 0) {
+                    continue;
+                }
+                leader = leader < 0 ? fd : leader;
+                fds.push_back(fd);
+                names.push_back(name);
+            }
+        }
+        ~PerfCounters() {
+            for (int fd: fds) {
+                close(fd);
+            }
+        }
+        PerfCounters(const PerfCounters&) = delete;
+        PerfCounters& operator=(const PerfCounters&) = delete;
+
+        bool available() const { return leader >= 0; }
+        void start() {
+            ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+        std::vector<std::pair<std::string, double>> stop(std::uint64_t calls) {
+            ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+            std::vector<std::uint64_t> values(fds.size() + 1);  // NOTE: the number of counters, then their values
+            std::vector<std::pair<std::string, double>> counters;
+            if (read(leader, values.data(), values.size() * sizeof(std::uint64_t)) > 0) {
+                for (std::size_t i=0; i<names.size(); ++i) {
+                    counters.emplace_back(names[i], static_cast<double>(values[i+1]) / calls);
+                }
+            }
+            return counters;
+        }
+
+    private:
+        int leader = -1;
+        std::vector<int> fds;
+        std::vector<const char*> names;
+    };
+#endif
+}
+
+template<typename F>
+void grtest::Benchmark::measure(F&& f) {
+    std::size_t iterations = 1;
+    for (std::size_t i=0; i<std::max<std::size_t>(options_.warmup, 1); ++i) {
+        while (sample(f, iterations) < options_.min_sample && iterations < (std::size_t(1) << 30)) {
+            iterations *= 2;
+        }
+    }
+
+    std::vector<double> samples;
+#ifdef GRTEST_PERF_EVENTS
+    std::optional<PerfCounters> perf;
+    if (options_.perf && perf.emplace().available()) {
+        perf->start();
+    } else {
+        perf.reset();
+    }
+#endif
+    for (std::size_t i=0; i<std::max<std::size_t>(options_.repetitions, 1); ++i) {
+        samples.push_back(static_cast<double>(sample(f, iterations).count()) / iterations);
+    }
+#ifdef GRTEST_PERF_EVENTS
+    if (perf) {
+        result_.counters = perf->stop(samples.size() * iterations);
+    }
+#endif
+
+    std::ranges::sort(samples);
+    auto rank = [&](double q) { return samples[static_cast<std::size_t>(std::ceil(q * samples.size())) - 1]; };
+    result_.samples = samples.size();
+    result_.iterations = iterations;
+    result_.min = samples.front();
+    result_.median = samples.size() % 2 ? samples[samples.size()/2] : (samples[samples.size()/2 - 1] + samples[samples.size()/2]) / 2;
+    result_.p99 = rank(0.99);
+}
+
+namespace {
     int list_tests(std::string target, std::string filename) {
         std::replace(filename.begin(), filename.end(), '\\', '/');
         std::cout << "Generating " << filename << std::endl;
@@ -32,6 +220,20 @@ namespace {
         return 0;
     }
 
+    // NOTE: as tests labelled benchmark, one short sample each, to keep them building and running
+    int list_benchmarks(std::string target, std::string filename) {
+        std::replace(filename.begin(), filename.end(), '\\', '/');
+        std::cout << "Generating " << filename << std::endl;
+        std::ofstream output(filename);
+        for (auto& bench: registered_benchmarks) {
+            output << "add_test(" << target << "." << bench.name << " \"" << target << "\" run-benchmarks --name " << bench.name << " --warmup 0 --repetitions 1 --min-time-ms 0)" << std::endl;
+            std::string bench_file(bench.loc.file_name());
+            std::replace(bench_file.begin(), bench_file.end(), '\\', '/');
+            output << "set_tests_properties(" << target << "." << bench.name << " PROPERTIES LABELS benchmark _BACKTRACE_TRIPLES \"" << bench_file << ";" << bench.loc.line() << ";\")" << std::endl;
+        }
+        return 0;
+    }
+
     int run_test(std::string filter) {
         for (auto test: registered_tests) {
             if (test.name == filter) {
@@ -48,16 +250,159 @@ namespace {
         }
         return 0;
     }
+
+    struct BenchmarkRun {
+        grtest::BenchmarkOptions options;
+        std::string filter;  // NOTE: runs benchmarks whose name contains it
+        std::string name;  // NOTE: runs only the benchmark with exactly this name, as ctest does
+        std::string json;  // NOTE: file to write results to
+        std::string baseline;  // NOTE: results written by an earlier run to compare with
+        double tolerance = 0.05;  // NOTE: how much slower the median may get before it counts as a regression
+    };
+
+    void write_benchmarks_json(const std::vector<std::pair<std::string, grtest::BenchmarkResult>>& results, std::ostream& output) {
+        output << "{\"benchmarks\": [";
+        for (std::size_t i=0; i<results.size(); ++i) {
+            auto& [name, result] = results[i];
+            output << (i ? ",\n" : "\n") << "  {\"name\": \"" << name << "\", \"samples\": " << result.samples << ", \"iterations\": " << result.iterations
+                << std::format(", \"min_ns\": {}, \"median_ns\": {}, \"p99_ns\": {}", result.min, result.median, result.p99)
+                << ", \"items\": " << result.items << ", \"bytes\": " << result.bytes << ", \"counters\": {";
+            for (std::size_t j=0; j<result.counters.size(); ++j) {
+                output << std::format("{}\"{}\": {}", j ? ", " : "", result.counters[j].first, result.counters[j].second);
+            }
+            output << "}}";
+        }
+        output << "\n]}\n";
+    }
+
+    // NOTE: only reads what write_benchmarks_json writes, one benchmark per line
+    std::map<std::string, double> read_baseline(std::istream& input) {
+        std::map<std::string, double> medians;
+        std::string line;
+        while (std::getline(input, line)) {
+            auto name = line.find("\"name\": \"");
+            auto median = line.find("\"median_ns\": ");
+            if (name == std::string::npos || median == std::string::npos) {
+                continue;
+            }
+            name += 9;
+            medians[line.substr(name, line.find('"', name) - name)] = std::stod(line.substr(median + 13));
+        }
+        return medians;
+    }
+
+    int run_benchmarks(const BenchmarkRun& run) {
+        std::vector<std::pair<std::string, grtest::BenchmarkResult>> results;
+        for (auto bench: registered_benchmarks) {
+            if (std::string_view(bench.name).find(run.filter) == std::string_view::npos || (!run.name.empty() && bench.name != run.name)) {
+                continue;
+            }
+            grtest::Benchmark benchmark(run.options);
+            bench.func(benchmark);
+            if (!benchmark.measured()) {
+                std::cerr << bench.name << ": never called measure" << std::endl;
+                return 1;
+            }
+            auto& result = benchmark.result();
+            std::cout << std::format("{}: min {:.1f} ns, median {:.1f} ns, p99 {:.1f} ns ({} samples of {})", bench.name, result.min, result.median, result.p99, result.samples, result.iterations);
+            if (result.items) {
+                std::cout << std::format(", {:.2f} Mitems/s", result.items / result.median * 1e3);
+            }
+            if (result.bytes) {
+                std::cout << std::format(", {:.2f} MiB/s", result.bytes / result.median * 1e9 / (1 << 20));
+            }
+            for (auto& [counter, value]: result.counters) {
+                std::cout << std::format(", {} {:.1f}", counter, value);
+            }
+            std::cout << std::endl;
+            results.emplace_back(bench.name, result);
+        }
+        if (!run.name.empty() && results.empty()) {
+            std::cerr << "no benchmark " << run.name << std::endl;
+            return 1;
+        }
+        if (!run.json.empty()) {
+            std::ofstream output(run.json);
+            write_benchmarks_json(results, output);
+        }
+
+        int regressions = 0;
+        if (!run.baseline.empty()) {
+            std::ifstream input(run.baseline);
+            if (!input) {
+                std::cerr << "no baseline at " << run.baseline << std::endl;
+                return 1;
+            }
+            auto medians = read_baseline(input);
+            for (auto& [name, result]: results) {
+                auto it = medians.find(name);
+                if (it == medians.end()) {
+                    continue;
+                }
+                double change = result.median / it->second - 1;
+                if (change > run.tolerance) {
+                    std::cout << std::format("REGRESSION {}: median {:.1f} ns -> {:.1f} ns (+{:.1f}%)", name, it->second, result.median, change * 100) << std::endl;
+                    ++regressions;
+                }
+            }
+        }
+        return regressions ? 1 : 0;
+    }
+
+    int run_benchmarks(int argc, char* argv[]) {
+        BenchmarkRun run;
+        for (int i=0; i<argc; ++i) {
+            std::string_view option = argv[i];
+            if (option == "--perf") {
+                run.options.perf = true;
+                continue;
+            }
+            if (i+1 == argc) {
+                std::cerr << "no value for " << option << std::endl;
+                return 1;
+            }
+            std::string value = argv[++i];
+            if (option == "--filter") {
+                run.filter = value;
+            } else if (option == "--name") {
+                run.name = value;
+            } else if (option == "--warmup") {
+                run.options.warmup = std::stoul(value);
+            } else if (option == "--repetitions") {
+                run.options.repetitions = std::stoul(value);
+            } else if (option == "--min-time-ms") {
+                run.options.min_sample = std::chrono::milliseconds(std::stoul(value));
+            } else if (option == "--json") {
+                run.json = value;
+            } else if (option == "--baseline") {
+                run.baseline = value;
+            } else if (option == "--tolerance") {
+                run.tolerance = std::stod(value) / 100;
+            } else {
+                std::cerr << "unknown option " << option << std::endl;
+                return 1;
+            }
+        }
+        return run_benchmarks(run);
+    }
 }
 #define TEST_CASE(name) void name(); test_register test_register_##name(name, #name, std::source_location::current()); void name()
+#define BENCHMARK_CASE(name) void name(grtest::Benchmark&); benchmark_register benchmark_register_##name(name, #name, std::source_location::current()); void name([[maybe_unused]] grtest::Benchmark& benchmark)
 
 
 int main(int argc, char* argv[]) {
     if (argc > 3 && argv[1] == std::string_view("list-tests")) {
         return list_tests(argv[2], argv[3]);
     }
+    if (argc > 3 && argv[1] == std::string_view("list-benchmarks")) {
+        return list_benchmarks(argv[2], argv[3]);
+    }
     if (argc > 2 && argv[1] == std::string_view("run-test")) {
         return run_test(argv[2]);
     }
-    return run_all_tests();
+    if (argc > 1 && argv[1] == std::string_view("run-benchmarks")) {
+        return run_benchmarks(argc - 2, argv + 2);
+    }
+    run_all_tests();
+    return registered_benchmarks.empty() ? 0 : run_benchmarks(BenchmarkRun{});
 }